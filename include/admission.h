@@ -0,0 +1,67 @@
+#ifndef _ADMISSION_H
+#define _ADMISSION_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define ADMISSION_REJECTED 0xFFFFFFFF /*Sent in place of a response's leading count when rejected*/
+
+#define ADMISSION_COST_ADD_BLOCK 1 /*Tokens charged per endpoint request*/
+#define ADMISSION_COST_SEARCH 4
+#define ADMISSION_COST_HEADERS 8
+#define ADMISSION_COST_PAYLOADS 4 /*Per range of at most MAX_PAYLOAD_RANGE payloads*/
+#define ADMISSION_COST_BLOCKS 4 /*Per range of at most MAX_PAYLOAD_RANGE blocks*/
+#define ADMISSION_COST_TREE 1 /*Per run of at most RANGE_TREE_MAX_NODES subtree hashes*/
+#define ADMISSION_COST_WINDOW 4 /*Per time window of at most MAX_PAYLOAD_RANGE blocks*/
+#define ADMISSION_COST_SUBSCRIBE 8 /*Per subscription. Its backlog is streamed from the chain*/
+#define ADMISSION_COST_TRACE 8 /*Per dump of the node's recorded request spans*/
+#define ADMISSION_COST_CHAIN 32 /*Full chain transfers serialise the entire chain*/
+
+#define ADMISSION_BURST_S 2 /*Bucket capacity in seconds worth of refill*/
+#define ADMISSION_IP_SLOTS 4096 /*Number of source addresses tracked. Power of 2*/
+#define ADMISSION_DEFAULT_STREAMS 4 /*Default limit on in-flight chain streams*/
+
+/*Token bucket. Refilled lazily whenever it is charged*/
+struct TokenBucket {
+    double tokens;
+    uint64_t last_ns; /*Monotonic time of last refill*/
+};
+
+/*Bucket of a source address*/
+struct AddressBucket {
+    uint8_t addr[16]; /*IPv6 or v4 mapped address. All zero for local clients*/
+    uint8_t used;
+    struct TokenBucket bucket;
+};
+
+/*Bucket of a connection and the address it came from*/
+struct ConnectionBucket {
+    uint8_t addr[16];
+    struct TokenBucket bucket;
+};
+
+/*Per connection and per source address rate limits plus a global limit on
+ concurrent chain streams. Shared by all reactors*/
+struct Admission {
+    double conn_rate; /*Tokens per second granted to each connection*/
+    double addr_rate; /*Tokens per second shared by all connections from an address*/
+    uint32_t max_streams; /*Max chain streams in flight at once*/
+    uint32_t streams; /*Chain streams currently in flight*/
+
+    struct ConnectionBucket * conns; /*Indexed by socket fd*/
+    int conns_cap;
+    struct AddressBucket * addrs; /*Open addressing table of ADMISSION_IP_SLOTS*/
+
+    uint64_t rejected; /*Requests rejected since start*/
+    pthread_mutex_t lock;
+};
+
+int initialise_admission(struct Admission * padmission, double conn_rate, double addr_rate,
+        uint32_t max_streams);
+void deinitialise_admission(struct Admission * padmission);
+int admission_track_client(struct Admission * padmission, int sockfd);
+int admission_admit(struct Admission * padmission, int sockfd, unsigned cost);
+int admission_acquire_stream(struct Admission * padmission);
+void admission_release_stream(struct Admission * padmission);
+
+#endif /*_ADMISSION_H*/
@@ -0,0 +1,21 @@
+#ifndef _ARCHIVE_H
+#define _ARCHIVE_H
+
+#include <stdint.h>
+#include "block.h"
+
+#define ARCHIVE_MAX_THREADS 64 /*Upper bound on worker threads used to load an archive*/
+
+/*Outcome of loading an archive*/
+struct ArchiveStats {
+    uint32_t blocks; /*Number of blocks loaded*/
+    uint32_t pruned; /*Blocks stored without payload whose hash could not be checked*/
+    uint64_t bytes; /*Size of archive file*/
+    unsigned threads; /*Number of worker threads used*/
+};
+
+int write_archive(const struct BlockChain * pblock_chain, const char * path);
+int load_archive(struct BlockChain * pblock_chain, const char * path, unsigned n_threads,
+        struct ArchiveStats * pstats);
+
+#endif /*_ARCHIVE_H*/
@@ -2,17 +2,54 @@
 #define _BLOCK_H
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/types.h>
 
-#define MAX_PAYLOAD 1024 /*Max length of transaction exc null char*/
-#define TOTAL_PAYLOAD_LEN MAX_PAYLOAD + 1 /*Actual size of buffer to alloc considering null char*/
+#define MAX_PAYLOAD (64 << 20) /*Max length of transaction exc null char*/
+#define PAYLOAD_PRUNED_FLAG 0x80000000 /*Set in transmitted payload length when payload was pruned and not sent*/
+#define PAYLOAD_CHUNK 65536 /*Bytes received and hashed per step when streaming a payload in*/
+#define BLOCK_WIRE_HEADER_SZ (3 * sizeof(uint32_t) + sizeof(uint64_t)) /*Packed payload length, prev hash, hash, timestamp*/
+#define HASH_SEED 5381 /*Initial state of incremental block hash*/
+#define MAX_PAYLOAD_RANGE 4096 /*Max number of payloads fetched by a single payload range request*/
+#define MAX_CHAIN 0xFFFFFFF0 /*Max length of a chain. Heights above it are reserved for response markers*/
+#define ADD_BLOCK_DUPLICATE 0xFFFFFFFE /*Sent in place of the height when an added payload was a recent duplicate*/
+#define ADD_BLOCK_FAILED 0xFFFFFFFD /*Sent in place of the height when an added block could not be made durable*/
+#define ADD_BLOCK_UNVERIFIED 0xFFFFFFFC /*Sent in place of the height when a transaction's signature was refused*/
+#define ADD_BLOCK_READ_ONLY 0xFFFFFFFB /*Sent in place of the height when the node is a read replica*/
 
 struct Block {
     uint32_t prev_hash; /*hash of last block. 0 for gen*/
     uint32_t hash; /*hash of current block. Computed on transactoin data*/
-    uint16_t payload_len; /*length of payload excluding null char*/
-    char* payload; /*Block payload */
+    uint32_t payload_len; /*length of payload excluding null char*/
+    uint64_t timestamp; /*Milliseconds since the Unix epoch when appended. Covered by hash and never
+                          less than the previous block's*/
+    char* payload; /*Block payload. NULL once pruned from memory or packed*/
+    uint8_t* packed; /*Payload compressed by the chain's codec while payload is NULL. NULL if not packed*/
+    uint32_t packed_len; /*Length of compressed payload, in memory or cold storage. 0 if stored raw*/
+    int64_t cold_offset; /*Offset of pruned payload in chain's cold storage. -1 if not stored*/
 };
 
+/*Compact fixed size view of a block without its payload*/
+struct BlockHeader {
+    uint32_t prev_hash;
+    uint32_t hash;
+    uint32_t payload_len;
+    uint64_t timestamp;
+};
+
+/*Scratch space for payloads that have to be read back from cold storage. Grows to the
+ largest payload read through it*/
+struct PayloadBuf {
+    char * data;
+    size_t cap;
+};
+
+struct PayloadCodec;
+
+/*Restores a packed payload of payload_len bytes into payload, which has room for a null char
+ after it. Returns 0 on success, -1 if the packed payload is corrupt*/
+typedef int (*payload_unpack_f)(const struct PayloadCodec * pcodec, const uint8_t * packed,
+        uint32_t packed_len, char * payload, uint32_t payload_len);
+
 /*single link in blockchain*/
 struct Link {
     struct Block block; /*The chain 'links' block*/
@@ -24,6 +61,20 @@ struct BlockChain {
     uint32_t len; /*Length of block chain*/
     struct Link * head; /*Head of chain*/
     struct Link * tail; /*Tail of chain to speed up additions to chain*/
+    struct Link * resident_head; /*Oldest link whose payload is still held in memory*/
+    uint32_t pruned_len; /*Number of links at the start of the chain with pruned payloads*/
+    int cold_fd; /*Cold storage file for pruned payloads. -1 if pruned payloads are dropped*/
+    off_t cold_end; /*Offset in cold storage the next pruned payload is written at*/
+    struct Link ** links; /*Links indexed by height for constant time lookup*/
+    uint32_t links_cap; /*Allocated size of links*/
+    struct Link * bulk_links; /*Links allocated as one array by bulk loading. NULL if unused*/
+    uint32_t bulk_len; /*Number of links in bulk_links*/
+    char * bulk_payloads; /*Arena holding payloads of bulk loaded links*/
+    size_t bulk_payloads_sz; /*Size of bulk_payloads*/
+    uint32_t * bulk_page_refs; /*Payloads still held on each page of bulk_payloads. Pages are handed
+                                 back to the kernel as they empty. NULL if unused*/
+    const struct PayloadCodec * pcodec; /*Codec packed payloads are restored with. NULL if none are packed*/
+    payload_unpack_f unpack; /*Unpacks payloads packed by pcodec*/
 };
 
 /*Operations on chain*/
@@ -33,12 +84,30 @@ struct BlockChain initialise_chain(void);
 void deinitialise_chain(struct BlockChain * pblock_chain);
 void print_chain(const struct BlockChain * pblock_chain);
 struct Link* append_link(struct BlockChain* pblock_chain);
+struct Link* get_link(const struct BlockChain* pblock_chain, uint32_t height);
 int add_block(struct BlockChain * pblock_chain, const char * payload);
+int append_block(struct BlockChain * pblock_chain, char * payload, uint32_t len, uint32_t hash,
+        uint64_t timestamp);
+int append_header(struct BlockChain * pblock_chain, const struct Block * pheader);
 int unpack_block(int sockfd, struct BlockChain * pblock_chain);
+ssize_t unpack_block_buf(const uint8_t * buf, size_t len, struct BlockChain * pblock_chain);
+char * receive_payload(int sockfd, uint32_t len, uint32_t * phash);
+const char * view_payload(const struct BlockChain * pblock_chain, const struct Block * pblock,
+        struct PayloadBuf * pscratch);
+void free_payload_buf(struct PayloadBuf * pscratch);
+void release_payload(const struct BlockChain * pblock_chain, struct Block * pblock);
+uint64_t next_timestamp(const struct BlockChain * pblock_chain);
+int adopt_bulk_links(struct BlockChain * pblock_chain, struct Link * links, uint32_t n_links,
+        char * payloads, size_t payloads_sz);
 
 /*Operations on block*/
 void print_block(const struct Block block);
 int add_payload(struct Block* pblock, const char* payload, uint8_t length_known);
 void pack_block(const struct Block block, uint8_t** pbuf, size_t* len);
+void pack_block_header(const struct Block * pblock, uint8_t * buf);
+int unpack_block_header(const uint8_t * buf, struct Block * pblock);
 void hash_block(struct Block* pblock);
+uint32_t hash_payload(const char * payload, size_t len);
+uint32_t hash_payload_update(uint32_t hash, const void * chunk, size_t len);
+uint32_t seal_hash(uint32_t payload_hash, uint64_t timestamp);
 #endif //_BLOCK_H
@@ -0,0 +1,24 @@
+#ifndef _CHAIN_SYNC_H
+#define _CHAIN_SYNC_H
+
+#include <stdint.h>
+#include "block.h"
+
+#define SYNC_RANGE_BLOCKS 512 /*Payloads fetched per range request. At most MAX_PAYLOAD_RANGE*/
+#define SYNC_MAX_WORKERS 64 /*Upper bound on concurrent payload fetch connections*/
+#define SYNC_MAX_PEERS 64 /*Upper bound on peers payloads are fetched from*/
+#define SYNC_MAX_ATTEMPTS 3 /*Times a range is retried after a failed fetch*/
+
+/*Outcome of a headers-first sync*/
+struct SyncStats {
+    uint32_t blocks; /*Number of blocks synced*/
+    uint32_t pruned; /*Blocks no peer could supply a payload for*/
+    uint64_t payload_bytes; /*Payload bytes fetched*/
+    unsigned workers; /*Number of fetch connections used*/
+    uint32_t retries; /*Ranges fetched more than once*/
+};
+
+int sync_chain(struct BlockChain * pblock_chain, char * const * peers, unsigned n_peers,
+        unsigned conns_per_peer, struct SyncStats * pstats);
+
+#endif /*_CHAIN_SYNC_H*/
@@ -0,0 +1,100 @@
+#ifndef _CHERUB_H
+#define _CHERUB_H
+
+/*libcherub: asynchronous client for cherub chain nodes. Requests are queued without
+ blocking, pipelined over a pool of persistent connections and completed through
+ callbacks run from cherub_process. Not thread safe; use one client per thread*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include "block.h"
+
+#define CHERUB_MAX_CONNS 64 /*Upper bound on pooled connections per client*/
+#define CHERUB_MAX_PENDING 4096 /*Requests queued per connection before submissions fail*/
+#define CHERUB_RECONNECT_MIN_MS 50 /*First reconnection backoff. Doubles on each failure*/
+#define CHERUB_RECONNECT_MAX_MS 2000
+
+/*Status passed to completion callbacks*/
+enum cherub_status {
+    CHERUB_OK = 0,
+    CHERUB_ERR = -1, /*Malformed response, connection repeatedly failed with request in flight
+                       or node could not make the block durable*/
+    CHERUB_REJECTED = -2, /*Node's admission control rejected the request*/
+    CHERUB_CANCELLED = -3, /*Client was deinitialised before the request completed*/
+    CHERUB_DUPLICATE = -4, /*Node rejected the payload as a recent duplicate*/
+    CHERUB_UNVERIFIED = -5, /*Node refused the payload as a malformed or badly signed transaction*/
+    CHERUB_UNKNOWN = -6, /*Connection failed after the add block was written but before it was
+                           acknowledged. The node may or may not have appended the block, so it
+                           is not resent*/
+    CHERUB_READ_ONLY = -7 /*Node is a read replica and refuses writes*/
+};
+
+enum cherub_request_type {
+    CHERUB_ADD_BLOCK,
+    CHERUB_CHAIN
+};
+
+/*Called once the node has acknowledged an add block request. height and hash identify the
+ appended block when status is CHERUB_OK and are 0 otherwise*/
+typedef void (*cherub_add_block_cb)(void * arg, enum cherub_status status, uint32_t height,
+        uint32_t hash);
+/*Called with the node's chain. The chain is deinitialised once the callback returns unless
+ the callback takes it by copying the struct and setting *pchain to initialise_chain()*/
+typedef void (*cherub_chain_cb)(void * arg, enum cherub_status status, struct BlockChain * pchain);
+
+/*Queued request. Kept until completed so a chain request can be resent after a reconnection*/
+struct CherubRequest {
+    enum cherub_request_type type;
+    uint8_t * wire; /*Encoded request*/
+    size_t wire_len;
+    union {
+        cherub_add_block_cb add_block;
+        cherub_chain_cb chain;
+    } cb;
+    void * arg;
+    uint8_t attempts; /*Connections a chain request was written to that then failed*/
+    uint32_t height; /*Height acknowledged for an add block request*/
+    uint32_t hash; /*Hash acknowledged for an add block request*/
+};
+
+/*Pooled connection with its FIFO of requests. Responses arrive in request order*/
+struct CherubConn {
+    int fd; /*-1 while disconnected*/
+    uint64_t retry_at_ms; /*Earliest time to reconnect*/
+    unsigned backoff_ms; /*Wait before next reconnection attempt*/
+    int want_write; /*EPOLLOUT currently registered*/
+
+    struct CherubRequest * queue; /*Ring of CHERUB_MAX_PENDING requests*/
+    uint32_t head; /*Oldest incomplete request*/
+    uint32_t count; /*Number of incomplete requests*/
+    uint32_t write_idx; /*Requests before this (relative to head) are fully written*/
+    size_t write_off; /*Bytes of request at write_idx already written*/
+
+    uint8_t * in; /*Received bytes not yet parsed*/
+    size_t in_len;
+    size_t in_cap;
+    struct BlockChain chain; /*Chain response being assembled*/
+    int64_t chain_expected; /*Blocks expected in chain response. -1 until count is parsed*/
+};
+
+struct CherubClient {
+    char peer[256]; /*Node as host:port or unix:<path>*/
+    int epfd; /*epoll instance every connection is registered with*/
+    int timer_fd; /*timerfd registered with epfd. Fires when a dropped connection is due a retry*/
+    unsigned n_conns;
+    struct CherubConn conns[CHERUB_MAX_CONNS];
+    uint64_t reconnects; /*Connections re-established after a failure*/
+};
+
+int cherub_init(struct CherubClient * pclient, const char * peer, unsigned n_conns);
+void cherub_deinit(struct CherubClient * pclient);
+int cherub_fd(const struct CherubClient * pclient);
+int cherub_add_block(struct CherubClient * pclient, const char * payload,
+        cherub_add_block_cb cb, void * arg);
+int cherub_get_chain(struct CherubClient * pclient, cherub_chain_cb cb, void * arg);
+int cherub_process(struct CherubClient * pclient, int timeout_ms);
+uint32_t cherub_pending(const struct CherubClient * pclient);
+int cherub_drain(struct CherubClient * pclient, int timeout_ms);
+
+#endif /*_CHERUB_H*/
@@ -0,0 +1,49 @@
+#ifndef _CODEC_H
+#define _CODEC_H
+
+#include <stdint.h>
+#include <zlib.h>
+#include "block.h"
+
+#define CODEC_DICT_SZ (16 << 10) /*Bytes of a trained dictionary. Setting it costs time per payload packed*/
+#define CODEC_MAX_DICTS 255 /*Dictionary versions a store can hold. Versions are numbered from 1*/
+#define CODEC_SAMPLE_BYTES (4 << 20) /*Bytes of recent payloads a dictionary is trained on*/
+#define CODEC_MIN_SAMPLES 256 /*Payloads needed before a dictionary is trained*/
+#define CODEC_MIN_PAYLOAD 32 /*Payloads shorter than this are left raw*/
+#define CODEC_BATCH 256 /*Max payloads packed per call to compress_chain*/
+#define CODEC_DEFAULT_DEPTH 256 /*Payloads deeper than this are packed unless configured otherwise*/
+
+struct EndpointContext;
+
+/*Dictionary payloads are packed against. Packed payloads name the version they need, so
+ payloads packed before a retrain stay readable*/
+struct PayloadDict {
+    uint32_t version; /*Version of dictionary. 0 if unused*/
+    uint32_t len; /*Bytes in data*/
+    uint32_t sampled; /*Bytes of payloads it was trained on*/
+    uint8_t * data;
+};
+
+/*Compresses payloads at rest with the latest of a store of trained dictionaries. Every
+ dictionary ever trained is kept in the store so any packed payload can be unpacked*/
+struct PayloadCodec {
+    int store_fd; /*Append only file of dictionaries*/
+    struct PayloadDict dicts[CODEC_MAX_DICTS + 1]; /*Indexed by version*/
+    uint32_t latest; /*Version new payloads are packed with. 0 until one is trained*/
+    z_stream deflater; /*Reused by the thread packing payloads*/
+    uint8_t * out; /*Scratch payloads are packed into*/
+    size_t out_cap;
+    uint32_t next_height; /*Lowest height not yet considered for packing*/
+    uint64_t packed; /*Number of payloads packed*/
+    uint64_t raw_bytes; /*Unpacked size of packed payloads*/
+    uint64_t packed_bytes; /*Packed size of packed payloads*/
+};
+
+int initialise_codec(struct PayloadCodec * pcodec, const char * store_path, struct BlockChain * pblock_chain);
+void deinitialise_codec(struct PayloadCodec * pcodec);
+int train_codec(struct PayloadCodec * pcodec, struct EndpointContext * pctx);
+int compress_chain(struct PayloadCodec * pcodec, struct EndpointContext * pctx, uint32_t depth);
+int unpack_payload(const struct PayloadCodec * pcodec, const uint8_t * packed, uint32_t packed_len,
+        char * payload, uint32_t payload_len);
+
+#endif /*_CODEC_H*/
@@ -0,0 +1,33 @@
+#ifndef _DEDUP_H
+#define _DEDUP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define DEDUP_DEFAULT_WINDOW 65536 /*Default number of recent payloads checked for duplicates*/
+
+/*Duplicate payload filter over a sliding window of recent payload hashes.
+ Two generations of Bloom filter give a fast negative answer for new payloads and
+ an exact hash set resolves the rare positives*/
+struct DedupFilter {
+    uint32_t window; /*Number of most recent payload hashes remembered*/
+
+    uint64_t * bloom[2]; /*Current and previous Bloom generation bitsets*/
+    uint64_t bloom_mask; /*Number of bits per generation minus 1*/
+    uint32_t bloom_count; /*Insertions into current generation*/
+
+    uint64_t * set; /*Open addressing table of hashes in window. 0 marks empty*/
+    uint64_t set_mask; /*Number of slots minus 1*/
+
+    uint64_t * recent; /*Ring of hashes in insertion order used to evict from set*/
+    uint32_t recent_pos; /*Next slot of recent to overwrite*/
+    uint32_t recent_count; /*Number of valid entries in recent*/
+};
+
+int initialise_dedup(struct DedupFilter * pfilter, uint32_t window);
+void deinitialise_dedup(struct DedupFilter * pfilter);
+uint64_t hash_payload64(const char * payload, size_t len);
+int dedup_contains(const struct DedupFilter * pfilter, uint64_t hash);
+void dedup_insert(struct DedupFilter * pfilter, uint64_t hash);
+
+#endif /*_DEDUP_H*/
@@ -1,7 +1,17 @@
 #ifndef _ENDPOINTS_H
 #define _ENDPOINTS_H
 
+#include <pthread.h>
 #include "block.h"
+#include "dedup.h"
+#include "search_index.h"
+#include "range_tree.h"
+#include "time_index.h"
+#include "admission.h"
+#include "journal.h"
+#include "subscriptions.h"
+#include "verify.h"
+#include "trace.h"
 
 enum endpoint_dispatch_retval {
     DISPATCH_OK = 0,
@@ -9,10 +19,106 @@ enum endpoint_dispatch_retval {
     DISPATCH_INVALID_ENDPOINT = -2,
     DISPATCH_SEND_FAIL = -3,
     DISPATCH_RECV_FAIL = -4,
-    DISPATCH_INVALID_ARGS = -5
+    DISPATCH_INVALID_ARGS = -5,
+    DISPATCH_DUPLICATE = -6,
+    DISPATCH_RATE_LIMITED = -7,
+    DISPATCH_DETACHED = -8, /*Connection was handed off by the endpoint and is no longer served*/
+    DISPATCH_UNVERIFIED = -9, /*Transaction was malformed or its signature did not hold*/
+    DISPATCH_READ_ONLY = -10 /*Write refused by a read replica. Payload must still be read and dropped*/
+};
+
+/*Add block response held back until the group commit that makes its block durable*/
+struct PendingAck {
+    int sockfd; /*Client that added the block*/
+    uint32_t height; /*Height of block, or a rejection marker*/
+    uint32_t hash; /*Hash of block. 0 with a rejection marker*/
+};
+
+/*Add block responses of one reactor awaiting the next group commit. Held in arrival order
+ so a client pipelining requests sees responses in the order it sent them*/
+struct AckQueue {
+    struct PendingAck * acks;
+    uint32_t len;
+    uint32_t cap;
+};
+
+/*Signed transaction held with its reserved response until the reactor's next verification
+ batch. Transactions are appended in arrival order once the batch is verified*/
+struct PendingTx {
+    char * payload; /*malloc'd payload. Moved onto the chain if its signature holds*/
+    uint32_t len; /*Length of payload excluding null char*/
+    uint32_t payload_hash; /*Hash of payload computed as it was received*/
+    uint32_t ack; /*Index of its response in the reactor's ack queue*/
+};
+
+/*Transactions of one reactor awaiting verification. jobs[i] is the parsed form of txs[i]*/
+struct TxQueue {
+    struct PendingTx * txs;
+    struct VerifyJob * jobs;
+    uint32_t len;
+    uint32_t cap;
+};
+
+/*Takes add block responses in place of sending them on the client's socket, for a backend
+ that sends from its own event loop*/
+struct ResponseSink {
+    int (*send)(void * arg, int sockfd, const void * buf, size_t len); /*0 once queued, -1 on failure*/
+    void * arg;
+};
+
+/*Chain endpoint response produced a batch at a time*/
+struct ChainStream;
+
+/*State endpoints operate on. Optional subsystems are NULL when disabled*/
+struct EndpointContext {
+    struct BlockChain * pblock_chain; /*Chain of the node*/
+    struct DedupFilter * pdedup; /*Rejects recently seen payloads on ingest*/
+    struct SearchIndex * psearch; /*Payload index queried by the search endpoint*/
+    struct RangeTree * ptree; /*Hash tree over height ranges queried by the tree endpoint*/
+    struct TimeIndex * ptime; /*Sparse time index queried by the window endpoint*/
+    struct Admission * padmission; /*Rate limits requests per connection and address*/
+    struct SubHub * psubs; /*Subscribers new blocks are published to*/
+    struct Journal * pjournal; /*Appended blocks are recorded here and synced before being served*/
+    struct AckQueue * packs; /*Add block responses held for the next commit_acks. NULL to commit
+                               and respond to each add block request on its own*/
+    struct Verifier * pverifier; /*Checks signed transactions before they are added. NULL accepts
+                                   any payload*/
+    struct TxQueue * ptxs; /*Transactions held for the next batch verification. NULL to verify
+                             each on its own. Only used with packs*/
+    pthread_rwlock_t * plock; /*Guards chain and indexes when shared by several reactors.
+                                NULL when the node is single threaded*/
+    struct ResponseSink * psink; /*Takes held add block responses. NULL to send them on the socket*/
+    int read_only; /*Set on read replicas. Write endpoints are refused*/
 };
 
 enum endpoint_dispatch_retval endpoint_dispatch(unsigned int endpoint_id,
-        int sockfd, struct BlockChain * pblock_chain);
+        int sockfd, struct EndpointContext * pctx);
+int serve_request(int sockfd, struct EndpointContext * pctx);
+int serve_endpoint(uint8_t endpoint_id, int sockfd, struct EndpointContext * pctx,
+        struct TraceSpan * pspan);
+int finish_request(uint8_t endpoint_id, int sockfd, enum endpoint_dispatch_retval ret,
+        struct TraceSpan * pspan);
+enum endpoint_dispatch_retval admit_add_block(int sockfd, struct EndpointContext * pctx,
+        uint32_t payload_sz);
+enum endpoint_dispatch_retval add_received_block(int sockfd, struct EndpointContext * pctx,
+        char * payload, uint32_t len, uint32_t payload_hash);
+enum endpoint_dispatch_retval open_chain_stream(int sockfd, struct EndpointContext * pctx,
+        struct ChainStream ** ppstream);
+int next_chain_batch(struct EndpointContext * pctx, struct ChainStream * pstream,
+        const uint8_t ** pbuf, size_t * plen);
+void close_chain_stream(struct EndpointContext * pctx, struct ChainStream * pstream);
+enum endpoint_dispatch_retval ingest_payload(struct EndpointContext * pctx,
+        char * payload, uint32_t len, uint32_t payload_hash, uint32_t * pheight, uint32_t * phash);
+enum endpoint_dispatch_retval replicate_blocks(struct EndpointContext * pctx,
+        struct BlockChain * pblocks, uint32_t height);
+int commit_chain(struct EndpointContext * pctx);
+int commit_acks(struct EndpointContext * pctx);
+void cancel_acks(struct EndpointContext * pctx, int sockfd);
+void free_ack_queue(struct AckQueue * packs);
+void verify_pending(struct EndpointContext * pctx);
+void free_tx_queue(struct TxQueue * ptxs);
+void lock_chain_shared(struct EndpointContext * pctx);
+void lock_chain_exclusive(struct EndpointContext * pctx);
+void unlock_chain(struct EndpointContext * pctx);
 
 #endif /*_ENDPOINTS_H*/
@@ -0,0 +1,30 @@
+#ifndef _FOLLOWER_H
+#define _FOLLOWER_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "endpoints.h"
+
+#define FOLLOW_BATCH_BLOCKS 512 /*Most pushed blocks appended to the replica with one commit*/
+#define FOLLOW_WAIT_MS 100 /*Longest wait for pushed blocks before checking the follower is still running*/
+#define FOLLOW_MAX_DIVERGENCES 3 /*Mismatches at one height before the follower gives up on the primary*/
+#define FOLLOW_RETRY_MS 500 /*Wait before reconnecting after the primary fails*/
+#define FOLLOW_RECV_TIMEOUT_S 5 /*Primary considered unresponsive after this long*/
+
+/*Tails a primary node's chain into a read replica's chain from a background thread by subscribing
+ to the blocks it appends*/
+struct Follower {
+    char peer[256]; /*Primary as host:port or unix:<path>*/
+    struct EndpointContext * pctx; /*State of the replica. plock must be set*/
+    pthread_t thread;
+    volatile int running; /*Cleared to stop the follower thread*/
+    uint64_t blocks; /*Blocks replicated since start*/
+    uint64_t reconnects; /*Connections to the primary re-established after a failure*/
+    int diverged; /*Set once the follower stopped because the primary's chain differs from the replica's*/
+    uint32_t diverged_height; /*Height of the first block that did not link to the replica's tip*/
+};
+
+int start_follower(struct Follower * pfollower, const char * peer, struct EndpointContext * pctx);
+void stop_follower(struct Follower * pfollower);
+
+#endif /*_FOLLOWER_H*/
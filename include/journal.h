@@ -0,0 +1,32 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "block.h"
+
+#define JOURNAL_BUFFER_SZ (1 << 20) /*Bytes of records gathered in memory between writes*/
+
+/*Append only log of every block appended to the chain. Records are buffered and only made
+ durable by journal_sync, so one fdatasync commits every block appended since the last*/
+struct Journal {
+    int fd; /*Journal file. -1 once closed*/
+    uint8_t * buf; /*Records not yet written to fd*/
+    size_t len; /*Number of buffered bytes*/
+    struct PayloadBuf cold; /*Scratch for payloads read back from cold storage*/
+    uint64_t appended; /*Records handed to the journal*/
+    uint64_t durable; /*Records known to be on disk*/
+    uint64_t syncs; /*Number of fdatasync calls made*/
+    int failed; /*Set once a write fails. Nothing after it is reported durable*/
+    pthread_mutex_t lock; /*Guards buffer and counters. Syncs run outside it*/
+};
+
+int open_journal(struct Journal * pjournal, const char * path, struct BlockChain * pblock_chain);
+void close_journal(struct Journal * pjournal);
+int journal_append(struct Journal * pjournal, const struct BlockChain * pblock_chain,
+        const struct Block * pblock);
+int journal_sync(struct Journal * pjournal);
+uint32_t journal_committed(struct Journal * pjournal);
+int journal_failed(struct Journal * pjournal);
+
+#endif /*_JOURNAL_H*/
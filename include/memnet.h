@@ -0,0 +1,60 @@
+#ifndef _MEMNET_H
+#define _MEMNET_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "server.h"
+
+#define MEMNET_HOST "sim" /*Host of in-memory peers. sim<from>:<to> connects node from to node to*/
+#define MEMNET_MSS 1448 /*Bytes per simulated segment, as for TCP over Ethernet*/
+#define MEMNET_MIN_RTO_US 200000 /*Retransmission timeout for a lost segment with none after it*/
+#define MEMNET_BACKLOG 256 /*Connections waiting to be accepted per node before connects are refused*/
+#define MEMNET_QUEUE_BYTES (4 << 20) /*Bytes held per direction before the relay stops reading the sender*/
+#define MEMNET_READ_BYTES 65536 /*Most bytes the relay reads from a sender at once*/
+
+/*Links every connection of a MemNet is shaped by*/
+struct MemLinks {
+    uint64_t latency_us; /*One way delay*/
+    uint64_t jitter_us; /*Max extra delay drawn per read from the sender*/
+    uint64_t bandwidth; /*Bytes per second every node can send, shared by all its links. 0 for unlimited*/
+    double loss; /*Probability each segment is lost and retransmitted*/
+    uint64_t seed; /*Jitter and loss are drawn from generators seeded from this and the link*/
+};
+
+/*Connections a node has made to it that it has yet to accept*/
+struct MemListener {
+    int fd; /*eventfd counting waiting connections, polled as the node's listener. -1 if not listening*/
+    int queue[MEMNET_BACKLOG]; /*Ring of server ends of waiting connections*/
+    uint32_t head;
+    uint32_t count;
+};
+
+struct MemConn;
+
+/*In-memory network of nodes in one process. Installed with set_transport so nodes reach each
+ other through connect_to_node and get_client as they would over sockets*/
+struct MemNet {
+    struct Transport transport; /*Install with set_transport*/
+    struct MemLinks links;
+    uint32_t n_nodes;
+    struct MemListener * listeners; /*One per node*/
+    uint32_t * pair_conns; /*Connections made so far between each ordered pair of nodes*/
+    pthread_mutex_t lock; /*Guards listeners, pair_conns and adopted*/
+    struct MemConn * adopted; /*Connections made since the relay last ran*/
+    int epoll_fd; /*Relay ends of every connection*/
+    int wake_fd; /*eventfd waking the relay for new connections and shutdown*/
+    pthread_t relay;
+    volatile int running; /*Cleared to stop the relay*/
+    struct MemConn * conns; /*Connections the relay carries. Relay thread only*/
+    uint64_t * busy_until_us; /*Time each node's upload is free. Relay thread only*/
+    uint64_t connections; /*Connections made*/
+    uint64_t bytes; /*Bytes sent, counting each retransmitted segment again. Read once stopped*/
+    uint64_t retransmitted; /*Bytes of retransmitted segments. Read once stopped*/
+};
+
+int initialise_memnet(struct MemNet * pnet, uint32_t n_nodes, const struct MemLinks * plinks);
+void deinitialise_memnet(struct MemNet * pnet);
+int memnet_listen(struct MemNet * pnet, uint32_t node);
+uint64_t memnet_now_us(void);
+
+#endif /*_MEMNET_H*/
@@ -0,0 +1,73 @@
+#ifndef _NETSIM_H
+#define _NETSIM_H
+
+#include <stdint.h>
+#include "block.h"
+
+#define NETSIM_MAX_NODES 1024 /*Upper bound on simulated nodes*/
+#define NETSIM_MAX_LIVE_NODES 256 /*Upper bound on nodes of a live run. Each runs several threads*/
+#define NETSIM_MAX_JOINERS 64 /*Upper bound on nodes joining by sync*/
+#define NETSIM_MAX_DEGREE 16 /*Upper bound on upstreams a node subscribes to*/
+#define NETSIM_MSS 1448 /*Bytes per simulated segment, as for TCP over Ethernet*/
+#define NETSIM_MIN_RTO_US 200000 /*Retransmission timeout for a lost segment with none after it*/
+#define NETSIM_EPOCH_MS 1767225600000ULL /*Wall clock time simulated time 0 maps to in block timestamps*/
+#define NETSIM_STALL_S 10 /*Live run ends once no node has appended a block for this long*/
+
+/*Network and workload to simulate. run_simulation draws every random choice from seed and
+ runs on simulated time, so equal configurations always produce equal reports.
+ run_live_simulation draws the mesh, payloads and every link's jitter and loss from seed, but
+ runs the node's real endpoints, sync and subscriptions on threads timed by the real clock, so
+ its reports vary from run to run and with the load on the machine*/
+struct SimConfig {
+    uint32_t n_nodes; /*Nodes present from the start. Node 0 produces every block*/
+    uint32_t degree; /*Upstreams each node subscribes to for new blocks*/
+    uint32_t n_blocks; /*Blocks produced*/
+    uint64_t interval_us; /*Time between blocks*/
+    uint32_t payload_size; /*Length of each payload*/
+    uint64_t latency_us; /*One way delay of every link*/
+    uint64_t jitter_us; /*Max extra delay drawn per message, or per chunk sent in a live run*/
+    uint64_t bandwidth; /*Bytes per second every node can send, shared by all its links. 0 for unlimited*/
+    double loss; /*Probability each segment is lost and retransmitted*/
+    uint32_t n_joiners; /*Nodes joining once every block is produced, by syncing from peers*/
+    uint32_t sync_peers; /*Peers each joiner fetches payloads from*/
+    uint32_t conns_per_peer; /*Concurrent range requests each joiner keeps open to each peer*/
+    uint64_t seed;
+};
+
+/*Outcome of a joiner's sync*/
+struct SimSync {
+    int failed; /*Set if the sync failed or the joiner never caught up*/
+    uint32_t blocks; /*Blocks synced*/
+    uint64_t time_us; /*From headers request to chain assembled*/
+    uint64_t bytes; /*Bytes received while syncing. Payload bytes fetched in a live run*/
+    uint32_t retries; /*Ranges fetched more than once*/
+    uint64_t catch_up_us; /*From chain assembled to holding the tip*/
+};
+
+/*Measurements of a simulation*/
+struct SimReport {
+    uint64_t end_us; /*Simulated time the last event happened at. In a live run, time from the
+                       first block being produced to the last node catching up*/
+    uint64_t events; /*Events processed. 0 in a live run*/
+    uint64_t messages; /*Messages delivered. 0 in a live run*/
+    uint64_t connections; /*Connections made between nodes in a live run*/
+    uint64_t bytes; /*Bytes sent between nodes, counting each retransmitted segment again*/
+    uint64_t retransmitted; /*Bytes of retransmitted segments*/
+    uint64_t duplicate_bytes; /*Bytes of blocks received by nodes already holding them*/
+    uint32_t bad_blocks; /*Received blocks failing verification. Always 0 unless the protocol breaks*/
+    uint32_t missing; /*Block and node pairs never delivered*/
+    uint64_t prop_p50_us; /*Percentiles of the time from production until a node appends a block*/
+    uint64_t prop_p90_us;
+    uint64_t prop_p99_us;
+    uint64_t prop_max_us;
+    uint64_t all_p50_us; /*Percentiles of the time until every node holds a block*/
+    uint64_t all_p99_us;
+    uint64_t all_max_us;
+    uint32_t n_syncs;
+    struct SimSync syncs[NETSIM_MAX_JOINERS];
+};
+
+int run_simulation(const struct SimConfig * pconfig, struct SimReport * preport);
+int run_live_simulation(const struct SimConfig * pconfig, struct SimReport * preport);
+
+#endif /*_NETSIM_H*/
@@ -0,0 +1,29 @@
+#ifndef _RANGE_TREE_H
+#define _RANGE_TREE_H
+
+#include <stdint.h>
+#include "block.h"
+
+#define RANGE_TREE_MAX_LEVELS 33 /*Leaf level plus one per doubling of a 32 bit height*/
+#define RANGE_TREE_MAX_NODES 1024 /*Max number of node hashes returned by a single request*/
+
+/*Binary hash tree over block height ranges. Node i of level k covers heights
+ [i << k, (i + 1) << k) and hashes its two children, or is a copy of its left child when
+ the chain ends before the right one starts. Two chains agree on every height a node covers
+ exactly when the node hashes match, so the first divergent height can be found by
+ descending from the root*/
+struct RangeTree {
+    uint64_t * levels[RANGE_TREE_MAX_LEVELS]; /*Node hashes of each level. Level 0 holds leaves*/
+    uint32_t caps[RANGE_TREE_MAX_LEVELS]; /*Allocated nodes of each level*/
+    uint32_t n_levels; /*Levels in use. The top level holds a single root*/
+    uint32_t len; /*Blocks below this height have been added*/
+};
+
+int initialise_range_tree(struct RangeTree * ptree);
+void deinitialise_range_tree(struct RangeTree * ptree);
+int range_tree_update(struct RangeTree * ptree, const struct BlockChain * pblock_chain);
+uint32_t range_tree_level_len(const struct RangeTree * ptree, uint32_t len, uint32_t level);
+uint32_t range_tree_nodes(const struct RangeTree * ptree, uint32_t len, uint32_t level, uint32_t start,
+        uint32_t count, uint64_t * hashes);
+
+#endif /*_RANGE_TREE_H*/
@@ -3,14 +3,41 @@
 
 #include "block.h"
 #include "server.h"
+#include "search_index.h"
+#include "range_tree.h"
+#include "trace.h"
 
 //Define command enum
 enum endpoint_id {
     ENDPOINT_CHAIN = 0,
-    ENDPOINT_ADD_BLOCK = 1
+    ENDPOINT_ADD_BLOCK = 1,
+    ENDPOINT_SEARCH = 2,
+    ENDPOINT_HEADERS = 3,
+    ENDPOINT_PAYLOADS = 4,
+    ENDPOINT_BLOCKS = 5,
+    ENDPOINT_TREE = 6,
+    ENDPOINT_WINDOW = 7,
+    ENDPOINT_SUBSCRIBE = 8,
+    ENDPOINT_TRACE = 9
 };
 
 int request_chain_endpoint(int sockfd, struct BlockChain * pblock_chain);
-int request_add_block_endpoint(int sockfd, const char * payload);
+int request_add_block_endpoint(int sockfd, const char * payload, size_t payload_len,
+        uint32_t * pheight, uint32_t * phash);
+int request_search_endpoint(int sockfd, enum search_mode mode, const char * query,
+        struct BlockChain * presults, uint32_t * heights, int * ptruncated);
+int request_headers_endpoint(int sockfd, struct BlockHeader ** pheaders, uint32_t * plen);
+int request_payloads_endpoint(int sockfd, uint32_t start, uint32_t count,
+        const struct BlockHeader * headers, char ** payloads);
+int request_blocks_endpoint(int sockfd, uint32_t start, uint32_t count, const uint32_t * pprev_hash,
+        struct BlockChain * pblocks);
+int request_tree_endpoint(int sockfd, uint32_t level, uint32_t start, uint32_t count,
+        uint64_t * hashes, uint32_t * pchain_len);
+int request_window_endpoint(int sockfd, uint64_t since, uint64_t until, uint32_t min_height,
+        uint32_t count, struct BlockChain * pblocks, uint32_t * pstart);
+int request_subscribe_endpoint(int sockfd, uint32_t start);
+int receive_subscribed_blocks(int sockfd, uint32_t height, uint32_t count, const uint32_t * pprev_hash,
+        struct BlockChain * pblocks);
+int request_trace_endpoint(int sockfd, struct TraceSpan ** pspans, uint32_t * plen);
 
 #endif //_REQUESTS_H
@@ -0,0 +1,42 @@
+#ifndef _SEARCH_INDEX_H
+#define _SEARCH_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "block.h"
+
+#define SEARCH_MAX_RESULTS 1024 /*Max number of matches returned by a single query*/
+#define SEARCH_TRUNCATED_FLAG 0x80000000 /*Set in transmitted match count when more blocks matched than were sent*/
+#define SEARCH_MAX_QUERY 1024 /*Max length of a query. Independent of MAX_PAYLOAD*/
+
+enum search_mode {
+    SEARCH_EXACT = 0, /*Payload equals query*/
+    SEARCH_PREFIX = 1, /*Payload starts with query*/
+    SEARCH_SUBSTRING = 2 /*Payload contains query*/
+};
+
+/*Heights of all blocks containing a given trigram, in ascending order*/
+struct PostingList {
+    uint32_t gram; /*Trigram packed into low 24 bits*/
+    uint32_t len;
+    uint32_t cap;
+    uint32_t * heights; /*NULL marks an empty slot in the index table*/
+};
+
+/*Trigram inverted index over block payloads. Payloads are indexed with start and end
+ anchors so the same index answers exact, prefix and substring queries*/
+struct SearchIndex {
+    struct PostingList * table; /*Open addressing table keyed by trigram*/
+    uint32_t table_cap; /*Number of slots. Power of 2*/
+    uint32_t n_grams; /*Number of occupied slots*/
+    uint32_t indexed; /*Blocks below this height have been indexed*/
+};
+
+int initialise_search_index(struct SearchIndex * pindex);
+void deinitialise_search_index(struct SearchIndex * pindex);
+int search_index_update(struct SearchIndex * pindex, const struct BlockChain * pblock_chain);
+int search_index_query(const struct SearchIndex * pindex, const struct BlockChain * pblock_chain,
+        enum search_mode mode, const char * query, size_t query_len,
+        uint32_t * results, uint32_t max_results);
+
+#endif /*_SEARCH_INDEX_H*/
@@ -5,21 +5,42 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <poll.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
 
 struct ServerData {
     struct pollfd* pollfds; //array of pollfd objects for poll call
     int fd_count; //How many pollfd objects are being used
     int fd_size; //Total size of the pollfd array
     int listenerfd; //pointer to listener object so we can tell when to 'accept' new conn
+    int unix_listenerfd; //optional AF_UNIX listener for same-host clients. -1 if unused
+    char unix_path[sizeof(((struct sockaddr_un *)0)->sun_path)]; //path unix listener is bound to
 };
 
+/*Carries connections between nodes in place of sockets, such as the in-memory transport
+ used to run many nodes in one process. Sockets are used while none is installed*/
+struct Transport {
+    int (*connect)(void * arg, const char * node_address, const char * servname); /*Connected fd or -1*/
+    int (*accept)(void * arg, int listenfd); /*Connection waiting on listenfd or -1*/
+    void * arg; /*Passed to both*/
+};
+
+void set_transport(const struct Transport * ptransport);
 struct ServerData initialise_server(const char * servname);
+struct ServerData initialise_reuseport_server(const char * servname);
 void deinitialise_server(struct ServerData * pserver_data);
 int add_fd_to_server(struct ServerData* server_data, int new_fd);
+int add_unix_listener_to_server(struct ServerData* pserver_data, const char * path);
+int is_listener(const struct ServerData* pserver_data, int fd);
 int get_client(const int listenfd);
+int configure_client(int new_fd);
 int connect_to_node(const char *node_address, const char *servname);
+int connect_to_peer(const char *peer);
 void delete_fd_from_server(struct ServerData* server_data, int fd_index);
+void remove_fd_from_server(struct ServerData* server_data, int fd_index);
 int send_buf(int sockfd, const void * buf, size_t len);
 int receive_buf(int sockfd, void * buf, size_t len);
+void set_receive_prefix(int sockfd, const void * buf, size_t len);
+size_t clear_receive_prefix(void);
 
 #endif /*_SERVER_H*/
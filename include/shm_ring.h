@@ -0,0 +1,46 @@
+#ifndef _SHM_RING_H
+#define _SHM_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "block.h"
+
+#define SHM_RING_DATA_SIZE (1 << 20) /*Bytes of payload storage in ring. Must be a power of 2*/
+#define SHM_RING_MAX_RECORD (SHM_RING_DATA_SIZE / 4) /*Larger payloads must be sent over a socket*/
+#define SHM_RING_DRAIN_BATCH 256 /*Max records appended to the chain per drain*/
+#define SHM_PREFIX "shm:" /*Node address prefix selecting the shared memory transport*/
+
+/*Control block at the start of the shared mapping. Producer and consumer indices
+ live on separate cache lines so the two sides do not false share*/
+struct ShmRingHeader {
+    uint32_t magic; /*Set by the node once the ring is ready*/
+    uint32_t size; /*Size of data region*/
+    pthread_mutex_t producer_lock; /*Serialises producers in separate client processes. Robust, so a
+                                     producer dying while holding it does not wedge the ring*/
+    uint8_t pad0[64 - 2 * sizeof(uint32_t) - sizeof(pthread_mutex_t)];
+    uint64_t head; /*Consumer position. Written only by the node*/
+    uint8_t pad1[56];
+    uint64_t tail; /*Producer position. Written only by the producer holding the lock*/
+    uint8_t pad2[56];
+};
+
+/*Called for each payload drained from ring with a malloc'd copy the consumer takes
+ ownership of. Return -1 to stop draining*/
+typedef int (*shm_ring_consumer_f)(void * ctx, char * payload, uint32_t len);
+
+struct ShmRing {
+    struct ShmRingHeader * hdr; /*NULL when ring is not mapped*/
+    uint8_t * data; /*Start of data region following header*/
+    size_t map_sz; /*Total size of mapping*/
+    char name[64]; /*Name of shared memory object*/
+    int owner; /*Owner unlinks the object on detach*/
+};
+
+int create_shm_ring(struct ShmRing * pring, const char * name);
+int attach_shm_ring(struct ShmRing * pring, const char * name);
+void detach_shm_ring(struct ShmRing * pring);
+int shm_ring_push(struct ShmRing * pring, const char * payload, uint32_t len);
+int shm_ring_drain(struct ShmRing * pring, shm_ring_consumer_f consumer, void * ctx);
+
+#endif /*_SHM_RING_H*/
@@ -0,0 +1,34 @@
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include <stdint.h>
+#include "block.h"
+
+#define SNAPSHOT_INTERVAL_S 60 /*Seconds between periodic snapshots taken by the node*/
+
+/*Where a block's pruned payload is kept in the chain's cold storage*/
+struct ColdPayload {
+    int64_t offset; /*Offset in cold storage. -1 if the payload is not stored there*/
+    uint32_t packed_len; /*Length of packed payload as stored. 0 if stored raw*/
+};
+
+/*Point in time summary of a chain. Enough to verify linkage without any payloads, and to
+ find again the payloads pruned to cold storage*/
+struct ChainSnapshot {
+    uint32_t height; /*Number of blocks in chain when snapshot was taken*/
+    uint32_t tip_hash; /*Hash of last block. 0 for empty chain*/
+    struct BlockHeader * headers; /*height headers in chain order*/
+    struct ColdPayload * cold; /*height cold storage locations in chain order*/
+    uint64_t cold_end; /*Bytes of cold storage in use when snapshot was taken*/
+};
+
+int take_snapshot(const struct BlockChain * pblock_chain, struct ChainSnapshot * psnapshot);
+int write_snapshot(const struct ChainSnapshot * psnapshot, const char * path);
+int load_snapshot(struct ChainSnapshot * psnapshot, const char * path);
+int restore_snapshot(struct BlockChain * pblock_chain, const struct ChainSnapshot * psnapshot);
+uint32_t check_snapshot(const struct BlockChain * pblock_chain, const struct ChainSnapshot * psnapshot);
+void free_snapshot(struct ChainSnapshot * psnapshot);
+int open_cold_store(struct BlockChain * pblock_chain, const char * path);
+int prune_chain(struct BlockChain * pblock_chain, uint32_t depth);
+
+#endif /*_SNAPSHOT_H*/
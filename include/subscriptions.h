@@ -0,0 +1,66 @@
+#ifndef _SUBSCRIPTIONS_H
+#define _SUBSCRIPTIONS_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "block.h"
+
+#define SUB_MAX_SUBSCRIBERS 1024 /*Upper bound on concurrent subscriptions per node*/
+#define SUB_QUEUE_FRAMES 1024 /*Blocks queued per subscriber before it overflows*/
+#define SUB_QUEUE_BYTES (16 << 20) /*Bytes queued per subscriber before it overflows*/
+#define SUB_CATCHUP_BLOCKS 256 /*Blocks read from the chain per subscriber per catch-up step*/
+#define SUB_STALL_S 30 /*Subscriber whose socket accepts nothing for this long is dropped*/
+#define SUB_POLL_MS 1000 /*Max wait of the publisher between checks for stalled subscribers*/
+
+struct EndpointContext;
+
+/*Serialised block in wire format. One frame is shared by every subscriber it is queued for
+ and freed when the last of them has sent it*/
+struct SubFrame {
+    uint32_t refs; /*Subscriber queues holding the frame*/
+    uint32_t len; /*Bytes in data*/
+    uint8_t data[]; /*Packed header followed by payload*/
+};
+
+/*Client pushed every block from a height onwards. Frames are queued for it live as blocks
+ are committed while it keeps up. On overflow it stops taking live frames and is fed from
+ the chain instead until it has caught up again, so memory per subscriber stays bounded
+ however far behind it falls*/
+struct Subscriber {
+    int fd; /*Subscribed socket. -1 once dropped*/
+    uint32_t next_height; /*Height of next block to queue*/
+    int live; /*Set while next_height is the published length and new blocks are queued as published*/
+    struct SubFrame ** queue; /*Ring of SUB_QUEUE_FRAMES frames to send*/
+    uint32_t head; /*Oldest queued frame*/
+    uint32_t count; /*Number of queued frames*/
+    size_t queued_bytes; /*Bytes of queued frames not yet sent*/
+    size_t sent; /*Bytes of head frame already sent*/
+    time_t last_progress; /*Last time the socket accepted bytes or had nothing to send*/
+};
+
+/*Subscribers of a node and the thread that writes to them. Publishing only queues frames
+ so appends never wait on a subscriber's socket*/
+struct SubHub {
+    struct EndpointContext * pctx; /*State of the node. plock must be set*/
+    struct Subscriber * subs; /*SUB_MAX_SUBSCRIBERS subscribers, n_subs of them in use*/
+    uint32_t n_subs;
+    uint32_t reserved; /*Slots held for clients being sent their confirmation*/
+    uint32_t published; /*Blocks below this height have been committed and published*/
+    struct PayloadBuf cold; /*Scratch for payloads read back from cold storage on catch-up*/
+    pthread_mutex_t lock; /*Guards subscribers and frames. Taken after the chain lock*/
+    int wake_fd; /*eventfd waking the publisher thread*/
+    int wake_pending; /*Set once publishing has woken the publisher until it next runs*/
+    pthread_t thread;
+    volatile int running; /*Cleared to stop the publisher thread*/
+    uint64_t frames; /*Frames serialised for live subscribers*/
+    uint64_t overflows; /*Times a subscriber overflowed and fell back to the chain*/
+    uint64_t dropped; /*Subscribers dropped for stalling or failing*/
+};
+
+int start_subscriptions(struct SubHub * phub, struct EndpointContext * pctx);
+void stop_subscriptions(struct SubHub * phub);
+int subscribe_client(struct SubHub * phub, int sockfd, uint32_t start);
+void publish_blocks(struct SubHub * phub, const struct BlockChain * pblock_chain, uint32_t len);
+
+#endif /*_SUBSCRIPTIONS_H*/
@@ -0,0 +1,25 @@
+#ifndef _TIME_INDEX_H
+#define _TIME_INDEX_H
+
+#include <stdint.h>
+#include "block.h"
+
+#define TIME_INDEX_STRIDE 64 /*Blocks per index entry. Bounds the scan after each binary search*/
+
+/*Sparse index from time to height. Block timestamps never decrease with height so the
+ timestamp of every TIME_INDEX_STRIDE'th block is enough to binary search for the first
+ block at or after any time, leaving a scan of at most one stride of links*/
+struct TimeIndex {
+    uint64_t * stamps; /*stamps[i] is the timestamp of block i * TIME_INDEX_STRIDE*/
+    uint32_t len; /*Number of entries*/
+    uint32_t cap; /*Allocated entries*/
+    uint32_t indexed; /*Blocks below this height have been indexed*/
+};
+
+int initialise_time_index(struct TimeIndex * pindex);
+void deinitialise_time_index(struct TimeIndex * pindex);
+int time_index_update(struct TimeIndex * pindex, const struct BlockChain * pblock_chain);
+uint32_t time_index_find(const struct TimeIndex * pindex, const struct BlockChain * pblock_chain,
+        uint64_t timestamp);
+
+#endif /*_TIME_INDEX_H*/
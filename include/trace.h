@@ -0,0 +1,99 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <time.h>
+
+#define TRACE_DEFAULT_SPANS 4096 /*Spans the recorder keeps unless configured otherwise*/
+#define TRACE_MAX_SPANS 65536 /*Upper bound on spans kept. Also bounds a trace endpoint response*/
+#define TRACE_SPAN_WIRE_SZ (8 * sizeof(uint64_t) + 2 * sizeof(uint32_t)) /*Packed size of a span*/
+
+/*Static tracepoints for perf and bpftrace, e.g. usdt:bin/node:cherub:receive_buf. With
+ <sys/sdt.h> each is a nop in the instruction stream and a note telling tracers where to
+ patch in; without it they compile to nothing. Arguments must be free of side effects*/
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef TRACE_HAVE_SDT
+#define TRACE_PROBE1(name, a) DTRACE_PROBE1(cherub, name, a)
+#define TRACE_PROBE2(name, a, b) DTRACE_PROBE2(cherub, name, a, b)
+#define TRACE_PROBE3(name, a, b, c) DTRACE_PROBE3(cherub, name, a, b, c)
+#else
+#define TRACE_PROBE1(name, a) ((void)(a))
+#define TRACE_PROBE2(name, a, b) ((void)(a), (void)(b))
+#define TRACE_PROBE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+#endif
+
+/*Stages a request's time is broken down into. Time in none of them is spent in the
+ endpoint itself, such as waiting on locks or searching indexes*/
+enum trace_stage {
+    TRACE_RECV = 0, /*receive_buf*/
+    TRACE_SEND = 1, /*send_buf*/
+    TRACE_PACK = 2, /*Serialising blocks, including reading back packed or cold payloads*/
+    TRACE_HASH = 3, /*Hashing payloads and blocks*/
+    TRACE_N_STAGES = 4
+};
+
+/*Timing breakdown of one request served by a node*/
+struct TraceSpan {
+    uint64_t start_ns; /*CLOCK_MONOTONIC time the request was picked up*/
+    uint64_t total_ns; /*Time until the endpoint returned*/
+    uint64_t stage_ns[TRACE_N_STAGES]; /*Time spent in each stage*/
+    uint64_t bytes_in; /*Bytes received*/
+    uint64_t bytes_out; /*Bytes sent*/
+    int32_t sockfd; /*Client served*/
+    uint8_t endpoint; /*Endpoint requested*/
+    int8_t result; /*Result of the endpoint. 0 on success*/
+};
+
+/*Span of the request the calling thread is serving. NULL unless the recorder is running*/
+extern __thread struct TraceSpan * trace_current;
+
+int start_tracing(uint32_t n_spans);
+void stop_tracing(void);
+void trace_begin_span(struct TraceSpan * pspan, int sockfd);
+void trace_end_span(struct TraceSpan * pspan, uint8_t endpoint, int result);
+void trace_drop_span(struct TraceSpan * pspan);
+uint32_t trace_capacity(void);
+uint32_t trace_snapshot(struct TraceSpan * spans, uint32_t max);
+void dump_trace(FILE * out);
+void print_trace_summary(FILE * out, const struct TraceSpan * spans, uint32_t n_spans);
+void print_trace_span(FILE * out, const struct TraceSpan * pspan);
+void pack_trace_span(const struct TraceSpan * pspan, uint8_t * buf);
+void unpack_trace_span(const uint8_t * buf, struct TraceSpan * pspan);
+
+/*Start timing a stage. Costs one thread local load when no span is being recorded.
+ Returns 0 when not recording*/
+static inline uint64_t trace_stage_begin(void) {
+    struct timespec now;
+    if (trace_current == NULL) {
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*Add the time since trace_stage_begin to a stage of the span being recorded. Bytes are
+ counted as received or sent for those stages*/
+static inline void trace_stage_end(enum trace_stage stage, uint64_t begin, size_t bytes) {
+    struct TraceSpan * pspan = trace_current;
+    struct timespec now;
+    if (pspan == NULL || begin == 0) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pspan->stage_ns[stage] += (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec - begin;
+    if (stage == TRACE_RECV) {
+        pspan->bytes_in += bytes;
+    } else if (stage == TRACE_SEND) {
+        pspan->bytes_out += bytes;
+    }
+}
+
+#endif /*_TRACE_H*/
@@ -0,0 +1,69 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 256 /*Number of submission queue entries requested from the kernel*/
+
+#define URING_TAG_SHIFT 3 /*Low bits of user_data holding the event type. The tag is stored above them*/
+
+//Type of request a completion belongs to. Stored in the low bits of user_data
+enum uring_event_type {
+    URING_EVENT_ACCEPT = 1,
+    URING_EVENT_RECV = 2,
+    URING_EVENT_SEND = 3,
+    URING_EVENT_CANCEL = 4
+};
+
+//Minimal io_uring instance driven by raw syscalls so no external library is needed
+struct UringData {
+    int ring_fd; //fd returned by io_uring_setup. -1 when not initialised
+    unsigned pending; //Number of sqes queued but not yet submitted to the kernel
+
+    //submission queue ring
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+
+    //completion queue ring
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    //mappings to release on deinit
+    void *sq_ring_ptr;
+    size_t sq_ring_sz;
+    void *cq_ring_ptr;
+    size_t cq_ring_sz;
+    size_t sqes_sz;
+};
+
+int initialise_uring(struct UringData * puring, unsigned entries);
+void deinitialise_uring(struct UringData * puring);
+int uring_arm_accept(struct UringData * puring, int listenfd);
+int uring_arm_recv(struct UringData * puring, int fd, void * buf, size_t len, uint64_t user_data);
+int uring_arm_send(struct UringData * puring, int fd, const void * buf, size_t len, uint64_t user_data);
+int uring_cancel(struct UringData * puring, uint64_t user_data);
+int uring_submit_and_wait(struct UringData * puring, unsigned timeout_ms);
+int uring_next_completion(struct UringData * puring, struct io_uring_cqe * pcqe);
+
+/*Helpers to pack and unpack user_data. Tags are an fd or a pointer to the request's owner so
+ fit in the 61 bits above the type*/
+static inline uint64_t uring_user_data(enum uring_event_type type, uint64_t tag) {
+    return tag << URING_TAG_SHIFT | (uint64_t)type;
+}
+
+static inline enum uring_event_type uring_event_type(uint64_t user_data) {
+    return (enum uring_event_type)(user_data & ((1u << URING_TAG_SHIFT) - 1));
+}
+
+static inline uint64_t uring_event_tag(uint64_t user_data) {
+    return user_data >> URING_TAG_SHIFT;
+}
+
+#endif /*_URING_H*/
@@ -0,0 +1,67 @@
+#ifndef _VERIFY_H
+#define _VERIFY_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+
+#define TX_PREFIX "ed25519:" /*Leads every signed transaction*/
+#define TX_PREFIX_LEN (sizeof(TX_PREFIX) - 1)
+#define TX_KEY_SZ 32 /*Bytes of an Ed25519 public key or private key seed*/
+#define TX_SIG_SZ 64 /*Bytes of an Ed25519 signature*/
+#define TX_HEADER_LEN (TX_PREFIX_LEN + 2 * TX_KEY_SZ + 1 + 2 * TX_SIG_SZ + 1) /*Text before the message*/
+#define VERIFY_MAX_WORKERS 64 /*Upper bound on verification threads*/
+#define VERIFY_CHUNK 16 /*Transactions a worker claims at a time*/
+#define VERIFY_MAX_BATCH 1024 /*Transactions a reactor holds before verifying them early*/
+
+/*Transaction as carried in a payload: "ed25519:<public key hex>:<signature hex>:<message>".
+ The signature covers the message alone. Kept as text so payloads stay printable*/
+struct SignedTx {
+    uint8_t public_key[TX_KEY_SZ];
+    uint8_t signature[TX_SIG_SZ];
+    const char * message; /*Points into the payload the transaction was parsed from*/
+    uint32_t message_len;
+};
+
+/*Transaction to verify and the outcome*/
+struct VerifyJob {
+    struct SignedTx tx;
+    int valid; /*Set by verify_batch if the signature holds*/
+};
+
+/*Batch handed in by one caller of verify_batch. Lives on the caller's stack and is queued
+ on the pool until every job in it has been claimed*/
+struct VerifyBatch {
+    struct VerifyJob * jobs;
+    uint32_t n_jobs;
+    uint32_t next; /*First job not yet claimed*/
+    uint32_t finished; /*Jobs verified*/
+    pthread_cond_t done; /*Signalled when the last job is finished*/
+    struct VerifyBatch * pnext; /*Next queued batch*/
+};
+
+/*Pool of threads verifying batches of transactions. Each signature is checked on its own;
+ batching only spreads a batch's signatures over the pool. Batches from different callers
+ are queued together and share the pool, each caller verifying its own batch alongside the
+ workers, so a pool of no threads verifies on the callers alone*/
+struct Verifier {
+    pthread_t threads[VERIFY_MAX_WORKERS];
+    unsigned n_workers;
+    pthread_mutex_t lock; /*Guards the fields below*/
+    pthread_cond_t work; /*Signalled when a batch is queued or the pool is stopped*/
+    struct VerifyBatch * queue; /*Batches with jobs left to claim, oldest first. NULL while idle*/
+    int running; /*Cleared to stop the workers*/
+    uint64_t verified; /*Signatures that held*/
+    uint64_t rejected; /*Signatures that did not*/
+    uint64_t batches;
+};
+
+int start_verifier(struct Verifier * pverifier, unsigned n_workers);
+void stop_verifier(struct Verifier * pverifier);
+void verify_batch(struct Verifier * pverifier, struct VerifyJob * jobs, uint32_t n_jobs);
+int parse_transaction(const char * payload, uint32_t len, struct SignedTx * ptx);
+int verify_transaction(EVP_MD_CTX * pmd_ctx, const struct SignedTx * ptx);
+EVP_PKEY * load_signing_key(const char * seed_hex);
+char * sign_transaction(EVP_PKEY * pkey, const char * message, size_t message_len, size_t * plen);
+
+#endif /*_VERIFY_H*/
@@ -5,26 +5,83 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "block.h"
 #include "server.h"
 #include "requests.h"
+#include "shm_ring.h"
+#include "verify.h"
+
+#define ADD_BLOCK_USAGE "usage: add_block [-f file] [-k key_file] hostname|unix:path|shm:name servname [payload]\n"
+
+//Internal functions
+static int add_block_shm(const char * ring_name, const char * payload, size_t len);
+static const char * map_payload_file(const char * path, size_t * plen);
+static char * sign_payload(const char * key_path, const char * payload, size_t * plen);
 
 //Request chain endpoint on node at specified IP
 int main(int argc, char * argv[]) {
-     
-    if (argc != 4) {
-        fprintf(stderr, "usage: add_block hostname servname payload\n");
+    const char * file_path = NULL;
+    const char * key_path = NULL;
+    const char * payload;
+    size_t payload_len;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:k:")) != -1) {
+        switch (opt) {
+            case 'f':
+                file_path = optarg;
+                break;
+            case 'k':
+                key_path = optarg;
+                break;
+            default:
+                fprintf(stderr, ADD_BLOCK_USAGE);
+                return 1;
+        }
+    }
+    //payload comes from exactly one of the file or the command line
+    if (argc - optind != (file_path != NULL ? 2 : 3)) {
+        fprintf(stderr, ADD_BLOCK_USAGE);
         return 1;
     }
+    const char * host = argv[optind];
+    const char * servname = argv[optind + 1];
+
+    if (file_path != NULL) {
+        payload = map_payload_file(file_path, &payload_len);
+        if (payload == NULL) {
+            return 2;
+        }
+    } else {
+        payload = argv[optind + 2];
+        payload_len = strlen(payload);
+    }
+    //nodes requiring signatures only take payloads wrapped in a signed transaction
+    if (key_path != NULL) {
+        payload = sign_payload(key_path, payload, &payload_len);
+        if (payload == NULL) {
+            return 2;
+        }
+    }
+
+    //Same-host nodes can be fed through their shared memory ring instead of a socket
+    if (strncmp(host, SHM_PREFIX, strlen(SHM_PREFIX)) == 0) {
+        return add_block_shm(host + strlen(SHM_PREFIX), payload, payload_len);
+    }
 
     //connect to node with given hostname
-    int node_fd = connect_to_node(argv[1], argv[2]);
+    int node_fd = connect_to_node(host, servname);
 
     if (node_fd == -1) {
         return 2;
     }
     
-    int ret = request_add_block_endpoint(node_fd, argv[3]);
+    uint32_t height, hash;
+    int ret = request_add_block_endpoint(node_fd, payload, payload_len, &height, &hash);
 
     close(node_fd);
     
@@ -33,7 +90,111 @@ int main(int argc, char * argv[]) {
         return 3;
     }
 
-    printf("Add block: Block successfully added with payload %s\n", argv[3]);
+    if (file_path != NULL) {
+        printf("Add block: Block successfully added with %lu byte payload from %s\n",
+                payload_len, file_path);
+    } else {
+        printf("Add block: Block successfully added with payload %s\n", payload);
+    }
+    printf("Add block: Height %u, hash %u\n", height, hash);
+    return 0;
+}
+
+
+/**
+ * Write payload into the shared memory ring of a node on this host
+ * @param ring_name name of ring the node was started with
+ * @param payload payload to add
+ * @param len length of payload
+ * @return exit status for main
+ */
+static int add_block_shm(const char * ring_name, const char * payload, size_t len) {
+    struct ShmRing ring;
+
+    if (len > SHM_RING_MAX_RECORD) {
+        fprintf(stderr, "Add block: payload too large for ring, send it over a socket instead\n");
+        return 3;
+    }
+
+    if (attach_shm_ring(&ring, ring_name) != 0) {
+        return 2;
+    }
+
+    int ret = shm_ring_push(&ring, payload, len);
+    detach_shm_ring(&ring);
+
+    if (ret == -1) {
+        return 3;
+    }
+
+    printf("Add block: Block queued on ring %s with %lu byte payload\n", ring_name, len);
     return 0;
 }
 
+/**
+ * Map a file to send as a payload. Large documents are sent straight from the page cache
+ * @param path file holding payload
+ * @param plen set to size of file
+ * @return mapped payload or NULL on failure. Mapping lives until exit
+ */
+static const char * map_payload_file(const char * path, size_t * plen) {
+    struct stat st;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("Add block: open");
+        return NULL;
+    }
+    if (fstat(fd, &st) == -1) {
+        perror("Add block: fstat");
+        close(fd);
+        return NULL;
+    }
+    //an empty mapping is invalid. Empty payloads need no backing memory
+    if (st.st_size == 0) {
+        close(fd);
+        *plen = 0;
+        return "";
+    }
+
+    void * map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Add block: mmap");
+        return NULL;
+    }
+    *plen = st.st_size;
+    return map;
+}
+
+/**
+ * Wrap a payload in a transaction signed with the key held in a file
+ * @param key_path file whose first line is the hex seed of an Ed25519 key
+ * @param payload payload to sign
+ * @param plen length of payload. Set to length of the transaction
+ * @return malloc'd transaction or NULL on failure. Lives until exit
+ */
+static char * sign_payload(const char * key_path, const char * payload, size_t * plen) {
+    char seed_hex[2 * TX_KEY_SZ + 2];
+
+    FILE * key_file = fopen(key_path, "r");
+    if (key_file == NULL) {
+        perror("Add block: fopen");
+        return NULL;
+    }
+    char * line = fgets(seed_hex, sizeof(seed_hex), key_file);
+    fclose(key_file);
+    if (line == NULL) {
+        fprintf(stderr, "Add block: %s holds no key\n", key_path);
+        return NULL;
+    }
+    seed_hex[strcspn(seed_hex, "\r\n")] = '\0';
+
+    EVP_PKEY * pkey = load_signing_key(seed_hex);
+    if (pkey == NULL) {
+        return NULL;
+    }
+    char * tx = sign_transaction(pkey, payload, *plen, plen);
+    EVP_PKEY_free(pkey);
+    return tx;
+}
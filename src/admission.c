@@ -0,0 +1,262 @@
+/**
+ * Admission control for node endpoints. Each request is charged a cost against
+ * token buckets of its connection and of its source address, and full chain
+ * transfers are additionally limited in how many may be in flight at once.
+ * Requests over budget are rejected immediately rather than queued so a
+ * misbehaving client cannot starve ingest for everyone else.
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "admission.h"
+
+#define ADDRESS_PROBE_LIMIT 8 //slots probed before the least recently charged address is evicted
+#define CONNS_INITIAL_CAP 64 //initial number of connection buckets
+
+//Internal functions
+static uint64_t now_ns(void);
+static double capacity(double rate);
+static void refill(struct TokenBucket * pbucket, double rate, uint64_t now);
+static void peer_address(int sockfd, uint8_t * addr);
+static struct AddressBucket * find_address(struct Admission * padmission, const uint8_t * addr,
+        uint64_t now);
+static int grow_conns(struct Admission * padmission, int sockfd);
+
+/**
+ * Create admission controller
+ * @param padmission controller to initialise
+ * @param conn_rate tokens per second granted to each connection
+ * @param addr_rate tokens per second shared by all connections from one address
+ * @param max_streams max number of chain streams in flight at once
+ * @return 0 on success, -1 on failure
+ */
+int initialise_admission(struct Admission * padmission, double conn_rate, double addr_rate,
+        uint32_t max_streams) {
+    padmission->conn_rate = conn_rate;
+    padmission->addr_rate = addr_rate;
+    padmission->max_streams = max_streams;
+    padmission->streams = 0;
+    padmission->rejected = 0;
+    padmission->conns = NULL;
+    padmission->conns_cap = 0;
+    padmission->addrs = calloc(ADMISSION_IP_SLOTS, sizeof(struct AddressBucket));
+
+    if (padmission->addrs == NULL) {
+        fprintf(stderr, "Admission: failed to allocate memory for address table\n");
+        return -1;
+    }
+    pthread_mutex_init(&padmission->lock, NULL);
+    return 0;
+}
+
+/**
+ * Free memory held by admission controller
+ * @param padmission controller to deinitialise
+ * @return void
+ */
+void deinitialise_admission(struct Admission * padmission) {
+    free(padmission->conns);
+    free(padmission->addrs);
+    pthread_mutex_destroy(&padmission->lock);
+    padmission->conns = NULL;
+    padmission->addrs = NULL;
+    padmission->conns_cap = 0;
+}
+
+/**
+ * Start tracking a newly accepted connection. Gives it a full bucket and records
+ * the address it came from
+ * @param padmission controller
+ * @param sockfd accepted socket
+ * @return 0 on success, -1 on failure
+ */
+int admission_track_client(struct Admission * padmission, int sockfd) {
+    uint8_t addr[16];
+    peer_address(sockfd, addr);
+
+    pthread_mutex_lock(&padmission->lock);
+    if (sockfd >= padmission->conns_cap && grow_conns(padmission, sockfd) != 0) {
+        pthread_mutex_unlock(&padmission->lock);
+        return -1;
+    }
+    struct ConnectionBucket * pconn = &padmission->conns[sockfd];
+    memcpy(pconn->addr, addr, sizeof(addr));
+    pconn->bucket.tokens = capacity(padmission->conn_rate);
+    pconn->bucket.last_ns = now_ns();
+    pthread_mutex_unlock(&padmission->lock);
+    return 0;
+}
+
+/**
+ * Charge a request against its connection's and address's budgets. Nothing is charged
+ * unless both can afford the request
+ * @param padmission controller
+ * @param sockfd socket the request arrived on
+ * @param cost tokens the request costs
+ * @return 0 if the request is admitted, -1 if it must be rejected
+ */
+int admission_admit(struct Admission * padmission, int sockfd, unsigned cost) {
+    uint64_t now = now_ns();
+
+    pthread_mutex_lock(&padmission->lock);
+    //untracked connections get a zeroed bucket which refills to full on first charge
+    if (sockfd >= padmission->conns_cap && grow_conns(padmission, sockfd) != 0) {
+        pthread_mutex_unlock(&padmission->lock);
+        return -1;
+    }
+    struct ConnectionBucket * pconn = &padmission->conns[sockfd];
+    struct AddressBucket * paddr = find_address(padmission, pconn->addr, now);
+
+    refill(&pconn->bucket, padmission->conn_rate, now);
+    refill(&paddr->bucket, padmission->addr_rate, now);
+
+    if (pconn->bucket.tokens < cost || paddr->bucket.tokens < cost) {
+        padmission->rejected++;
+        pthread_mutex_unlock(&padmission->lock);
+        return -1;
+    }
+    pconn->bucket.tokens -= cost;
+    paddr->bucket.tokens -= cost;
+    pthread_mutex_unlock(&padmission->lock);
+    return 0;
+}
+
+/**
+ * Reserve one of the limited chain stream slots
+ * @param padmission controller
+ * @return 0 if a slot was reserved, -1 if all slots are in use
+ */
+int admission_acquire_stream(struct Admission * padmission) {
+    int ret = -1;
+    pthread_mutex_lock(&padmission->lock);
+    if (padmission->streams < padmission->max_streams) {
+        padmission->streams++;
+        ret = 0;
+    } else {
+        padmission->rejected++;
+    }
+    pthread_mutex_unlock(&padmission->lock);
+    return ret;
+}
+
+/**
+ * Release chain stream slot reserved by admission_acquire_stream
+ * @param padmission controller
+ * @return void
+ */
+void admission_release_stream(struct Admission * padmission) {
+    pthread_mutex_lock(&padmission->lock);
+    padmission->streams--;
+    pthread_mutex_unlock(&padmission->lock);
+}
+
+/**
+ * Current monotonic time in nanoseconds
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Capacity of a bucket refilled at rate. Never below the most expensive request so
+ * low rates still admit it eventually
+ */
+static double capacity(double rate) {
+    double burst = rate * ADMISSION_BURST_S;
+    return burst > ADMISSION_COST_CHAIN ? burst : ADMISSION_COST_CHAIN;
+}
+
+/**
+ * Add tokens accrued since the bucket was last refilled, up to its capacity
+ */
+static void refill(struct TokenBucket * pbucket, double rate, uint64_t now) {
+    double max_tokens = capacity(rate);
+    pbucket->tokens += (now - pbucket->last_ns) / 1e9 * rate;
+    if (pbucket->tokens > max_tokens) {
+        pbucket->tokens = max_tokens;
+    }
+    pbucket->last_ns = now;
+}
+
+/**
+ * Get the address a socket is connected from as an IPv6 or v4 mapped address.
+ * Non IP sockets all share the zero address
+ */
+static void peer_address(int sockfd, uint8_t * addr) {
+    struct sockaddr_storage peer;
+    socklen_t len = sizeof(peer);
+
+    memset(addr, 0, 16);
+    if (getpeername(sockfd, (struct sockaddr *)&peer, &len) == -1) {
+        return;
+    }
+    if (peer.ss_family == AF_INET) {
+        addr[10] = addr[11] = 0xff;
+        memcpy(addr + 12, &((struct sockaddr_in *)&peer)->sin_addr, 4);
+    } else if (peer.ss_family == AF_INET6) {
+        memcpy(addr, &((struct sockaddr_in6 *)&peer)->sin6_addr, 16);
+    }
+}
+
+/**
+ * Find bucket of an address, claiming a slot for it if it is not tracked. When every
+ * probed slot is taken the least recently charged address is evicted. Its bucket had
+ * the longest to refill so little budget is forgiven. Caller must hold the lock
+ * @return bucket of addr
+ */
+static struct AddressBucket * find_address(struct Admission * padmission, const uint8_t * addr,
+        uint64_t now) {
+    uint64_t words[2];
+    memcpy(words, addr, sizeof(words));
+    uint32_t slot = (uint32_t)(((words[0] ^ (words[1] * 0x9e3779b97f4a7c15ull)) *
+                0x9e3779b97f4a7c15ull) >> 40) & (ADMISSION_IP_SLOTS - 1);
+    struct AddressBucket * victim = NULL;
+
+    for (int i = 0; i < ADDRESS_PROBE_LIMIT; i++) {
+        struct AddressBucket * paddr = &padmission->addrs[(slot + i) & (ADMISSION_IP_SLOTS - 1)];
+        if (paddr->used && memcmp(paddr->addr, addr, sizeof(paddr->addr)) == 0) {
+            return paddr;
+        }
+        if (!paddr->used) {
+            victim = paddr;
+            break;
+        }
+        if (victim == NULL || paddr->bucket.last_ns < victim->bucket.last_ns) {
+            victim = paddr;
+        }
+    }
+
+    memcpy(victim->addr, addr, sizeof(victim->addr));
+    victim->used = 1;
+    victim->bucket.tokens = capacity(padmission->addr_rate);
+    victim->bucket.last_ns = now;
+    return victim;
+}
+
+/**
+ * Grow connection table so sockfd can be indexed. Caller must hold the lock
+ * @return 0 on success, -1 on failure
+ */
+static int grow_conns(struct Admission * padmission, int sockfd) {
+    int new_cap = padmission->conns_cap ? padmission->conns_cap : CONNS_INITIAL_CAP;
+    while (new_cap <= sockfd) {
+        new_cap *= 2;
+    }
+    struct ConnectionBucket * conns = realloc(padmission->conns, new_cap * sizeof(struct ConnectionBucket));
+    if (conns == NULL) {
+        fprintf(stderr, "Admission: failed to allocate memory for connection table\n");
+        return -1;
+    }
+    memset(conns + padmission->conns_cap, 0,
+            (new_cap - padmission->conns_cap) * sizeof(struct ConnectionBucket));
+    padmission->conns = conns;
+    padmission->conns_cap = new_cap;
+    return 0;
+}
@@ -0,0 +1,307 @@
+/**
+ * Compact binary chain archives for moving chains between nodes offline.
+ * An archive is a magic number and block count followed by every block in
+ * pack_block format. Loading maps the file, decodes and re-hashes blocks on
+ * all cores, then links them in a single pass into one allocation of links
+ * and one payload arena.
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "archive.h"
+#include "server.h"
+
+#define ARCHIVE_MAGIC 0x43485833 //"CHX3". 32 bit payload lengths and block timestamps
+#define ARCHIVE_HEADER_SZ (2 * sizeof(uint32_t)) //magic and block count
+
+//Location of a single block found by the scan pass
+struct ArchiveRecord {
+    size_t offset; //offset of packed block in archive
+    size_t payload_off; //offset of payload in arena
+};
+
+//Work handed to each decode thread
+struct DecodeJob {
+    const uint8_t * map; //mapped archive
+    const struct ArchiveRecord * records;
+    struct Link * links; //bulk link array to decode into
+    char * arena; //payload arena
+    uint32_t start; //first block to decode
+    uint32_t end; //one past last block to decode
+    uint32_t bad_hash; //height of first block whose hash did not verify. UINT32_MAX if none
+    uint32_t pruned; //blocks without payload in range
+};
+
+//Internal functions
+static void * decode_worker(void * arg);
+static int scan_archive(const uint8_t * map, size_t map_sz, uint32_t n_blocks,
+        struct ArchiveRecord * records, size_t * parena_sz);
+
+/**
+ * Write chain to an archive file
+ * @param pblock_chain chain to write
+ * @param path destination file
+ * @return 0 on success, -1 on failure
+ */
+int write_archive(const struct BlockChain * pblock_chain, const char * path) {
+    struct PayloadBuf cold = {NULL, 0};
+    uint8_t header_buf[BLOCK_WIRE_HEADER_SZ];
+
+    FILE * fp = fopen(path, "wb");
+    if (fp == NULL) {
+        perror("Archive: fopen");
+        return -1;
+    }
+
+    uint32_t header[2] = {htonl(ARCHIVE_MAGIC), htonl(pblock_chain->len)};
+    if (fwrite(header, sizeof(header), 1, fp) != 1) {
+        perror("Archive: fwrite");
+        fclose(fp);
+        return -1;
+    }
+
+    for (const struct Link* link = pblock_chain->head; link != NULL; link = link->next) {
+        struct Block block = link->block;
+        //Payloads in cold storage are written out in full
+        if (block.payload == NULL) {
+            block.payload = (char *)view_payload(pblock_chain, &block, &cold);
+        }
+        //payload is written from where it lives rather than packed alongside its header
+        pack_block_header(&block, header_buf);
+        if (fwrite(header_buf, sizeof(header_buf), 1, fp) != 1 || (block.payload != NULL &&
+                    block.payload_len > 0 && fwrite(block.payload, block.payload_len, 1, fp) != 1)) {
+            perror("Archive: fwrite");
+            free_payload_buf(&cold);
+            fclose(fp);
+            return -1;
+        }
+    }
+    free_payload_buf(&cold);
+
+    if (fclose(fp) != 0) {
+        perror("Archive: fclose");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Bulk load an archive into an empty chain. Blocks are decoded and their hashes verified in
+ * parallel, then linked and checked for linkage in one pass
+ * @param pblock_chain initialised empty chain to load into
+ * @param path archive file
+ * @param n_threads number of decode threads. 0 uses one per online core
+ * @param pstats populated with load statistics. May be NULL
+ * @return 0 on success, -1 on failure. Chain is left empty on failure
+ */
+int load_archive(struct BlockChain * pblock_chain, const char * path, unsigned n_threads,
+        struct ArchiveStats * pstats) {
+    struct stat st;
+    uint32_t header[2];
+    int ret = -1;
+
+    if (pblock_chain->len != 0) {
+        fprintf(stderr, "Archive: can only load into an empty chain\n");
+        return -1;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("Archive: open");
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < ARCHIVE_HEADER_SZ) {
+        fprintf(stderr, "Archive: %s is not a valid archive\n", path);
+        close(fd);
+        return -1;
+    }
+
+    uint8_t * map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Archive: mmap");
+        return -1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    memcpy(header, map, sizeof(header));
+    uint32_t n_blocks = ntohl(header[1]);
+    if (ntohl(header[0]) != ARCHIVE_MAGIC) {
+        fprintf(stderr, "Archive: %s is not a valid archive\n", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    if (n_threads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = online > 0 ? (unsigned)online : 1;
+    }
+    n_threads = n_threads > ARCHIVE_MAX_THREADS ? ARCHIVE_MAX_THREADS : n_threads;
+    n_threads = n_threads > n_blocks ? (n_blocks > 0 ? n_blocks : 1) : n_threads;
+
+    //one allocation each for records, links and payloads
+    size_t arena_sz = 0;
+    struct ArchiveRecord * records = malloc((size_t)n_blocks * sizeof(struct ArchiveRecord) + 1);
+    struct Link * links = malloc((size_t)n_blocks * sizeof(struct Link) + 1);
+    char * arena = NULL;
+    struct DecodeJob jobs[ARCHIVE_MAX_THREADS];
+    pthread_t threads[ARCHIVE_MAX_THREADS];
+
+    if (records == NULL || links == NULL) {
+        fprintf(stderr, "Archive: failed to allocate memory for %u blocks\n", n_blocks);
+        goto cleanup;
+    }
+
+    if (scan_archive(map, st.st_size, n_blocks, records, &arena_sz) != 0) {
+        goto cleanup;
+    }
+
+    arena = malloc(arena_sz + 1);
+    if (arena == NULL) {
+        fprintf(stderr, "Archive: failed to allocate memory for payloads\n");
+        goto cleanup;
+    }
+
+    //decode and re-hash in parallel
+    unsigned started = 0;
+    for (unsigned t = 0; t < n_threads; t++) {
+        jobs[t].map = map;
+        jobs[t].records = records;
+        jobs[t].links = links;
+        jobs[t].arena = arena;
+        jobs[t].start = (uint32_t)((uint64_t)n_blocks * t / n_threads);
+        jobs[t].end = (uint32_t)((uint64_t)n_blocks * (t + 1) / n_threads);
+        if (pthread_create(&threads[t], NULL, decode_worker, &jobs[t]) != 0) {
+            fprintf(stderr, "Archive: failed to start decode thread\n");
+            break;
+        }
+        started++;
+    }
+    for (unsigned t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    if (started != n_threads) {
+        goto cleanup;
+    }
+
+    uint32_t pruned = 0;
+    for (unsigned t = 0; t < n_threads; t++) {
+        if (jobs[t].bad_hash != UINT32_MAX) {
+            fprintf(stderr, "Archive: hash mismatch at height %u\n", jobs[t].bad_hash);
+            goto cleanup;
+        }
+        pruned += jobs[t].pruned;
+    }
+
+    //single linking pass
+    if (adopt_bulk_links(pblock_chain, links, n_blocks, arena, arena_sz) != 0) {
+        goto cleanup;
+    }
+
+    if (pstats != NULL) {
+        pstats->blocks = n_blocks;
+        pstats->pruned = pruned;
+        pstats->bytes = st.st_size;
+        pstats->threads = n_threads;
+    }
+    //ownership passed to chain
+    links = NULL;
+    arena = NULL;
+    ret = 0;
+
+cleanup:
+    free(records);
+    free(links);
+    free(arena);
+    munmap(map, st.st_size);
+    return ret;
+}
+
+/**
+ * Sequential pass locating every block and assigning its payload a place in the arena.
+ * Only reads block lengths so runs at memory bandwidth
+ * @param map mapped archive
+ * @param map_sz size of archive
+ * @param n_blocks number of blocks archive header claims
+ * @param records array of n_blocks records to fill
+ * @param parena_sz set to total arena size needed including null chars
+ * @return 0 on success, -1 if the archive is truncated or malformed
+ */
+static int scan_archive(const uint8_t * map, size_t map_sz, uint32_t n_blocks,
+        struct ArchiveRecord * records, size_t * parena_sz) {
+    size_t offset = ARCHIVE_HEADER_SZ;
+    size_t arena_sz = 0;
+
+    for (uint32_t i = 0; i < n_blocks; i++) {
+        struct Block block;
+
+        if (offset + BLOCK_WIRE_HEADER_SZ > map_sz) {
+            fprintf(stderr, "Archive: truncated at block %u\n", i);
+            return -1;
+        }
+
+        records[i].offset = offset;
+        records[i].payload_off = arena_sz;
+        offset += BLOCK_WIRE_HEADER_SZ;
+
+        //header only blocks carry no payload bytes
+        if (unpack_block_header(map + records[i].offset, &block)) {
+            continue;
+        }
+        size_t payload_sz = block.payload_len;
+        if (payload_sz > MAX_PAYLOAD || offset + payload_sz > map_sz) {
+            fprintf(stderr, "Archive: malformed block %u\n", i);
+            return -1;
+        }
+        offset += payload_sz;
+        arena_sz += payload_sz + 1; //+1 for null char
+    }
+
+    if (offset != map_sz) {
+        fprintf(stderr, "Archive: trailing data after %u blocks\n", n_blocks);
+        return -1;
+    }
+    *parena_sz = arena_sz;
+    return 0;
+}
+
+/**
+ * Decode a range of blocks into their bulk links, copy payloads into the arena and
+ * verify each block's hash
+ * @param arg DecodeJob describing the range
+ * @return NULL
+ */
+static void * decode_worker(void * arg) {
+    struct DecodeJob * job = arg;
+    job->bad_hash = UINT32_MAX;
+    job->pruned = 0;
+
+    for (uint32_t i = job->start; i < job->end; i++) {
+        const uint8_t * cur = job->map + job->records[i].offset;
+        struct Block * pblock = &job->links[i].block;
+
+        if (unpack_block_header(cur, pblock)) {
+            job->pruned++;
+            continue;
+        }
+        cur += BLOCK_WIRE_HEADER_SZ;
+        uint32_t sent_hash = pblock->hash;
+
+        pblock->payload = job->arena + job->records[i].payload_off;
+        memcpy(pblock->payload, cur, pblock->payload_len);
+        pblock->payload[pblock->payload_len] = '\0';
+
+        hash_block(pblock);
+        if (pblock->hash != sent_hash && job->bad_hash == UINT32_MAX) {
+            job->bad_hash = i;
+        }
+    }
+    return NULL;
+}
@@ -8,27 +8,41 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
+#include <endian.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "block.h"
 #include "server.h"
+#include "trace.h"
 
 
 #define BLOCK_DIV "------\n"
+#define LINKS_INITIAL_CAP 64 //initial size of the height index
 
 //Internal functions
-static uint32_t hash_djb2(unsigned char *payload);
+static int check_timestamp(const struct Link * pprev, uint64_t timestamp);
+static void count_bulk_pages(struct BlockChain * pblock_chain);
+static void release_bulk_pages(const struct BlockChain * pblock_chain, const char * payload, size_t len);
+
 
 /**
- * Print representation of chain to stdout.
+ * Print representation of chain to stdout. Packed and cold payloads are read back to print
  * @param pblock_chain block chain struct containing chain to print
  * @return void
  */
 void print_chain(const struct BlockChain * pblock_chain) {
+    struct PayloadBuf scratch = {NULL, 0};
+
     //walk chain
     for (const struct Link* link = pblock_chain->head; link != NULL; link = link->next) {
+        struct Block block = link->block;
+        block.payload = (char *)view_payload(pblock_chain, &block, &scratch);
         printf(BLOCK_DIV);
-        print_block(link->block);
+        print_block(block);
     }
+    free_payload_buf(&scratch);
 }
 
 /**
@@ -39,7 +53,20 @@ void print_chain(const struct BlockChain * pblock_chain) {
 struct BlockChain initialise_chain(void) {
     struct BlockChain block_chain;
     block_chain.head = block_chain.tail = NULL; //no elements in chain yet
+    block_chain.resident_head = NULL;
     block_chain.len = 0;
+    block_chain.pruned_len = 0;
+    block_chain.cold_fd = -1; //no cold storage until one is opened
+    block_chain.cold_end = 0;
+    block_chain.links = NULL;
+    block_chain.links_cap = 0;
+    block_chain.bulk_links = NULL;
+    block_chain.bulk_len = 0;
+    block_chain.bulk_payloads = NULL;
+    block_chain.bulk_payloads_sz = 0;
+    block_chain.bulk_page_refs = NULL;
+    block_chain.pcodec = NULL; //payloads are stored raw until a codec is attached
+    block_chain.unpack = NULL;
     return block_chain;
 }
 
@@ -54,6 +81,18 @@ struct Link* append_link(struct BlockChain* pblock_chain) {
         fprintf(stderr, "Block: Max chain length reached");
         return NULL;
     }
+    //grow height index
+    if (pblock_chain->len == pblock_chain->links_cap) {
+        uint32_t new_cap = pblock_chain->links_cap ? pblock_chain->links_cap * 2 : LINKS_INITIAL_CAP;
+        struct Link ** links = realloc(pblock_chain->links, new_cap * sizeof(struct Link *));
+        if (links == NULL) {
+            fprintf(stderr, "Block: Failed to allocate memory for link index");
+            return NULL;
+        }
+        pblock_chain->links = links;
+        pblock_chain->links_cap = new_cap;
+    }
+
     struct Link* plink = malloc(sizeof(struct Link));
     //Leave error handling to caller
     if (plink == NULL)  {
@@ -77,11 +116,34 @@ struct Link* append_link(struct BlockChain* pblock_chain) {
     }
 
     plink->next = NULL;
+    plink->block.payload = NULL;
+    plink->block.packed = NULL;
+    plink->block.packed_len = 0;
+    plink->block.cold_offset = -1; //payload starts resident
+    pblock_chain->links[pblock_chain->len] = plink;
     pblock_chain->len++; //increase size
 
+    //everything before this link has been pruned
+    if (pblock_chain->resident_head == NULL) {
+        pblock_chain->resident_head = plink;
+    }
+
     return plink;
 }
 
+/**
+ * Look up link by its height in the chain
+ * @param pblock_chain chain to look in
+ * @param height height of link. Genesis block is height 0
+ * @return link at height or NULL if height is beyond the tip
+ */
+struct Link* get_link(const struct BlockChain* pblock_chain, uint32_t height) {
+    if (height >= pblock_chain->len) {
+        return NULL;
+    }
+    return pblock_chain->links[height];
+}
+
 /**
  * Free allocated memory for given block chain.
  * @param pblock_chain Chain to free
@@ -90,16 +152,39 @@ struct Link* append_link(struct BlockChain* pblock_chain) {
 void deinitialise_chain(struct BlockChain * pblock_chain) {
     struct Link *current, *next;
     current = pblock_chain->head;
+    //the arena is freed whole below, so its pages are not handed back one at a time
+    free(pblock_chain->bulk_page_refs);
+    pblock_chain->bulk_page_refs = NULL;
     while (current != NULL) {
         next = current->next;
-        free(current->block.payload); //free payload memory
-        free(current); //free remainder of block
+        release_payload(pblock_chain, &current->block); //free payload memory
+        //bulk loaded links are freed together below
+        if (current < pblock_chain->bulk_links ||
+                current >= pblock_chain->bulk_links + pblock_chain->bulk_len) {
+            free(current); //free remainder of block
+        }
         current = next;
     }
+    free(pblock_chain->bulk_links);
+    free(pblock_chain->bulk_payloads);
+
+    if (pblock_chain->cold_fd != -1) {
+        close(pblock_chain->cold_fd);
+    }
+    free(pblock_chain->links);
 
     //show chain as being empty
-    pblock_chain->head = pblock_chain->tail = NULL;
+    pblock_chain->head = pblock_chain->tail = pblock_chain->resident_head = NULL;
     pblock_chain->len = 0;
+    pblock_chain->pruned_len = 0;
+    pblock_chain->cold_fd = -1;
+    pblock_chain->cold_end = 0;
+    pblock_chain->links = NULL;
+    pblock_chain->links_cap = 0;
+    pblock_chain->bulk_links = NULL;
+    pblock_chain->bulk_len = 0;
+    pblock_chain->bulk_payloads = NULL;
+    pblock_chain->bulk_payloads_sz = 0;
 }
 
 /**
@@ -109,6 +194,7 @@ void deinitialise_chain(struct BlockChain * pblock_chain) {
  * @return 0 on success, -1 otherwise
  */
 int add_block(struct BlockChain * pblock_chain, const char * payload) {
+    uint64_t timestamp = next_timestamp(pblock_chain);
 
     struct Link * plink = append_link(pblock_chain);
     if (plink == NULL) {
@@ -121,18 +207,73 @@ int add_block(struct BlockChain * pblock_chain, const char * payload) {
         return -1;
     }
     
+    plink->block.timestamp = timestamp;
     hash_block(&plink->block);
     return 0;
 }
 
+/**
+ * Append a block whose payload has already been received into its final allocation.
+ * Lets payloads streamed in from a socket or ring become part of the chain without a copy
+ * @param pblock_chain block chain to append to
+ * @param payload malloc'd null terminated payload. Owned by the chain on success
+ * @param len length of payload excluding null char
+ * @param hash block hash. seal_hash of the payload's hash, typically computed with
+ * hash_payload_update as it arrived, and timestamp
+ * @param timestamp time of block. New blocks take next_timestamp, received blocks keep theirs
+ * @return 0 on success, -1 on failure in which case the caller keeps ownership of payload
+ */
+int append_block(struct BlockChain * pblock_chain, char * payload, uint32_t len, uint32_t hash,
+        uint64_t timestamp) {
+    if (check_timestamp(pblock_chain->tail, timestamp) != 0) {
+        return -1;
+    }
+    struct Link * plink = append_link(pblock_chain);
+    if (plink == NULL) {
+        return -1;
+    }
+    plink->block.payload = payload;
+    plink->block.payload_len = len;
+    plink->block.hash = hash;
+    plink->block.timestamp = timestamp;
+    return 0;
+}
+
+/**
+ * Append a block known only by its header, such as one whose payload a peer has pruned.
+ * A header only block with no resident payload before it extends the chain's pruned prefix
+ * @param pblock_chain block chain to append to
+ * @param pheader block whose hash, payload length and timestamp to copy. Its payload is ignored
+ * @return 0 on success, -1 on failure
+ */
+int append_header(struct BlockChain * pblock_chain, const struct Block * pheader) {
+    if (check_timestamp(pblock_chain->tail, pheader->timestamp) != 0) {
+        return -1;
+    }
+    struct Link * plink = append_link(pblock_chain);
+    if (plink == NULL) {
+        return -1;
+    }
+    plink->block.payload_len = pheader->payload_len;
+    plink->block.hash = pheader->hash;
+    plink->block.timestamp = pheader->timestamp;
+
+    if (pblock_chain->resident_head == plink) {
+        pblock_chain->resident_head = NULL;
+        pblock_chain->pruned_len++;
+    }
+    return 0;
+}
+
 /**
  * Print single block to stdou
  * @param block block to print
  * @return void
  */
 void print_block(const struct Block block) {
-    printf("Previous block hash: %u\nHash: %u\nPayload: %s\n", block.prev_hash,
-            block.hash, block.payload);
+    printf("Previous block hash: %u\nHash: %u\nTimestamp: %llu\nPayload: %s\n", block.prev_hash,
+            block.hash, (unsigned long long)block.timestamp,
+            block.payload != NULL ? block.payload : "<pruned>");
 }
 
 /**
@@ -144,19 +285,23 @@ void print_block(const struct Block block) {
  */
 int add_payload(struct Block* pblock, const char* payload, uint8_t length_known) {
     if (!length_known) {
-        pblock->payload_len = strlen(payload);
+        size_t payload_len = strlen(payload);
+        if (payload_len > MAX_PAYLOAD) {
+            fprintf(stderr, "Block: payload size %lu larger than max allowed payload %d\n",
+                    payload_len, MAX_PAYLOAD);
+            return -1;
+        }
+        pblock->payload_len = payload_len;
     }
-    //+1 for null char
-    size_t payload_sz = pblock->payload_len + 1; //+1 for null char consideration
-    payload_sz = (payload_sz > TOTAL_PAYLOAD_LEN) ? TOTAL_PAYLOAD_LEN: payload_sz;
 
-    pblock->payload = malloc(payload_sz);
+    //+1 for null char
+    pblock->payload = malloc((size_t)pblock->payload_len + 1);
 
     if (pblock->payload == NULL) {
         fprintf(stderr, "Block: failed to allocate memory for payload");
         return -1;
     }
-    memcpy(pblock->payload, payload, payload_sz);
+    memcpy(pblock->payload, payload, pblock->payload_len);
     
     //ensure null termination
     *(pblock->payload + pblock->payload_len) = '\0';
@@ -173,9 +318,11 @@ int add_payload(struct Block* pblock, const char* payload, uint8_t length_known)
  * @return void
  */
 void pack_block(const struct Block block, uint8_t** pbuf, size_t* len) {
+    uint64_t begin = trace_stage_begin();
+    TRACE_PROBE2(pack_block, block.hash, block.payload_len);
     //must send length length of payload which will vary between blocks.
-    //payload length, Prev hash, hash, payload
-    *len = sizeof(uint16_t) + 2*sizeof(uint32_t) + block.payload_len;
+    //payload length, Prev hash, hash, timestamp, payload
+    *len = BLOCK_WIRE_HEADER_SZ + (block.payload != NULL ? block.payload_len : 0);
 
     //realloc so successive calls to pack_block can re-use same memory for efficiency
     *pbuf = realloc(*pbuf, *len);
@@ -186,17 +333,63 @@ void pack_block(const struct Block block, uint8_t** pbuf, size_t* len) {
         return;
     }
 
+    pack_block_header(&block, *pbuf);
+    if (block.payload != NULL) {
+        memcpy(*pbuf + BLOCK_WIRE_HEADER_SZ, block.payload, block.payload_len);
+    }
+    trace_stage_end(TRACE_PACK, begin, 0);
+}
+
+/**
+ * Pack the fixed size part of a block that precedes its payload on the wire. Lets large
+ * payloads be sent straight from where they are stored rather than copied into a packed buffer
+ * @param pblock block whose header to pack. Pruned payloads are flagged so receivers keep our hash
+ * @param buf buffer of at least BLOCK_WIRE_HEADER_SZ bytes
+ * @return void
+ */
+void pack_block_header(const struct Block * pblock, uint8_t * buf) {
+    uint32_t payload_len = pblock->payload_len;
+    if (pblock->payload == NULL) {
+        payload_len |= PAYLOAD_PRUNED_FLAG;
+    }
+
     //get network ordered data
-    uint32_t net_prev_hash = htonl(block.prev_hash);
-    uint32_t net_hash = htonl(block.hash);
-    uint16_t net_payload_sz = htons(block.payload_len);
-
-    //pack data into buf
-    uint8_t *cur = *pbuf;
-    memcpy(cur, &net_payload_sz, sizeof(uint16_t)); cur+= sizeof(uint16_t); 
-    memcpy(cur, &net_prev_hash, sizeof(uint32_t)); cur+= sizeof(uint32_t); 
-    memcpy(cur, &net_hash, sizeof(uint32_t)); cur+= sizeof(uint32_t); 
-    memcpy(cur, block.payload, block.payload_len);
+    uint32_t net_payload_sz = htonl(payload_len);
+    uint32_t net_prev_hash = htonl(pblock->prev_hash);
+    uint32_t net_hash = htonl(pblock->hash);
+    uint64_t net_timestamp = htobe64(pblock->timestamp);
+
+    memcpy(buf, &net_payload_sz, sizeof(uint32_t)); buf += sizeof(uint32_t);
+    memcpy(buf, &net_prev_hash, sizeof(uint32_t)); buf += sizeof(uint32_t);
+    memcpy(buf, &net_hash, sizeof(uint32_t)); buf += sizeof(uint32_t);
+    memcpy(buf, &net_timestamp, sizeof(uint64_t));
+}
+
+/**
+ * Decode the fixed size part of a packed block. Payload is left NULL
+ * @param buf BLOCK_WIRE_HEADER_SZ bytes as produced by pack_block_header
+ * @param pblock block to populate
+ * @return 1 if the sender pruned the payload and it does not follow, 0 if it follows
+ */
+int unpack_block_header(const uint8_t * buf, struct Block * pblock) {
+    uint32_t network_payload_sz, network_prev_hash, network_hash;
+    uint64_t network_timestamp;
+
+    memcpy(&network_payload_sz, buf, sizeof(uint32_t)); buf += sizeof(uint32_t);
+    memcpy(&network_prev_hash, buf, sizeof(uint32_t)); buf += sizeof(uint32_t);
+    memcpy(&network_hash, buf, sizeof(uint32_t)); buf += sizeof(uint32_t);
+    memcpy(&network_timestamp, buf, sizeof(uint64_t));
+
+    uint32_t payload_sz = ntohl(network_payload_sz);
+    pblock->payload_len = payload_sz & ~PAYLOAD_PRUNED_FLAG;
+    pblock->prev_hash = ntohl(network_prev_hash);
+    pblock->hash = ntohl(network_hash);
+    pblock->timestamp = be64toh(network_timestamp);
+    pblock->payload = NULL;
+    pblock->packed = NULL;
+    pblock->packed_len = 0;
+    pblock->cold_offset = -1;
+    return (payload_sz & PAYLOAD_PRUNED_FLAG) != 0;
 }
 
 /**
@@ -206,78 +399,441 @@ void pack_block(const struct Block block, uint8_t** pbuf, size_t* len) {
  * @return 0 on success and -1 on failure
  */
 int unpack_block(int sockfd, struct BlockChain * pblock_chain) {
-    uint16_t network_payload_sz;
-    uint32_t network_prev_hash, network_hash;
-    char tmp_payload_buf[TOTAL_PAYLOAD_LEN];
+    uint8_t header[BLOCK_WIRE_HEADER_SZ];
 
     struct Link * plink = append_link(pblock_chain);
     if (plink == NULL) {
         return -1;
     }
         
-    //Read payload size
-    int ret = receive_buf(sockfd, &network_payload_sz, sizeof(network_payload_sz));
+    //Read payload size and hashes
+    int ret = receive_buf(sockfd, header, sizeof(header));
     //Failed
     if (ret <= 0) {
         return -1;
     }
-    //convert to host byte order
-    plink->block.payload_len = ntohs(network_payload_sz);
 
-    //Read hashes
-    ret = receive_buf(sockfd, &network_prev_hash, sizeof(network_prev_hash));
-    if (ret <= 0) {
+    //Sender no longer holds the payload. Keep header as sent
+    int pruned = unpack_block_header(header, &plink->block);
+    if (check_timestamp(plink->prev, plink->block.timestamp) != 0) {
         return -1;
     }
+    if (pruned) {
+        return 0;
+    }
 
-    ret = receive_buf(sockfd, &network_hash, sizeof(network_hash));
-    if (ret <= 0) {
+    if (plink->block.payload_len > MAX_PAYLOAD) {
+        fprintf(stderr, "Block: received payload size %u larger than max allowed payload %d\n",
+                plink->block.payload_len, MAX_PAYLOAD);
         return -1;
     }
 
-    //Store in link with appropriate byte order
-    plink->block.prev_hash = ntohl(network_prev_hash);
-    plink->block.hash = ntohl(network_hash);
+    //read payload straight into the block, hashing it as it arrives
+    uint32_t payload_hash;
+    plink->block.payload = receive_payload(sockfd, plink->block.payload_len, &payload_hash);
+    if (plink->block.payload == NULL) {
+        return -1;
+    }
+    plink->block.hash = seal_hash(payload_hash, plink->block.timestamp);
+    return 0;
+}
 
-    //read payload 
-    ret = receive_buf(sockfd, tmp_payload_buf, plink->block.payload_len);
-    if (ret <= 0) {
+/**
+ * Unpack a block from a buffer onto the end of chain. Counterpart of unpack_block for
+ * callers doing their own non-blocking reads
+ * @param buf bytes received so far
+ * @param len number of bytes in buf
+ * @param pblock_chain block chain to append to
+ * @return number of bytes consumed, 0 if buf does not yet hold a whole block or -1 on failure
+ */
+ssize_t unpack_block_buf(const uint8_t * buf, size_t len, struct BlockChain * pblock_chain) {
+    struct Block block;
+
+    if (len < BLOCK_WIRE_HEADER_SZ) {
+        return 0;
+    }
+    int pruned = unpack_block_header(buf, &block);
+
+    if (block.payload_len > MAX_PAYLOAD) {
+        fprintf(stderr, "Block: received payload size %u larger than max allowed payload %d\n",
+                block.payload_len, MAX_PAYLOAD);
+        return -1;
+    }
+    if (!pruned && len < BLOCK_WIRE_HEADER_SZ + block.payload_len) {
+        return 0;
+    }
+    if (check_timestamp(pblock_chain->tail, block.timestamp) != 0) {
         return -1;
     }
-    //Null terminate
-    tmp_payload_buf[plink->block.payload_len] = '\0';
 
-    if (add_payload(&plink->block, tmp_payload_buf, 1) != 0) {
-        //failed to add payload
+    //Sender no longer holds the payload. Keep header as sent
+    if (!pruned) {
+        block.payload = malloc((size_t)block.payload_len + 1);
+        if (block.payload == NULL) {
+            fprintf(stderr, "Block: failed to allocate memory for payload\n");
+            return -1;
+        }
+        memcpy(block.payload, buf + BLOCK_WIRE_HEADER_SZ, block.payload_len);
+        block.payload[block.payload_len] = '\0';
+        hash_block(&block);
+    }
+
+    struct Link * plink = append_link(pblock_chain);
+    if (plink == NULL) {
+        free(block.payload);
         return -1;
     }
-    
-    hash_block(&plink->block);
+    plink->block = block;
+    return BLOCK_WIRE_HEADER_SZ + (pruned ? 0 : block.payload_len);
+}
+
+/**
+ * Receive a payload of known length into a new allocation in PAYLOAD_CHUNK sized steps,
+ * hashing each chunk while it is still in cache. The allocation is the payload's final
+ * storage so it is never copied again. It is grown as bytes arrive rather than sized from
+ * the claimed length up front, so a peer that claims a large payload and stalls only costs
+ * memory for what it actually sent
+ * @param sockfd socket to read from
+ * @param len length of payload. At most MAX_PAYLOAD
+ * @param phash set to hash of payload
+ * @return malloc'd null terminated payload or NULL on failure
+ */
+char * receive_payload(int sockfd, uint32_t len, uint32_t * phash) {
+    uint32_t hash = HASH_SEED;
+    size_t cap = len < PAYLOAD_CHUNK ? (size_t)len + 1 : PAYLOAD_CHUNK;
+    char * payload = malloc(cap);
+
+    if (payload == NULL) {
+        fprintf(stderr, "Block: failed to allocate memory for payload\n");
+        return NULL;
+    }
+
+    for (uint32_t off = 0; off < len; ) {
+        uint32_t chunk = len - off > PAYLOAD_CHUNK ? PAYLOAD_CHUNK : len - off;
+        //doubled up to the exact size, so growth costs O(len) copying in total
+        if (off + chunk + 1 > cap) {
+            size_t grown = cap * 2 < (size_t)len + 1 ? cap * 2 : (size_t)len + 1;
+            char * tmp = realloc(payload, grown);
+            if (tmp == NULL) {
+                fprintf(stderr, "Block: failed to allocate memory for payload\n");
+                free(payload);
+                return NULL;
+            }
+            payload = tmp;
+            cap = grown;
+        }
+        if (receive_buf(sockfd, payload + off, chunk) <= 0) {
+            free(payload);
+            return NULL;
+        }
+        hash = hash_payload_update(hash, payload + off, chunk);
+        off += chunk;
+    }
+    payload[len] = '\0';
+    *phash = hash;
+    return payload;
+}
+
+/**
+ * Get a block's payload without copying it when resident. Packed payloads are only unpacked
+ * here, on being read, and payloads pruned to cold storage are read back, both into scratch
+ * which is grown to fit
+ * @param pblock_chain chain the block belongs to
+ * @param pblock block to read payload of
+ * @param pscratch scratch buffer reused across calls. Zero initialise before first use
+ * @return null terminated payload valid until the block is pruned or packed or scratch is
+ * reused, NULL if the payload was dropped or could not be read
+ */
+const char * view_payload(const struct BlockChain * pblock_chain, const struct Block * pblock,
+        struct PayloadBuf * pscratch) {
+    if (pblock->payload != NULL) {
+        return pblock->payload;
+    }
+
+    int in_cold = pblock->packed == NULL;
+    if (in_cold && (pblock->cold_offset < 0 || pblock_chain->cold_fd == -1)) {
+        return NULL;
+    }
+    if (pblock->packed_len > 0 && pblock_chain->unpack == NULL) {
+        fprintf(stderr, "Block: no codec to unpack payload with\n");
+        return NULL;
+    }
+
+    //packed payloads read from cold storage land after room for the unpacked payload
+    size_t payload_sz = (size_t)pblock->payload_len + 1;
+    size_t need = payload_sz + (in_cold ? pblock->packed_len : 0);
+    if (pscratch->cap < need) {
+        char * data = realloc(pscratch->data, need);
+        if (data == NULL) {
+            fprintf(stderr, "Block: failed to allocate memory for payload\n");
+            return NULL;
+        }
+        pscratch->data = data;
+        pscratch->cap = need;
+    }
+
+    const uint8_t * packed = pblock->packed;
+    if (in_cold) {
+        uint32_t stored_len = pblock->packed_len > 0 ? pblock->packed_len : pblock->payload_len;
+        char * dest = pblock->packed_len > 0 ? pscratch->data + payload_sz : pscratch->data;
+        ssize_t n = pread(pblock_chain->cold_fd, dest, stored_len, pblock->cold_offset);
+        if (n != stored_len) {
+            perror("Block: pread cold storage");
+            return NULL;
+        }
+        packed = (const uint8_t *)dest;
+    }
+    if (pblock->packed_len > 0 && pblock_chain->unpack(pblock_chain->pcodec, packed,
+                pblock->packed_len, pscratch->data, pblock->payload_len) != 0) {
+        return NULL;
+    }
+    pscratch->data[pblock->payload_len] = '\0';
+    return pscratch->data;
+}
+
+/**
+ * Free memory held by a payload scratch buffer
+ * @param pscratch scratch buffer to free
+ * @return void
+ */
+void free_payload_buf(struct PayloadBuf * pscratch) {
+    free(pscratch->data);
+    pscratch->data = NULL;
+    pscratch->cap = 0;
+}
+
+/**
+ * Timestamp for a block about to be appended. Follows the wall clock but never steps back
+ * past the tip, so timestamps stay ordered by height even if the clock is adjusted
+ * @param pblock_chain chain the block is appended to
+ * @return milliseconds since the Unix epoch
+ */
+uint64_t next_timestamp(const struct BlockChain * pblock_chain) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t timestamp = (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+    if (pblock_chain->tail != NULL && pblock_chain->tail->block.timestamp > timestamp) {
+        return pblock_chain->tail->block.timestamp;
+    }
+    return timestamp;
+}
+
+/**
+ * Make links decoded in bulk the contents of an empty chain. Links must be in height order
+ * with their blocks populated. Linkage is verified and next/prev pointers and the height
+ * index are set up in a single pass along with timestamp order. Leading blocks without
+ * payloads count as pruned
+ * @param pblock_chain empty chain to adopt links into
+ * @param links array of n_links links. Owned by the chain on success
+ * @param n_links number of links
+ * @param payloads arena all non NULL payloads point into. Owned by the chain on success
+ * @param payloads_sz size of payloads arena
+ * @return 0 on success, -1 on failure in which case the caller keeps ownership
+ */
+int adopt_bulk_links(struct BlockChain * pblock_chain, struct Link * links, uint32_t n_links,
+        char * payloads, size_t payloads_sz) {
+    if (pblock_chain->len != 0) {
+        fprintf(stderr, "Block: can only adopt links into an empty chain\n");
+        return -1;
+    }
+
+    struct Link ** index = malloc((size_t)n_links * sizeof(struct Link *) + 1);
+    if (index == NULL) {
+        fprintf(stderr, "Block: Failed to allocate memory for link index\n");
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < n_links; i++) {
+        uint32_t expected_prev = i == 0 ? 0 : links[i - 1].block.hash;
+        if (links[i].block.prev_hash != expected_prev) {
+            fprintf(stderr, "Block: broken linkage at height %u\n", i);
+            free(index);
+            return -1;
+        }
+        if (check_timestamp(i == 0 ? NULL : &links[i - 1], links[i].block.timestamp) != 0) {
+            free(index);
+            return -1;
+        }
+        links[i].prev = i == 0 ? NULL : &links[i - 1];
+        links[i].next = i + 1 == n_links ? NULL : &links[i + 1];
+        index[i] = &links[i];
+    }
+
+    pblock_chain->len = n_links;
+    pblock_chain->head = n_links > 0 ? &links[0] : NULL;
+    pblock_chain->tail = n_links > 0 ? &links[n_links - 1] : NULL;
+    pblock_chain->links = index;
+    pblock_chain->links_cap = n_links;
+    pblock_chain->bulk_links = links;
+    pblock_chain->bulk_len = n_links;
+    pblock_chain->bulk_payloads = payloads;
+    pblock_chain->bulk_payloads_sz = payloads_sz;
+
+    //chains from pruned nodes start with a run of header only blocks
+    pblock_chain->pruned_len = 0;
+    while (pblock_chain->pruned_len < n_links && links[pblock_chain->pruned_len].block.payload == NULL) {
+        pblock_chain->pruned_len++;
+    }
+    pblock_chain->resident_head = pblock_chain->pruned_len < n_links ?
+        &links[pblock_chain->pruned_len] : NULL;
+    count_bulk_pages(pblock_chain);
     return 0;
 }
 
 /**
- * Interface to hash block. 
+ * Count the payloads on each page of a chain's bulk load arena, so pages can be handed back
+ * to the kernel once pruning or packing has released every payload on them. Pages the arena
+ * only partly covers are shared with other allocations and are never handed back. Without
+ * memory for the counts arena payloads are only detached when released
+ * @param pblock_chain chain that has just adopted its bulk links
+ * @return void
+ */
+static void count_bulk_pages(struct BlockChain * pblock_chain) {
+    size_t page_sz = (size_t)sysconf(_SC_PAGESIZE);
+    uintptr_t base = (uintptr_t)pblock_chain->bulk_payloads & ~(page_sz - 1);
+    uintptr_t end = (uintptr_t)pblock_chain->bulk_payloads + pblock_chain->bulk_payloads_sz;
+
+    if (pblock_chain->bulk_payloads_sz == 0) {
+        return;
+    }
+    size_t n_pages = (end - base + page_sz - 1) / page_sz;
+    uint32_t * refs = calloc(n_pages, sizeof(uint32_t));
+    if (refs == NULL) {
+        fprintf(stderr, "Block: failed to allocate memory for arena pages, pruned payloads stay resident\n");
+        return;
+    }
+    //pinned by an extra count as the partial pages at either end are never emptied
+    refs[0]++;
+    refs[n_pages - 1]++;
+
+    for (uint32_t i = 0; i < pblock_chain->bulk_len; i++) {
+        const char * payload = pblock_chain->bulk_links[i].block.payload;
+        if (payload == NULL) {
+            continue;
+        }
+        //payloads are followed by their null char
+        size_t first = ((uintptr_t)payload - base) / page_sz;
+        size_t last = ((uintptr_t)payload + pblock_chain->bulk_links[i].block.payload_len - base) / page_sz;
+        for (size_t page = first; page <= last; page++) {
+            refs[page]++;
+        }
+    }
+    pblock_chain->bulk_page_refs = refs;
+}
+
+/**
+ * Drop a released payload from the counts of the arena pages it was on, and hand pages no
+ * payload is left on back to the kernel. The arena itself stays mapped and is freed whole
+ * @param pblock_chain chain the arena belongs to
+ * @param payload released payload in the arena
+ * @param len bytes the payload took, including its null char
+ * @return void
+ */
+static void release_bulk_pages(const struct BlockChain * pblock_chain, const char * payload, size_t len) {
+    size_t page_sz = (size_t)sysconf(_SC_PAGESIZE);
+    uintptr_t base = (uintptr_t)pblock_chain->bulk_payloads & ~(page_sz - 1);
+    size_t first = ((uintptr_t)payload - base) / page_sz;
+    size_t last = ((uintptr_t)payload + len - 1 - base) / page_sz;
+    size_t run = 0; //emptied pages not yet handed back, ending at the current page
+
+    for (size_t page = first; page <= last + 1; page++) {
+        if (page <= last && --pblock_chain->bulk_page_refs[page] == 0) {
+            run++;
+            continue;
+        }
+        //a large payload empties a run of pages at once, handed back in a single call
+        if (run > 0 && madvise((void *)(base + (page - run) * page_sz), run * page_sz, MADV_DONTNEED) != 0) {
+            perror("Block: madvise");
+        }
+        run = 0;
+    }
+}
+
+/**
+ * Free a block's payload, packed or not. Payloads living in the chain's bulk load arena
+ * are detached, and the arena's pages are handed back to the kernel as the last payload on
+ * each is released. The arena itself is freed as a whole. packed_len is kept as it also
+ * describes a packed payload in cold storage
+ * @param pblock_chain chain the block belongs to
+ * @param pblock block whose payload to release
+ * @return void
+ */
+void release_payload(const struct BlockChain * pblock_chain, struct Block * pblock) {
+    if (pblock->payload < pblock_chain->bulk_payloads ||
+            pblock->payload >= pblock_chain->bulk_payloads + pblock_chain->bulk_payloads_sz) {
+        free(pblock->payload);
+    } else if (pblock_chain->bulk_page_refs != NULL) {
+        release_bulk_pages(pblock_chain, pblock->payload, (size_t)pblock->payload_len + 1);
+    }
+    pblock->payload = NULL;
+    free(pblock->packed);
+    pblock->packed = NULL;
+}
+
+/**
+ * Interface to hash block. Covers payload and timestamp
  * @param pblock pointer to block
  * @return void
  */
 void hash_block(struct Block* pblock) {
-    pblock->hash = hash_djb2((unsigned char *)pblock->payload);
+    TRACE_PROBE2(hash_block, pblock->payload_len, pblock->timestamp);
+    pblock->hash = seal_hash(hash_payload(pblock->payload, pblock->payload_len), pblock->timestamp);
 }
 
 /**
- * djb2 hash function (http://www.cse.yorku.ca/~oz/hash.html)
+ * Hash a whole payload
  * @param payload payload of data to hash
- * @return computed djb2 hash
+ * @param len length of payload
+ * @return computed hash
+ */
+uint32_t hash_payload(const char * payload, size_t len) {
+    return hash_payload_update(HASH_SEED, payload, len);
+}
+
+/**
+ * djb2 hash function (http://www.cse.yorku.ca/~oz/hash.html). Runs over the payload's length
+ * rather than up to its null char so it can be fed a chunk at a time as a payload arrives
+ * @param hash HASH_SEED or hash of the preceding chunks
+ * @param chunk next bytes of payload
+ * @param len number of bytes in chunk
+ * @return hash of payload up to and including chunk
  */
 //TODO: Replace with cryptographic hash function
-static uint32_t hash_djb2(unsigned char *payload) {
-    uint32_t hash = 5381;
-    int32_t c;
+uint32_t hash_payload_update(uint32_t hash, const void * chunk, size_t len) {
+    const unsigned char * cur = chunk;
+    uint64_t begin = trace_stage_begin();
 
-    while ((c = *payload++))
-        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+    for (size_t i = 0; i < len; i++)
+        hash = ((hash << 5) + hash) + cur[i]; /* hash * 33 + c */
 
+    trace_stage_end(TRACE_HASH, begin, 0);
     return hash;
 }
 
+/**
+ * Complete a block hash by continuing the payload's hash over the block's timestamp.
+ * Lets payloads be hashed as they stream in before the timestamp is known
+ * @param payload_hash hash of payload from hash_payload or hash_payload_update
+ * @param timestamp timestamp of block
+ * @return block hash
+ */
+uint32_t seal_hash(uint32_t payload_hash, uint64_t timestamp) {
+    uint64_t net_timestamp = htobe64(timestamp);
+    return hash_payload_update(payload_hash, &net_timestamp, sizeof(net_timestamp));
+}
+
+/**
+ * Check a block's timestamp does not precede the block it follows
+ * @param pprev link the block is appended after. NULL for the genesis block
+ * @param timestamp timestamp of block
+ * @return 0 if in order, -1 otherwise
+ */
+static int check_timestamp(const struct Link * pprev, uint64_t timestamp) {
+    if (pprev != NULL && timestamp < pprev->block.timestamp) {
+        fprintf(stderr, "Block: timestamp %llu precedes previous block's %llu\n",
+                (unsigned long long)timestamp, (unsigned long long)pprev->block.timestamp);
+        return -1;
+    }
+    return 0;
+}
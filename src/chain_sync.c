@@ -0,0 +1,372 @@
+/**
+ * Headers-first chain sync. The compact headers of a peer's chain are fetched
+ * and their linkage checked first, then payloads are fetched in fixed size
+ * height ranges by worker threads spread over several peers and connections.
+ * Payloads are received straight into one arena and checked against the hash
+ * in their header, and the chain is assembled in height order at the end.
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "chain_sync.h"
+#include "server.h"
+#include "requests.h"
+
+//Range work shared by all fetch workers
+struct SyncWork {
+    const struct BlockHeader * headers; //verified headers of the chain being synced
+    struct Link * links; //links being assembled. Payloads point into arena
+    char * arena; //single allocation holding every payload
+    size_t * offsets; //offset of each block's payload in arena
+    uint32_t n_blocks;
+    uint32_t n_ranges;
+    unsigned n_peers;
+
+    uint32_t next_range; //next range never handed out
+    uint32_t * retry; //ranges waiting to be fetched again
+    uint32_t retry_len;
+    uint8_t * attempts; //number of times each range has been handed out
+    uint64_t * tried; //bitmask of peers each range has been fetched from
+    uint64_t live_peers; //bitmask of peers with at least one running worker
+    unsigned peer_workers[SYNC_MAX_PEERS]; //running workers per peer
+    uint32_t completed; //ranges fully assembled
+    unsigned active; //workers still running
+    int failed; //set when a range ran out of attempts
+
+    uint64_t payload_bytes;
+    uint32_t pruned;
+    uint32_t retries;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond; //signalled whenever a range is requeued or completed or a worker exits
+};
+
+//State of a single fetch worker
+struct SyncWorker {
+    struct SyncWork * pwork;
+    const char * peer; //peer this worker fetches from
+    unsigned peer_idx; //index of peer. Bit in SyncWork tried masks
+    pthread_t thread;
+};
+
+//Internal functions
+static void * fetch_worker(void * arg);
+static int take_range(struct SyncWork * pwork, unsigned peer_idx, uint32_t * prange);
+static void finish_range(struct SyncWork * pwork, unsigned peer_idx, uint32_t range, int status,
+        uint32_t pruned, uint64_t bytes);
+static int fetch_range(struct SyncWork * pwork, int sockfd, uint32_t range, char ** payloads,
+        uint32_t * ppruned, uint64_t * pbytes);
+static int fetch_headers(char * const * peers, unsigned n_peers, struct BlockHeader ** pheaders,
+        uint32_t * plen);
+
+/**
+ * Sync an empty chain from one or more peers. Headers come from the first peer that answers,
+ * payloads from every peer concurrently
+ * @param pblock_chain initialised empty chain to sync into
+ * @param peers peers as host:port or unix:<path>. All must serve the same chain
+ * @param n_peers number of peers
+ * @param conns_per_peer number of concurrent fetch connections opened to each peer
+ * @param pstats populated with sync statistics. May be NULL
+ * @return 0 on success, -1 on failure. Chain is left empty on failure
+ */
+int sync_chain(struct BlockChain * pblock_chain, char * const * peers, unsigned n_peers,
+        unsigned conns_per_peer, struct SyncStats * pstats) {
+    struct SyncWorker workers[SYNC_MAX_WORKERS];
+    struct SyncWork work;
+    struct BlockHeader * headers = NULL;
+    uint32_t n_blocks;
+    int ret = -1;
+
+    if (pblock_chain->len != 0 || n_peers == 0) {
+        fprintf(stderr, "Sync: can only sync an empty chain from at least one peer\n");
+        return -1;
+    }
+    n_peers = n_peers > SYNC_MAX_PEERS ? SYNC_MAX_PEERS : n_peers;
+    if (fetch_headers(peers, n_peers, &headers, &n_blocks) != 0) {
+        return -1;
+    }
+
+    //reject a bad header chain before fetching any payloads
+    for (uint32_t i = 0; i < n_blocks; i++) {
+        if (headers[i].prev_hash != (i == 0 ? 0 : headers[i - 1].hash) ||
+                (i > 0 && headers[i].timestamp < headers[i - 1].timestamp) ||
+                headers[i].payload_len > MAX_PAYLOAD) {
+            fprintf(stderr, "Sync: invalid header at height %u\n", i);
+            free(headers);
+            return -1;
+        }
+    }
+
+    memset(&work, 0, sizeof(work));
+    work.headers = headers;
+    work.n_blocks = n_blocks;
+    work.n_ranges = (n_blocks + SYNC_RANGE_BLOCKS - 1) / SYNC_RANGE_BLOCKS;
+    work.n_peers = n_peers;
+    work.links = malloc((size_t)n_blocks * sizeof(struct Link) + 1);
+    work.offsets = malloc((size_t)n_blocks * sizeof(size_t) + 1);
+    work.retry = malloc((size_t)work.n_ranges * sizeof(uint32_t) + 1);
+    work.attempts = calloc(work.n_ranges + 1, sizeof(uint8_t));
+    work.tried = calloc(work.n_ranges + 1, sizeof(uint64_t));
+    pthread_mutex_init(&work.lock, NULL);
+    pthread_cond_init(&work.cond, NULL);
+
+    if (work.links == NULL || work.offsets == NULL || work.retry == NULL || work.attempts == NULL ||
+            work.tried == NULL) {
+        fprintf(stderr, "Sync: failed to allocate memory for %u blocks\n", n_blocks);
+        goto cleanup;
+    }
+
+    //lay out every payload in one arena and populate links from headers
+    size_t arena_sz = 0;
+    for (uint32_t i = 0; i < n_blocks; i++) {
+        work.offsets[i] = arena_sz;
+        arena_sz += headers[i].payload_len + 1; //+1 for null char
+        work.links[i].block.prev_hash = headers[i].prev_hash;
+        work.links[i].block.hash = headers[i].hash;
+        work.links[i].block.payload_len = headers[i].payload_len;
+        work.links[i].block.timestamp = headers[i].timestamp;
+        work.links[i].block.payload = NULL;
+        work.links[i].block.packed = NULL;
+        work.links[i].block.packed_len = 0;
+        work.links[i].block.cold_offset = -1;
+    }
+    work.arena = malloc(arena_sz + 1);
+    if (work.arena == NULL) {
+        fprintf(stderr, "Sync: failed to allocate memory for payloads\n");
+        goto cleanup;
+    }
+
+    unsigned n_workers = n_peers * (conns_per_peer > 0 ? conns_per_peer : 1);
+    n_workers = n_workers > SYNC_MAX_WORKERS ? SYNC_MAX_WORKERS : n_workers;
+    unsigned started = 0;
+    pthread_mutex_lock(&work.lock);
+    for (unsigned w = 0; w < n_workers; w++) {
+        workers[w].pwork = &work;
+        workers[w].peer_idx = w % n_peers; //spread connections evenly over peers
+        workers[w].peer = peers[workers[w].peer_idx];
+        if (pthread_create(&workers[w].thread, NULL, fetch_worker, &workers[w]) != 0) {
+            fprintf(stderr, "Sync: failed to start fetch worker\n");
+            break;
+        }
+        started++;
+        work.active++;
+        work.peer_workers[workers[w].peer_idx]++;
+        work.live_peers |= 1ull << workers[w].peer_idx;
+    }
+    pthread_mutex_unlock(&work.lock);
+
+    for (unsigned w = 0; w < started; w++) {
+        pthread_join(workers[w].thread, NULL);
+    }
+    if (work.failed || work.completed != work.n_ranges) {
+        fprintf(stderr, "Sync: fetched %u of %u payload ranges\n", work.completed, work.n_ranges);
+        goto cleanup;
+    }
+
+    if (adopt_bulk_links(pblock_chain, work.links, n_blocks, work.arena, arena_sz) != 0) {
+        goto cleanup;
+    }
+    if (pstats != NULL) {
+        pstats->blocks = n_blocks;
+        pstats->pruned = work.pruned;
+        pstats->payload_bytes = work.payload_bytes;
+        pstats->workers = started;
+        pstats->retries = work.retries;
+    }
+    //ownership passed to chain
+    work.links = NULL;
+    work.arena = NULL;
+    ret = 0;
+
+cleanup:
+    free(headers);
+    free(work.links);
+    free(work.arena);
+    free(work.offsets);
+    free(work.retry);
+    free(work.attempts);
+    free(work.tried);
+    pthread_mutex_destroy(&work.lock);
+    pthread_cond_destroy(&work.cond);
+    return ret;
+}
+
+/**
+ * Fetch headers from the first peer that serves them
+ * @return 0 on success, -1 if no peer could
+ */
+static int fetch_headers(char * const * peers, unsigned n_peers, struct BlockHeader ** pheaders,
+        uint32_t * plen) {
+    for (unsigned i = 0; i < n_peers; i++) {
+        int sockfd = connect_to_peer(peers[i]);
+        if (sockfd == -1) {
+            continue;
+        }
+        int ret = request_headers_endpoint(sockfd, pheaders, plen);
+        close(sockfd);
+        if (ret == 0) {
+            return 0;
+        }
+    }
+    fprintf(stderr, "Sync: no peer served headers\n");
+    return -1;
+}
+
+/**
+ * Fetch worker thread. Repeatedly takes a range and fetches it from the worker's peer over
+ * a single connection. Exits once all ranges are done or its connection breaks
+ * @param arg SyncWorker
+ * @return NULL
+ */
+static void * fetch_worker(void * arg) {
+    struct SyncWorker * pworker = arg;
+    struct SyncWork * pwork = pworker->pwork;
+    char * payloads[SYNC_RANGE_BLOCKS];
+    uint32_t range;
+
+    int sockfd = connect_to_peer(pworker->peer);
+
+    while (sockfd != -1 && take_range(pwork, pworker->peer_idx, &range) == 0) {
+        uint32_t pruned = 0;
+        uint64_t bytes = 0;
+        int status = fetch_range(pwork, sockfd, range, payloads, &pruned, &bytes);
+        finish_range(pwork, pworker->peer_idx, range, status, pruned, bytes);
+        //stream is out of sync or peer served bad data. Leave the range to other peers
+        if (status != 0) {
+            break;
+        }
+    }
+
+    if (sockfd != -1) {
+        close(sockfd);
+    }
+    pthread_mutex_lock(&pwork->lock);
+    pwork->active--;
+    if (--pwork->peer_workers[pworker->peer_idx] == 0) {
+        pwork->live_peers &= ~(1ull << pworker->peer_idx);
+    }
+    pthread_cond_broadcast(&pwork->cond);
+    pthread_mutex_unlock(&pwork->lock);
+    return NULL;
+}
+
+/**
+ * Hand out the next range to fetch. Requeued ranges the worker's peer has not tried yet are
+ * preferred. Ranges another live peer has yet to try are left for that peer, otherwise the
+ * worker waits for a range to be requeued or completed
+ * @param pwork shared work
+ * @param peer_idx peer the worker fetches from
+ * @param prange set to range to fetch
+ * @return 0 if a range was taken, -1 if there is nothing left to do
+ */
+static int take_range(struct SyncWork * pwork, unsigned peer_idx, uint32_t * prange) {
+    uint64_t peer_bit = 1ull << peer_idx;
+    int found = 0;
+
+    pthread_mutex_lock(&pwork->lock);
+    while (!found && !pwork->failed && pwork->completed < pwork->n_ranges) {
+        for (uint32_t i = 0; i < pwork->retry_len; i++) {
+            uint64_t tried = pwork->tried[pwork->retry[i]];
+            //retry from the same peer only once no live peer is left to try it
+            if (!(tried & peer_bit) || (tried & pwork->live_peers) == pwork->live_peers) {
+                *prange = pwork->retry[i];
+                pwork->retry[i] = pwork->retry[--pwork->retry_len];
+                pwork->retries++;
+                found = 1;
+                break;
+            }
+        }
+        if (!found && pwork->next_range < pwork->n_ranges) {
+            *prange = pwork->next_range++;
+            found = 1;
+        }
+        if (!found) {
+            pthread_cond_wait(&pwork->cond, &pwork->lock);
+        }
+    }
+
+    if (found) {
+        pwork->attempts[*prange]++;
+    }
+    pthread_mutex_unlock(&pwork->lock);
+    return found ? 0 : -1;
+}
+
+/**
+ * Record the outcome of fetching a range. Failed ranges, and ranges with payloads the peer
+ * had pruned, are requeued for another attempt. Pruned payloads are accepted once every live
+ * peer has been asked for them
+ * @param pwork shared work
+ * @param peer_idx peer the range was fetched from
+ * @param range range that was fetched
+ * @param status 0 if fetch succeeded, -1 otherwise
+ * @param pruned number of payloads in range the peer did not have
+ * @param bytes payload bytes received
+ * @return void
+ */
+static void finish_range(struct SyncWork * pwork, unsigned peer_idx, uint32_t range, int status,
+        uint32_t pruned, uint64_t bytes) {
+    pthread_mutex_lock(&pwork->lock);
+    pwork->payload_bytes += bytes;
+    pwork->tried[range] |= 1ull << peer_idx;
+
+    int exhausted = (pwork->tried[range] & pwork->live_peers) == pwork->live_peers;
+    if (status == 0 && (pruned == 0 || exhausted)) {
+        pwork->pruned += pruned;
+        pwork->completed++;
+    } else if (pwork->attempts[range] < SYNC_MAX_ATTEMPTS) {
+        pwork->retry[pwork->retry_len++] = range;
+    } else {
+        fprintf(stderr, "Sync: giving up on range starting at height %u\n", range * SYNC_RANGE_BLOCKS);
+        pwork->failed = 1;
+    }
+    pthread_cond_broadcast(&pwork->cond);
+    pthread_mutex_unlock(&pwork->lock);
+}
+
+/**
+ * Fetch a range of payloads into the arena and check each against its header's hash.
+ * Links of the range are only pointed at their payloads once all of them verified
+ * @param pwork shared work
+ * @param sockfd connection to peer
+ * @param range range to fetch
+ * @param payloads scratch array of SYNC_RANGE_BLOCKS pointers
+ * @param ppruned set to number of payloads the peer did not have
+ * @param pbytes set to number of payload bytes received
+ * @return 0 on success, -1 on failure
+ */
+static int fetch_range(struct SyncWork * pwork, int sockfd, uint32_t range, char ** payloads,
+        uint32_t * ppruned, uint64_t * pbytes) {
+    uint32_t start = range * SYNC_RANGE_BLOCKS;
+    uint32_t count = pwork->n_blocks - start < SYNC_RANGE_BLOCKS ?
+        pwork->n_blocks - start : SYNC_RANGE_BLOCKS;
+
+    for (uint32_t i = 0; i < count; i++) {
+        payloads[i] = pwork->arena + pwork->offsets[start + i];
+    }
+    if (request_payloads_endpoint(sockfd, start, count, pwork->headers + start, payloads) != 0) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (payloads[i] == NULL) {
+            (*ppruned)++;
+            continue;
+        }
+        const struct BlockHeader * pheader = &pwork->headers[start + i];
+        if (seal_hash(hash_payload(payloads[i], pheader->payload_len), pheader->timestamp) !=
+                pheader->hash) {
+            fprintf(stderr, "Sync: payload at height %u does not match its header hash\n", start + i);
+            return -1;
+        }
+        *pbytes += pwork->headers[start + i].payload_len;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        pwork->links[start + i].block.payload = payloads[i];
+    }
+    return 0;
+}
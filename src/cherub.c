@@ -0,0 +1,717 @@
+/**
+ * libcherub asynchronous client. Each pooled connection keeps a FIFO of
+ * encoded requests which are written back to back with a single sendmsg per
+ * batch, so many requests are in flight per round trip. Responses, including
+ * the node's acknowledgement of each added block, are parsed incrementally as
+ * bytes arrive. Requests stay queued until completed. If their connection has to
+ * be re-established, unwritten requests and chain requests are sent again from the
+ * start, while add blocks already written complete with an unknown outcome.
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "cherub.h"
+#include "server.h"
+#include "requests.h"
+#include "admission.h"
+
+#define CHERUB_MAX_EVENTS 64 //epoll events handled per wait
+#define CHERUB_MAX_IOV 64 //requests written per sendmsg
+#define CHERUB_MAX_ATTEMPTS 3 //connections a chain request may be written to before it fails
+#define CHERUB_IN_INITIAL_CAP 65536 //initial size of receive buffer
+
+//Internal functions
+static uint64_t now_ms(void);
+static struct CherubConn * pick_conn(struct CherubClient * pclient);
+static int enqueue(struct CherubClient * pclient, struct CherubRequest * preq);
+static int service_conns(struct CherubClient * pclient);
+static void arm_retry_timer(struct CherubClient * pclient);
+static int conn_open(struct CherubClient * pclient, struct CherubConn * pconn);
+static int conn_fail(struct CherubClient * pclient, struct CherubConn * pconn);
+static int fail_written(struct CherubConn * pconn, uint32_t written);
+static int conn_write(struct CherubClient * pclient, struct CherubConn * pconn);
+static int conn_read(struct CherubClient * pclient, struct CherubConn * pconn);
+static int parse_responses(struct CherubConn * pconn);
+static ssize_t parse_ack(struct CherubConn * pconn, const uint8_t * buf, size_t len);
+static void set_want_write(struct CherubClient * pclient, struct CherubConn * pconn, int want);
+static void complete_head(struct CherubConn * pconn, enum cherub_status status);
+
+/**
+ * Create client and open its connection pool
+ * @param pclient client to initialise
+ * @param peer node as host:port or unix:<path>
+ * @param n_conns number of pooled connections. At most CHERUB_MAX_CONNS
+ * @return 0 if at least one connection was opened, -1 on failure
+ */
+int cherub_init(struct CherubClient * pclient, const char * peer, unsigned n_conns) {
+    memset(pclient, 0, sizeof(*pclient));
+    pclient->timer_fd = -1;
+    if (n_conns == 0 || n_conns > CHERUB_MAX_CONNS || strlen(peer) >= sizeof(pclient->peer)) {
+        fprintf(stderr, "Cherub: invalid client configuration\n");
+        return -1;
+    }
+    strcpy(pclient->peer, peer);
+    pclient->n_conns = n_conns;
+
+    pclient->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (pclient->epfd == -1) {
+        perror("Cherub: epoll_create1");
+        return -1;
+    }
+    //reconnections are timed through the epoll fd so cherub_fd wakes applications for them too
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    pclient->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (pclient->timer_fd == -1 || epoll_ctl(pclient->epfd, EPOLL_CTL_ADD, pclient->timer_fd, &ev) == -1) {
+        perror("Cherub: register reconnection timer");
+        pclient->n_conns = 0; //no connection is set up yet
+        cherub_deinit(pclient);
+        return -1;
+    }
+
+    int connected = 0;
+    for (unsigned i = 0; i < n_conns; i++) {
+        struct CherubConn * pconn = &pclient->conns[i];
+        pconn->fd = -1;
+        pconn->backoff_ms = CHERUB_RECONNECT_MIN_MS;
+        pconn->chain = initialise_chain();
+        pconn->chain_expected = -1;
+        pconn->queue = calloc(CHERUB_MAX_PENDING, sizeof(struct CherubRequest));
+        if (pconn->queue == NULL) {
+            fprintf(stderr, "Cherub: failed to allocate memory for request queue\n");
+            pclient->n_conns = i + 1;
+            cherub_deinit(pclient);
+            return -1;
+        }
+        connected += conn_open(pclient, pconn) == 0;
+    }
+
+    if (connected == 0) {
+        cherub_deinit(pclient);
+        return -1;
+    }
+    arm_retry_timer(pclient);
+    return 0;
+}
+
+/**
+ * Close every connection. Incomplete requests are completed with CHERUB_CANCELLED
+ * @param pclient client to deinitialise
+ * @return void
+ */
+void cherub_deinit(struct CherubClient * pclient) {
+    for (unsigned i = 0; i < pclient->n_conns; i++) {
+        struct CherubConn * pconn = &pclient->conns[i];
+        while (pconn->queue != NULL && pconn->count > 0) {
+            complete_head(pconn, CHERUB_CANCELLED);
+        }
+        if (pconn->fd != -1) {
+            close(pconn->fd);
+        }
+        free(pconn->queue);
+        free(pconn->in);
+        deinitialise_chain(&pconn->chain);
+        pconn->queue = NULL;
+        pconn->in = NULL;
+        pconn->fd = -1;
+    }
+    if (pclient->timer_fd != -1) {
+        close(pclient->timer_fd);
+    }
+    if (pclient->epfd > 0) {
+        close(pclient->epfd);
+    }
+    pclient->timer_fd = -1;
+    pclient->epfd = -1;
+    pclient->n_conns = 0;
+}
+
+/**
+ * File descriptor that becomes readable whenever the client has I/O to process, including a
+ * dropped connection becoming due for reconnection. Add it to an application's own event loop
+ * and call cherub_process(pclient, 0) when it fires
+ * @param pclient client
+ * @return epoll fd of client
+ */
+int cherub_fd(const struct CherubClient * pclient) {
+    return pclient->epfd;
+}
+
+/**
+ * Queue an add block request. Does not block
+ * @param pclient client
+ * @param payload null terminated payload
+ * @param cb called from cherub_process once the node has acknowledged the block. May be NULL
+ * @param arg passed to cb
+ * @return 0 if queued, -1 if the payload is invalid or every connection's queue is full
+ */
+int cherub_add_block(struct CherubClient * pclient, const char * payload,
+        cherub_add_block_cb cb, void * arg) {
+    struct CherubRequest req;
+    size_t payload_len = strlen(payload);
+
+    if (payload_len > MAX_PAYLOAD) {
+        fprintf(stderr, "Cherub: payload size %lu larger than max allowed payload %d\n",
+                payload_len, MAX_PAYLOAD);
+        return -1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.type = CHERUB_ADD_BLOCK;
+    req.cb.add_block = cb;
+    req.arg = arg;
+    req.wire_len = sizeof(uint8_t) + sizeof(uint32_t) + payload_len;
+    req.wire = malloc(req.wire_len);
+    if (req.wire == NULL) {
+        fprintf(stderr, "Cherub: failed to allocate memory for request\n");
+        return -1;
+    }
+    uint32_t network_payload_len = htonl((uint32_t)payload_len);
+    req.wire[0] = ENDPOINT_ADD_BLOCK;
+    memcpy(req.wire + 1, &network_payload_len, sizeof(uint32_t));
+    memcpy(req.wire + 1 + sizeof(uint32_t), payload, payload_len);
+
+    return enqueue(pclient, &req);
+}
+
+/**
+ * Queue a request for the node's whole chain. Does not block
+ * @param pclient client
+ * @param cb called from cherub_process with the received chain
+ * @param arg passed to cb
+ * @return 0 if queued, -1 if every connection's queue is full
+ */
+int cherub_get_chain(struct CherubClient * pclient, cherub_chain_cb cb, void * arg) {
+    struct CherubRequest req;
+
+    memset(&req, 0, sizeof(req));
+    req.type = CHERUB_CHAIN;
+    req.cb.chain = cb;
+    req.arg = arg;
+    req.wire_len = sizeof(uint8_t);
+    req.wire = malloc(req.wire_len);
+    if (req.wire == NULL) {
+        fprintf(stderr, "Cherub: failed to allocate memory for request\n");
+        return -1;
+    }
+    req.wire[0] = ENDPOINT_CHAIN;
+
+    return enqueue(pclient, &req);
+}
+
+/**
+ * Perform pending I/O and run completion callbacks. Reconnects dropped connections once
+ * their backoff has passed. Reconnection itself is a blocking connect
+ * @param pclient client
+ * @param timeout_ms max time to wait for I/O. 0 to only handle what is ready
+ * @return number of requests completed or -1 on failure
+ */
+int cherub_process(struct CherubClient * pclient, int timeout_ms) {
+    struct epoll_event events[CHERUB_MAX_EVENTS];
+    int completed = service_conns(pclient);
+
+    //requests completed by failed writes are reported without waiting on more I/O
+    if (completed > 0) {
+        timeout_ms = 0;
+    }
+    int n_events = epoll_wait(pclient->epfd, events, CHERUB_MAX_EVENTS, timeout_ms);
+    if (n_events == -1) {
+        if (errno == EINTR) {
+            return completed;
+        }
+        perror("Cherub: epoll_wait");
+        return -1;
+    }
+
+    int retry_due = 0;
+    for (int i = 0; i < n_events; i++) {
+        struct CherubConn * pconn = events[i].data.ptr;
+        if (pconn == NULL) {
+            uint64_t expirations;
+            retry_due = read(pclient->timer_fd, &expirations, sizeof(expirations)) > 0;
+            continue;
+        }
+        if (pconn->fd != -1 && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+            completed += conn_read(pclient, pconn);
+        }
+        if (pconn->fd != -1 && (events[i].events & EPOLLOUT)) {
+            completed += conn_write(pclient, pconn);
+        }
+    }
+    if (retry_due) {
+        completed += service_conns(pclient);
+    }
+    return completed;
+}
+
+/**
+ * Number of requests not yet completed
+ * @param pclient client
+ * @return number of incomplete requests over all connections
+ */
+uint32_t cherub_pending(const struct CherubClient * pclient) {
+    uint32_t pending = 0;
+    for (unsigned i = 0; i < pclient->n_conns; i++) {
+        pending += pclient->conns[i].count;
+    }
+    return pending;
+}
+
+/**
+ * Process I/O until every queued request has completed
+ * @param pclient client
+ * @param timeout_ms max time to wait. Negative to wait indefinitely
+ * @return 0 if all requests completed, -1 on timeout or failure
+ */
+int cherub_drain(struct CherubClient * pclient, int timeout_ms) {
+    uint64_t deadline = now_ms() + (timeout_ms < 0 ? 0 : timeout_ms);
+
+    while (cherub_pending(pclient) > 0) {
+        uint64_t now = now_ms();
+        if (timeout_ms >= 0 && now >= deadline) {
+            return -1;
+        }
+        int wait = timeout_ms < 0 ? CHERUB_RECONNECT_MAX_MS : (int)(deadline - now);
+        if (cherub_process(pclient, wait) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Current monotonic time in milliseconds
+ */
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Reconnect dropped connections whose backoff has passed and write queued requests to every
+ * connected one, then time the next reconnection
+ * @return number of requests completed by failed writes
+ */
+static int service_conns(struct CherubClient * pclient) {
+    uint64_t now = now_ms();
+    int completed = 0;
+
+    for (unsigned i = 0; i < pclient->n_conns; i++) {
+        struct CherubConn * pconn = &pclient->conns[i];
+        if (pconn->fd == -1 && now >= pconn->retry_at_ms && conn_open(pclient, pconn) == 0) {
+            pclient->reconnects++;
+        }
+        //write eagerly. EPOLLOUT is only waited on once the socket buffer is full
+        if (pconn->fd != -1 && pconn->write_idx < pconn->count) {
+            completed += conn_write(pclient, pconn);
+        }
+    }
+    arm_retry_timer(pclient);
+    return completed;
+}
+
+/**
+ * Set the reconnection timer to the earliest retry of any dropped connection, or disarm it
+ * when every connection is up
+ * @return void
+ */
+static void arm_retry_timer(struct CherubClient * pclient) {
+    struct itimerspec its;
+    uint64_t retry_at = 0;
+
+    for (unsigned i = 0; i < pclient->n_conns; i++) {
+        const struct CherubConn * pconn = &pclient->conns[i];
+        if (pconn->fd == -1 && (retry_at == 0 || pconn->retry_at_ms < retry_at)) {
+            retry_at = pconn->retry_at_ms;
+        }
+    }
+    memset(&its, 0, sizeof(its));
+    //a zero value disarms, so a retry already due still needs a time set
+    if (retry_at != 0) {
+        its.it_value.tv_sec = retry_at / 1000;
+        its.it_value.tv_nsec = (retry_at % 1000) * 1000000 + 1;
+    }
+    if (timerfd_settime(pclient->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+        perror("Cherub: timerfd_settime");
+    }
+}
+
+/**
+ * Least loaded connection with room in its queue, preferring connected ones
+ * @return connection or NULL if every queue is full
+ */
+static struct CherubConn * pick_conn(struct CherubClient * pclient) {
+    struct CherubConn * best = NULL;
+    for (unsigned i = 0; i < pclient->n_conns; i++) {
+        struct CherubConn * pconn = &pclient->conns[i];
+        if (pconn->count == CHERUB_MAX_PENDING) {
+            continue;
+        }
+        if (best == NULL || (pconn->fd != -1 && best->fd == -1) ||
+                ((pconn->fd != -1) == (best->fd != -1) && pconn->count < best->count)) {
+            best = pconn;
+        }
+    }
+    return best;
+}
+
+/**
+ * Add encoded request to the tail of a connection's queue
+ * @return 0 on success, -1 if every queue is full. Request's wire is freed on failure
+ */
+static int enqueue(struct CherubClient * pclient, struct CherubRequest * preq) {
+    struct CherubConn * pconn = pick_conn(pclient);
+    if (pconn == NULL) {
+        fprintf(stderr, "Cherub: request queues full\n");
+        free(preq->wire);
+        return -1;
+    }
+    pconn->queue[(pconn->head + pconn->count) % CHERUB_MAX_PENDING] = *preq;
+    pconn->count++;
+    return 0;
+}
+
+/**
+ * Connect a pooled connection. Any queued requests are written from the start
+ * @return 0 on success, -1 on failure in which case a retry is scheduled
+ */
+static int conn_open(struct CherubClient * pclient, struct CherubConn * pconn) {
+    int fd = connect_to_peer(pclient->peer);
+    if (fd == -1) {
+        pconn->retry_at_ms = now_ms() + pconn->backoff_ms;
+        pconn->backoff_ms = pconn->backoff_ms * 2 > CHERUB_RECONNECT_MAX_MS ?
+            CHERUB_RECONNECT_MAX_MS : pconn->backoff_ms * 2;
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = pconn;
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1 ||
+            epoll_ctl(pclient->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("Cherub: register connection");
+        close(fd);
+        pconn->retry_at_ms = now_ms() + pconn->backoff_ms;
+        return -1;
+    }
+
+    pconn->fd = fd;
+    pconn->backoff_ms = CHERUB_RECONNECT_MIN_MS;
+    pconn->want_write = 0;
+    pconn->write_idx = 0;
+    pconn->write_off = 0;
+    pconn->in_len = 0;
+    return 0;
+}
+
+/**
+ * Drop a broken connection and schedule its reconnection. Unwritten requests are sent on the
+ * new connection. Written ones are completed by fail_written, except chain requests which are
+ * resent
+ * @return number of requests completed
+ */
+static int conn_fail(struct CherubClient * pclient, struct CherubConn * pconn) {
+    epoll_ctl(pclient->epfd, EPOLL_CTL_DEL, pconn->fd, NULL);
+    close(pconn->fd);
+    pconn->fd = -1;
+    pconn->retry_at_ms = now_ms() + pconn->backoff_ms;
+    arm_retry_timer(pclient);
+
+    //partially received chain is discarded and requested again
+    deinitialise_chain(&pconn->chain);
+    pconn->chain = initialise_chain();
+    pconn->chain_expected = -1;
+
+    uint32_t written = pconn->write_idx + (pconn->write_off > 0);
+    pconn->write_idx = 0;
+    pconn->write_off = 0;
+    return fail_written(pconn, written);
+}
+
+/**
+ * Complete the requests a failed connection had written, oldest first. An add block may
+ * already have been appended, so resending it risks a duplicate or a second block and it
+ * completes with CHERUB_UNKNOWN instead. Chain requests are safe to repeat and are kept
+ * for the new connection, unless they have now been written CHERUB_MAX_ATTEMPTS times in
+ * which case they fail in case they are what the node objects to
+ * @param pconn connection whose queue to settle. Nothing may be marked as written
+ * @param written number of requests at the head of the queue that were written
+ * @return number of requests completed
+ */
+static int fail_written(struct CherubConn * pconn, uint32_t written) {
+    uint32_t n_failed = 0;
+
+    //requests that fail are moved ahead of those kept so both keep their order
+    for (uint32_t i = 0; i < written; i++) {
+        struct CherubRequest * preq = &pconn->queue[(pconn->head + i) % CHERUB_MAX_PENDING];
+        if (preq->type == CHERUB_CHAIN && ++preq->attempts < CHERUB_MAX_ATTEMPTS) {
+            continue;
+        }
+        struct CherubRequest failed = *preq;
+        for (uint32_t k = i; k > n_failed; k--) {
+            pconn->queue[(pconn->head + k) % CHERUB_MAX_PENDING] =
+                pconn->queue[(pconn->head + k - 1) % CHERUB_MAX_PENDING];
+        }
+        pconn->queue[(pconn->head + n_failed) % CHERUB_MAX_PENDING] = failed;
+        n_failed++;
+    }
+
+    //callbacks may queue new requests, which land behind the ones kept
+    for (uint32_t i = 0; i < n_failed; i++) {
+        complete_head(pconn, pconn->queue[pconn->head].type == CHERUB_ADD_BLOCK ?
+                CHERUB_UNKNOWN : CHERUB_ERR);
+    }
+    return (int)n_failed;
+}
+
+/**
+ * Write as many queued requests as the socket accepts
+ * @return number of requests completed by the connection failing
+ */
+static int conn_write(struct CherubClient * pclient, struct CherubConn * pconn) {
+    while (pconn->write_idx < pconn->count) {
+        struct iovec iov[CHERUB_MAX_IOV];
+        struct msghdr msg;
+        int n_iov = 0;
+
+        for (uint32_t i = pconn->write_idx; i < pconn->count && n_iov < CHERUB_MAX_IOV; i++) {
+            struct CherubRequest * preq = &pconn->queue[(pconn->head + i) % CHERUB_MAX_PENDING];
+            size_t skip = i == pconn->write_idx ? pconn->write_off : 0;
+            iov[n_iov].iov_base = preq->wire + skip;
+            iov[n_iov].iov_len = preq->wire_len - skip;
+            n_iov++;
+        }
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n_iov;
+
+        ssize_t n = sendmsg(pconn->fd, &msg, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            set_want_write(pclient, pconn, 1);
+            return 0;
+        }
+        if (n == -1) {
+            perror("Cherub: sendmsg");
+            return conn_fail(pclient, pconn);
+        }
+
+        //advance write position over fully and partially written requests
+        for (int i = 0; i < n_iov && n > 0; i++) {
+            if ((size_t)n >= iov[i].iov_len) {
+                n -= iov[i].iov_len;
+                pconn->write_idx++;
+                pconn->write_off = 0;
+            } else {
+                pconn->write_off += n;
+                n = 0;
+            }
+        }
+    }
+    set_want_write(pclient, pconn, 0);
+    return 0;
+}
+
+/**
+ * Read everything available on a connection and parse any complete responses
+ * @return number of requests completed
+ */
+static int conn_read(struct CherubClient * pclient, struct CherubConn * pconn) {
+    for (;;) {
+        if (pconn->in_cap - pconn->in_len < CHERUB_IN_INITIAL_CAP / 4) {
+            size_t new_cap = pconn->in_cap ? pconn->in_cap * 2 : CHERUB_IN_INITIAL_CAP;
+            uint8_t * in = realloc(pconn->in, new_cap);
+            if (in == NULL) {
+                fprintf(stderr, "Cherub: failed to allocate memory for receive buffer\n");
+                return conn_fail(pclient, pconn);
+            }
+            pconn->in = in;
+            pconn->in_cap = new_cap;
+        }
+
+        ssize_t n = recv(pconn->fd, pconn->in + pconn->in_len, pconn->in_cap - pconn->in_len, 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n <= 0) {
+            if (n == 0) {
+                fprintf(stderr, "Cherub: node closed connection %d\n", pconn->fd);
+            } else {
+                perror("Cherub: recv");
+            }
+            //acks that arrived before the close still settle their requests
+            int completed = parse_responses(pconn);
+            return (completed > 0 ? completed : 0) + conn_fail(pclient, pconn);
+        }
+        pconn->in_len += n;
+    }
+
+    int completed = parse_responses(pconn);
+    if (completed < 0) {
+        return conn_fail(pclient, pconn);
+    }
+    return completed;
+}
+
+/**
+ * Parse buffered response bytes against the oldest written requests
+ * @return number of requests completed or -1 on a protocol error
+ */
+static int parse_responses(struct CherubConn * pconn) {
+    size_t off = 0;
+    int completed = 0;
+
+    while (off < pconn->in_len) {
+        //responses only arrive for written requests
+        if (pconn->write_idx == 0) {
+            fprintf(stderr, "Cherub: unexpected data from node\n");
+            return -1;
+        }
+
+        if (pconn->queue[pconn->head].type == CHERUB_ADD_BLOCK) {
+            ssize_t n = parse_ack(pconn, pconn->in + off, pconn->in_len - off);
+            if (n == 0) {
+                break;
+            }
+            off += n;
+            completed++;
+            continue;
+        }
+
+        if (pconn->chain_expected < 0) {
+            uint32_t network_len;
+            if (pconn->in_len - off < sizeof(network_len)) {
+                break;
+            }
+            memcpy(&network_len, pconn->in + off, sizeof(network_len));
+            off += sizeof(network_len);
+            uint32_t len = ntohl(network_len);
+            if (len == ADMISSION_REJECTED) {
+                complete_head(pconn, CHERUB_REJECTED);
+                completed++;
+                continue;
+            }
+            pconn->chain_expected = len;
+        }
+
+        while (pconn->chain.len < pconn->chain_expected) {
+            ssize_t n = unpack_block_buf(pconn->in + off, pconn->in_len - off, &pconn->chain);
+            if (n == -1) {
+                return -1;
+            }
+            if (n == 0) {
+                break;
+            }
+            off += n;
+        }
+        if (pconn->chain.len < pconn->chain_expected) {
+            break;
+        }
+        complete_head(pconn, CHERUB_OK);
+        completed++;
+    }
+
+    //keep unparsed tail at the start of the buffer
+    memmove(pconn->in, pconn->in + off, pconn->in_len - off);
+    pconn->in_len -= off;
+    return completed;
+}
+
+/**
+ * Complete the oldest request, an add block, with the node's acknowledgement of it
+ * @param pconn connection whose head request is an add block
+ * @param buf bytes received so far
+ * @param len number of bytes in buf
+ * @return number of bytes consumed, 0 if buf does not yet hold a whole acknowledgement
+ */
+static ssize_t parse_ack(struct CherubConn * pconn, const uint8_t * buf, size_t len) {
+    uint32_t network_ack[2];
+
+    if (len < sizeof(network_ack)) {
+        return 0;
+    }
+    memcpy(network_ack, buf, sizeof(network_ack));
+    uint32_t height = ntohl(network_ack[0]);
+
+    enum cherub_status status = CHERUB_OK;
+    if (height == ADMISSION_REJECTED) {
+        status = CHERUB_REJECTED;
+    } else if (height == ADD_BLOCK_DUPLICATE) {
+        status = CHERUB_DUPLICATE;
+    } else if (height == ADD_BLOCK_FAILED) {
+        status = CHERUB_ERR;
+    } else if (height == ADD_BLOCK_UNVERIFIED) {
+        status = CHERUB_UNVERIFIED;
+    } else if (height == ADD_BLOCK_READ_ONLY) {
+        status = CHERUB_READ_ONLY;
+    }
+    if (status == CHERUB_OK) {
+        struct CherubRequest * preq = &pconn->queue[pconn->head];
+        preq->height = height;
+        preq->hash = ntohl(network_ack[1]);
+    }
+    complete_head(pconn, status);
+    return sizeof(network_ack);
+}
+
+/**
+ * Register or unregister interest in the connection becoming writable
+ * @return void
+ */
+static void set_want_write(struct CherubClient * pclient, struct CherubConn * pconn, int want) {
+    if (pconn->want_write == want) {
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (want ? EPOLLOUT : 0);
+    ev.data.ptr = pconn;
+    if (epoll_ctl(pclient->epfd, EPOLL_CTL_MOD, pconn->fd, &ev) == 0) {
+        pconn->want_write = want;
+    }
+}
+
+/**
+ * Pop oldest request and run its callback. The request is removed before the callback runs
+ * so callbacks may queue new requests
+ * @return void
+ */
+static void complete_head(struct CherubConn * pconn, enum cherub_status status) {
+    struct CherubRequest req = pconn->queue[pconn->head];
+    pconn->head = (pconn->head + 1) % CHERUB_MAX_PENDING;
+    pconn->count--;
+    if (pconn->write_idx > 0) {
+        pconn->write_idx--;
+    } else {
+        pconn->write_off = 0;
+    }
+    free(req.wire);
+
+    if (req.type == CHERUB_ADD_BLOCK) {
+        if (req.cb.add_block != NULL) {
+            req.cb.add_block(req.arg, status, req.height, req.hash);
+        }
+        return;
+    }
+
+    struct BlockChain chain = pconn->chain;
+    pconn->chain = initialise_chain();
+    pconn->chain_expected = -1;
+    if (req.cb.chain != NULL) {
+        req.cb.chain(req.arg, status, &chain);
+    }
+    deinitialise_chain(&chain);
+}
@@ -0,0 +1,542 @@
+/**
+ * At rest compression of block payloads. Payloads are mostly small, similar records
+ * that share little within themselves, so each is deflated against a dictionary
+ * trained from a sample of the chain's own payloads. Dictionaries are versioned in an
+ * append only store and every packed payload names the version it was packed with.
+ * Blocks keep hashing over their unpacked payloads, which are only restored when read.
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "codec.h"
+#include "endpoints.h"
+#include "server.h"
+
+#define CODEC_MAGIC 0x43485a31 //"CHZ1"
+#define CODEC_RECORD_HEADER_SZ (4 * sizeof(uint32_t)) //version, length, bytes sampled and hash of a dictionary
+#define CODEC_KMER 8 //bytes in the substrings whose frequency dictionaries are trained on
+#define CODEC_SEGMENT 64 //bytes copied from the samples into a dictionary at a time
+#define CODEC_TABLE_BITS 20 //log2 of buckets counting substring frequencies
+
+//Internal functions
+static int load_dicts(struct PayloadCodec * pcodec, off_t size);
+static int store_dict(struct PayloadCodec * pcodec, const uint8_t * data, uint32_t len, uint32_t sampled);
+static uint32_t gather_samples(struct EndpointContext * pctx, uint8_t * samples, size_t * plen);
+static uint32_t build_dict(const uint8_t * samples, size_t len, uint8_t * dict, uint32_t cap);
+static inline uint32_t kmer_bucket(const uint8_t * kmer);
+static int compare_segments(const void * a, const void * b);
+static int pack_payload(struct PayloadCodec * pcodec, const char * payload, uint32_t len,
+        uint32_t * ppacked_len);
+
+//Segment of the samples chosen for a dictionary
+struct DictSegment {
+    size_t offset;
+    uint64_t score; //summed frequency of its substrings when chosen
+};
+
+/**
+ * Open a codec's dictionary store, creating it if missing, and attach the codec to a chain
+ * so packed payloads are unpacked on being read. A dictionary torn by a crash mid-write is
+ * cut off the end of the store
+ * @param pcodec codec to initialise
+ * @param store_path dictionary store
+ * @param pblock_chain chain whose payloads are packed. Must be deinitialised before the codec
+ * @return 0 on success, -1 on failure
+ */
+int initialise_codec(struct PayloadCodec * pcodec, const char * store_path, struct BlockChain * pblock_chain) {
+    struct stat st;
+
+    memset(pcodec, 0, sizeof(*pcodec));
+    pcodec->store_fd = open(store_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (pcodec->store_fd == -1) {
+        perror("Codec: open");
+        return -1;
+    }
+    if (fstat(pcodec->store_fd, &st) != 0) {
+        perror("Codec: fstat");
+        close(pcodec->store_fd);
+        return -1;
+    }
+
+    if (st.st_size == 0) {
+        uint32_t network_magic = htonl(CODEC_MAGIC);
+        if (write(pcodec->store_fd, &network_magic, sizeof(network_magic)) != sizeof(network_magic) ||
+                fdatasync(pcodec->store_fd) != 0) {
+            perror("Codec: initialise");
+            close(pcodec->store_fd);
+            return -1;
+        }
+    } else if (load_dicts(pcodec, st.st_size) != 0) {
+        deinitialise_codec(pcodec);
+        return -1;
+    }
+
+    //raw deflate as the length and hash of every payload are already known
+    if (deflateInit2(&pcodec->deflater, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+                Z_DEFAULT_STRATEGY) != Z_OK) {
+        fprintf(stderr, "Codec: failed to initialise deflate\n");
+        deinitialise_codec(pcodec);
+        return -1;
+    }
+
+    pblock_chain->pcodec = pcodec;
+    pblock_chain->unpack = unpack_payload;
+    if (pcodec->latest > 0) {
+        printf("Codec: packing with dictionary version %u of %s\n", pcodec->latest, store_path);
+    }
+    return 0;
+}
+
+/**
+ * Close a codec's store and free its dictionaries. Its chain must already be deinitialised
+ * @param pcodec codec to free
+ * @return void
+ */
+void deinitialise_codec(struct PayloadCodec * pcodec) {
+    //state is only set while deflate is initialised
+    if (pcodec->deflater.state != NULL) {
+        deflateEnd(&pcodec->deflater);
+    }
+    for (uint32_t v = 1; v <= CODEC_MAX_DICTS; v++) {
+        free(pcodec->dicts[v].data);
+        pcodec->dicts[v].data = NULL;
+        pcodec->dicts[v].version = 0;
+    }
+    free(pcodec->out);
+    pcodec->out = NULL;
+    pcodec->out_cap = 0;
+    if (pcodec->store_fd != -1) {
+        close(pcodec->store_fd);
+        pcodec->store_fd = -1;
+    }
+}
+
+/**
+ * Train a new dictionary version from the chain's most recent payloads and make it the one
+ * payloads are packed with from then on. Payloads already packed keep their version
+ * @param pcodec codec to train
+ * @param pctx state of the node whose chain is sampled
+ * @return number of payloads sampled, 0 if there were too few to train on, -1 on failure
+ */
+int train_codec(struct PayloadCodec * pcodec, struct EndpointContext * pctx) {
+    if (pcodec->latest == CODEC_MAX_DICTS) {
+        fprintf(stderr, "Codec: dictionary store is full\n");
+        return -1;
+    }
+
+    uint8_t * samples = malloc(CODEC_SAMPLE_BYTES);
+    uint8_t * dict = malloc(CODEC_DICT_SZ);
+    if (samples == NULL || dict == NULL) {
+        fprintf(stderr, "Codec: failed to allocate memory for training\n");
+        free(samples);
+        free(dict);
+        return -1;
+    }
+
+    size_t len;
+    uint32_t n_samples = gather_samples(pctx, samples, &len);
+    int ret = 0;
+    if (n_samples >= CODEC_MIN_SAMPLES) {
+        uint32_t dict_len = build_dict(samples, len, dict, CODEC_DICT_SZ);
+        ret = dict_len > 0 && store_dict(pcodec, dict, dict_len, len) == 0 ? (int)n_samples : -1;
+        if (ret > 0) {
+            printf("Codec: trained dictionary version %u of %u bytes on %u payloads\n",
+                    pcodec->latest, dict_len, n_samples);
+        }
+    }
+    free(samples);
+    free(dict);
+    return ret;
+}
+
+/**
+ * Pack the next batch of payloads more than depth blocks behind the tip. Payloads are
+ * deflated outside the chain lock, so appends carry on meanwhile, and swapped in under it.
+ * Payloads that do not shrink stay raw. Must be called from the thread that prunes the chain
+ * @param pcodec trained codec
+ * @param pctx state of the node whose chain to pack
+ * @param depth number of most recent blocks whose payloads stay raw
+ * @return number of payloads packed
+ */
+int compress_chain(struct PayloadCodec * pcodec, struct EndpointContext * pctx, uint32_t depth) {
+    const struct BlockChain * pblock_chain = pctx->pblock_chain;
+    struct Block * blocks[CODEC_BATCH];
+    uint8_t * packed[CODEC_BATCH];
+    uint32_t packed_lens[CODEC_BATCH];
+    uint32_t n_blocks = 0;
+
+    if (pcodec->latest == 0) {
+        return 0;
+    }
+
+    //links and their raw payloads only move or go away on this thread
+    lock_chain_shared(pctx);
+    while (n_blocks < CODEC_BATCH && pblock_chain->len - pcodec->next_height > depth) {
+        struct Block * pblock = &get_link(pblock_chain, pcodec->next_height++)->block;
+        if (pblock->payload != NULL && pblock->payload_len >= CODEC_MIN_PAYLOAD) {
+            blocks[n_blocks++] = pblock;
+        }
+    }
+    unlock_chain(pctx);
+
+    for (uint32_t i = 0; i < n_blocks; i++) {
+        packed[i] = NULL;
+        if (pack_payload(pcodec, blocks[i]->payload, blocks[i]->payload_len, &packed_lens[i]) != 0 ||
+                packed_lens[i] >= blocks[i]->payload_len) {
+            continue;
+        }
+        packed[i] = malloc(packed_lens[i]);
+        if (packed[i] == NULL) {
+            fprintf(stderr, "Codec: failed to allocate memory for packed payload\n");
+            continue;
+        }
+        memcpy(packed[i], pcodec->out, packed_lens[i]);
+    }
+
+    int n_packed = 0;
+    lock_chain_exclusive(pctx);
+    for (uint32_t i = 0; i < n_blocks; i++) {
+        if (packed[i] == NULL) {
+            continue;
+        }
+        pcodec->raw_bytes += blocks[i]->payload_len;
+        pcodec->packed_bytes += packed_lens[i];
+        release_payload(pblock_chain, blocks[i]);
+        blocks[i]->packed = packed[i];
+        blocks[i]->packed_len = packed_lens[i];
+        n_packed++;
+    }
+    unlock_chain(pctx);
+    pcodec->packed += n_packed;
+    return n_packed;
+}
+
+/**
+ * Restore a packed payload. Safe to call from any number of threads at once
+ * @param pcodec codec the payload was packed with
+ * @param packed packed payload. Version of its dictionary followed by a raw deflate stream
+ * @param packed_len length of packed payload
+ * @param payload buffer of at least payload_len bytes to unpack into
+ * @param payload_len length of unpacked payload
+ * @return 0 on success, -1 if the payload is corrupt or its dictionary unknown
+ */
+int unpack_payload(const struct PayloadCodec * pcodec, const uint8_t * packed, uint32_t packed_len,
+        char * payload, uint32_t payload_len) {
+    z_stream inflater;
+
+    if (packed_len < 1 || pcodec->dicts[packed[0]].version == 0) {
+        fprintf(stderr, "Codec: payload packed with unknown dictionary\n");
+        return -1;
+    }
+    const struct PayloadDict * pdict = &pcodec->dicts[packed[0]];
+
+    memset(&inflater, 0, sizeof(inflater));
+    if (inflateInit2(&inflater, -MAX_WBITS) != Z_OK) {
+        fprintf(stderr, "Codec: failed to initialise inflate\n");
+        return -1;
+    }
+    inflater.next_in = (Bytef *)packed + 1;
+    inflater.avail_in = packed_len - 1;
+    inflater.next_out = (Bytef *)payload;
+    inflater.avail_out = payload_len;
+
+    int ret = inflateSetDictionary(&inflater, pdict->data, pdict->len);
+    if (ret == Z_OK) {
+        ret = inflate(&inflater, Z_FINISH);
+    }
+    uLong total_out = inflater.total_out;
+    inflateEnd(&inflater);
+    if (ret != Z_STREAM_END || total_out != payload_len) {
+        fprintf(stderr, "Codec: corrupt packed payload\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Read every dictionary in the store and truncate whatever follows the last whole one
+ * @param pcodec codec whose store_fd is positioned at the start of the store
+ * @param size size of store
+ * @return 0 on success, -1 on failure
+ */
+static int load_dicts(struct PayloadCodec * pcodec, off_t size) {
+    uint8_t header[CODEC_RECORD_HEADER_SZ];
+    uint32_t network_magic;
+
+    if (read(pcodec->store_fd, &network_magic, sizeof(network_magic)) != sizeof(network_magic) ||
+            ntohl(network_magic) != CODEC_MAGIC) {
+        fprintf(stderr, "Codec: not a dictionary store\n");
+        return -1;
+    }
+
+    off_t good = sizeof(network_magic);
+    while (read(pcodec->store_fd, header, sizeof(header)) == sizeof(header)) {
+        uint32_t network_u32;
+        memcpy(&network_u32, header, sizeof(uint32_t));
+        uint32_t version = ntohl(network_u32);
+        memcpy(&network_u32, header + sizeof(uint32_t), sizeof(uint32_t));
+        uint32_t len = ntohl(network_u32);
+        memcpy(&network_u32, header + 2 * sizeof(uint32_t), sizeof(uint32_t));
+        uint32_t sampled = ntohl(network_u32);
+        memcpy(&network_u32, header + 3 * sizeof(uint32_t), sizeof(uint32_t));
+        uint32_t hash = ntohl(network_u32);
+
+        //versions are stored in order so any gap is damage
+        if (version != pcodec->latest + 1 || version > CODEC_MAX_DICTS || len == 0 ||
+                len > CODEC_DICT_SZ) {
+            break;
+        }
+        uint8_t * data = malloc(len);
+        if (data == NULL) {
+            fprintf(stderr, "Codec: failed to allocate memory for dictionary\n");
+            return -1;
+        }
+        if (read(pcodec->store_fd, data, len) != len || hash_payload((const char *)data, len) != hash) {
+            free(data);
+            break;
+        }
+        pcodec->dicts[version].version = version;
+        pcodec->dicts[version].len = len;
+        pcodec->dicts[version].sampled = sampled;
+        pcodec->dicts[version].data = data;
+        pcodec->latest = version;
+        good += sizeof(header) + len;
+    }
+
+    if (good < size) {
+        fprintf(stderr, "Codec: discarding %lld bytes after last complete dictionary\n",
+                (long long)(size - good));
+        if (ftruncate(pcodec->store_fd, good) != 0 || fdatasync(pcodec->store_fd) != 0) {
+            perror("Codec: truncate");
+            return -1;
+        }
+    }
+    if (lseek(pcodec->store_fd, 0, SEEK_END) == -1) {
+        perror("Codec: lseek");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Durably append a dictionary to the store as the next version, then start packing with it
+ * @param pcodec codec to add dictionary to
+ * @param data dictionary
+ * @param len length of dictionary
+ * @param sampled bytes of payloads it was trained on
+ * @return 0 on success, -1 on failure
+ */
+static int store_dict(struct PayloadCodec * pcodec, const uint8_t * data, uint32_t len, uint32_t sampled) {
+    uint8_t header[CODEC_RECORD_HEADER_SZ];
+    uint32_t version = pcodec->latest + 1;
+
+    uint8_t * copy = malloc(len);
+    if (copy == NULL) {
+        fprintf(stderr, "Codec: failed to allocate memory for dictionary\n");
+        return -1;
+    }
+    memcpy(copy, data, len);
+
+    uint32_t network_u32 = htonl(version);
+    memcpy(header, &network_u32, sizeof(uint32_t));
+    network_u32 = htonl(len);
+    memcpy(header + sizeof(uint32_t), &network_u32, sizeof(uint32_t));
+    network_u32 = htonl(sampled);
+    memcpy(header + 2 * sizeof(uint32_t), &network_u32, sizeof(uint32_t));
+    network_u32 = htonl(hash_payload((const char *)data, len));
+    memcpy(header + 3 * sizeof(uint32_t), &network_u32, sizeof(uint32_t));
+
+    //nothing may be packed with a version that would not survive a restart
+    if (write(pcodec->store_fd, header, sizeof(header)) != sizeof(header) ||
+            write(pcodec->store_fd, data, len) != len || fdatasync(pcodec->store_fd) != 0) {
+        perror("Codec: write dictionary");
+        free(copy);
+        return -1;
+    }
+    pcodec->dicts[version].version = version;
+    pcodec->dicts[version].len = len;
+    pcodec->dicts[version].sampled = sampled;
+    pcodec->dicts[version].data = copy;
+    pcodec->latest = version;
+    return 0;
+}
+
+/**
+ * Copy the chain's most recent payloads into a sample buffer, newest first
+ * @param pctx state of the node whose chain to sample
+ * @param samples buffer of CODEC_SAMPLE_BYTES
+ * @param plen set to number of bytes sampled
+ * @return number of payloads sampled
+ */
+static uint32_t gather_samples(struct EndpointContext * pctx, uint8_t * samples, size_t * plen) {
+    const struct BlockChain * pblock_chain = pctx->pblock_chain;
+    struct PayloadBuf scratch = {NULL, 0};
+    uint32_t n_samples = 0;
+    size_t len = 0;
+
+    lock_chain_shared(pctx);
+    for (const struct Link * link = pblock_chain->tail; link != NULL && len < CODEC_SAMPLE_BYTES;
+            link = link->prev) {
+        const char * payload = view_payload(pblock_chain, &link->block, &scratch);
+        if (payload == NULL) {
+            continue;
+        }
+        size_t take = link->block.payload_len;
+        if (take > CODEC_SAMPLE_BYTES - len) {
+            take = CODEC_SAMPLE_BYTES - len;
+        }
+        memcpy(samples + len, payload, take);
+        len += take;
+        n_samples++;
+    }
+    unlock_chain(pctx);
+
+    free_payload_buf(&scratch);
+    *plen = len;
+    return n_samples;
+}
+
+/**
+ * Build a dictionary from the segments of the samples made of their most frequent substrings.
+ * The samples are split into one epoch per segment and the best segment of each is taken,
+ * after which its substrings stop counting so later segments add something new. Deflate
+ * reaches the end of a dictionary most cheaply, so the best segments are placed last
+ * @param samples concatenated sample payloads
+ * @param len bytes of samples
+ * @param dict buffer to build dictionary in
+ * @param cap size of dict
+ * @return length of dictionary. 0 if samples were too short or had nothing in common
+ */
+static uint32_t build_dict(const uint8_t * samples, size_t len, uint8_t * dict, uint32_t cap) {
+    if (len < CODEC_SEGMENT) {
+        return 0;
+    }
+    uint32_t * counts = calloc((size_t)1 << CODEC_TABLE_BITS, sizeof(uint32_t));
+    uint32_t n_segments = cap / CODEC_SEGMENT;
+    struct DictSegment * segments = malloc(n_segments * sizeof(struct DictSegment));
+    if (counts == NULL || segments == NULL) {
+        fprintf(stderr, "Codec: failed to allocate memory for training\n");
+        free(counts);
+        free(segments);
+        return 0;
+    }
+
+    for (size_t i = 0; i + CODEC_KMER <= len; i++) {
+        counts[kmer_bucket(samples + i)]++;
+    }
+
+    size_t epoch = len / n_segments;
+    if (epoch < CODEC_SEGMENT) {
+        epoch = CODEC_SEGMENT;
+        n_segments = len / CODEC_SEGMENT;
+    }
+
+    uint32_t n_chosen = 0;
+    for (uint32_t e = 0; e < n_segments; e++) {
+        size_t begin = e * epoch;
+        size_t end = begin + epoch < len ? begin + epoch : len;
+        if (end - begin < CODEC_SEGMENT) {
+            break;
+        }
+
+        //slide a segment across the epoch scoring the substrings starting within it
+        uint64_t score = 0, best_score = 0;
+        size_t best = begin;
+        for (size_t j = begin; j <= begin + CODEC_SEGMENT - CODEC_KMER; j++) {
+            score += counts[kmer_bucket(samples + j)];
+        }
+        best_score = score;
+        for (size_t s = begin + 1; s + CODEC_SEGMENT <= end; s++) {
+            score += counts[kmer_bucket(samples + s + CODEC_SEGMENT - CODEC_KMER)];
+            score -= counts[kmer_bucket(samples + s - 1)];
+            if (score > best_score) {
+                best_score = score;
+                best = s;
+            }
+        }
+        //a substring only seen once is not worth a place
+        if (best_score <= CODEC_SEGMENT - CODEC_KMER + 1) {
+            continue;
+        }
+
+        segments[n_chosen].offset = best;
+        segments[n_chosen].score = best_score;
+        n_chosen++;
+        for (size_t j = best; j <= best + CODEC_SEGMENT - CODEC_KMER; j++) {
+            counts[kmer_bucket(samples + j)] = 0;
+        }
+    }
+
+    qsort(segments, n_chosen, sizeof(struct DictSegment), compare_segments);
+    for (uint32_t i = 0; i < n_chosen; i++) {
+        memcpy(dict + i * CODEC_SEGMENT, samples + segments[i].offset, CODEC_SEGMENT);
+    }
+    free(counts);
+    free(segments);
+    return n_chosen * CODEC_SEGMENT;
+}
+
+/**
+ * Bucket counting a substring's frequency
+ * @param kmer CODEC_KMER bytes of substring
+ * @return bucket index
+ */
+static inline uint32_t kmer_bucket(const uint8_t * kmer) {
+    uint64_t v;
+    memcpy(&v, kmer, sizeof(v));
+    return (uint32_t)((v * 0x9E3779B97F4A7C15ULL) >> (64 - CODEC_TABLE_BITS));
+}
+
+/**
+ * Order dictionary segments by ascending score
+ */
+static int compare_segments(const void * a, const void * b) {
+    const struct DictSegment * pa = a, * pb = b;
+    return (pa->score > pb->score) - (pa->score < pb->score);
+}
+
+/**
+ * Deflate a payload against the latest dictionary into the codec's scratch
+ * @param pcodec trained codec
+ * @param payload payload to pack
+ * @param len length of payload
+ * @param ppacked_len set to length of packed payload left in pcodec->out
+ * @return 0 on success, -1 on failure
+ */
+static int pack_payload(struct PayloadCodec * pcodec, const char * payload, uint32_t len,
+        uint32_t * ppacked_len) {
+    const struct PayloadDict * pdict = &pcodec->dicts[pcodec->latest];
+
+    if (deflateReset(&pcodec->deflater) != Z_OK ||
+            deflateSetDictionary(&pcodec->deflater, pdict->data, pdict->len) != Z_OK) {
+        fprintf(stderr, "Codec: failed to reset deflate\n");
+        return -1;
+    }
+    size_t need = 1 + deflateBound(&pcodec->deflater, len);
+    if (pcodec->out_cap < need) {
+        uint8_t * out = realloc(pcodec->out, need);
+        if (out == NULL) {
+            fprintf(stderr, "Codec: failed to allocate memory for packing\n");
+            return -1;
+        }
+        pcodec->out = out;
+        pcodec->out_cap = need;
+    }
+
+    pcodec->out[0] = (uint8_t)pcodec->latest;
+    pcodec->deflater.next_in = (Bytef *)payload;
+    pcodec->deflater.avail_in = len;
+    pcodec->deflater.next_out = pcodec->out + 1;
+    pcodec->deflater.avail_out = pcodec->out_cap - 1;
+    if (deflate(&pcodec->deflater, Z_FINISH) != Z_STREAM_END) {
+        fprintf(stderr, "Codec: failed to deflate payload\n");
+        return -1;
+    }
+    *ppacked_len = 1 + pcodec->deflater.total_out;
+    return 0;
+}
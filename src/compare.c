@@ -0,0 +1,237 @@
+/**
+ * Simple program to find the first height at which two running nodes' chains
+ * differ by descending their range hash trees, optionally fetching only the
+ * differing suffix of each
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "block.h"
+#include "server.h"
+#include "requests.h"
+
+#define COMPARE_USAGE "usage: compare [-s] host:port|unix:path host:port|unix:path\n"
+#define TREE_REQUEST_SZ (2 * sizeof(uint8_t) + 2 * sizeof(uint32_t)) //bytes of a tree request
+#define TREE_RESPONSE_SZ (2 * sizeof(uint32_t)) //bytes of a tree response before its hashes
+
+//Node being compared
+struct Peer {
+    const char * name; //host:port or unix:path
+    int fd;
+    uint32_t len; //chain length as of the last response
+    uint64_t bytes; //bytes sent to and received from the node
+};
+
+//Internal functions
+static int fetch_nodes(struct Peer * ppeer, uint32_t level, uint32_t index, uint32_t count,
+        uint64_t * hashes);
+static int nodes_match(struct Peer * peers, uint32_t level, uint32_t index);
+static int64_t find_divergence(struct Peer * peers, unsigned * prounds);
+static int fetch_suffix(struct Peer * ppeer, uint32_t start, uint32_t * pblocks);
+
+//Compare chains of two nodes and print where they diverge
+int main(int argc, char * argv[]) {
+    struct Peer peers[2];
+    struct timespec start, end;
+    int fetch = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s")) != -1) {
+        switch (opt) {
+            case 's':
+                fetch = 1;
+                break;
+            default:
+                fprintf(stderr, COMPARE_USAGE);
+                return 1;
+        }
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, COMPARE_USAGE);
+        return 1;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        peers[i].name = argv[optind + i];
+        peers[i].bytes = 0;
+        peers[i].fd = connect_to_peer(peers[i].name);
+        if (peers[i].fd == -1) {
+            if (i == 1) {
+                close(peers[0].fd);
+            }
+            return 2;
+        }
+    }
+
+    unsigned rounds = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int64_t divergence = find_divergence(peers, &rounds);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    //failed
+    if (divergence == -1) {
+        close(peers[0].fd);
+        close(peers[1].fd);
+        return 3;
+    }
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (divergence == peers[0].len && divergence == peers[1].len) {
+        printf("Compare: chains are identical up to height %u\n", peers[0].len);
+    } else {
+        printf("Compare: chains diverge at height %lld\n", (long long)divergence);
+    }
+    printf("Compare: %s has %u blocks, %s has %u blocks\n", peers[0].name, peers[0].len,
+            peers[1].name, peers[1].len);
+    printf("Compare: %u round trips, %llu bytes exchanged, %.3f ms\n", rounds,
+            (unsigned long long)(peers[0].bytes + peers[1].bytes), elapsed * 1e3);
+
+    int ret = 0;
+    for (int i = 0; fetch && i < 2 && ret == 0; i++) {
+        uint32_t n_blocks;
+        uint64_t before = peers[i].bytes;
+        if (fetch_suffix(&peers[i], (uint32_t)divergence, &n_blocks) != 0) {
+            ret = 4;
+            break;
+        }
+        printf("Compare: fetched %u differing blocks (%llu bytes) from %s\n", n_blocks,
+                (unsigned long long)(peers[i].bytes - before), peers[i].name);
+    }
+
+    close(peers[0].fd);
+    close(peers[1].fd);
+    return ret;
+}
+
+/**
+ * Find the first height at which two chains differ. Every subtree entirely below the
+ * shorter chain's length is final on both nodes, so only those are compared and the
+ * result stays correct while the nodes keep appending
+ * @param peers the two nodes to compare
+ * @param prounds incremented once per round of requests to both nodes
+ * @return first differing height, which is the shorter chain's length when one is a
+ * prefix of the other, or -1 on failure
+ */
+static int64_t find_divergence(struct Peer * peers, unsigned * prounds) {
+    //empty requests learn each chain's length
+    for (int i = 0; i < 2; i++) {
+        if (fetch_nodes(&peers[i], 0, 0, 0, NULL) == -1) {
+            return -1;
+        }
+    }
+    (*prounds)++;
+
+    uint32_t common = peers[0].len < peers[1].len ? peers[0].len : peers[1].len;
+    if (common == 0) {
+        return 0;
+    }
+
+    //lowest level whose first node spans the common prefix
+    uint32_t level = 0;
+    while (((uint64_t)1 << level) < common) {
+        level++;
+    }
+
+    //Heights below index << level are known to match. Follow the leftmost differing child
+    uint32_t index = 0;
+    for (; level > 0; level--) {
+        uint32_t left = 2 * index;
+        if (((uint64_t)left + 1) << (level - 1) > common) {
+            index = left;
+            continue;
+        }
+        int match = nodes_match(peers, level - 1, left);
+        if (match == -1) {
+            return -1;
+        }
+        (*prounds)++;
+        index = match ? left + 1 : left;
+    }
+
+    if (index >= common) {
+        return common;
+    }
+    int match = nodes_match(peers, 0, index);
+    if (match == -1) {
+        return -1;
+    }
+    (*prounds)++;
+    return match ? index + 1 : index;
+}
+
+/**
+ * Compare a single node of both peers' trees
+ * @param peers the two nodes to compare
+ * @param level level of node
+ * @param index index of node within its level
+ * @return 1 if the hashes match, 0 if they differ, -1 on failure
+ */
+static int nodes_match(struct Peer * peers, uint32_t level, uint32_t index) {
+    uint64_t hashes[2];
+
+    for (int i = 0; i < 2; i++) {
+        if (fetch_nodes(&peers[i], level, index, 1, &hashes[i]) != 1) {
+            fprintf(stderr, "Compare: %s has no tree node %u of level %u\n", peers[i].name, index, level);
+            return -1;
+        }
+    }
+    return hashes[0] == hashes[1];
+}
+
+/**
+ * Fetch a run of tree nodes from a peer and note its chain length
+ * @param ppeer node to request from
+ * @param level level of nodes
+ * @param index index of first node within its level
+ * @param count max number of nodes. 0 only learns the chain length
+ * @param hashes array of at least count entries filled with node hashes
+ * @return number of hashes received, or -1 on failure
+ */
+static int fetch_nodes(struct Peer * ppeer, uint32_t level, uint32_t index, uint32_t count,
+        uint64_t * hashes) {
+    int n_hashes = request_tree_endpoint(ppeer->fd, level, index, count, hashes, &ppeer->len);
+    if (n_hashes == -1) {
+        fprintf(stderr, "Compare: tree request to %s failed\n", ppeer->name);
+        return -1;
+    }
+    ppeer->bytes += TREE_REQUEST_SZ + TREE_RESPONSE_SZ + n_hashes * sizeof(uint64_t);
+    return n_hashes;
+}
+
+/**
+ * Fetch every block of a peer's chain from a height onwards
+ * @param ppeer node to fetch from
+ * @param start first height to fetch
+ * @param pblocks set to number of blocks fetched
+ * @return 0 on success, -1 on failure
+ */
+static int fetch_suffix(struct Peer * ppeer, uint32_t start, uint32_t * pblocks) {
+    struct BlockChain blocks = initialise_chain();
+    unsigned n_requests = 0;
+    int n_blocks;
+
+    //linkage of the first block is unknown as the heights before it are not fetched
+    do {
+        uint32_t tip_hash = blocks.tail != NULL ? blocks.tail->block.hash : 0;
+        n_blocks = request_blocks_endpoint(ppeer->fd, start + blocks.len, MAX_PAYLOAD_RANGE,
+                blocks.tail != NULL ? &tip_hash : NULL, &blocks);
+        n_requests++;
+    } while (n_blocks == MAX_PAYLOAD_RANGE);
+
+    if (n_blocks == -1) {
+        fprintf(stderr, "Compare: failed to fetch blocks from %s\n", ppeer->name);
+        deinitialise_chain(&blocks);
+        return -1;
+    }
+
+    //each request and its leading count, then every block
+    ppeer->bytes += n_requests * (sizeof(uint8_t) + 3 * sizeof(uint32_t));
+    for (const struct Link * link = blocks.head; link != NULL; link = link->next) {
+        ppeer->bytes += BLOCK_WIRE_HEADER_SZ + (link->block.payload != NULL ? link->block.payload_len : 0);
+    }
+    *pblocks = blocks.len;
+    deinitialise_chain(&blocks);
+    return 0;
+}
@@ -0,0 +1,227 @@
+/**
+ * Duplicate payload filter for the ingest path. Remembers the hashes of the
+ * most recent payloads so client retries can be rejected before they are
+ * appended to the chain. The common case (a new payload) is answered by a
+ * Bloom filter probe, with an exact set only consulted on a Bloom hit.
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "dedup.h"
+#include "trace.h"
+
+#define BLOOM_BITS_PER_ENTRY 16 //~0.25% false positive rate per generation with 4 probes
+#define BLOOM_PROBES 4
+#define HASH_P1 0x9e3779b97f4a7c15ULL
+#define HASH_P2 0xc2b2ae3d27d4eb4fULL
+
+//Internal functions
+static uint64_t next_pow2(uint64_t x);
+static uint64_t mix64(uint64_t x);
+static void set_remove(struct DedupFilter * pfilter, uint64_t hash);
+
+/**
+ * Allocate filter able to remember window recent payloads
+ * @param pfilter filter to initialise
+ * @param window number of recent payload hashes to check against
+ * @return 0 on success, -1 on failure
+ */
+int initialise_dedup(struct DedupFilter * pfilter, uint32_t window) {
+    memset(pfilter, 0, sizeof(*pfilter));
+
+    if (window == 0) {
+        fprintf(stderr, "Dedup: window must be at least 1\n");
+        return -1;
+    }
+    pfilter->window = window;
+
+    uint64_t bloom_bits = next_pow2((uint64_t)window * BLOOM_BITS_PER_ENTRY);
+    bloom_bits = bloom_bits < 64 ? 64 : bloom_bits;
+    pfilter->bloom_mask = bloom_bits - 1;
+    pfilter->bloom[0] = calloc(bloom_bits / 64, sizeof(uint64_t));
+    pfilter->bloom[1] = calloc(bloom_bits / 64, sizeof(uint64_t));
+
+    //keep load factor at or below 50% so probe sequences stay short
+    uint64_t set_slots = next_pow2((uint64_t)window * 2);
+    pfilter->set_mask = set_slots - 1;
+    pfilter->set = calloc(set_slots, sizeof(uint64_t));
+    pfilter->recent = calloc(window, sizeof(uint64_t));
+
+    if (pfilter->bloom[0] == NULL || pfilter->bloom[1] == NULL ||
+            pfilter->set == NULL || pfilter->recent == NULL) {
+        fprintf(stderr, "Dedup: failed to allocate memory for filter\n");
+        deinitialise_dedup(pfilter);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Free memory held by filter
+ * @param pfilter filter to deinitialise
+ * @return void
+ */
+void deinitialise_dedup(struct DedupFilter * pfilter) {
+    free(pfilter->bloom[0]);
+    free(pfilter->bloom[1]);
+    free(pfilter->set);
+    free(pfilter->recent);
+    memset(pfilter, 0, sizeof(*pfilter));
+}
+
+/**
+ * Fast 64 bit hash of a payload, processed a word at a time. Never returns 0
+ * as the exact set uses 0 to mark empty slots
+ * @param payload bytes to hash
+ * @param len number of bytes
+ * @return hash of payload
+ */
+uint64_t hash_payload64(const char * payload, size_t len) {
+    uint64_t hash = HASH_P1 ^ (len * HASH_P2);
+    uint64_t word;
+    size_t i = 0;
+    uint64_t begin = trace_stage_begin();
+
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        memcpy(&word, payload + i, sizeof(uint64_t));
+        hash ^= word * HASH_P2;
+        hash = ((hash << 31) | (hash >> 33)) * HASH_P1;
+    }
+
+    //remaining tail bytes
+    word = 0;
+    memcpy(&word, payload + i, len - i);
+    hash ^= word * HASH_P2;
+
+    hash = mix64(hash);
+    trace_stage_end(TRACE_HASH, begin, 0);
+    return hash != 0 ? hash : 1;
+}
+
+/**
+ * Check whether a payload hash is in the window
+ * @param pfilter filter to check
+ * @param hash hash from hash_payload64
+ * @return 1 if hash was seen within the window, 0 otherwise
+ */
+int dedup_contains(const struct DedupFilter * pfilter, uint64_t hash) {
+    //Bloom probes use double hashing on two halves of the hash
+    uint64_t step = ((hash >> 32) | (hash << 32)) | 1;
+    int maybe[2] = {1, 1};
+
+    for (int i = 0; i < BLOOM_PROBES; i++) {
+        uint64_t bit = (hash + i * step) & pfilter->bloom_mask;
+        for (int gen = 0; gen < 2; gen++) {
+            if (!(pfilter->bloom[gen][bit / 64] & (1ULL << (bit % 64)))) {
+                maybe[gen] = 0;
+            }
+        }
+    }
+
+    //fast negative path
+    if (!maybe[0] && !maybe[1]) {
+        return 0;
+    }
+
+    for (uint64_t slot = hash & pfilter->set_mask; pfilter->set[slot] != 0;
+            slot = (slot + 1) & pfilter->set_mask) {
+        if (pfilter->set[slot] == hash) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Record a payload hash, evicting the oldest hash once the window is full.
+ * Only call for hashes dedup_contains reported as absent
+ * @param pfilter filter to insert into
+ * @param hash hash from hash_payload64
+ * @return void
+ */
+void dedup_insert(struct DedupFilter * pfilter, uint64_t hash) {
+    //Once a generation holds a full window, the previous one only holds hashes that
+    //have left the window, so it can be recycled
+    if (pfilter->bloom_count == pfilter->window) {
+        uint64_t * tmp = pfilter->bloom[1];
+        pfilter->bloom[1] = pfilter->bloom[0];
+        pfilter->bloom[0] = tmp;
+        memset(pfilter->bloom[0], 0, (pfilter->bloom_mask + 1) / 8);
+        pfilter->bloom_count = 0;
+    }
+
+    uint64_t step = ((hash >> 32) | (hash << 32)) | 1;
+    for (int i = 0; i < BLOOM_PROBES; i++) {
+        uint64_t bit = (hash + i * step) & pfilter->bloom_mask;
+        pfilter->bloom[0][bit / 64] |= 1ULL << (bit % 64);
+    }
+    pfilter->bloom_count++;
+
+    //evict oldest hash from exact set
+    if (pfilter->recent_count == pfilter->window) {
+        set_remove(pfilter, pfilter->recent[pfilter->recent_pos]);
+    } else {
+        pfilter->recent_count++;
+    }
+    pfilter->recent[pfilter->recent_pos] = hash;
+    pfilter->recent_pos = (pfilter->recent_pos + 1) % pfilter->window;
+
+    uint64_t slot = hash & pfilter->set_mask;
+    while (pfilter->set[slot] != 0) {
+        slot = (slot + 1) & pfilter->set_mask;
+    }
+    pfilter->set[slot] = hash;
+}
+
+/**
+ * Remove hash from exact set. Uses backward shift deletion so no tombstones
+ * accumulate in the linear probe sequences
+ */
+static void set_remove(struct DedupFilter * pfilter, uint64_t hash) {
+    uint64_t slot = hash & pfilter->set_mask;
+
+    while (pfilter->set[slot] != hash) {
+        if (pfilter->set[slot] == 0) {
+            return; //not present
+        }
+        slot = (slot + 1) & pfilter->set_mask;
+    }
+
+    //shift back any entries whose probe sequence passes through the freed slot
+    uint64_t hole = slot;
+    for (uint64_t next = (slot + 1) & pfilter->set_mask; pfilter->set[next] != 0;
+            next = (next + 1) & pfilter->set_mask) {
+        uint64_t home = pfilter->set[next] & pfilter->set_mask;
+        //entry can move if its home is not cyclically within (hole, next]
+        if (((next - home) & pfilter->set_mask) >= ((next - hole) & pfilter->set_mask)) {
+            pfilter->set[hole] = pfilter->set[next];
+            hole = next;
+        }
+    }
+    pfilter->set[hole] = 0;
+}
+
+/**
+ * Round up to next power of 2
+ */
+static uint64_t next_pow2(uint64_t x) {
+    uint64_t p = 1;
+    while (p < x) {
+        p <<= 1;
+    }
+    return p;
+}
+
+/**
+ * Final avalanche step from MurmurHash3
+ */
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
@@ -5,21 +5,84 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <endian.h>
 #include "endpoints.h"
 #include "block.h"
 #include "server.h"
+#include "requests.h"
+#include "trace.h"
+
+#define SEND_BATCH_SIZE 65536 //bytes of response coalesced into each send
+#define ACK_SZ (2 * sizeof(uint32_t)) //height and hash of an add block response
+#define ACKS_PER_SEND 1024 //consecutive acks to one client coalesced into each send
+#define ACK_QUEUE_INITIAL_CAP 64 //initial number of acks a queue holds
+#define TX_QUEUE_INITIAL_CAP 64 //initial number of transactions a queue holds
+
+//Coalesces small writes so endpoints pay one send per batch rather than one per field
+struct SendBatch {
+    int sockfd; //socket batch is flushed to
+    uint8_t * buf; //queued bytes
+    size_t len; //number of queued bytes
+    size_t cap; //bytes buf can hold. Grows past SEND_BATCH_SIZE only for blocks larger than it
+    struct PayloadBuf cold; //scratch for payloads read back from cold storage
+};
+
+//Chain endpoint response in progress, produced a batch at a time
+struct ChainStream {
+    struct SendBatch batch; //batch handed out by next_chain_batch
+    const struct Link * link; //next block to queue
+    uint32_t queued; //blocks queued so far
+    uint32_t len; //committed length of the chain when the stream started
+    int started; //set once the length has been queued
+};
 
 //Endpoint function typedef
-typedef enum endpoint_dispatch_retval (*endpoint_f)(int sockfd, struct BlockChain * pblock_chain);
+typedef enum endpoint_dispatch_retval (*endpoint_f)(int sockfd, struct EndpointContext * pctx);
 
 //Function prototypes
-static enum endpoint_dispatch_retval chain_endpoint(int sockfd, struct BlockChain * pblock_chain);
-static enum endpoint_dispatch_retval add_block_endpoint(int sockfd, struct BlockChain * pblock_chain);
+static enum endpoint_dispatch_retval chain_endpoint(int sockfd, struct EndpointContext * pctx);
+static enum endpoint_dispatch_retval add_block_endpoint(int sockfd, struct EndpointContext * pctx);
+static enum endpoint_dispatch_retval search_endpoint(int sockfd, struct EndpointContext * pctx);
+static enum endpoint_dispatch_retval headers_endpoint(int sockfd, struct EndpointContext * pctx);
+static enum endpoint_dispatch_retval payloads_endpoint(int sockfd, struct EndpointContext * pctx);
+static enum endpoint_dispatch_retval blocks_endpoint(int sockfd, struct EndpointContext * pctx);
+static enum endpoint_dispatch_retval tree_endpoint(int sockfd, struct EndpointContext * pctx);
+static enum endpoint_dispatch_retval window_endpoint(int sockfd, struct EndpointContext * pctx);
+static enum endpoint_dispatch_retval subscribe_endpoint(int sockfd, struct EndpointContext * pctx);
+static enum endpoint_dispatch_retval trace_endpoint(int sockfd, struct EndpointContext * pctx);
+static uint32_t committed_len(const struct EndpointContext * pctx);
+static int admit_request(int sockfd, struct EndpointContext * pctx, unsigned cost);
+static enum endpoint_dispatch_retval reject_request(int sockfd);
+static int discard_payload(int sockfd, uint32_t len);
+static enum endpoint_dispatch_retval append_payload(int sockfd, struct EndpointContext * pctx,
+        char * payload, uint32_t len, uint32_t payload_hash);
+static enum endpoint_dispatch_retval queue_transaction(int sockfd, struct EndpointContext * pctx,
+        char * payload, uint32_t len, uint32_t payload_hash);
+static int queue_ack(struct EndpointContext * pctx, int sockfd, uint32_t height, uint32_t hash);
+static int reserve_ack(struct AckQueue * packs);
+static int send_acks(struct EndpointContext * pctx, const struct PendingAck * acks, uint32_t n_acks,
+        int committed);
+static int batch_open(struct SendBatch * pbatch, int sockfd);
+static int batch_append(struct SendBatch * pbatch, const void * data, size_t len);
+static int batch_append_block(struct SendBatch * pbatch, const struct BlockChain * pblock_chain,
+        const struct Block * pblock);
+static int batch_yield(struct SendBatch * pbatch, struct EndpointContext * pctx);
+static int batch_flush(struct SendBatch * pbatch);
+static void batch_close(struct SendBatch * pbatch);
 
 //Define dispatch table of endpoints
 static endpoint_f ENDPOINT_DISPATCH_TABLE[] = {
     chain_endpoint, //Endpoint 0
-    add_block_endpoint //Endpoint 1
+    add_block_endpoint, //Endpoint 1
+    search_endpoint, //Endpoint 2
+    headers_endpoint, //Endpoint 3
+    payloads_endpoint, //Endpoint 4
+    blocks_endpoint, //Endpoint 5
+    tree_endpoint, //Endpoint 6
+    window_endpoint, //Endpoint 7
+    subscribe_endpoint, //Endpoint 8
+    trace_endpoint //Endpoint 9
 };
 
 //Store compile time number of endpoints for iteration
@@ -30,11 +93,11 @@ static size_t N_ENDPOINTS = sizeof(ENDPOINT_DISPATCH_TABLE)/sizeof(*ENDPOINT_DIS
  * executing pre-defined endpoints 
  * @param endpoint_id Unique id specifying which endpoint should be called
  * @param sockfd Open socket that requested the endpoint
- * @param head pointer to the head of the nodes chain
+ * @param pctx state of the node the endpoint operates on
  * @return Result status of endpoint call
  */
 enum endpoint_dispatch_retval endpoint_dispatch(unsigned int endpoint_id,
-        int sockfd, struct BlockChain * pblock_chain) {
+        int sockfd, struct EndpointContext * pctx) {
 
     if (endpoint_id >= N_ENDPOINTS) {
         fprintf(stderr, "Endpoints: Invalid endpoint: %d\n", endpoint_id);
@@ -42,51 +105,542 @@ enum endpoint_dispatch_retval endpoint_dispatch(unsigned int endpoint_id,
     }
     
     //Run desired endpoint
-    return ENDPOINT_DISPATCH_TABLE[endpoint_id](sockfd, pblock_chain);
+    TRACE_PROBE2(endpoint_start, endpoint_id, sockfd);
+    enum endpoint_dispatch_retval ret = ENDPOINT_DISPATCH_TABLE[endpoint_id](sockfd, pctx);
+    TRACE_PROBE3(endpoint_done, endpoint_id, sockfd, ret);
+    return ret;
+}
+
+/**
+ * Serve a single request from a socket that has pending data. Reads the endpoint id
+ * and dispatches to the requested endpoint
+ * @param sockfd Open socket with a pending request
+ * @param pctx state of the node
+ * @return 0 if the connection should be kept open, -1 if it should be dropped, 1 if it was
+ * handed off by the endpoint and must be forgotten without being closed
+ */
+int serve_request(int sockfd, struct EndpointContext * pctx) {
+    uint8_t endpoint_id;
+    struct TraceSpan span;
+    trace_begin_span(&span, sockfd);
+    //Read endpoint id to determine appropriate endpoint to run
+    int nbytes = receive_buf(sockfd, &endpoint_id, 1);
+
+    if (nbytes <= 0) {
+        // Got error or connection closed by client
+        trace_drop_span(&span);
+        return -1;
+    }
+    return serve_endpoint(endpoint_id, sockfd, pctx, &span);
+}
+
+/**
+ * Serve a request whose endpoint id has already been read. Shared by all of the node's
+ * I/O backends
+ * @param endpoint_id endpoint requested
+ * @param sockfd Open socket the request arrived on
+ * @param pctx state of the node
+ * @param pspan span begun for the request
+ * @return as for serve_request
+ */
+int serve_endpoint(uint8_t endpoint_id, int sockfd, struct EndpointContext * pctx,
+        struct TraceSpan * pspan) {
+    //Responses must not overtake add block acks still waiting on the group commit
+    if (endpoint_id != ENDPOINT_ADD_BLOCK && pctx->packs != NULL && pctx->packs->len > 0) {
+        commit_acks(pctx);
+    }
+
+    //Try to dispatch to the requested endpoint
+    enum endpoint_dispatch_retval ret = endpoint_dispatch(endpoint_id, sockfd, pctx);
+    return finish_request(endpoint_id, sockfd, ret, pspan);
+}
+
+/**
+ * Record the outcome of a request and decide what becomes of its connection
+ * @param endpoint_id endpoint requested
+ * @param sockfd socket the request arrived on
+ * @param ret result of the endpoint
+ * @param pspan span begun for the request
+ * @return as for serve_request
+ */
+int finish_request(uint8_t endpoint_id, int sockfd, enum endpoint_dispatch_retval ret,
+        struct TraceSpan * pspan) {
+    trace_end_span(pspan, endpoint_id, ret);
+
+    if (ret == DISPATCH_DETACHED) {
+        return 1;
+    }
+    //Rejected duplicates, transactions, writes to replicas and rate limited requests were fully
+    //read so the stream is still in sync
+    if (ret != DISPATCH_OK && ret != DISPATCH_DUPLICATE && ret != DISPATCH_RATE_LIMITED &&
+            ret != DISPATCH_UNVERIFIED && ret != DISPATCH_READ_ONLY) {
+        //If we do not receive OK response then drop the connection
+        fprintf(stderr, "Endpoints: Dropping connection: %d\n", sockfd);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Append a payload received by any ingest path to the chain. Applies the node's
+ * ingest policy (duplicate filtering) before appending and updates indexes after.
+ * The payload's allocation becomes the block's storage so it is never copied. The block
+ * is not served until a later commit_chain makes it durable
+ * @param pctx state of the node
+ * @param payload malloc'd null terminated payload. Always taken over; freed if not appended
+ * @param len length of payload excluding null char
+ * @param payload_hash hash of payload as computed while it was received. Sealed with the
+ * block's timestamp once it is appended
+ * @param pheight set to height of the new block. May be NULL
+ * @param phash set to hash of the new block. May be NULL
+ * @return DISPATCH_OK on success, DISPATCH_DUPLICATE if payload was recently added
+ */
+enum endpoint_dispatch_retval ingest_payload(struct EndpointContext * pctx,
+        char * payload, uint32_t len, uint32_t payload_hash, uint32_t * pheight, uint32_t * phash) {
+    uint64_t hash = 0;
+
+    //nothing appended after a failed journal could ever be committed
+    if (pctx->pjournal != NULL && journal_failed(pctx->pjournal)) {
+        fprintf(stderr, "Endpoints: Journal has failed, refusing to append\n");
+        free(payload);
+        return DISPATCH_UNKNOWN_ERR;
+    }
+
+    //hash outside the lock. Only the lookup and append are serialised
+    if (pctx->pdedup != NULL) {
+        hash = hash_payload64(payload, len);
+    }
+
+    //single point where the chain and its indexes are mutated
+    lock_chain_exclusive(pctx);
+    if (pctx->pdedup != NULL && dedup_contains(pctx->pdedup, hash)) {
+        unlock_chain(pctx);
+        free(payload);
+        fprintf(stderr, "Endpoints: Rejecting duplicate payload\n");
+        return DISPATCH_DUPLICATE;
+    }
+
+    //stamped under the lock so timestamps follow append order
+    uint64_t timestamp = next_timestamp(pctx->pblock_chain);
+    if (append_block(pctx->pblock_chain, payload, len, seal_hash(payload_hash, timestamp),
+                timestamp) != 0) {
+        unlock_chain(pctx);
+        free(payload);
+        return DISPATCH_UNKNOWN_ERR;
+    }
+
+    const struct Block * pblock = &pctx->pblock_chain->tail->block;
+    if (pheight != NULL) {
+        *pheight = pctx->pblock_chain->len - 1;
+    }
+    if (phash != NULL) {
+        *phash = pblock->hash;
+    }
+    //a failed record is reported when the block is committed
+    if (pctx->pjournal != NULL && journal_append(pctx->pjournal, pctx->pblock_chain, pblock) != 0) {
+        fprintf(stderr, "Endpoints: Failed to journal block\n");
+    }
+
+    //only remember payloads that made it onto the chain
+    if (pctx->pdedup != NULL) {
+        dedup_insert(pctx->pdedup, hash);
+    }
+
+    //Index failures leave the block unsearchable but the append itself succeeded
+    if (pctx->psearch != NULL && search_index_update(pctx->psearch, pctx->pblock_chain) != 0) {
+        fprintf(stderr, "Endpoints: Failed to index block payload\n");
+    }
+    //a tree or time index left behind is caught up by the endpoint querying it
+    if (pctx->ptree != NULL && range_tree_update(pctx->ptree, pctx->pblock_chain) != 0) {
+        fprintf(stderr, "Endpoints: Failed to add block to range tree\n");
+    }
+    if (pctx->ptime != NULL && time_index_update(pctx->ptime, pctx->pblock_chain) != 0) {
+        fprintf(stderr, "Endpoints: Failed to add block to time index\n");
+    }
+    //published to subscribers by commit_chain once it is durable
+    unlock_chain(pctx);
+    return DISPATCH_OK;
+}
+
+/**
+ * Append blocks a read replica fetched from its primary. Blocks were verified against each
+ * other and the replica's tip when received so only the tip having moved is checked here
+ * @param pctx state of the replica
+ * @param pblocks blocks fetched from the primary. Their payloads are moved onto the chain
+ * @param height height of the replica's chain when the blocks were requested
+ * @return DISPATCH_OK on success, DISPATCH_INVALID_ARGS if the chain moved since the request
+ */
+enum endpoint_dispatch_retval replicate_blocks(struct EndpointContext * pctx,
+        struct BlockChain * pblocks, uint32_t height) {
+    enum endpoint_dispatch_retval ret = DISPATCH_OK;
+
+    if (pctx->pjournal != NULL && journal_failed(pctx->pjournal)) {
+        fprintf(stderr, "Endpoints: Journal has failed, refusing to replicate\n");
+        return DISPATCH_UNKNOWN_ERR;
+    }
+    lock_chain_exclusive(pctx);
+    if (pctx->pblock_chain->len != height) {
+        unlock_chain(pctx);
+        fprintf(stderr, "Endpoints: Chain moved while replicating at height %u\n", height);
+        return DISPATCH_INVALID_ARGS;
+    }
+
+    for (struct Link * link = pblocks->head; link != NULL && ret == DISPATCH_OK; link = link->next) {
+        struct Block * pblock = &link->block;
+        if (pblock->payload == NULL) {
+            ret = append_header(pctx->pblock_chain, pblock) == 0 ? DISPATCH_OK : DISPATCH_UNKNOWN_ERR;
+        } else if (append_block(pctx->pblock_chain, pblock->payload, pblock->payload_len,
+                    pblock->hash, pblock->timestamp) == 0) {
+            pblock->payload = NULL; //now owned by the node's chain
+        } else {
+            ret = DISPATCH_UNKNOWN_ERR;
+        }
+        if (ret == DISPATCH_OK && pctx->pjournal != NULL &&
+                journal_append(pctx->pjournal, pctx->pblock_chain, &pctx->pblock_chain->tail->block) != 0) {
+            fprintf(stderr, "Endpoints: Failed to journal replicated block\n");
+        }
+    }
+
+    if (pctx->psearch != NULL && search_index_update(pctx->psearch, pctx->pblock_chain) != 0) {
+        fprintf(stderr, "Endpoints: Failed to index block payload\n");
+    }
+    if (pctx->ptree != NULL && range_tree_update(pctx->ptree, pctx->pblock_chain) != 0) {
+        fprintf(stderr, "Endpoints: Failed to add block to range tree\n");
+    }
+    if (pctx->ptime != NULL && time_index_update(pctx->ptime, pctx->pblock_chain) != 0) {
+        fprintf(stderr, "Endpoints: Failed to add block to time index\n");
+    }
+    unlock_chain(pctx);
+
+    //the whole fetched batch is committed with one sync
+    if (commit_chain(pctx) != 0) {
+        fprintf(stderr, "Endpoints: Failed to commit replicated blocks\n");
+        return DISPATCH_UNKNOWN_ERR;
+    }
+    return ret;
+}
+
+/**
+ * Make every block appended so far durable then publish them to subscribers. Blocks are
+ * only served, published or acknowledged once committed, so a failed sync leaves nothing
+ * visible that a restart would lose
+ * @param pctx state of the node whose chain to commit
+ * @return 0 on success, -1 if the journal failed to sync
+ */
+int commit_chain(struct EndpointContext * pctx) {
+    if (pctx->pjournal != NULL && journal_sync(pctx->pjournal) != 0) {
+        return -1;
+    }
+    //subscribers are only queued frames so this never waits on their sockets
+    if (pctx->psubs != NULL) {
+        lock_chain_shared(pctx);
+        publish_blocks(pctx->psubs, pctx->pblock_chain, committed_len(pctx));
+        unlock_chain(pctx);
+    }
+    return 0;
+}
+
+/**
+ * Group commit. Makes every block appended so far durable with a single journal sync and
+ * publishes them, then releases all held add block responses together. Called by each reactor once per event loop
+ * iteration so the cost of a sync is shared by every block added during the iteration
+ * @param pctx state of the node whose held responses to release
+ * @return number of responses released
+ */
+int commit_acks(struct EndpointContext * pctx) {
+    struct AckQueue * packs = pctx->packs;
+
+    //held transactions are appended first so their blocks are part of this commit
+    verify_pending(pctx);
+    if (packs == NULL || packs->len == 0) {
+        return 0;
+    }
+    int committed = commit_chain(pctx) == 0;
+
+    //consecutive responses to the same client leave in one send
+    uint32_t start = 0;
+    for (uint32_t i = 1; i <= packs->len; i++) {
+        if (i == packs->len || i - start == ACKS_PER_SEND ||
+                packs->acks[i].sockfd != packs->acks[start].sockfd) {
+            send_acks(pctx, packs->acks + start, i - start, committed);
+            start = i;
+        }
+    }
+
+    int released = packs->len;
+    packs->len = 0;
+    return released;
+}
+
+/**
+ * Discard held responses of a client being dropped so they are never sent to a later client
+ * that is handed the same fd
+ * @param pctx state of the node holding the responses
+ * @param sockfd client being dropped
+ * @return void
+ */
+void cancel_acks(struct EndpointContext * pctx, int sockfd) {
+    struct AckQueue * packs = pctx->packs;
+
+    if (packs == NULL) {
+        return;
+    }
+    //transactions refer to their responses by index so are settled before any are removed.
+    //A client dropping after sending a transaction still has it appended, as without batching
+    verify_pending(pctx);
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < packs->len; i++) {
+        if (packs->acks[i].sockfd != sockfd) {
+            packs->acks[kept++] = packs->acks[i];
+        }
+    }
+    packs->len = kept;
+}
+
+/**
+ * Free memory held by an ack queue. Held responses are discarded
+ * @param packs queue to free
+ * @return void
+ */
+void free_ack_queue(struct AckQueue * packs) {
+    free(packs->acks);
+    packs->acks = NULL;
+    packs->len = packs->cap = 0;
+}
+
+/**
+ * Verify every transaction held by a reactor as one batch then append those whose
+ * signature holds in the order they arrived. Each transaction's reserved response is
+ * filled in with its block or the reason it was refused
+ * @param pctx state of the node whose held transactions to verify
+ * @return void
+ */
+void verify_pending(struct EndpointContext * pctx) {
+    struct TxQueue * ptxs = pctx->ptxs;
+    uint32_t height, hash;
+
+    if (ptxs == NULL || ptxs->len == 0) {
+        return;
+    }
+    verify_batch(pctx->pverifier, ptxs->jobs, ptxs->len);
+
+    for (uint32_t i = 0; i < ptxs->len; i++) {
+        struct PendingTx * ptx = &ptxs->txs[i];
+        struct PendingAck * pack = &pctx->packs->acks[ptx->ack];
+        if (!ptxs->jobs[i].valid) {
+            fprintf(stderr, "Endpoints: Rejecting transaction with bad signature from %d\n",
+                    pack->sockfd);
+            free(ptx->payload);
+            continue;
+        }
+        enum endpoint_dispatch_retval ret = ingest_payload(pctx, ptx->payload, ptx->len,
+                ptx->payload_hash, &height, &hash);
+        if (ret == DISPATCH_OK) {
+            pack->height = height;
+            pack->hash = hash;
+            printf("Endpoints: block added successfully\n");
+        } else {
+            pack->height = ret == DISPATCH_DUPLICATE ? ADD_BLOCK_DUPLICATE : ADD_BLOCK_FAILED;
+        }
+    }
+    ptxs->len = 0;
+}
+
+/**
+ * Free memory held by a transaction queue. Held transactions are discarded
+ * @param ptxs queue to free
+ * @return void
+ */
+void free_tx_queue(struct TxQueue * ptxs) {
+    for (uint32_t i = 0; i < ptxs->len; i++) {
+        free(ptxs->txs[i].payload);
+    }
+    free(ptxs->txs);
+    free(ptxs->jobs);
+    ptxs->txs = NULL;
+    ptxs->jobs = NULL;
+    ptxs->len = ptxs->cap = 0;
+}
+
+/**
+ * Take the chain lock for reading. Any number of readers may hold it at once.
+ * No-op when the node is single threaded
+ * @param pctx state of the node
+ * @return void
+ */
+void lock_chain_shared(struct EndpointContext * pctx) {
+    if (pctx->plock != NULL) {
+        pthread_rwlock_rdlock(pctx->plock);
+    }
+}
+
+/**
+ * Take the chain lock for writing. Required to append, prune or update indexes.
+ * No-op when the node is single threaded
+ * @param pctx state of the node
+ * @return void
+ */
+void lock_chain_exclusive(struct EndpointContext * pctx) {
+    if (pctx->plock != NULL) {
+        pthread_rwlock_wrlock(pctx->plock);
+    }
+}
+
+/**
+ * Release chain lock taken with lock_chain_shared or lock_chain_exclusive
+ * @param pctx state of the node
+ * @return void
+ */
+void unlock_chain(struct EndpointContext * pctx) {
+    if (pctx->plock != NULL) {
+        pthread_rwlock_unlock(pctx->plock);
+    }
 }
 
 /**
  * Internal chain endpoint. Transmits entire block chain with pre-defined bit stream structure
  * @param sockfd Open socket that requested the endpoint
- * @param pblock_chain block chain to transmit
+ * @param pctx state of the node whose chain is transmitted
  * @return execution result of endpoint
  */
-static enum endpoint_dispatch_retval chain_endpoint(int sockfd, struct BlockChain * pblock_chain) {
-    uint8_t *buf = NULL; //set to NULL to allocate initial memory
+static enum endpoint_dispatch_retval chain_endpoint(int sockfd, struct EndpointContext * pctx) {
+    struct ChainStream * pstream;
+    const uint8_t * buf;
     size_t len;
-    int32_t nbytes;
-    
-    //Send chain length
-    uint32_t network_chain_length = htonl(pblock_chain->len);
-    if ((nbytes = send_buf(sockfd, (uint8_t*)&network_chain_length, sizeof(uint32_t))) == -1) {
+    int more;
+
+    enum endpoint_dispatch_retval ret = open_chain_stream(sockfd, pctx, &pstream);
+    if (ret == DISPATCH_RATE_LIMITED) {
+        return reject_request(sockfd);
+    }
+    if (ret != DISPATCH_OK) {
+        return ret;
+    }
+    while ((more = next_chain_batch(pctx, pstream, &buf, &len)) == 1) {
+        if (send_buf(sockfd, buf, len) == -1) {
+            more = -1;
+            break;
+        }
+    }
+    close_chain_stream(pctx, pstream);
+    if (more != 0) {
         return DISPATCH_SEND_FAIL;
     }
+    
+    printf("Endpoints: chain transmitted successfully\n");
+    return DISPATCH_OK;
+}
 
-    for (const struct Link* link = pblock_chain->head; link != NULL; link = link->next) {
-        pack_block(link->block, &buf, &len);
-        if (buf == NULL) {
-            return DISPATCH_UNKNOWN_ERR;
+/**
+ * Begin a chain endpoint response. Full transfers are capped in how many may run at once and
+ * charged more. The cap is checked first so clients it turns away keep their tokens
+ * @param sockfd Open socket that requested the endpoint
+ * @param pctx state of the node whose chain is transmitted
+ * @param ppstream set to the stream to take batches from and close with close_chain_stream
+ * @return DISPATCH_OK on success, DISPATCH_RATE_LIMITED if the request was refused and the
+ * rejection marker must be sent in place of the chain, another error on failure
+ */
+enum endpoint_dispatch_retval open_chain_stream(int sockfd, struct EndpointContext * pctx,
+        struct ChainStream ** ppstream) {
+    if (pctx->padmission != NULL && admission_acquire_stream(pctx->padmission) != 0) {
+        fprintf(stderr, "Endpoints: Too many chain streams in flight, rejecting %d\n", sockfd);
+        return DISPATCH_RATE_LIMITED;
+    }
+    if (admit_request(sockfd, pctx, ADMISSION_COST_CHAIN) != 0) {
+        if (pctx->padmission != NULL) {
+            admission_release_stream(pctx->padmission);
         }
-        if ((nbytes = send_buf(sockfd, buf, len)) == -1) {
-                return DISPATCH_SEND_FAIL;
+        return DISPATCH_RATE_LIMITED;
+    }
+
+    struct ChainStream * pstream = malloc(sizeof(struct ChainStream));
+    if (pstream == NULL || batch_open(&pstream->batch, sockfd) != 0) {
+        fprintf(stderr, "Endpoints: failed to allocate chain stream\n");
+        free(pstream);
+        if (pctx->padmission != NULL) {
+            admission_release_stream(pctx->padmission);
         }
+        return DISPATCH_UNKNOWN_ERR;
     }
-    
-    printf("Endpoints: chain transmitted successfully\n");
-    //once done transmitting, free buffer
-    free(buf);
+    pstream->link = NULL;
+    pstream->queued = 0;
+    pstream->len = 0;
+    pstream->started = 0;
+    *ppstream = pstream;
     return DISPATCH_OK;
 }
 
 /**
- * Internal add_block endpoint. Reads in transmitted payload and appends link to the chain
+ * Produce the next batch of a chain response: the length of the chain followed by every
+ * block. The chain lock is only held while a batch is filled, so appends are not held off
+ * for the whole stream and the batch can be sent however long that takes. Links below the
+ * length read at the start stay valid while the lock is released
+ * @param pctx state of the node whose chain is transmitted
+ * @param pstream stream from open_chain_stream
+ * @param pbuf set to the batch. Valid until the next call
+ * @param plen set to length of the batch
+ * @return 1 if a batch was produced, 0 once the whole chain has been, -1 on failure
+ */
+int next_chain_batch(struct EndpointContext * pctx, struct ChainStream * pstream,
+        const uint8_t ** pbuf, size_t * plen) {
+    const struct BlockChain * pblock_chain = pctx->pblock_chain;
+    struct SendBatch * pbatch = &pstream->batch;
+
+    if (pstream->started && pstream->queued == pstream->len) {
+        return 0;
+    }
+    pbatch->len = 0;
+    lock_chain_shared(pctx);
+    //Chain length leads the stream. Blocks appended while it is sent are left for the next request
+    if (!pstream->started) {
+        pstream->len = committed_len(pctx);
+        pstream->link = pblock_chain->head;
+        pstream->started = 1;
+        uint32_t network_chain_length = htonl(pstream->len);
+        if (batch_append(pbatch, &network_chain_length, sizeof(uint32_t)) != 0) {
+            unlock_chain(pctx);
+            return -1;
+        }
+    }
+    while (pstream->queued < pstream->len && pbatch->len < SEND_BATCH_SIZE) {
+        if (batch_append_block(pbatch, pblock_chain, &pstream->link->block) != 0) {
+            unlock_chain(pctx);
+            return -1;
+        }
+        pstream->link = pstream->link->next;
+        pstream->queued++;
+    }
+    unlock_chain(pctx);
+
+    *pbuf = pbatch->buf;
+    *plen = pbatch->len;
+    return 1;
+}
+
+/**
+ * Finish a chain response, whether or not every batch was sent
+ * @param pctx state of the node whose chain was transmitted
+ * @param pstream stream from open_chain_stream. Freed
+ * @return void
+ */
+void close_chain_stream(struct EndpointContext * pctx, struct ChainStream * pstream) {
+    batch_close(&pstream->batch);
+    free(pstream);
+    if (pctx->padmission != NULL) {
+        admission_release_stream(pctx->padmission);
+    }
+}
+
+/**
+ * Internal add_block endpoint. Streams transmitted payload into its block's storage and
+ * appends link to the chain. Responds with the block's height and hash once it is durable,
+ * which with an ack queue is at the reactor's next group commit
  * @param sockfd Open socket that requested the endpoint
- @ @param pblock_chain block chain to append to
+ * @param pctx state of the node whose chain is appended to
  * @return execution result of adding block
  */
-static enum endpoint_dispatch_retval add_block_endpoint(int sockfd, struct BlockChain * pblock_chain) {
-    char payload_buf[TOTAL_PAYLOAD_LEN];
-    uint16_t network_payload_sz, payload_sz;
+static enum endpoint_dispatch_retval add_block_endpoint(int sockfd, struct EndpointContext * pctx) {
+    uint32_t network_payload_sz, payload_sz, payload_hash;
 
     //Read length of payload from sock
     int ret = receive_buf(sockfd, &network_payload_sz, sizeof(payload_sz));
@@ -95,26 +649,978 @@ static enum endpoint_dispatch_retval add_block_endpoint(int sockfd, struct Block
         return DISPATCH_RECV_FAIL;
     }
     //convert to host byte-order
-    payload_sz = ntohs(network_payload_sz); 
-    
+    payload_sz = ntohl(network_payload_sz); 
+
+    enum endpoint_dispatch_retval admitted = admit_add_block(sockfd, pctx, payload_sz);
+    if (admitted == DISPATCH_RATE_LIMITED || admitted == DISPATCH_READ_ONLY) {
+        return discard_payload(sockfd, payload_sz) == 0 ? admitted : DISPATCH_RECV_FAIL;
+    }
+    if (admitted != DISPATCH_OK) {
+        return admitted;
+    }
+
+    //receive in chunks straight into the allocation the block keeps, hashing as it arrives
+    char * payload = receive_payload(sockfd, payload_sz, &payload_hash);
+    if (payload == NULL) {
+        return DISPATCH_RECV_FAIL;
+    }
+    return add_received_block(sockfd, pctx, payload, payload_sz, payload_hash);
+}
+
+/**
+ * Decide whether the payload of an add block request is taken, before any of it is read.
+ * Admitted before the body is read so a rate limited client never gets a payload allocated.
+ * Rejections are queued like acks so they keep their place among the client's responses
+ * @param sockfd client adding the block
+ * @param pctx state of the node
+ * @param payload_sz length of payload the client announced
+ * @return DISPATCH_OK to read the payload, DISPATCH_RATE_LIMITED or DISPATCH_READ_ONLY if it
+ * was refused and must be read and dropped, another error if the connection must be dropped
+ */
+enum endpoint_dispatch_retval admit_add_block(int sockfd, struct EndpointContext * pctx,
+        uint32_t payload_sz) {
     if (payload_sz > MAX_PAYLOAD) {
-        fprintf(stderr, "Endpoints: Specified payload size %d larger than max allowed payload %d\n",
+        fprintf(stderr, "Endpoints: Specified payload size %u larger than max allowed payload %d\n",
                 payload_sz, MAX_PAYLOAD);
         return DISPATCH_INVALID_ARGS;
     }
+    //replicas only take blocks from their primary
+    if (pctx->read_only) {
+        fprintf(stderr, "Endpoints: Node is a read replica, refusing write from %d\n", sockfd);
+        return queue_ack(pctx, sockfd, ADD_BLOCK_READ_ONLY, 0) == 0 ?
+            DISPATCH_READ_ONLY : DISPATCH_SEND_FAIL;
+    }
+    if (admit_request(sockfd, pctx, ADMISSION_COST_ADD_BLOCK) != 0) {
+        fprintf(stderr, "Endpoints: Rate limited, rejecting payload from %d\n", sockfd);
+        return queue_ack(pctx, sockfd, ADMISSION_REJECTED, 0) == 0 ?
+            DISPATCH_RATE_LIMITED : DISPATCH_SEND_FAIL;
+    }
+    return DISPATCH_OK;
+}
 
-    //attempt to read that many bytes into a static buffer (make it the size of the payload)
-    ret = receive_buf(sockfd, payload_buf, payload_sz);
-    if (ret <= 0) {
+/**
+ * Add a payload admitted by admit_add_block once it has been read in full
+ * @param sockfd client that sent the payload
+ * @param pctx state of the node
+ * @param payload malloc'd null terminated payload. Always taken over
+ * @param len length of payload excluding null char
+ * @param payload_hash hash of payload computed as it was received
+ * @return execution result of adding block
+ */
+enum endpoint_dispatch_retval add_received_block(int sockfd, struct EndpointContext * pctx,
+        char * payload, uint32_t len, uint32_t payload_hash) {
+    //signed transactions are only appended once their signature is checked
+    if (pctx->pverifier != NULL) {
+        return queue_transaction(sockfd, pctx, payload, len, payload_hash);
+    }
+    return append_payload(sockfd, pctx, payload, len, payload_hash);
+}
+
+
+/**
+ * Internal search endpoint. Reads a query and transmits the height and block of
+ * every match found in the payload search index
+ * @param sockfd Open socket that requested the endpoint
+ * @param pctx state of the node whose chain is searched
+ * @return execution result of endpoint
+ */
+static enum endpoint_dispatch_retval search_endpoint(int sockfd, struct EndpointContext * pctx) {
+    char query_buf[SEARCH_MAX_QUERY + 1];
+    uint32_t results[SEARCH_MAX_RESULTS + 1];
+    uint16_t network_query_len, query_len;
+    uint8_t mode;
+    struct SendBatch batch;
+
+    //Read search mode and query
+    if (receive_buf(sockfd, &mode, sizeof(mode)) <= 0 ||
+            receive_buf(sockfd, &network_query_len, sizeof(network_query_len)) <= 0) {
+        return DISPATCH_RECV_FAIL;
+    }
+    query_len = ntohs(network_query_len);
+
+    if (query_len > SEARCH_MAX_QUERY) {
+        fprintf(stderr, "Endpoints: Specified query size %d larger than max allowed query %d\n",
+                query_len, SEARCH_MAX_QUERY);
+        return DISPATCH_INVALID_ARGS;
+    }
+    //a close part way through the query must not be taken for the whole query
+    if (query_len > 0 && receive_buf(sockfd, query_buf, query_len) <= 0) {
         return DISPATCH_RECV_FAIL;
     }
-    //Add null termination
-    payload_buf[payload_sz] = '\0';
 
-    if (add_block(pblock_chain, payload_buf) != 0) {
+    if (pctx->psearch == NULL) {
+        fprintf(stderr, "Endpoints: Search index is disabled on this node\n");
+        return DISPATCH_INVALID_ENDPOINT;
+    }
+    if (mode > SEARCH_SUBSTRING) {
+        fprintf(stderr, "Endpoints: Invalid search mode: %d\n", mode);
+        return DISPATCH_INVALID_ARGS;
+    }
+    if (admit_request(sockfd, pctx, ADMISSION_COST_SEARCH) != 0) {
+        return reject_request(sockfd);
+    }
+
+    //catch up with blocks appended outside of ingest_payload
+    lock_chain_shared(pctx);
+    if (pctx->psearch->indexed < pctx->pblock_chain->len) {
+        unlock_chain(pctx);
+        lock_chain_exclusive(pctx);
+        int update_ret = search_index_update(pctx->psearch, pctx->pblock_chain);
+        unlock_chain(pctx);
+        if (update_ret != 0) {
+            return DISPATCH_UNKNOWN_ERR;
+        }
+        lock_chain_shared(pctx);
+    }
+    //one match beyond the limit shows the client it was sent only part of them
+    int n_results = search_index_query(pctx->psearch, pctx->pblock_chain, mode,
+            query_buf, query_len, results, SEARCH_MAX_RESULTS + 1);
+    //matches are in height order, so blocks not yet committed are at the end
+    uint32_t chain_len = committed_len(pctx);
+    while (n_results > 0 && results[n_results - 1] >= chain_len) {
+        n_results--;
+    }
+    uint32_t truncated = 0;
+    if (n_results > SEARCH_MAX_RESULTS) {
+        n_results = SEARCH_MAX_RESULTS;
+        truncated = SEARCH_TRUNCATED_FLAG;
+    }
+
+    if (batch_open(&batch, sockfd) != 0) {
+        unlock_chain(pctx);
         return DISPATCH_UNKNOWN_ERR;
     }
+
+    //Number of matches, then height and block of each
+    uint32_t network_u32 = htonl((uint32_t)n_results | truncated);
+    int ret = batch_append(&batch, &network_u32, sizeof(uint32_t));
+    for (int i = 0; i < n_results && ret == 0; i++) {
+        network_u32 = htonl(results[i]);
+        ret = batch_append(&batch, &network_u32, sizeof(uint32_t));
+        if (ret == 0) {
+            ret = batch_append_block(&batch, pctx->pblock_chain,
+                    &get_link(pctx->pblock_chain, results[i])->block);
+        }
+        if (ret == 0 && batch_yield(&batch, pctx) != 0) {
+            batch_close(&batch);
+            return DISPATCH_SEND_FAIL;
+        }
+    }
+    unlock_chain(pctx);
+    if (ret == 0) {
+        ret = batch_flush(&batch);
+    }
+    batch_close(&batch);
+
+    if (ret != 0) {
+        return DISPATCH_SEND_FAIL;
+    }
+    printf("Endpoints: search returned %d matches\n", n_results);
+    return DISPATCH_OK;
+}
+
+/**
+ * Internal headers endpoint. Transmits the compact header of every block so a syncing
+ * client can verify linkage before fetching any payloads
+ * @param sockfd Open socket that requested the endpoint
+ * @param pctx state of the node whose headers are transmitted
+ * @return execution result of endpoint
+ */
+static enum endpoint_dispatch_retval headers_endpoint(int sockfd, struct EndpointContext * pctx) {
+    const struct BlockChain * pblock_chain = pctx->pblock_chain;
+    struct SendBatch batch;
+
+    if (admit_request(sockfd, pctx, ADMISSION_COST_HEADERS) != 0) {
+        return reject_request(sockfd);
+    }
+    if (batch_open(&batch, sockfd) != 0) {
+        return DISPATCH_UNKNOWN_ERR;
+    }
+
+    lock_chain_shared(pctx);
+    //Number of headers, then prev hash, hash, payload length and timestamp of each
+    uint32_t chain_len = committed_len(pctx);
+    uint32_t network_u32 = htonl(chain_len);
+    int ret = batch_append(&batch, &network_u32, sizeof(uint32_t));
+    const struct Link * link = pblock_chain->head;
+    for (uint32_t i = 0; i < chain_len && ret == 0; i++, link = link->next) {
+        uint8_t header[3 * sizeof(uint32_t) + sizeof(uint64_t)];
+        uint32_t net_prev_hash = htonl(link->block.prev_hash);
+        uint32_t net_hash = htonl(link->block.hash);
+        uint32_t net_payload_len = htonl(link->block.payload_len);
+        uint64_t net_timestamp = htobe64(link->block.timestamp);
+        memcpy(header, &net_prev_hash, sizeof(uint32_t));
+        memcpy(header + sizeof(uint32_t), &net_hash, sizeof(uint32_t));
+        memcpy(header + 2 * sizeof(uint32_t), &net_payload_len, sizeof(uint32_t));
+        memcpy(header + 3 * sizeof(uint32_t), &net_timestamp, sizeof(uint64_t));
+        ret = batch_append(&batch, header, sizeof(header));
+        if (ret == 0 && batch_yield(&batch, pctx) != 0) {
+            batch_close(&batch);
+            return DISPATCH_SEND_FAIL;
+        }
+    }
+    unlock_chain(pctx);
+
+    if (ret == 0) {
+        ret = batch_flush(&batch);
+    }
+    batch_close(&batch);
+
+    if (ret != 0) {
+        return DISPATCH_SEND_FAIL;
+    }
+    printf("Endpoints: headers transmitted successfully\n");
+    return DISPATCH_OK;
+}
+
+/**
+ * Internal payloads endpoint. Reads a height range and transmits the payload of each block
+ * in it. Payloads the node no longer holds are flagged as pruned and not sent
+ * @param sockfd Open socket that requested the endpoint
+ * @param pctx state of the node whose payloads are transmitted
+ * @return execution result of endpoint
+ */
+static enum endpoint_dispatch_retval payloads_endpoint(int sockfd, struct EndpointContext * pctx) {
+    uint32_t network_start, network_count;
+    struct SendBatch batch;
+
+    if (receive_buf(sockfd, &network_start, sizeof(network_start)) <= 0 ||
+            receive_buf(sockfd, &network_count, sizeof(network_count)) <= 0) {
+        return DISPATCH_RECV_FAIL;
+    }
+    uint32_t start = ntohl(network_start);
+    uint32_t count = ntohl(network_count);
+
+    if (count > MAX_PAYLOAD_RANGE) {
+        fprintf(stderr, "Endpoints: Requested payload range %u larger than max allowed range %d\n",
+                count, MAX_PAYLOAD_RANGE);
+        return DISPATCH_INVALID_ARGS;
+    }
+    if (admit_request(sockfd, pctx, ADMISSION_COST_PAYLOADS) != 0) {
+        return reject_request(sockfd);
+    }
+    if (batch_open(&batch, sockfd) != 0) {
+        return DISPATCH_UNKNOWN_ERR;
+    }
+
+    lock_chain_shared(pctx);
+    const struct BlockChain * pblock_chain = pctx->pblock_chain;
+    //Clamp range to the committed chain. Client learns how many were sent from the count
+    uint32_t chain_len = committed_len(pctx);
+    if (start > chain_len) {
+        start = chain_len;
+    }
+    if (count > chain_len - start) {
+        count = chain_len - start;
+    }
+
+    //Number of payloads, then length and bytes of each
+    uint32_t network_u32 = htonl(count);
+    int ret = batch_append(&batch, &network_u32, sizeof(uint32_t));
+    for (uint32_t i = 0; i < count && ret == 0; i++) {
+        const struct Block * pblock = &get_link(pblock_chain, start + i)->block;
+        uint32_t payload_len = pblock->payload_len;
+        uint64_t begin = trace_stage_begin();
+        const char * payload = view_payload(pblock_chain, pblock, &batch.cold);
+        trace_stage_end(TRACE_PACK, begin, 0);
+        if (payload == NULL) {
+            payload_len |= PAYLOAD_PRUNED_FLAG;
+        }
+        network_u32 = htonl(payload_len);
+        ret = batch_append(&batch, &network_u32, sizeof(uint32_t));
+        if (ret == 0 && payload != NULL) {
+            ret = batch_append(&batch, payload, pblock->payload_len);
+        }
+        if (ret == 0 && batch_yield(&batch, pctx) != 0) {
+            batch_close(&batch);
+            return DISPATCH_SEND_FAIL;
+        }
+    }
+    unlock_chain(pctx);
+
+    if (ret == 0) {
+        ret = batch_flush(&batch);
+    }
+    batch_close(&batch);
+
+    if (ret != 0) {
+        return DISPATCH_SEND_FAIL;
+    }
+    return DISPATCH_OK;
+}
+
+/**
+ * Internal blocks endpoint. Reads a start height and count and transmits every block in
+ * that range. Lets read replicas tail the chain by repeatedly asking for blocks past their tip
+ * @param sockfd Open socket that requested the endpoint
+ * @param pctx state of the node whose blocks are transmitted
+ * @return execution result of endpoint
+ */
+static enum endpoint_dispatch_retval blocks_endpoint(int sockfd, struct EndpointContext * pctx) {
+    uint32_t network_start, network_count;
+    struct SendBatch batch;
+
+    if (receive_buf(sockfd, &network_start, sizeof(network_start)) <= 0 ||
+            receive_buf(sockfd, &network_count, sizeof(network_count)) <= 0) {
+        return DISPATCH_RECV_FAIL;
+    }
+    uint32_t start = ntohl(network_start);
+    uint32_t count = ntohl(network_count);
+
+    if (count > MAX_PAYLOAD_RANGE) {
+        fprintf(stderr, "Endpoints: Requested block range %u larger than max allowed range %d\n",
+                count, MAX_PAYLOAD_RANGE);
+        return DISPATCH_INVALID_ARGS;
+    }
+    if (admit_request(sockfd, pctx, ADMISSION_COST_BLOCKS) != 0) {
+        return reject_request(sockfd);
+    }
+    if (batch_open(&batch, sockfd) != 0) {
+        return DISPATCH_UNKNOWN_ERR;
+    }
+
+    lock_chain_shared(pctx);
+    const struct BlockChain * pblock_chain = pctx->pblock_chain;
+    //Clamp range to the committed chain. Caught up clients get an empty range
+    uint32_t chain_len = committed_len(pctx);
+    if (start > chain_len) {
+        start = chain_len;
+    }
+    if (count > chain_len - start) {
+        count = chain_len - start;
+    }
+
+    uint32_t network_u32 = htonl(count);
+    int ret = batch_append(&batch, &network_u32, sizeof(uint32_t));
+    for (uint32_t i = 0; i < count && ret == 0; i++) {
+        ret = batch_append_block(&batch, pblock_chain, &get_link(pblock_chain, start + i)->block);
+        if (ret == 0 && batch_yield(&batch, pctx) != 0) {
+            batch_close(&batch);
+            return DISPATCH_SEND_FAIL;
+        }
+    }
+    unlock_chain(pctx);
+
+    if (ret == 0) {
+        ret = batch_flush(&batch);
+    }
+    batch_close(&batch);
+
+    if (ret != 0) {
+        return DISPATCH_SEND_FAIL;
+    }
+    return DISPATCH_OK;
+}
+
+/**
+ * Internal tree endpoint. Reads a level, start index and count and transmits that run of
+ * subtree hashes from the node's range hash tree, preceded by the chain length they cover.
+ * Comparing hashes level by level lets two nodes find where their chains diverge in
+ * O(log n) round trips
+ * @param sockfd Open socket that requested the endpoint
+ * @param pctx state of the node whose tree is transmitted
+ * @return execution result of endpoint
+ */
+static enum endpoint_dispatch_retval tree_endpoint(int sockfd, struct EndpointContext * pctx) {
+    uint64_t hashes[RANGE_TREE_MAX_NODES];
+    uint32_t network_start, network_count;
+    uint8_t level;
+
+    if (receive_buf(sockfd, &level, sizeof(level)) <= 0 ||
+            receive_buf(sockfd, &network_start, sizeof(network_start)) <= 0 ||
+            receive_buf(sockfd, &network_count, sizeof(network_count)) <= 0) {
+        return DISPATCH_RECV_FAIL;
+    }
+    uint32_t start = ntohl(network_start);
+    uint32_t count = ntohl(network_count);
+
+    if (pctx->ptree == NULL) {
+        fprintf(stderr, "Endpoints: Range tree is disabled on this node\n");
+        return DISPATCH_INVALID_ENDPOINT;
+    }
+    if (level >= RANGE_TREE_MAX_LEVELS || count > RANGE_TREE_MAX_NODES) {
+        fprintf(stderr, "Endpoints: Invalid tree request for %u nodes of level %d\n", count, level);
+        return DISPATCH_INVALID_ARGS;
+    }
+    if (admit_request(sockfd, pctx, ADMISSION_COST_TREE) != 0) {
+        return reject_request(sockfd);
+    }
+
+    //catch up with blocks appended outside of ingest_payload
+    lock_chain_shared(pctx);
+    if (pctx->ptree->len < pctx->pblock_chain->len) {
+        unlock_chain(pctx);
+        lock_chain_exclusive(pctx);
+        int update_ret = range_tree_update(pctx->ptree, pctx->pblock_chain);
+        unlock_chain(pctx);
+        if (update_ret != 0) {
+            return DISPATCH_UNKNOWN_ERR;
+        }
+        lock_chain_shared(pctx);
+    }
+    //blocks not yet durable are left out of the hashes, as they are left out of every response
+    uint32_t chain_len = committed_len(pctx);
+    if (chain_len > pctx->ptree->len) {
+        chain_len = pctx->ptree->len;
+    }
+    count = range_tree_nodes(pctx->ptree, chain_len, level, start, count, hashes);
+    unlock_chain(pctx);
+
+    //Number of hashes and chain length, then each hash
+    uint8_t response[2 * sizeof(uint32_t) + sizeof(hashes)];
+    uint32_t network_u32 = htonl(count);
+    memcpy(response, &network_u32, sizeof(uint32_t));
+    network_u32 = htonl(chain_len);
+    memcpy(response + sizeof(uint32_t), &network_u32, sizeof(uint32_t));
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t network_u64 = htobe64(hashes[i]);
+        memcpy(response + 2 * sizeof(uint32_t) + i * sizeof(uint64_t), &network_u64, sizeof(uint64_t));
+    }
+    if (send_buf(sockfd, response, 2 * sizeof(uint32_t) + count * sizeof(uint64_t)) == -1) {
+        return DISPATCH_SEND_FAIL;
+    }
+    return DISPATCH_OK;
+}
+
+/**
+ * Internal window endpoint. Reads a time window, a minimum height and a count and transmits
+ * the blocks appended within the window. The start of the window is found through the sparse
+ * time index so a query costs O(log n) plus the blocks sent. Windows larger than count are
+ * paged through by raising the minimum height past the blocks already received
+ * @param sockfd Open socket that requested the endpoint
+ * @param pctx state of the node whose blocks are transmitted
+ * @return execution result of endpoint
+ */
+static enum endpoint_dispatch_retval window_endpoint(int sockfd, struct EndpointContext * pctx) {
+    uint8_t request[2 * sizeof(uint64_t) + 2 * sizeof(uint32_t)];
+    uint64_t network_u64;
+    uint32_t network_u32;
+    struct SendBatch batch;
+
+    if (receive_buf(sockfd, request, sizeof(request)) <= 0) {
+        return DISPATCH_RECV_FAIL;
+    }
+    memcpy(&network_u64, request, sizeof(uint64_t));
+    uint64_t since = be64toh(network_u64);
+    memcpy(&network_u64, request + sizeof(uint64_t), sizeof(uint64_t));
+    uint64_t until = be64toh(network_u64);
+    memcpy(&network_u32, request + 2 * sizeof(uint64_t), sizeof(uint32_t));
+    uint32_t min_height = ntohl(network_u32);
+    memcpy(&network_u32, request + 2 * sizeof(uint64_t) + sizeof(uint32_t), sizeof(uint32_t));
+    uint32_t count = ntohl(network_u32);
+
+    if (pctx->ptime == NULL) {
+        fprintf(stderr, "Endpoints: Time index is disabled on this node\n");
+        return DISPATCH_INVALID_ENDPOINT;
+    }
+    if (count > MAX_PAYLOAD_RANGE) {
+        fprintf(stderr, "Endpoints: Requested window of %u blocks larger than max allowed range %d\n",
+                count, MAX_PAYLOAD_RANGE);
+        return DISPATCH_INVALID_ARGS;
+    }
+    if (admit_request(sockfd, pctx, ADMISSION_COST_WINDOW) != 0) {
+        return reject_request(sockfd);
+    }
+    if (batch_open(&batch, sockfd) != 0) {
+        return DISPATCH_UNKNOWN_ERR;
+    }
+
+    //catch up with blocks appended outside of ingest_payload
+    lock_chain_shared(pctx);
+    if (pctx->ptime->indexed < pctx->pblock_chain->len) {
+        unlock_chain(pctx);
+        lock_chain_exclusive(pctx);
+        int update_ret = time_index_update(pctx->ptime, pctx->pblock_chain);
+        unlock_chain(pctx);
+        if (update_ret != 0) {
+            batch_close(&batch);
+            return DISPATCH_UNKNOWN_ERR;
+        }
+        lock_chain_shared(pctx);
+    }
+    const struct BlockChain * pblock_chain = pctx->pblock_chain;
+    uint32_t chain_len = committed_len(pctx);
+    uint32_t start = time_index_find(pctx->ptime, pblock_chain, since);
+    if (start < min_height) {
+        start = min_height;
+    }
+    if (start > chain_len) {
+        start = chain_len;
+    }
+    //timestamps are ordered so the window ends at the first block at or after until
+    uint32_t n_blocks = 0;
+    while (n_blocks < count && start + n_blocks < chain_len &&
+            get_link(pblock_chain, start + n_blocks)->block.timestamp < until) {
+        n_blocks++;
+    }
+
+    //Number of blocks and height of first, then each block
+    uint8_t prefix[2 * sizeof(uint32_t)];
+    network_u32 = htonl(n_blocks);
+    memcpy(prefix, &network_u32, sizeof(uint32_t));
+    network_u32 = htonl(start);
+    memcpy(prefix + sizeof(uint32_t), &network_u32, sizeof(uint32_t));
+    int ret = batch_append(&batch, prefix, sizeof(prefix));
+    for (uint32_t i = 0; i < n_blocks && ret == 0; i++) {
+        ret = batch_append_block(&batch, pblock_chain, &get_link(pblock_chain, start + i)->block);
+        if (ret == 0 && batch_yield(&batch, pctx) != 0) {
+            batch_close(&batch);
+            return DISPATCH_SEND_FAIL;
+        }
+    }
+    unlock_chain(pctx);
+
+    if (ret == 0) {
+        ret = batch_flush(&batch);
+    }
+    batch_close(&batch);
+
+    if (ret != 0) {
+        return DISPATCH_SEND_FAIL;
+    }
+    return DISPATCH_OK;
+}
+
+/**
+ * Internal subscribe endpoint. Reads a starting height and hands the connection over to the
+ * node's subscription hub, which confirms the subscription then pushes every block from that
+ * height onwards, backlog first, for as long as the client stays connected
+ * @param sockfd Open socket that requested the endpoint. Owned by the hub on success
+ * @param pctx state of the node whose blocks are pushed
+ * @return DISPATCH_DETACHED once subscribed, otherwise execution result of endpoint
+ */
+static enum endpoint_dispatch_retval subscribe_endpoint(int sockfd, struct EndpointContext * pctx) {
+    uint32_t network_start;
+
+    if (receive_buf(sockfd, &network_start, sizeof(network_start)) <= 0) {
+        return DISPATCH_RECV_FAIL;
+    }
+    if (pctx->psubs == NULL) {
+        fprintf(stderr, "Endpoints: Subscriptions are disabled on this node\n");
+        return DISPATCH_INVALID_ENDPOINT;
+    }
+    //refusing a full hub is reported like any other rejection so the client backs off
+    if (admit_request(sockfd, pctx, ADMISSION_COST_SUBSCRIBE) != 0 ||
+            subscribe_client(pctx->psubs, sockfd, ntohl(network_start)) != 0) {
+        return reject_request(sockfd);
+    }
+    return DISPATCH_DETACHED;
+}
+
+/**
+ * Internal trace endpoint. Transmits the request spans the node has recorded, oldest first,
+ * so tail latency can be broken down without attaching a tracer to the node. Reports no
+ * spans unless the node was started with its recorder running
+ * @param sockfd Open socket that requested the endpoint
+ * @param pctx state of the node
+ * @return execution result of endpoint
+ */
+static enum endpoint_dispatch_retval trace_endpoint(int sockfd, struct EndpointContext * pctx) {
+    struct SendBatch batch;
+
+    if (admit_request(sockfd, pctx, ADMISSION_COST_TRACE) != 0) {
+        return reject_request(sockfd);
+    }
+    //spans are copied out first as this request's own span is written once it returns
+    uint32_t cap = trace_capacity();
+    struct TraceSpan * spans = malloc(((size_t)cap + 1) * sizeof(struct TraceSpan));
+    if (spans == NULL) {
+        fprintf(stderr, "Endpoints: failed to allocate memory for %u spans\n", cap);
+        return DISPATCH_UNKNOWN_ERR;
+    }
+    uint32_t n_spans = trace_snapshot(spans, cap);
+    if (batch_open(&batch, sockfd) != 0) {
+        free(spans);
+        return DISPATCH_UNKNOWN_ERR;
+    }
+
+    //Number of spans, then each packed
+    uint32_t network_u32 = htonl(n_spans);
+    int ret = batch_append(&batch, &network_u32, sizeof(uint32_t));
+    for (uint32_t i = 0; i < n_spans && ret == 0; i++) {
+        uint8_t packed[TRACE_SPAN_WIRE_SZ];
+        pack_trace_span(&spans[i], packed);
+        ret = batch_append(&batch, packed, sizeof(packed));
+        if (ret == 0 && batch.len >= SEND_BATCH_SIZE) {
+            ret = batch_flush(&batch);
+        }
+    }
+    if (ret == 0) {
+        ret = batch_flush(&batch);
+    }
+    batch_close(&batch);
+    free(spans);
+
+    if (ret != 0) {
+        return DISPATCH_SEND_FAIL;
+    }
+    printf("Endpoints: %u trace spans transmitted successfully\n", n_spans);
+    return DISPATCH_OK;
+}
+
+/**
+ * Length of the chain readers are served. Blocks appended since the last commit are held
+ * back until they are durable. Caller holds the chain lock
+ * @param pctx state of the node
+ * @return number of blocks from genesis that may be sent
+ */
+static uint32_t committed_len(const struct EndpointContext * pctx) {
+    if (pctx->pjournal == NULL) {
+        return pctx->pblock_chain->len;
+    }
+    uint32_t committed = journal_committed(pctx->pjournal);
+    return committed < pctx->pblock_chain->len ? committed : pctx->pblock_chain->len;
+}
+
+/**
+ * Charge a request against the node's admission control
+ * @param sockfd socket the request arrived on
+ * @param pctx state of the node
+ * @param cost weight of the request
+ * @return 0 if the request may be served, -1 if it is over budget
+ */
+static int admit_request(int sockfd, struct EndpointContext * pctx, unsigned cost) {
+    if (pctx->padmission == NULL) {
+        return 0;
+    }
+    return admission_admit(pctx->padmission, sockfd, cost);
+}
+
+/**
+ * Read and drop the body of a refused request so the client's next request is read from
+ * where it starts. Uses a fixed buffer whatever length was claimed
+ * @param sockfd socket to read from
+ * @param len number of bytes to drop
+ * @return 0 on success, -1 on failure
+ */
+static int discard_payload(int sockfd, uint32_t len) {
+    char sink[4096];
+
+    for (uint32_t off = 0; off < len; ) {
+        uint32_t chunk = len - off > sizeof(sink) ? sizeof(sink) : len - off;
+        if (receive_buf(sockfd, sink, chunk) <= 0) {
+            return -1;
+        }
+        off += chunk;
+    }
+    return 0;
+}
+
+/**
+ * Reject a request whose response leads with a count. The rejection marker is sent in
+ * place of the count so the client can back off without waiting on a timeout
+ * @param sockfd socket the request arrived on
+ * @return DISPATCH_RATE_LIMITED, or DISPATCH_SEND_FAIL if the marker could not be sent
+ */
+static enum endpoint_dispatch_retval reject_request(int sockfd) {
+    uint32_t network_marker = htonl(ADMISSION_REJECTED);
+    if (send_buf(sockfd, &network_marker, sizeof(network_marker)) == -1) {
+        return DISPATCH_SEND_FAIL;
+    }
+    return DISPATCH_RATE_LIMITED;
+}
+
+/**
+ * Append a received payload to the chain and queue the response to its client
+ * @param sockfd client that sent the payload
+ * @param pctx state of the node
+ * @param payload malloc'd null terminated payload. Always taken over
+ * @param len length of payload excluding null char
+ * @param payload_hash hash of payload computed as it was received
+ * @return execution result of adding block
+ */
+static enum endpoint_dispatch_retval append_payload(int sockfd, struct EndpointContext * pctx,
+        char * payload, uint32_t len, uint32_t payload_hash) {
+    uint32_t height, hash;
+
+    enum endpoint_dispatch_retval ingest_ret = ingest_payload(pctx, payload, len, payload_hash,
+            &height, &hash);
+    if (ingest_ret == DISPATCH_DUPLICATE) {
+        return queue_ack(pctx, sockfd, ADD_BLOCK_DUPLICATE, 0) == 0 ?
+            DISPATCH_DUPLICATE : DISPATCH_SEND_FAIL;
+    }
+    if (ingest_ret != DISPATCH_OK) {
+        return ingest_ret;
+    }
+    if (queue_ack(pctx, sockfd, height, hash) != 0) {
+        return DISPATCH_SEND_FAIL;
+    }
     printf("Endpoints: block added successfully\n");
     return DISPATCH_OK;
 }
 
+/**
+ * Take a signed transaction. Malformed transactions and recent duplicates are turned away
+ * straight away without any signature work. Others are held with a reserved response for
+ * the reactor's next verification batch, or verified on their own without a queue
+ * @param sockfd client that sent the transaction
+ * @param pctx state of the node. pverifier must be set
+ * @param payload malloc'd null terminated payload. Always taken over
+ * @param len length of payload excluding null char
+ * @param payload_hash hash of payload computed as it was received
+ * @return execution result of adding transaction
+ */
+static enum endpoint_dispatch_retval queue_transaction(int sockfd, struct EndpointContext * pctx,
+        char * payload, uint32_t len, uint32_t payload_hash) {
+    struct TxQueue * ptxs = pctx->ptxs;
+    struct VerifyJob job;
+
+    if (parse_transaction(payload, len, &job.tx) != 0) {
+        fprintf(stderr, "Endpoints: Rejecting malformed transaction from %d\n", sockfd);
+        free(payload);
+        return queue_ack(pctx, sockfd, ADD_BLOCK_UNVERIFIED, 0) == 0 ?
+            DISPATCH_UNVERIFIED : DISPATCH_SEND_FAIL;
+    }
+    //a replayed transaction would otherwise cost a verification before dedup refused it
+    if (pctx->pdedup != NULL) {
+        uint64_t hash64 = hash_payload64(payload, len);
+        lock_chain_shared(pctx);
+        int duplicate = dedup_contains(pctx->pdedup, hash64);
+        unlock_chain(pctx);
+        if (duplicate) {
+            fprintf(stderr, "Endpoints: Rejecting duplicate payload\n");
+            free(payload);
+            return queue_ack(pctx, sockfd, ADD_BLOCK_DUPLICATE, 0) == 0 ?
+                DISPATCH_DUPLICATE : DISPATCH_SEND_FAIL;
+        }
+    }
+
+    if (ptxs != NULL && pctx->packs != NULL && ptxs->len == ptxs->cap) {
+        uint32_t cap = ptxs->cap > 0 ? ptxs->cap * 2 : TX_QUEUE_INITIAL_CAP;
+        struct PendingTx * txs = realloc(ptxs->txs, cap * sizeof(struct PendingTx));
+        if (txs != NULL) {
+            ptxs->txs = txs;
+        }
+        struct VerifyJob * jobs = txs == NULL ? NULL : realloc(ptxs->jobs, cap * sizeof(struct VerifyJob));
+        if (jobs != NULL) {
+            ptxs->jobs = jobs;
+            ptxs->cap = cap;
+        }
+    }
+    //verified on its own when it cannot be held
+    if (ptxs == NULL || pctx->packs == NULL || ptxs->len == ptxs->cap ||
+            reserve_ack(pctx->packs) != 0) {
+        verify_batch(pctx->pverifier, &job, 1);
+        if (!job.valid) {
+            fprintf(stderr, "Endpoints: Rejecting transaction with bad signature from %d\n", sockfd);
+            free(payload);
+            return queue_ack(pctx, sockfd, ADD_BLOCK_UNVERIFIED, 0) == 0 ?
+                DISPATCH_UNVERIFIED : DISPATCH_SEND_FAIL;
+        }
+        return append_payload(sockfd, pctx, payload, len, payload_hash);
+    }
+
+    //response reserved now so it keeps its place among the client's responses
+    struct AckQueue * packs = pctx->packs;
+    ptxs->txs[ptxs->len] = (struct PendingTx){payload, len, payload_hash, packs->len};
+    ptxs->jobs[ptxs->len] = job;
+    ptxs->len++;
+    packs->acks[packs->len++] = (struct PendingAck){sockfd, ADD_BLOCK_UNVERIFIED, 0};
+    if (ptxs->len >= VERIFY_MAX_BATCH) {
+        verify_pending(pctx);
+    }
+    return DISPATCH_OK;
+}
+
+/**
+ * Hold an add block response for the next group commit. Without an ack queue the block is
+ * committed and the response sent straight away
+ * @param pctx state of the node
+ * @param sockfd client to respond to
+ * @param height height of block, or a rejection marker
+ * @param hash hash of block
+ * @return 0 on success, -1 if the response could not be sent
+ */
+static int queue_ack(struct EndpointContext * pctx, int sockfd, uint32_t height, uint32_t hash) {
+    struct AckQueue * packs = pctx->packs;
+    struct PendingAck ack = {sockfd, height, hash};
+
+    if (packs == NULL) {
+        int committed = commit_chain(pctx) == 0;
+        return send_acks(pctx, &ack, 1, committed);
+    }
+    if (reserve_ack(packs) != 0) {
+        //commit early rather than lose the response
+        commit_acks(pctx);
+        int committed = commit_chain(pctx) == 0;
+        return send_acks(pctx, &ack, 1, committed);
+    }
+    packs->acks[packs->len++] = ack;
+    return 0;
+}
+
+/**
+ * Make room in an ack queue for one more response
+ * @param packs queue to grow
+ * @return 0 on success, -1 if the queue is full and could not grow
+ */
+static int reserve_ack(struct AckQueue * packs) {
+    if (packs->len < packs->cap) {
+        return 0;
+    }
+    uint32_t cap = packs->cap > 0 ? packs->cap * 2 : ACK_QUEUE_INITIAL_CAP;
+    struct PendingAck * acks = realloc(packs->acks, cap * sizeof(struct PendingAck));
+    if (acks == NULL) {
+        fprintf(stderr, "Endpoints: failed to grow ack queue\n");
+        return -1;
+    }
+    packs->acks = acks;
+    packs->cap = cap;
+    return 0;
+}
+
+/**
+ * Send a run of add block responses to one client in a single send, or hand them to the
+ * context's response sink
+ * @param pctx state of the node
+ * @param acks responses to send, all to the same client. At most ACKS_PER_SEND
+ * @param n_acks number of responses
+ * @param committed 0 if the commit failed, in which case blocks are reported as not durable
+ * @return 0 on success, -1 on send failure
+ */
+static int send_acks(struct EndpointContext * pctx, const struct PendingAck * acks, uint32_t n_acks,
+        int committed) {
+    uint8_t buf[ACKS_PER_SEND * ACK_SZ];
+
+    for (uint32_t i = 0; i < n_acks; i++) {
+        //rejections stand regardless of the commit
+        uint32_t height = acks[i].height;
+        uint32_t hash = acks[i].hash;
+        if (!committed && height != ADMISSION_REJECTED && height != ADD_BLOCK_DUPLICATE &&
+                height != ADD_BLOCK_UNVERIFIED && height != ADD_BLOCK_READ_ONLY) {
+            height = ADD_BLOCK_FAILED;
+            hash = 0;
+        }
+        uint32_t network_ack[2] = {htonl(height), htonl(hash)};
+        memcpy(buf + i * ACK_SZ, network_ack, ACK_SZ);
+    }
+    int ret = pctx->psink != NULL ?
+        pctx->psink->send(pctx->psink->arg, acks[0].sockfd, buf, n_acks * ACK_SZ) :
+        send_buf(acks[0].sockfd, buf, n_acks * ACK_SZ);
+    if (ret == -1) {
+        fprintf(stderr, "Endpoints: failed to acknowledge blocks added by %d\n", acks[0].sockfd);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Prepare a send batch for a socket
+ * @param pbatch batch to initialise
+ * @param sockfd socket the batch is flushed to
+ * @return 0 on success, -1 on failure
+ */
+static int batch_open(struct SendBatch * pbatch, int sockfd) {
+    pbatch->sockfd = sockfd;
+    pbatch->len = 0;
+    pbatch->cold.data = NULL; //allocated on first cold payload
+    pbatch->cold.cap = 0;
+    pbatch->cap = SEND_BATCH_SIZE;
+    pbatch->buf = malloc(SEND_BATCH_SIZE);
+
+    if (pbatch->buf == NULL) {
+        fprintf(stderr, "Endpoints: failed to allocate send batch\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Copy bytes into the batch, growing it if they do not fit. Never sends, so it is safe to
+ * call with the chain lock held. Callers send what has been queued through batch_yield
+ * or batch_flush
+ * @param pbatch batch to append to
+ * @param data bytes to send
+ * @param len number of bytes
+ * @return 0 on success, -1 on failure
+ */
+static int batch_append(struct SendBatch * pbatch, const void * data, size_t len) {
+    if (pbatch->len + len > pbatch->cap) {
+        size_t cap = pbatch->len + len;
+        uint8_t * buf = realloc(pbatch->buf, cap);
+        if (buf == NULL) {
+            fprintf(stderr, "Endpoints: failed to grow send batch to %zu bytes\n", cap);
+            return -1;
+        }
+        pbatch->buf = buf;
+        pbatch->cap = cap;
+    }
+    memcpy(pbatch->buf + pbatch->len, data, len);
+    pbatch->len += len;
+    return 0;
+}
+
+/**
+ * Queue a block for sending. The header is packed into the batch and the payload copied in
+ * after it, so the block can be sent once the chain lock is released. Payloads moved to
+ * cold storage are read back so the receiver gets the full block
+ * @param pbatch batch to append to
+ * @param pblock_chain chain block belongs to
+ * @param pblock block to send
+ * @return 0 on success, -1 on failure
+ */
+static int batch_append_block(struct SendBatch * pbatch, const struct BlockChain * pblock_chain,
+        const struct Block * pblock) {
+    uint8_t header[BLOCK_WIRE_HEADER_SZ];
+    struct Block block = *pblock;
+    uint64_t begin = trace_stage_begin();
+
+    TRACE_PROBE2(pack_block, block.hash, block.payload_len);
+    if (block.payload == NULL) {
+        block.payload = (char *)view_payload(pblock_chain, &block, &pbatch->cold);
+    }
+    pack_block_header(&block, header);
+    trace_stage_end(TRACE_PACK, begin, 0);
+    if (batch_append(pbatch, header, sizeof(header)) != 0) {
+        return -1;
+    }
+    if (block.payload == NULL) {
+        return 0;
+    }
+    return batch_append(pbatch, block.payload, block.payload_len);
+}
+
+/**
+ * Send the batch once it has filled. The chain lock is dropped while sending and retaken
+ * after, so appends are never held off by a reader's socket. Links and everything below the
+ * length read before the lock was dropped stay valid, only payloads may have moved to cold
+ * storage, which view_payload reads back
+ * @param pbatch batch to send
+ * @param pctx state of the node whose chain lock is held shared
+ * @return 0 on success with the lock held, -1 on send failure with the lock released
+ */
+static int batch_yield(struct SendBatch * pbatch, struct EndpointContext * pctx) {
+    if (pbatch->len < SEND_BATCH_SIZE) {
+        return 0;
+    }
+    unlock_chain(pctx);
+    if (batch_flush(pbatch) != 0) {
+        return -1;
+    }
+    lock_chain_shared(pctx);
+    return 0;
+}
+
+/**
+ * Send all queued bytes
+ * @param pbatch batch to flush
+ * @return 0 on success, -1 on send failure
+ */
+static int batch_flush(struct SendBatch * pbatch) {
+    if (pbatch->len > 0 && send_buf(pbatch->sockfd, pbatch->buf, pbatch->len) == -1) {
+        return -1;
+    }
+    pbatch->len = 0;
+    return 0;
+}
+
+/**
+ * Free buffers held by batch. Does not flush
+ * @param pbatch batch to close
+ * @return void
+ */
+static void batch_close(struct SendBatch * pbatch) {
+    free(pbatch->buf);
+    free_payload_buf(&pbatch->cold);
+    pbatch->buf = NULL;
+}
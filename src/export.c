@@ -0,0 +1,48 @@
+/**
+ * Simple program to export the chain of a running node
+ * to an archive file
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "block.h"
+#include "server.h"
+#include "requests.h"
+#include "archive.h"
+
+//Request chain endpoint on node at specified IP and write it to an archive
+int main(int argc, char * argv[]) {
+
+    if (argc != 4) {
+        fprintf(stderr, "usage: export hostname servname archive\n");
+        return 1;
+    }
+
+    //connect to node with given hostname
+    int node_fd = connect_to_node(argv[1], argv[2]);
+
+    if (node_fd == -1) {
+        return 2;
+    }
+
+    struct BlockChain block_chain = initialise_chain();
+
+    int ret = request_chain_endpoint(node_fd, &block_chain);
+    close(node_fd);
+
+    //failed
+    if (ret == -1) {
+        deinitialise_chain(&block_chain);
+        return 3;
+    }
+
+    if (write_archive(&block_chain, argv[3]) != 0) {
+        deinitialise_chain(&block_chain);
+        return 4;
+    }
+
+    printf("Export: wrote %u blocks to %s\n", block_chain.len, argv[3]);
+    deinitialise_chain(&block_chain);
+    return 0;
+}
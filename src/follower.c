@@ -0,0 +1,231 @@
+/**
+ * Read replica follower. Keeps a subscription to a primary node from the
+ * replica's tip, so new blocks are pushed as soon as the primary commits them.
+ * Received blocks are checked for linkage and payload hashes before they are
+ * appended. A primary whose chain no longer extends the replica's is retried a
+ * few times, then reported as diverged and no longer followed.
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "follower.h"
+#include "server.h"
+#include "requests.h"
+
+//Internal functions
+static void * follow_thread(void * arg);
+static int connect_to_primary(struct Follower * pfollower);
+static int subscribe_to_primary(struct Follower * pfollower);
+static int receive_batch(int sockfd, uint32_t height, uint32_t tip_hash, struct BlockChain * pblocks,
+        int * pdiverged);
+static void follow_sleep(struct Follower * pfollower, unsigned ms);
+
+/**
+ * Start tailing a primary. The replica's chain must be empty or a prefix of the primary's
+ * @param pfollower follower to start
+ * @param peer primary as host:port or unix:<path>
+ * @param pctx state of the replica. Chain is appended to from the follower thread
+ * @return 0 on success, -1 on failure
+ */
+int start_follower(struct Follower * pfollower, const char * peer, struct EndpointContext * pctx) {
+    if (strlen(peer) >= sizeof(pfollower->peer) || pctx->plock == NULL) {
+        fprintf(stderr, "Follower: invalid configuration\n");
+        return -1;
+    }
+    strcpy(pfollower->peer, peer);
+    pfollower->pctx = pctx;
+    pfollower->blocks = 0;
+    pfollower->reconnects = 0;
+    pfollower->diverged = 0;
+    pfollower->diverged_height = 0;
+    pfollower->running = 1;
+
+    if (pthread_create(&pfollower->thread, NULL, follow_thread, pfollower) != 0) {
+        fprintf(stderr, "Follower: failed to start follower thread\n");
+        pfollower->running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Stop tailing and wait for the follower thread to exit
+ * @param pfollower follower to stop
+ * @return void
+ */
+void stop_follower(struct Follower * pfollower) {
+    pfollower->running = 0;
+    pthread_join(pfollower->thread, NULL);
+}
+
+/**
+ * Follower thread. Subscribes to the primary from the replica's tip and appends pushed blocks,
+ * committing everything that has arrived together. Reconnects when the primary goes away and
+ * stops after FOLLOW_MAX_DIVERGENCES pushes at one height fail to link to the replica's tip
+ * @param arg Follower
+ * @return NULL
+ */
+static void * follow_thread(void * arg) {
+    struct Follower * pfollower = arg;
+    struct EndpointContext * pctx = pfollower->pctx;
+    int sockfd = -1;
+    uint32_t mismatch_height = 0;
+    unsigned mismatches = 0;
+
+    while (pfollower->running) {
+        if (sockfd == -1) {
+            sockfd = subscribe_to_primary(pfollower);
+            if (sockfd == -1) {
+                follow_sleep(pfollower, FOLLOW_RETRY_MS);
+                continue;
+            }
+        }
+
+        //wait in slices so an idle primary neither stalls shutdown nor trips the receive timeout
+        struct pollfd pfd = {sockfd, POLLIN, 0};
+        int ready = poll(&pfd, 1, FOLLOW_WAIT_MS);
+        if (ready == 0 || (ready == -1 && errno == EINTR)) {
+            continue;
+        }
+
+        //only this thread appends so the tip cannot move under us
+        lock_chain_shared(pctx);
+        uint32_t height = pctx->pblock_chain->len;
+        uint32_t tip_hash = pctx->pblock_chain->tail != NULL ? pctx->pblock_chain->tail->block.hash : 0;
+        unlock_chain(pctx);
+
+        struct BlockChain blocks = initialise_chain();
+        int diverged = 0;
+        int ret = ready == -1 ? -1 : receive_batch(sockfd, height, tip_hash, &blocks, &diverged);
+        if (ret == 0 && replicate_blocks(pctx, &blocks, height) != DISPATCH_OK) {
+            ret = -1;
+        }
+        uint32_t n_blocks = blocks.len;
+        deinitialise_chain(&blocks);
+
+        if (ret == 0) {
+            pfollower->blocks += n_blocks;
+            continue;
+        }
+
+        if (diverged) {
+            if (height != mismatch_height) {
+                mismatch_height = height;
+                mismatches = 0;
+            }
+            if (++mismatches >= FOLLOW_MAX_DIVERGENCES) {
+                fprintf(stderr, "Follower: replica diverged from primary %s at height %u, "
+                        "stopping after %u attempts\n", pfollower->peer, height, mismatches);
+                pfollower->diverged = 1;
+                pfollower->diverged_height = height;
+                break;
+            }
+            fprintf(stderr, "Follower: block %u from primary %s does not link to the replica's tip, "
+                    "reconnecting\n", height, pfollower->peer);
+        } else {
+            //primary restarted or went away. Start over on a fresh subscription
+            fprintf(stderr, "Follower: lost primary %s at height %u, reconnecting\n",
+                    pfollower->peer, height);
+        }
+        close(sockfd);
+        sockfd = -1;
+        pfollower->reconnects++;
+        follow_sleep(pfollower, FOLLOW_RETRY_MS);
+    }
+
+    if (sockfd != -1) {
+        close(sockfd);
+    }
+    return NULL;
+}
+
+/**
+ * Connect to the primary and subscribe to its blocks from the replica's tip
+ * @return subscribed socket or -1 on failure
+ */
+static int subscribe_to_primary(struct Follower * pfollower) {
+    int sockfd = connect_to_primary(pfollower);
+    if (sockfd == -1) {
+        return -1;
+    }
+
+    //only this thread appends so the height cannot change before blocks arrive
+    lock_chain_shared(pfollower->pctx);
+    uint32_t height = pfollower->pctx->pblock_chain->len;
+    unlock_chain(pfollower->pctx);
+
+    if (request_subscribe_endpoint(sockfd, height) != 0) {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+/**
+ * Receive the blocks pushed so far, up to FOLLOW_BATCH_BLOCKS, after at least one has begun arriving
+ * @param sockfd subscribed socket
+ * @param height height of the first block, the replica's chain length
+ * @param tip_hash hash of the replica's tip. The first block must link to it unless height is 0
+ * @param pblocks initialised chain received blocks are appended to
+ * @param pdiverged set if the first block is valid but links to a different tip
+ * @return 0 on success, -1 on failure
+ */
+static int receive_batch(int sockfd, uint32_t height, uint32_t tip_hash, struct BlockChain * pblocks,
+        int * pdiverged) {
+    //first block keeps its own linkage so a different chain can be told apart from a broken stream
+    if (receive_subscribed_blocks(sockfd, height, 1, NULL, pblocks) != 0) {
+        return -1;
+    }
+    if (height > 0 && pblocks->head->block.prev_hash != tip_hash) {
+        *pdiverged = 1;
+        return -1;
+    }
+
+    struct pollfd pfd = {sockfd, POLLIN, 0};
+    while (pblocks->len < FOLLOW_BATCH_BLOCKS && poll(&pfd, 1, 0) == 1) {
+        uint32_t prev_hash = pblocks->tail->block.hash;
+        if (receive_subscribed_blocks(sockfd, height + pblocks->len, 1, &prev_hash, pblocks) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Connect to the primary with a receive timeout so a hung primary cannot stall shutdown
+ * @return connected socket or -1 on failure
+ */
+static int connect_to_primary(struct Follower * pfollower) {
+    struct timeval tv;
+    int sockfd = connect_to_peer(pfollower->peer);
+    if (sockfd == -1) {
+        return -1;
+    }
+
+    tv.tv_sec = FOLLOW_RECV_TIMEOUT_S;
+    tv.tv_usec = 0;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (void *)&tv, sizeof(tv)) != 0) {
+        perror("Follower: setsockopt");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+/**
+ * Sleep for up to ms, waking early once the follower is stopped
+ * @return void
+ */
+static void follow_sleep(struct Follower * pfollower, unsigned ms) {
+    struct timespec slice = {0, 10 * 1000000}; //10ms
+
+    for (unsigned slept = 0; slept < ms && pfollower->running; slept += 10) {
+        nanosleep(&slice, NULL);
+    }
+}
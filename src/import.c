@@ -0,0 +1,48 @@
+/**
+ * Simple program to load and validate an archive file
+ * and report how quickly it was imported
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "block.h"
+#include "archive.h"
+
+//Bulk load archive and print a summary of the imported chain
+int main(int argc, char * argv[]) {
+    struct ArchiveStats stats;
+    struct timespec start, end;
+    unsigned n_threads = 0; //one per core
+
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "usage: import archive [threads]\n");
+        return 1;
+    }
+    if (argc == 3) {
+        n_threads = strtoul(argv[2], NULL, 10);
+    }
+
+    struct BlockChain block_chain = initialise_chain();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int ret = load_archive(&block_chain, argv[1], n_threads, &stats);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    //failed
+    if (ret == -1) {
+        deinitialise_chain(&block_chain);
+        return 3;
+    }
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Import: %u blocks (%u without payload) validated using %u threads\n",
+            stats.blocks, stats.pruned, stats.threads);
+    printf("Import: tip hash %u\n", block_chain.tail != NULL ? block_chain.tail->block.hash : 0);
+    printf("Import: %.3f ms, %.1f MB/s\n", elapsed * 1e3,
+            elapsed > 0 ? stats.bytes / elapsed / 1e6 : 0.0);
+
+    deinitialise_chain(&block_chain);
+    return 0;
+}
@@ -0,0 +1,144 @@
+/**
+ * Simple program to load test a node through libcherub. Pipelines
+ * add block requests over a connection pool, then reads the chain back
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "cherub.h"
+
+#define INGEST_USAGE "usage: ingest [-c conns] [-n count] [-p prefix] [-s payload_size] " \
+    "host:port|unix:path\n"
+
+struct IngestResult {
+    uint32_t ok;
+    uint32_t failed;
+    uint32_t unknown; //lost with their connection, so may or may not have been added
+    uint32_t top_height; //highest height acknowledged
+    int chain_done;
+    uint32_t chain_len;
+};
+
+//Count add block outcomes
+static void on_add_block(void * arg, enum cherub_status status, uint32_t height, uint32_t hash) {
+    struct IngestResult * presult = arg;
+    (void)hash;
+    if (status == CHERUB_OK) {
+        presult->ok++;
+        if (height > presult->top_height) {
+            presult->top_height = height;
+        }
+    } else if (status == CHERUB_UNKNOWN) {
+        presult->unknown++;
+    } else {
+        presult->failed++;
+    }
+}
+
+//Record length of chain read back
+static void on_chain(void * arg, enum cherub_status status, struct BlockChain * pchain) {
+    struct IngestResult * presult = arg;
+    presult->chain_done = status == CHERUB_OK ? 1 : -1;
+    presult->chain_len = pchain->len;
+}
+
+//Submit count payloads as fast as the client accepts them and print throughput
+int main(int argc, char * argv[]) {
+    struct CherubClient * pclient;
+    struct IngestResult result;
+    struct timespec start, end;
+    unsigned n_conns = 4;
+    unsigned long count = 10000;
+    const char * prefix = "ingest";
+    size_t payload_size = 0;
+    char * payload;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:n:p:s:")) != -1) {
+        switch (opt) {
+            case 'c':
+                n_conns = strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                count = strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                prefix = optarg;
+                break;
+            case 's':
+                payload_size = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, INGEST_USAGE);
+                return 1;
+        }
+    }
+    if (optind != argc - 1 || payload_size > MAX_PAYLOAD) {
+        fprintf(stderr, INGEST_USAGE);
+        return 1;
+    }
+
+    //payloads are padded out to payload_size after their unique prefix
+    size_t payload_cap = payload_size > 64 ? payload_size + 1 : 65;
+    payload = malloc(payload_cap);
+    if (payload == NULL) {
+        fprintf(stderr, "Ingest: failed to allocate memory for payload\n");
+        return 2;
+    }
+
+    //client holds every connection's state inline so keep it off the stack
+    pclient = malloc(sizeof(*pclient));
+    if (pclient == NULL || cherub_init(pclient, argv[optind], n_conns) != 0) {
+        free(pclient);
+        free(payload);
+        return 2;
+    }
+    memset(&result, 0, sizeof(result));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned long i = 0; i < count; i++) {
+        int len = snprintf(payload, payload_cap, "%s-%d-%lu", prefix, getpid(), i);
+        if (payload_size > (size_t)len) {
+            memset(payload + len, 'x', payload_size - len);
+            payload[payload_size] = '\0';
+        }
+        //queues full so let some requests complete
+        while (cherub_add_block(pclient, payload, on_add_block, &result) != 0) {
+            if (cherub_process(pclient, 100) == -1) {
+                cherub_deinit(pclient);
+                free(pclient);
+                free(payload);
+                return 3;
+            }
+        }
+        cherub_process(pclient, 0);
+    }
+    if (cherub_drain(pclient, 30000) != 0) {
+        fprintf(stderr, "Ingest: timed out with %u requests pending\n", cherub_pending(pclient));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    //every add block has been acknowledged so the chain read back holds them all
+    if (cherub_get_chain(pclient, on_chain, &result) == 0) {
+        cherub_drain(pclient, 30000);
+    }
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Ingest: %u acknowledged up to height %u, %u failed, %u unknown over %u connections (%lu reconnects)\n",
+            result.ok, result.top_height, result.failed, result.unknown, n_conns,
+            (unsigned long)pclient->reconnects);
+    printf("Ingest: %.3f ms, %.0f requests/s, %.1f MB/s\n", elapsed * 1e3,
+            elapsed > 0 ? result.ok / elapsed : 0.0,
+            elapsed > 0 ? (double)result.ok * payload_size / elapsed / 1e6 : 0.0);
+    if (result.chain_done == 1) {
+        printf("Ingest: node chain has %u blocks\n", result.chain_len);
+    }
+
+    cherub_deinit(pclient);
+    free(pclient);
+    free(payload);
+    return result.failed > 0 || result.unknown > 0 ? 4 : 0;
+}
@@ -0,0 +1,332 @@
+/**
+ * Write ahead journal of appended blocks. Every block is recorded in pack_block
+ * format after a magic number as it is appended, and a node restarted on the same
+ * journal replays it to recover its chain. Records are only made durable by
+ * journal_sync, which is what lets the node commit a whole batch of concurrently
+ * added blocks with a single fdatasync before acknowledging any of them.
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "server.h"
+
+#define JOURNAL_MAGIC 0x43484a31 //"CHJ1"
+
+//Internal functions
+static int replay_journal(struct Journal * pjournal, struct BlockChain * pblock_chain, off_t size);
+static int buffer_bytes(struct Journal * pjournal, const void * data, size_t len);
+static int flush_buffer(struct Journal * pjournal);
+static int write_all(int fd, const void * data, size_t len);
+
+/**
+ * Open a journal, creating it if missing. Records already in it are replayed onto the chain
+ * and a torn record left by a crash mid-write is cut off, so the journal always ends at a
+ * block boundary that links onto the recovered tip
+ * @param pjournal journal to initialise
+ * @param path journal file
+ * @param pblock_chain initialised empty chain recovered blocks are appended to
+ * @return 0 on success, -1 on failure
+ */
+int open_journal(struct Journal * pjournal, const char * path, struct BlockChain * pblock_chain) {
+    struct stat st;
+
+    memset(pjournal, 0, sizeof(*pjournal));
+    pjournal->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (pjournal->fd == -1) {
+        perror("Journal: open");
+        return -1;
+    }
+    pjournal->buf = malloc(JOURNAL_BUFFER_SZ);
+    if (pjournal->buf == NULL) {
+        fprintf(stderr, "Journal: failed to allocate memory for buffer\n");
+        close(pjournal->fd);
+        return -1;
+    }
+    pthread_mutex_init(&pjournal->lock, NULL);
+
+    if (fstat(pjournal->fd, &st) != 0) {
+        perror("Journal: fstat");
+        close_journal(pjournal);
+        return -1;
+    }
+
+    //new journal. Magic must be on disk before any record is acknowledged
+    if (st.st_size == 0) {
+        uint32_t network_magic = htonl(JOURNAL_MAGIC);
+        if (write_all(pjournal->fd, &network_magic, sizeof(network_magic)) != 0 ||
+                fdatasync(pjournal->fd) != 0) {
+            perror("Journal: initialise");
+            close_journal(pjournal);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (pblock_chain->len > 0) {
+        fprintf(stderr, "Journal: cannot replay %s onto a populated chain\n", path);
+        close_journal(pjournal);
+        return -1;
+    }
+    if (replay_journal(pjournal, pblock_chain, st.st_size) != 0) {
+        close_journal(pjournal);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Write out and sync any buffered records then close the journal
+ * @param pjournal journal to close
+ * @return void
+ */
+void close_journal(struct Journal * pjournal) {
+    if (pjournal->fd == -1) {
+        return;
+    }
+    journal_sync(pjournal);
+    close(pjournal->fd);
+    pjournal->fd = -1;
+    free(pjournal->buf);
+    pjournal->buf = NULL;
+    free_payload_buf(&pjournal->cold);
+    pthread_mutex_destroy(&pjournal->lock);
+}
+
+/**
+ * Record a block just appended to the chain. Only buffers the record, it is not durable
+ * until a later journal_sync returns
+ * @param pjournal journal to append to
+ * @param pblock_chain chain the block belongs to
+ * @param pblock block to record. Payloads in cold storage are read back and recorded in full
+ * @return 0 on success, -1 on failure after which the journal refuses further records
+ */
+int journal_append(struct Journal * pjournal, const struct BlockChain * pblock_chain,
+        const struct Block * pblock) {
+    uint8_t header[BLOCK_WIRE_HEADER_SZ];
+    struct Block block = *pblock;
+    int ret = -1;
+
+    pthread_mutex_lock(&pjournal->lock);
+    if (!pjournal->failed) {
+        if (block.payload == NULL) {
+            block.payload = (char *)view_payload(pblock_chain, &block, &pjournal->cold);
+        }
+        //blocks whose payload was dropped are recorded as headers, as on the wire
+        pack_block_header(&block, header);
+        ret = buffer_bytes(pjournal, header, sizeof(header));
+        if (ret == 0 && block.payload != NULL) {
+            ret = buffer_bytes(pjournal, block.payload, block.payload_len);
+        }
+        if (ret == 0) {
+            pjournal->appended++;
+        } else {
+            pjournal->failed = 1;
+        }
+    }
+    pthread_mutex_unlock(&pjournal->lock);
+    return ret;
+}
+
+/**
+ * Make every record appended so far durable. The fdatasync runs outside the journal's lock
+ * so blocks keep being appended while it is in progress, and those are then committed
+ * together by the next call
+ * @param pjournal journal to sync
+ * @return 0 once every record appended before the call is on disk, -1 on failure
+ */
+int journal_sync(struct Journal * pjournal) {
+    pthread_mutex_lock(&pjournal->lock);
+    if (!pjournal->failed && flush_buffer(pjournal) != 0) {
+        pjournal->failed = 1;
+    }
+    if (pjournal->failed) {
+        pthread_mutex_unlock(&pjournal->lock);
+        return -1;
+    }
+    uint64_t target = pjournal->appended;
+    if (pjournal->durable >= target) {
+        pthread_mutex_unlock(&pjournal->lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&pjournal->lock);
+
+    int ret = fdatasync(pjournal->fd);
+    if (ret != 0) {
+        perror("Journal: fdatasync");
+    }
+
+    pthread_mutex_lock(&pjournal->lock);
+    pjournal->syncs++;
+    if (ret != 0) {
+        pjournal->failed = 1;
+    } else if (pjournal->durable < target) {
+        pjournal->durable = target;
+    }
+    pthread_mutex_unlock(&pjournal->lock);
+    return ret == 0 ? 0 : -1;
+}
+
+/**
+ * Number of blocks from the start of the chain whose records are on disk. Records are kept
+ * in chain order from genesis so this is also the height below which blocks are committed
+ * @param pjournal journal to query
+ * @return committed chain length
+ */
+uint32_t journal_committed(struct Journal * pjournal) {
+    pthread_mutex_lock(&pjournal->lock);
+    uint32_t committed = (uint32_t)pjournal->durable;
+    pthread_mutex_unlock(&pjournal->lock);
+    return committed;
+}
+
+/**
+ * Check whether the journal has failed. Blocks appended after a failure could never be
+ * committed, so nothing more should be appended
+ * @param pjournal journal to query
+ * @return 1 if a write or sync has failed, otherwise 0
+ */
+int journal_failed(struct Journal * pjournal) {
+    pthread_mutex_lock(&pjournal->lock);
+    int failed = pjournal->failed;
+    pthread_mutex_unlock(&pjournal->lock);
+    return failed;
+}
+
+/**
+ * Append every complete, valid record to the chain and truncate whatever follows the last
+ * one. A record is only valid if its hash verifies and it links onto the chain's tip
+ * @param pjournal journal positioned at its start
+ * @param pblock_chain empty chain to append to
+ * @param size size of journal file
+ * @return 0 on success, -1 on failure
+ */
+static int replay_journal(struct Journal * pjournal, struct BlockChain * pblock_chain, off_t size) {
+    uint8_t header[BLOCK_WIRE_HEADER_SZ];
+    uint32_t network_magic;
+
+    int fd = dup(pjournal->fd);
+    FILE * fp = fd == -1 ? NULL : fdopen(fd, "rb");
+    if (fp == NULL) {
+        perror("Journal: fdopen");
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    if (fread(&network_magic, sizeof(network_magic), 1, fp) != 1 ||
+            ntohl(network_magic) != JOURNAL_MAGIC) {
+        fprintf(stderr, "Journal: not a journal file\n");
+        fclose(fp);
+        return -1;
+    }
+
+    off_t good = sizeof(network_magic);
+    while (fread(header, sizeof(header), 1, fp) == 1) {
+        struct Block block;
+        int pruned = unpack_block_header(header, &block);
+        uint32_t tip_hash = pblock_chain->tail != NULL ? pblock_chain->tail->block.hash : 0;
+        if (block.payload_len > MAX_PAYLOAD || block.prev_hash != tip_hash) {
+            break;
+        }
+
+        if (pruned) {
+            if (append_header(pblock_chain, &block) != 0) {
+                break;
+            }
+        } else {
+            char * payload = malloc((size_t)block.payload_len + 1);
+            if (payload == NULL) {
+                fprintf(stderr, "Journal: failed to allocate memory for payload\n");
+                fclose(fp);
+                return -1;
+            }
+            if (block.payload_len > 0 && fread(payload, block.payload_len, 1, fp) != 1) {
+                free(payload);
+                break;
+            }
+            payload[block.payload_len] = '\0';
+            if (seal_hash(hash_payload(payload, block.payload_len), block.timestamp) != block.hash ||
+                    append_block(pblock_chain, payload, block.payload_len, block.hash,
+                        block.timestamp) != 0) {
+                free(payload);
+                break;
+            }
+        }
+        good += sizeof(header) + (pruned ? 0 : block.payload_len);
+    }
+    fclose(fp);
+
+    if (good < size) {
+        fprintf(stderr, "Journal: discarding %lld bytes after last complete record\n",
+                (long long)(size - good));
+        if (ftruncate(pjournal->fd, good) != 0 || fdatasync(pjournal->fd) != 0) {
+            perror("Journal: truncate");
+            return -1;
+        }
+    }
+    if (lseek(pjournal->fd, 0, SEEK_END) == -1) {
+        perror("Journal: lseek");
+        return -1;
+    }
+    pjournal->appended = pjournal->durable = pblock_chain->len;
+    printf("Journal: recovered %u blocks\n", pblock_chain->len);
+    return 0;
+}
+
+/**
+ * Queue bytes for writing, writing the buffer out first if they would not fit. Data larger
+ * than the buffer is written straight from where it is. Caller holds the journal's lock
+ * @return 0 on success, -1 on write failure
+ */
+static int buffer_bytes(struct Journal * pjournal, const void * data, size_t len) {
+    if (pjournal->len + len > JOURNAL_BUFFER_SZ && flush_buffer(pjournal) != 0) {
+        return -1;
+    }
+    if (len > JOURNAL_BUFFER_SZ) {
+        return write_all(pjournal->fd, data, len);
+    }
+    memcpy(pjournal->buf + pjournal->len, data, len);
+    pjournal->len += len;
+    return 0;
+}
+
+/**
+ * Write out buffered records. Caller holds the journal's lock
+ * @return 0 on success, -1 on write failure
+ */
+static int flush_buffer(struct Journal * pjournal) {
+    if (pjournal->len > 0 && write_all(pjournal->fd, pjournal->buf, pjournal->len) != 0) {
+        return -1;
+    }
+    pjournal->len = 0;
+    return 0;
+}
+
+/**
+ * Write a whole buffer, retrying short writes
+ * @return 0 on success, -1 on failure
+ */
+static int write_all(int fd, const void * data, size_t len) {
+    const uint8_t * p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            perror("Journal: write");
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
@@ -0,0 +1,612 @@
+/**
+ * In-memory transport for running many nodes in one process. Each connection is a
+ * pair of AF_UNIX socket pairs with a relay thread in the middle, so nodes reach
+ * each other through connect_to_node and get_client and run their real endpoints,
+ * sync and subscriptions unchanged. The relay holds back every chunk of bytes it
+ * carries for the link's latency and jitter, the sender's upload bandwidth and the
+ * retransmission of any lost segments, and stops reading a sender whose receiver
+ * falls behind so backpressure reaches it as it would over TCP
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "memnet.h"
+
+#define RELAY_EVENTS 64 //Events harvested per relay wait
+
+//Bytes read from a sender, held until they are due at the receiver
+struct MemChunk {
+    struct MemChunk * next;
+    uint64_t due_us; //time the last of its segments arrives
+    size_t len;
+    size_t sent; //bytes already written to the receiver
+    uint8_t data[];
+};
+
+//One direction of a connection
+struct MemPipe {
+    int in_fd; //relay end the sender's bytes are read from
+    int out_fd; //relay end the receiver's bytes are written to
+    uint32_t sender; //node whose upload carries this direction
+    uint64_t rng; //splitmix64 state for jitter and loss of this direction
+    uint64_t last_due_us; //due time of the last chunk so chunks arrive in order
+    struct MemChunk * head;
+    struct MemChunk * tail;
+    size_t queued; //bytes held in chunks
+    int eof; //sender closed its end
+    int blocked; //receiver's buffer was full on the last write
+    int done; //nothing more will be carried
+};
+
+//Relay end of a connection as registered with epoll. Read for one direction, written for the other
+struct MemEnd {
+    struct MemConn * pconn;
+    int side;
+    uint32_t events; //events currently registered
+    int hung_up; //peer closed. Removed from epoll
+};
+
+struct MemConn {
+    int fds[2]; //relay ends. 0 pairs with the connector's socket, 1 with the acceptor's
+    struct MemPipe pipes[2]; //0 carries connector to acceptor, 1 acceptor to connector
+    struct MemEnd ends[2];
+    struct MemConn * next;
+};
+
+//Internal functions
+static int memnet_connect(void * arg, const char * node_address, const char * servname);
+static int memnet_accept(void * arg, int listenfd);
+static uint64_t next_random(uint64_t * pstate);
+static void * relay_thread(void * arg);
+static void adopt_conns(struct MemNet * pnet);
+static void relay_read(struct MemNet * pnet, struct MemPipe * ppipe, int hung_up);
+static void relay_write(struct MemPipe * ppipe, uint64_t now);
+static void update_events(struct MemNet * pnet, struct MemConn * pconn, int side);
+static void drop_chunks(struct MemPipe * ppipe);
+static void free_conns(struct MemConn * pconn);
+
+/**
+ * Create a network of nodes and start its relay. Nodes are reachable once they listen
+ * @param pnet network to initialise. Install pnet->transport with set_transport to use it
+ * @param n_nodes number of nodes, addressed 0 to n_nodes - 1
+ * @param plinks shaping applied to every connection
+ * @return 0 on success, -1 on failure
+ */
+int initialise_memnet(struct MemNet * pnet, uint32_t n_nodes, const struct MemLinks * plinks) {
+    memset(pnet, 0, sizeof(*pnet));
+    pnet->transport.connect = memnet_connect;
+    pnet->transport.accept = memnet_accept;
+    pnet->transport.arg = pnet;
+    pnet->links = *plinks;
+    pnet->n_nodes = n_nodes;
+    pnet->epoll_fd = pnet->wake_fd = -1;
+    pnet->listeners = calloc(n_nodes, sizeof(struct MemListener));
+    pnet->pair_conns = calloc((size_t)n_nodes * n_nodes, sizeof(uint32_t));
+    pnet->busy_until_us = calloc(n_nodes, sizeof(uint64_t));
+    if (pnet->listeners == NULL || pnet->pair_conns == NULL || pnet->busy_until_us == NULL) {
+        fprintf(stderr, "Memnet: failed to allocate memory for %u nodes\n", n_nodes);
+        goto fail;
+    }
+    for (uint32_t i = 0; i < n_nodes; i++) {
+        pnet->listeners[i].fd = -1;
+    }
+
+    pnet->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    pnet->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pnet->epoll_fd == -1 || pnet->wake_fd == -1) {
+        perror("Memnet: epoll");
+        goto fail;
+    }
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(pnet->epoll_fd, EPOLL_CTL_ADD, pnet->wake_fd, &event) == -1) {
+        perror("Memnet: epoll_ctl");
+        goto fail;
+    }
+    pthread_mutex_init(&pnet->lock, NULL);
+
+    pnet->running = 1;
+    if (pthread_create(&pnet->relay, NULL, relay_thread, pnet) != 0) {
+        fprintf(stderr, "Memnet: failed to start relay thread\n");
+        pthread_mutex_destroy(&pnet->lock);
+        goto fail;
+    }
+    return 0;
+
+fail:
+    if (pnet->epoll_fd != -1) {
+        close(pnet->epoll_fd);
+    }
+    if (pnet->wake_fd != -1) {
+        close(pnet->wake_fd);
+    }
+    free(pnet->listeners);
+    free(pnet->pair_conns);
+    free(pnet->busy_until_us);
+    pnet->listeners = NULL;
+    return -1;
+}
+
+/**
+ * Stop the relay and close every connection it carries, every listener and every
+ * connection left waiting to be accepted. Nodes must no longer use the network
+ * @param pnet network to deinitialise
+ * @return void
+ */
+void deinitialise_memnet(struct MemNet * pnet) {
+    uint64_t one = 1;
+
+    pnet->running = 0;
+    if (write(pnet->wake_fd, &one, sizeof(one)) == -1) {
+        perror("Memnet: wake relay");
+    }
+    pthread_join(pnet->relay, NULL);
+
+    free_conns(pnet->conns);
+    free_conns(pnet->adopted);
+    for (uint32_t i = 0; i < pnet->n_nodes; i++) {
+        struct MemListener * plistener = &pnet->listeners[i];
+        for (uint32_t j = 0; j < plistener->count; j++) {
+            close(plistener->queue[(plistener->head + j) % MEMNET_BACKLOG]);
+        }
+        if (plistener->fd != -1) {
+            close(plistener->fd);
+        }
+    }
+    close(pnet->epoll_fd);
+    close(pnet->wake_fd);
+    pthread_mutex_destroy(&pnet->lock);
+    free(pnet->listeners);
+    free(pnet->pair_conns);
+    free(pnet->busy_until_us);
+    pnet->listeners = NULL;
+}
+
+/**
+ * Start accepting connections to a node
+ * @param pnet network the node is part of
+ * @param node node to listen as
+ * @return listener to poll for readability and pass to get_client, or -1 on failure. Closed
+ * by deinitialise_memnet
+ */
+int memnet_listen(struct MemNet * pnet, uint32_t node) {
+    //semaphore so each read takes exactly one waiting connection
+    int fd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd == -1) {
+        perror("Memnet: eventfd");
+        return -1;
+    }
+    pthread_mutex_lock(&pnet->lock);
+    pnet->listeners[node].fd = fd;
+    pthread_mutex_unlock(&pnet->lock);
+    return fd;
+}
+
+/**
+ * Current time on the clock the relay shapes links by
+ * @return microseconds since an arbitrary fixed point
+ */
+uint64_t memnet_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/**
+ * Transport connect. Joins the connector and a socket queued on the listener of the node
+ * connected to through the relay
+ * @param arg MemNet
+ * @param node_address sim<from> naming the connecting node
+ * @param servname node connected to
+ * @return connector's socket, or -1 if the node is not listening or its backlog is full
+ */
+static int memnet_connect(void * arg, const char * node_address, const char * servname) {
+    struct MemNet * pnet = arg;
+    char * end_from, * end_to;
+    int pair_a[2], pair_b[2];
+
+    if (strncmp(node_address, MEMNET_HOST, strlen(MEMNET_HOST)) != 0) {
+        fprintf(stderr, "Memnet: invalid peer %s:%s\n", node_address, servname);
+        return -1;
+    }
+    unsigned long from = strtoul(node_address + strlen(MEMNET_HOST), &end_from, 10);
+    unsigned long to = strtoul(servname, &end_to, 10);
+    if (*end_from != '\0' || *end_to != '\0' || from >= pnet->n_nodes || to >= pnet->n_nodes) {
+        fprintf(stderr, "Memnet: invalid peer %s:%s\n", node_address, servname);
+        return -1;
+    }
+
+    struct MemConn * pconn = calloc(1, sizeof(struct MemConn));
+    if (pconn == NULL) {
+        fprintf(stderr, "Memnet: failed to allocate memory for connection\n");
+        return -1;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair_a) == -1) {
+        perror("Memnet: socketpair");
+        free(pconn);
+        return -1;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair_b) == -1) {
+        perror("Memnet: socketpair");
+        close(pair_a[0]);
+        close(pair_a[1]);
+        free(pconn);
+        return -1;
+    }
+    //only the relay's ends are non-blocking. Nodes see ordinary blocking sockets
+    fcntl(pair_a[1], F_SETFL, O_NONBLOCK);
+    fcntl(pair_b[0], F_SETFL, O_NONBLOCK);
+    pconn->fds[0] = pair_a[1];
+    pconn->fds[1] = pair_b[0];
+
+    pthread_mutex_lock(&pnet->lock);
+    struct MemListener * plistener = &pnet->listeners[to];
+    if (plistener->fd == -1 || plistener->count == MEMNET_BACKLOG || !pnet->running) {
+        pthread_mutex_unlock(&pnet->lock);
+        fprintf(stderr, "Memnet: node %lu refused connection from node %lu\n", to, from);
+        close(pair_a[0]);
+        close(pair_a[1]);
+        close(pair_b[0]);
+        close(pair_b[1]);
+        free(pconn);
+        errno = ECONNREFUSED;
+        return -1;
+    }
+
+    //each direction draws from its own generator so its jitter and loss do not depend on
+    //how other connections interleave with it
+    uint32_t nth = pnet->pair_conns[from * pnet->n_nodes + to]++;
+    for (int side = 0; side < 2; side++) {
+        struct MemPipe * ppipe = &pconn->pipes[side];
+        ppipe->in_fd = pconn->fds[side];
+        ppipe->out_fd = pconn->fds[1 - side];
+        ppipe->sender = side == 0 ? (uint32_t)from : (uint32_t)to;
+        ppipe->rng = pnet->links.seed ^ ((uint64_t)from << 44) ^ ((uint64_t)to << 24) ^
+            ((uint64_t)nth << 1) ^ (uint64_t)side;
+        next_random(&ppipe->rng);
+        pconn->ends[side].pconn = pconn;
+        pconn->ends[side].side = side;
+    }
+    pconn->next = pnet->adopted;
+    pnet->adopted = pconn;
+
+    plistener->queue[(plistener->head + plistener->count++) % MEMNET_BACKLOG] = pair_b[1];
+    pnet->connections++;
+    uint64_t one = 1;
+    if (write(plistener->fd, &one, sizeof(one)) == -1 || write(pnet->wake_fd, &one, sizeof(one)) == -1) {
+        perror("Memnet: wake");
+    }
+    pthread_mutex_unlock(&pnet->lock);
+    return pair_a[0];
+}
+
+/**
+ * Transport accept. Takes the oldest connection waiting on a node's listener
+ * @param arg MemNet
+ * @param listenfd listener returned by memnet_listen
+ * @return acceptor's socket, or -1 if none is waiting
+ */
+static int memnet_accept(void * arg, int listenfd) {
+    struct MemNet * pnet = arg;
+    uint64_t taken;
+    int fd = -1;
+
+    pthread_mutex_lock(&pnet->lock);
+    for (uint32_t i = 0; i < pnet->n_nodes; i++) {
+        struct MemListener * plistener = &pnet->listeners[i];
+        if (plistener->fd != listenfd) {
+            continue;
+        }
+        if (plistener->count > 0 && read(listenfd, &taken, sizeof(taken)) == sizeof(taken)) {
+            fd = plistener->queue[plistener->head];
+            plistener->head = (plistener->head + 1) % MEMNET_BACKLOG;
+            plistener->count--;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&pnet->lock);
+    return fd;
+}
+
+/**
+ * Draw the next number from a splitmix64 generator
+ * @param pstate generator state
+ * @return 64 random bits
+ */
+static uint64_t next_random(uint64_t * pstate) {
+    uint64_t z = (*pstate += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * Relay thread. Reads whatever senders have written, holds it until it is due and writes it
+ * to the receivers, waking for readable and writable ends or the next chunk falling due
+ * @param arg MemNet
+ * @return NULL
+ */
+static void * relay_thread(void * arg) {
+    struct MemNet * pnet = arg;
+    struct epoll_event events[RELAY_EVENTS];
+    int timeout = -1;
+
+    while (pnet->running) {
+        int n = epoll_wait(pnet->epoll_fd, events, RELAY_EVENTS, timeout);
+        if (n == -1 && errno != EINTR) {
+            perror("Memnet: epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            struct MemEnd * pend = events[i].data.ptr;
+            if (pend == NULL) {
+                uint64_t woken;
+                if (read(pnet->wake_fd, &woken, sizeof(woken)) == -1 && errno != EAGAIN) {
+                    perror("Memnet: read wake");
+                }
+                adopt_conns(pnet);
+                continue;
+            }
+            struct MemConn * pconn = pend->pconn;
+            int hung_up = (events[i].events & (EPOLLHUP | EPOLLERR)) != 0;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                relay_read(pnet, &pconn->pipes[pend->side], hung_up);
+            }
+            if (events[i].events & EPOLLOUT) {
+                pconn->pipes[1 - pend->side].blocked = 0;
+            }
+            if (hung_up && !pend->hung_up) {
+                //nothing written to a closed socket is ever read
+                struct MemPipe * pout = &pconn->pipes[1 - pend->side];
+                drop_chunks(pout);
+                pout->done = 1;
+                pend->hung_up = 1;
+                epoll_ctl(pnet->epoll_fd, EPOLL_CTL_DEL, pconn->fds[pend->side], NULL);
+            }
+        }
+
+        //write out every chunk now due and free connections neither side will use again
+        uint64_t now = memnet_now_us();
+        uint64_t next_due = UINT64_MAX;
+        struct MemConn ** pprev = &pnet->conns;
+        while (*pprev != NULL) {
+            struct MemConn * pconn = *pprev;
+            for (int side = 0; side < 2; side++) {
+                struct MemPipe * ppipe = &pconn->pipes[side];
+                relay_write(ppipe, now);
+                if (!ppipe->done && !ppipe->blocked && ppipe->head != NULL && ppipe->head->due_us < next_due) {
+                    next_due = ppipe->head->due_us;
+                }
+            }
+            if (pconn->pipes[0].done && pconn->pipes[1].done) {
+                *pprev = pconn->next;
+                pconn->next = NULL;
+                free_conns(pconn);
+                continue;
+            }
+            update_events(pnet, pconn, 0);
+            update_events(pnet, pconn, 1);
+            pprev = &pconn->next;
+        }
+        timeout = next_due == UINT64_MAX ? -1 :
+            next_due <= now ? 0 : (int)((next_due - now + 999) / 1000);
+    }
+    return NULL;
+}
+
+/**
+ * Start relaying connections made since the relay last ran
+ * @param pnet network
+ * @return void
+ */
+static void adopt_conns(struct MemNet * pnet) {
+    pthread_mutex_lock(&pnet->lock);
+    struct MemConn * pconn = pnet->adopted;
+    pnet->adopted = NULL;
+    pthread_mutex_unlock(&pnet->lock);
+
+    while (pconn != NULL) {
+        struct MemConn * next = pconn->next;
+        for (int side = 0; side < 2; side++) {
+            struct epoll_event event = {.events = EPOLLIN, .data.ptr = &pconn->ends[side]};
+            if (epoll_ctl(pnet->epoll_fd, EPOLL_CTL_ADD, pconn->fds[side], &event) == -1) {
+                perror("Memnet: epoll_ctl");
+            }
+            pconn->ends[side].events = EPOLLIN;
+        }
+        pconn->next = pnet->conns;
+        pnet->conns = pconn;
+        pconn = next;
+    }
+}
+
+/**
+ * Read what a sender has written and queue it to arrive once it has crossed the link. It
+ * waits for the sender's upload to be free, then takes the latency plus jitter. Each lost
+ * segment is sent again: one round trip later if a segment after it triggers fast
+ * retransmit, or after the retransmission timeout if it was the last
+ * @param pnet network
+ * @param ppipe direction to read
+ * @param hung_up sender has closed, so read whatever is left regardless of what is queued
+ * @return void
+ */
+static void relay_read(struct MemNet * pnet, struct MemPipe * ppipe, int hung_up) {
+    const struct MemLinks * plinks = &pnet->links;
+    uint8_t buf[MEMNET_READ_BYTES];
+
+    if (ppipe->eof || ppipe->done || (!hung_up && ppipe->queued >= MEMNET_QUEUE_BYTES)) {
+        return;
+    }
+    ssize_t len = read(ppipe->in_fd, buf, sizeof(buf));
+    if (len == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (len <= 0) {
+        ppipe->eof = 1;
+        return;
+    }
+
+    size_t n_segs = ((size_t)len + MEMNET_MSS - 1) / MEMNET_MSS;
+    uint64_t resent = 0, recovery_us = 0;
+    if (plinks->loss > 0) {
+        uint64_t rtt_us = 2 * plinks->latency_us;
+        for (size_t s = 0; s < n_segs; s++) {
+            size_t seg_len = s + 1 < n_segs ? MEMNET_MSS : (size_t)len - s * MEMNET_MSS;
+            while ((next_random(&ppipe->rng) >> 11) * (1.0 / 9007199254740992.0) < plinks->loss) {
+                resent += seg_len;
+                if (s + 1 < n_segs) {
+                    recovery_us += rtt_us;
+                } else {
+                    recovery_us += rtt_us > MEMNET_MIN_RTO_US ? rtt_us : MEMNET_MIN_RTO_US;
+                }
+            }
+        }
+    }
+
+    uint64_t wire = (uint64_t)len + resent;
+    uint64_t now = memnet_now_us();
+    uint64_t * pbusy = &pnet->busy_until_us[ppipe->sender];
+    uint64_t start = *pbusy > now ? *pbusy : now;
+    *pbusy = plinks->bandwidth > 0 ? start + (wire * 1000000 + plinks->bandwidth - 1) / plinks->bandwidth : start;
+    uint64_t due = *pbusy + plinks->latency_us + recovery_us;
+    if (plinks->jitter_us > 0) {
+        due += next_random(&ppipe->rng) % (plinks->jitter_us + 1);
+    }
+    if (due < ppipe->last_due_us) {
+        due = ppipe->last_due_us;
+    }
+    ppipe->last_due_us = due;
+    pnet->bytes += wire;
+    pnet->retransmitted += resent;
+
+    struct MemChunk * pchunk = malloc(sizeof(struct MemChunk) + (size_t)len);
+    if (pchunk == NULL) {
+        //as if the connection reset
+        fprintf(stderr, "Memnet: failed to allocate memory for %zd bytes\n", len);
+        ppipe->eof = 1;
+        return;
+    }
+    pchunk->next = NULL;
+    pchunk->due_us = due;
+    pchunk->len = (size_t)len;
+    pchunk->sent = 0;
+    memcpy(pchunk->data, buf, (size_t)len);
+    if (ppipe->tail != NULL) {
+        ppipe->tail->next = pchunk;
+    } else {
+        ppipe->head = pchunk;
+    }
+    ppipe->tail = pchunk;
+    ppipe->queued += (size_t)len;
+}
+
+/**
+ * Write every due chunk of a direction to its receiver until its buffer is full. Once the
+ * sender has closed and everything is written the receiver is shown the end of the stream.
+ * A receiver that has gone away ends the direction and the sender's writes start failing
+ * @param ppipe direction to write
+ * @param now current time
+ * @return void
+ */
+static void relay_write(struct MemPipe * ppipe, uint64_t now) {
+    while (!ppipe->done && !ppipe->blocked && ppipe->head != NULL && ppipe->head->due_us <= now) {
+        struct MemChunk * pchunk = ppipe->head;
+        ssize_t n = send(ppipe->out_fd, pchunk->data + pchunk->sent, pchunk->len - pchunk->sent,
+                MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EAGAIN) {
+                ppipe->blocked = 1;
+            } else if (errno != EINTR) {
+                drop_chunks(ppipe);
+                ppipe->done = 1;
+                shutdown(ppipe->in_fd, SHUT_RD);
+            }
+            continue;
+        }
+        pchunk->sent += (size_t)n;
+        if (pchunk->sent == pchunk->len) {
+            ppipe->head = pchunk->next;
+            if (ppipe->head == NULL) {
+                ppipe->tail = NULL;
+            }
+            ppipe->queued -= pchunk->len;
+            free(pchunk);
+        }
+    }
+    if (!ppipe->done && ppipe->eof && ppipe->head == NULL) {
+        shutdown(ppipe->out_fd, SHUT_WR);
+        ppipe->done = 1;
+    }
+}
+
+/**
+ * Register the events a relay end is waiting on. It is read while its direction has room
+ * and written once its receiver's buffer was found full
+ * @param pnet network
+ * @param pconn connection
+ * @param side end to update
+ * @return void
+ */
+static void update_events(struct MemNet * pnet, struct MemConn * pconn, int side) {
+    struct MemEnd * pend = &pconn->ends[side];
+    const struct MemPipe * pin = &pconn->pipes[side];
+    const struct MemPipe * pout = &pconn->pipes[1 - side];
+    uint32_t events = 0;
+
+    if (pend->hung_up) {
+        return;
+    }
+    if (!pin->eof && !pin->done && pin->queued < MEMNET_QUEUE_BYTES) {
+        events |= EPOLLIN;
+    }
+    if (pout->blocked && !pout->done) {
+        events |= EPOLLOUT;
+    }
+    if (events != pend->events) {
+        struct epoll_event event = {.events = events, .data.ptr = pend};
+        if (epoll_ctl(pnet->epoll_fd, EPOLL_CTL_MOD, pconn->fds[side], &event) == -1) {
+            perror("Memnet: epoll_ctl");
+        }
+        pend->events = events;
+    }
+}
+
+/**
+ * Discard everything queued in a direction
+ * @param ppipe direction to empty
+ * @return void
+ */
+static void drop_chunks(struct MemPipe * ppipe) {
+    while (ppipe->head != NULL) {
+        struct MemChunk * next = ppipe->head->next;
+        free(ppipe->head);
+        ppipe->head = next;
+    }
+    ppipe->tail = NULL;
+    ppipe->queued = 0;
+}
+
+/**
+ * Close and free a list of connections
+ * @param pconn first connection of list
+ * @return void
+ */
+static void free_conns(struct MemConn * pconn) {
+    while (pconn != NULL) {
+        struct MemConn * next = pconn->next;
+        drop_chunks(&pconn->pipes[0]);
+        drop_chunks(&pconn->pipes[1]);
+        close(pconn->fds[0]);
+        close(pconn->fds[1]);
+        free(pconn);
+        pconn = next;
+    }
+}
@@ -0,0 +1,1083 @@
+/**
+ * Deterministic discrete-event simulation of many nodes in one process. Nodes hold
+ * real chains and exchange real wire encoded blocks, headers and payload ranges over
+ * simulated links with latency, jitter, per-node upload bandwidth and segment loss.
+ * Node 0 produces blocks which are pushed down a random subscription mesh, and joiners
+ * sync the finished chain headers-first from several peers before subscribing for the
+ * blocks they missed. Time is simulated so runs take only as long as the work on the
+ * blocks themselves and the same configuration always gives the same report. The
+ * endpoints block on their sockets so their protocol is modelled here rather than run;
+ * netsim_live.c runs the real endpoints instead, at the cost of reproducibility
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+
+#include "netsim.h"
+#include "requests.h"
+#include "chain_sync.h"
+
+#define SIM_RANGE_ATTEMPTS 64 //Times a joiner asks for a range before giving up on the sync
+#define SIM_RETRY_FLOOR_US 1000 //Least time a joiner waits before asking again for a range a peer lacked
+#define SIM_MAX_CONNS 64 //Upper bound on sync_peers * conns_per_peer
+
+enum SimEventType {
+    SIM_PRODUCE, //node 0 appends the next block
+    SIM_DELIVER, //a message arrives at its destination
+    SIM_JOIN, //a joiner starts syncing
+    SIM_WAKE //a joiner's sync connection is ready to ask for another range
+};
+
+enum SimMsgType {
+    SIM_SUBSCRIBE, //subscribe request with start height
+    SIM_SUBSCRIBED, //confirmation of a subscription
+    SIM_FRAME, //block pushed to a subscriber
+    SIM_HEADERS_REQ,
+    SIM_HEADERS,
+    SIM_PAYLOADS_REQ,
+    SIM_PAYLOADS
+};
+
+//Bytes in flight from one node to another
+struct SimMsg {
+    enum SimMsgType type;
+    uint32_t from;
+    uint32_t to;
+    uint32_t conn; //sync connection of the joiner a payload range belongs to
+    size_t len; //bytes in data
+    uint8_t data[]; //bytes as they are sent on a node's socket
+};
+
+struct SimEvent {
+    uint64_t time;
+    uint64_t seq; //breaks ties in time so events at one time run in the order scheduled
+    enum SimEventType type;
+    uint32_t node;
+    uint32_t arg; //connection woken by SIM_WAKE
+    struct SimMsg * pmsg; //message delivered by SIM_DELIVER
+};
+
+//Downstream node an upstream pushes blocks to
+struct SimSub {
+    uint32_t node;
+    uint32_t next_height; //height of next block to push
+};
+
+//Sync connection of a joiner to one of its peers
+struct SimConn {
+    uint32_t peer;
+    uint32_t range; //range being fetched
+    int busy; //set while a request is outstanding
+};
+
+//Headers-first sync of a joiner, as run by chain_sync but over simulated connections
+struct SimJoin {
+    struct SimSync * presult;
+    uint32_t peers[NETSIM_MAX_DEGREE];
+    uint32_t n_peers;
+    struct SimConn conns[SIM_MAX_CONNS];
+    uint32_t n_conns;
+    struct BlockHeader * headers;
+    char ** payloads; //received payloads by height. Moved into the chain once all are in
+    uint32_t n_blocks;
+    uint32_t n_ranges;
+    uint32_t next_range; //next range never handed out
+    uint32_t * retry; //ranges waiting to be fetched again
+    uint32_t retry_len;
+    uint8_t * attempts; //times each range has been asked for
+    uint32_t completed; //ranges received in full
+    uint64_t start_us;
+    uint64_t done_us;
+    int assembled; //set once the chain is assembled and the joiner is subscribed
+};
+
+struct SimNode {
+    struct BlockChain chain;
+    uint64_t * arrivals; //time each height was appended at
+    uint32_t ups[NETSIM_MAX_DEGREE]; //nodes subscribed to
+    uint32_t up_next[NETSIM_MAX_DEGREE]; //height of next block expected from each of ups
+    uint32_t n_ups;
+    struct SimSub * subs; //nodes subscribed to this one
+    uint32_t n_subs;
+    uint32_t subs_cap;
+    uint64_t egress_busy_until; //time the node's upload link is free
+    struct SimJoin * pjoin; //NULL unless node is a joiner
+};
+
+struct Sim {
+    const struct SimConfig * pconfig;
+    struct SimReport * preport;
+    uint64_t rng; //splitmix64 state
+    uint64_t now;
+    uint64_t seq;
+    struct SimEvent * heap; //min heap of pending events by time then seq
+    size_t heap_len;
+    size_t heap_cap;
+    struct SimNode * nodes; //n_nodes nodes followed by joiners
+    uint32_t n_total;
+    uint64_t * last_arrival; //latest arrival on each directed link so messages stay in order
+    uint64_t * produced; //time each height was produced at
+    int failed; //set on allocation failure
+};
+
+//Internal functions
+static uint64_t next_random(struct Sim * psim);
+static int push_event(struct Sim * psim, struct SimEvent event);
+static struct SimEvent pop_event(struct Sim * psim);
+static struct SimMsg * new_msg(struct Sim * psim, enum SimMsgType type, uint32_t from, uint32_t to,
+        size_t len);
+static void send_msg(struct Sim * psim, struct SimMsg * pmsg);
+static void pick_nodes(struct Sim * psim, uint32_t below, uint32_t want, uint32_t * out, uint32_t * pn);
+static void subscribe_node(struct Sim * psim, uint32_t node, uint32_t up, uint32_t start);
+static void push_backlog(struct Sim * psim, uint32_t node, struct SimSub * psub);
+static void push_block(struct Sim * psim, uint32_t node);
+static void produce_block(struct Sim * psim);
+static void receive_frame(struct Sim * psim, struct SimMsg * pmsg);
+static void join_node(struct Sim * psim, uint32_t node);
+static void serve_headers(struct Sim * psim, struct SimMsg * pmsg);
+static void receive_headers(struct Sim * psim, struct SimMsg * pmsg);
+static void request_range(struct Sim * psim, uint32_t node, uint32_t conn);
+static void serve_payloads(struct Sim * psim, struct SimMsg * pmsg);
+static void receive_payloads(struct Sim * psim, struct SimMsg * pmsg);
+static void retry_range(struct Sim * psim, uint32_t node, uint32_t conn);
+static void assemble_chain(struct Sim * psim, uint32_t node);
+static void deliver_msg(struct Sim * psim, struct SimMsg * pmsg);
+static int compare_u64(const void * a, const void * b);
+static uint64_t percentile(const uint64_t * sorted, size_t len, unsigned pct);
+static void measure_propagation(struct Sim * psim);
+static void free_sim(struct Sim * psim);
+
+/**
+ * Simulate a network of nodes producing, propagating and syncing a chain
+ * @param pconfig network and workload to simulate
+ * @param preport filled with measurements of the run
+ * @return 0 on success, -1 on invalid configuration or failure
+ */
+int run_simulation(const struct SimConfig * pconfig, struct SimReport * preport) {
+    struct Sim sim;
+
+    if (pconfig->n_nodes == 0 || pconfig->n_nodes > NETSIM_MAX_NODES
+            || pconfig->n_joiners > NETSIM_MAX_JOINERS) {
+        fprintf(stderr, "Netsim: need 1 to %d nodes and at most %d joiners\n", NETSIM_MAX_NODES,
+                NETSIM_MAX_JOINERS);
+        return -1;
+    }
+    if (pconfig->degree == 0 || pconfig->degree > NETSIM_MAX_DEGREE) {
+        fprintf(stderr, "Netsim: degree must be 1 to %d\n", NETSIM_MAX_DEGREE);
+        return -1;
+    }
+    if (pconfig->n_joiners > 0 && (pconfig->sync_peers == 0 || pconfig->sync_peers > NETSIM_MAX_DEGREE
+            || pconfig->conns_per_peer == 0
+            || pconfig->sync_peers * pconfig->conns_per_peer > SIM_MAX_CONNS)) {
+        fprintf(stderr, "Netsim: joiners need 1 to %d sync peers and at most %d connections\n",
+                NETSIM_MAX_DEGREE, SIM_MAX_CONNS);
+        return -1;
+    }
+    if (pconfig->payload_size == 0 || pconfig->payload_size > MAX_PAYLOAD || pconfig->loss < 0
+            || pconfig->loss >= 1) {
+        fprintf(stderr, "Netsim: payload size must be 1 to %d and loss below 1\n", MAX_PAYLOAD);
+        return -1;
+    }
+
+    memset(preport, 0, sizeof(*preport));
+    memset(&sim, 0, sizeof(sim));
+    sim.pconfig = pconfig;
+    sim.preport = preport;
+    sim.rng = pconfig->seed;
+    sim.n_total = pconfig->n_nodes + pconfig->n_joiners;
+    sim.nodes = calloc(sim.n_total, sizeof(struct SimNode));
+    sim.last_arrival = calloc((size_t)sim.n_total * sim.n_total, sizeof(uint64_t));
+    sim.produced = calloc((size_t)pconfig->n_blocks + 1, sizeof(uint64_t));
+    if (sim.nodes == NULL || sim.last_arrival == NULL || sim.produced == NULL) {
+        fprintf(stderr, "Netsim: failed to allocate memory for %u nodes\n", sim.n_total);
+        free_sim(&sim);
+        return -1;
+    }
+    for (uint32_t i = 0; i < sim.n_total; i++) {
+        struct SimNode * pnode = &sim.nodes[i];
+        pnode->chain = initialise_chain();
+        pnode->arrivals = malloc(((size_t)pconfig->n_blocks + 1) * sizeof(uint64_t));
+        if (pnode->arrivals == NULL) {
+            fprintf(stderr, "Netsim: failed to allocate memory for arrivals\n");
+            free_sim(&sim);
+            return -1;
+        }
+        for (uint32_t h = 0; h < pconfig->n_blocks; h++) {
+            pnode->arrivals[h] = UINT64_MAX;
+        }
+    }
+
+    //each node subscribes to upstreams drawn from the nodes before it so blocks flow away from
+    //node 0 and the mesh has no cycles
+    for (uint32_t i = 1; i < pconfig->n_nodes; i++) {
+        uint32_t ups[NETSIM_MAX_DEGREE], n_ups;
+        pick_nodes(&sim, i, pconfig->degree, ups, &n_ups);
+        for (uint32_t u = 0; u < n_ups; u++) {
+            subscribe_node(&sim, i, ups[u], 0);
+        }
+    }
+    if (pconfig->n_blocks > 0) {
+        push_event(&sim, (struct SimEvent){.time = 0, .type = SIM_PRODUCE});
+    } else {
+        for (uint32_t i = pconfig->n_nodes; i < sim.n_total; i++) {
+            push_event(&sim, (struct SimEvent){.time = 0, .type = SIM_JOIN, .node = i});
+        }
+    }
+
+    while (sim.heap_len > 0 && !sim.failed) {
+        struct SimEvent event = pop_event(&sim);
+        sim.now = event.time;
+        preport->events++;
+        switch (event.type) {
+            case SIM_PRODUCE:
+                produce_block(&sim);
+                break;
+            case SIM_DELIVER:
+                deliver_msg(&sim, event.pmsg);
+                free(event.pmsg);
+                break;
+            case SIM_JOIN:
+                join_node(&sim, event.node);
+                break;
+            case SIM_WAKE:
+                request_range(&sim, event.node, event.arg);
+                break;
+        }
+    }
+    preport->end_us = sim.now;
+
+    if (sim.failed) {
+        free_sim(&sim);
+        return -1;
+    }
+    measure_propagation(&sim);
+    preport->n_syncs = pconfig->n_joiners;
+    for (uint32_t i = pconfig->n_nodes; i < sim.n_total; i++) {
+        struct SimJoin * pjoin = sim.nodes[i].pjoin;
+        if (pjoin != NULL && !pjoin->assembled) {
+            pjoin->presult->failed = 1;
+        }
+    }
+    free_sim(&sim);
+    return 0;
+}
+
+/**
+ * Draw the next number from the simulation's splitmix64 generator
+ * @param psim simulation
+ * @return 64 random bits
+ */
+static uint64_t next_random(struct Sim * psim) {
+    uint64_t z = (psim->rng += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * Schedule an event. Its seq is assigned here
+ * @param psim simulation
+ * @param event event to schedule
+ * @return 0 on success, -1 on failure
+ */
+static int push_event(struct Sim * psim, struct SimEvent event) {
+    if (psim->heap_len == psim->heap_cap) {
+        size_t cap = psim->heap_cap == 0 ? 1024 : psim->heap_cap * 2;
+        struct SimEvent * heap = realloc(psim->heap, cap * sizeof(struct SimEvent));
+        if (heap == NULL) {
+            fprintf(stderr, "Netsim: failed to allocate memory for events\n");
+            psim->failed = 1;
+            free(event.pmsg);
+            return -1;
+        }
+        psim->heap = heap;
+        psim->heap_cap = cap;
+    }
+    event.seq = psim->seq++;
+
+    //sift up
+    size_t i = psim->heap_len++;
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        struct SimEvent * pparent = &psim->heap[parent];
+        if (pparent->time < event.time || (pparent->time == event.time && pparent->seq < event.seq)) {
+            break;
+        }
+        psim->heap[i] = *pparent;
+        i = parent;
+    }
+    psim->heap[i] = event;
+    return 0;
+}
+
+/**
+ * Remove the earliest event. Heap must not be empty
+ * @param psim simulation
+ * @return earliest event
+ */
+static struct SimEvent pop_event(struct Sim * psim) {
+    struct SimEvent top = psim->heap[0];
+    struct SimEvent last = psim->heap[--psim->heap_len];
+
+    //sift down
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= psim->heap_len) {
+            break;
+        }
+        struct SimEvent * pchild = &psim->heap[child];
+        if (child + 1 < psim->heap_len && (pchild[1].time < pchild->time
+                    || (pchild[1].time == pchild->time && pchild[1].seq < pchild->seq))) {
+            child++;
+            pchild++;
+        }
+        if (last.time < pchild->time || (last.time == pchild->time && last.seq < pchild->seq)) {
+            break;
+        }
+        psim->heap[i] = *pchild;
+        i = child;
+    }
+    if (psim->heap_len > 0) {
+        psim->heap[i] = last;
+    }
+    return top;
+}
+
+/**
+ * Allocate a message for data to be written into
+ * @param psim simulation
+ * @param type kind of message
+ * @param from sending node
+ * @param to receiving node
+ * @param len bytes of data
+ * @return message, or NULL on failure
+ */
+static struct SimMsg * new_msg(struct Sim * psim, enum SimMsgType type, uint32_t from, uint32_t to,
+        size_t len) {
+    struct SimMsg * pmsg = malloc(sizeof(struct SimMsg) + len);
+    if (pmsg == NULL) {
+        fprintf(stderr, "Netsim: failed to allocate memory for message\n");
+        psim->failed = 1;
+        return NULL;
+    }
+    pmsg->type = type;
+    pmsg->from = from;
+    pmsg->to = to;
+    pmsg->conn = 0;
+    pmsg->len = len;
+    return pmsg;
+}
+
+/**
+ * Put a message on the wire. It queues behind everything the sender is already
+ * uploading, then takes the link's latency plus jitter. Each lost segment is sent
+ * again: one round trip later if a segment after it triggers fast retransmit, or
+ * after the retransmission timeout if it was the last. Messages on a link arrive
+ * in the order they were sent, as on a TCP connection
+ * @param psim simulation
+ * @param pmsg message to send. Owned by the simulation from here on
+ */
+static void send_msg(struct Sim * psim, struct SimMsg * pmsg) {
+    const struct SimConfig * pconfig = psim->pconfig;
+    size_t n_segs = pmsg->len == 0 ? 1 : (pmsg->len + NETSIM_MSS - 1) / NETSIM_MSS;
+    uint64_t resent = 0, recovery_us = 0;
+
+    if (pconfig->loss > 0) {
+        uint64_t rtt_us = 2 * pconfig->latency_us;
+        for (size_t s = 0; s < n_segs; s++) {
+            size_t seg_len = s + 1 < n_segs ? NETSIM_MSS : pmsg->len - s * NETSIM_MSS;
+            while ((next_random(psim) >> 11) * (1.0 / 9007199254740992.0) < pconfig->loss) {
+                resent += seg_len;
+                if (s + 1 < n_segs) {
+                    recovery_us += rtt_us;
+                } else {
+                    recovery_us += rtt_us > NETSIM_MIN_RTO_US ? rtt_us : NETSIM_MIN_RTO_US;
+                }
+            }
+        }
+    }
+
+    uint64_t wire = pmsg->len + resent;
+    struct SimNode * psender = &psim->nodes[pmsg->from];
+    uint64_t start = psender->egress_busy_until > psim->now ? psender->egress_busy_until : psim->now;
+    if (pconfig->bandwidth > 0) {
+        psender->egress_busy_until = start + (wire * 1000000 + pconfig->bandwidth - 1) / pconfig->bandwidth;
+    } else {
+        psender->egress_busy_until = start;
+    }
+    uint64_t arrival = psender->egress_busy_until + pconfig->latency_us + recovery_us;
+    if (pconfig->jitter_us > 0) {
+        arrival += next_random(psim) % (pconfig->jitter_us + 1);
+    }
+    uint64_t * plast = &psim->last_arrival[(size_t)pmsg->from * psim->n_total + pmsg->to];
+    if (arrival < *plast) {
+        arrival = *plast;
+    }
+    *plast = arrival;
+
+    psim->preport->messages++;
+    psim->preport->bytes += wire;
+    psim->preport->retransmitted += resent;
+    push_event(psim, (struct SimEvent){.time = arrival, .type = SIM_DELIVER, .pmsg = pmsg});
+}
+
+/**
+ * Draw distinct nodes uniformly from those below a bound
+ * @param psim simulation
+ * @param below nodes are drawn from 0 to below - 1
+ * @param want number of nodes wanted. Fewer are drawn if below is smaller
+ * @param out filled with drawn nodes
+ * @param pn set to number of nodes drawn
+ */
+static void pick_nodes(struct Sim * psim, uint32_t below, uint32_t want, uint32_t * out, uint32_t * pn) {
+    uint32_t n = want < below ? want : below;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t candidate;
+        int taken;
+        do {
+            candidate = (uint32_t)(next_random(psim) % below);
+            taken = 0;
+            for (uint32_t j = 0; j < i; j++) {
+                taken |= out[j] == candidate;
+            }
+        } while (taken);
+        out[i] = candidate;
+    }
+    *pn = n;
+}
+
+/**
+ * Send a subscribe request from a node to an upstream, as request_subscribe_endpoint does
+ * @param psim simulation
+ * @param node subscribing node
+ * @param up node subscribed to
+ * @param start height of first block wanted
+ */
+static void subscribe_node(struct Sim * psim, uint32_t node, uint32_t up, uint32_t start) {
+    struct SimNode * pnode = &psim->nodes[node];
+    struct SimMsg * pmsg = new_msg(psim, SIM_SUBSCRIBE, node, up, sizeof(uint8_t) + sizeof(uint32_t));
+    if (pmsg == NULL) {
+        return;
+    }
+    uint32_t network_start = htonl(start);
+    pmsg->data[0] = ENDPOINT_SUBSCRIBE;
+    memcpy(pmsg->data + 1, &network_start, sizeof(uint32_t));
+
+    pnode->ups[pnode->n_ups] = up;
+    pnode->up_next[pnode->n_ups] = start;
+    pnode->n_ups++;
+    send_msg(psim, pmsg);
+}
+
+/**
+ * Push every block a subscriber has not been sent yet
+ * @param psim simulation
+ * @param node node holding the subscription
+ * @param psub subscriber to push to
+ */
+static void push_backlog(struct Sim * psim, uint32_t node, struct SimSub * psub) {
+    struct BlockChain * pchain = &psim->nodes[node].chain;
+    while (psub->next_height < pchain->len && !psim->failed) {
+        const struct Block * pblock = &get_link(pchain, psub->next_height)->block;
+        struct SimMsg * pmsg = new_msg(psim, SIM_FRAME, node, psub->node,
+                BLOCK_WIRE_HEADER_SZ + pblock->payload_len);
+        if (pmsg == NULL) {
+            return;
+        }
+        pack_block_header(pblock, pmsg->data);
+        memcpy(pmsg->data + BLOCK_WIRE_HEADER_SZ, pblock->payload, pblock->payload_len);
+        send_msg(psim, pmsg);
+        psub->next_height++;
+    }
+}
+
+/**
+ * Push a node's newly appended block to its subscribers
+ * @param psim simulation
+ * @param node node that appended a block
+ */
+static void push_block(struct Sim * psim, uint32_t node) {
+    struct SimNode * pnode = &psim->nodes[node];
+    for (uint32_t i = 0; i < pnode->n_subs; i++) {
+        push_backlog(psim, node, &pnode->subs[i]);
+    }
+}
+
+/**
+ * Append the next block to node 0's chain and push it out. Once the last block is
+ * produced the joiners start
+ * @param psim simulation
+ */
+static void produce_block(struct Sim * psim) {
+    const struct SimConfig * pconfig = psim->pconfig;
+    struct SimNode * pnode = &psim->nodes[0];
+    uint32_t height = pnode->chain.len;
+
+    //printable payload tagged with its height so no two are alike
+    char * payload = malloc((size_t)pconfig->payload_size + 1);
+    if (payload == NULL) {
+        fprintf(stderr, "Netsim: failed to allocate memory for payload\n");
+        psim->failed = 1;
+        return;
+    }
+    int tag = snprintf(payload, (size_t)pconfig->payload_size + 1, "%u:", height);
+    for (uint32_t i = tag < 0 ? 0 : (uint32_t)tag; i < pconfig->payload_size; i++) {
+        payload[i] = 'a' + (char)(next_random(psim) % 26);
+    }
+    payload[pconfig->payload_size] = '\0';
+
+    uint64_t timestamp = NETSIM_EPOCH_MS + psim->now / 1000;
+    uint32_t hash = seal_hash(hash_payload(payload, pconfig->payload_size), timestamp);
+    if (append_block(&pnode->chain, payload, pconfig->payload_size, hash, timestamp) != 0) {
+        free(payload);
+        psim->failed = 1;
+        return;
+    }
+    psim->produced[height] = psim->now;
+    pnode->arrivals[height] = psim->now;
+    push_block(psim, 0);
+
+    if (height + 1 < pconfig->n_blocks) {
+        push_event(psim, (struct SimEvent){.time = psim->now + pconfig->interval_us, .type = SIM_PRODUCE});
+        return;
+    }
+    for (uint32_t i = pconfig->n_nodes; i < psim->n_total; i++) {
+        push_event(psim, (struct SimEvent){.time = psim->now, .type = SIM_JOIN, .node = i});
+    }
+}
+
+/**
+ * Take a block pushed on a subscription. Blocks already held are counted as
+ * duplicates. The next block is checked to link to the tail and hash correctly
+ * before it is appended and pushed on
+ * @param psim simulation
+ * @param pmsg frame received
+ */
+static void receive_frame(struct Sim * psim, struct SimMsg * pmsg) {
+    struct SimNode * pnode = &psim->nodes[pmsg->to];
+    uint32_t up = 0;
+    while (up < pnode->n_ups && pnode->ups[up] != pmsg->from) {
+        up++;
+    }
+    if (up == pnode->n_ups) {
+        psim->preport->bad_blocks++;
+        return;
+    }
+    uint32_t height = pnode->up_next[up]++;
+
+    //already appended from another upstream
+    if (height < pnode->chain.len) {
+        psim->preport->duplicate_bytes += pmsg->len;
+        return;
+    }
+    struct Block header;
+    unpack_block_header(pmsg->data, &header);
+    uint32_t tail_hash = pnode->chain.tail == NULL ? 0 : pnode->chain.tail->block.hash;
+    if (height > pnode->chain.len || header.prev_hash != tail_hash) {
+        psim->preport->bad_blocks++;
+        return;
+    }
+    if (unpack_block_buf(pmsg->data, pmsg->len, &pnode->chain) <= 0) {
+        psim->preport->bad_blocks++;
+        return;
+    }
+    struct Block * pblock = &pnode->chain.tail->block;
+    pblock->prev_hash = tail_hash;
+    if (pblock->hash != header.hash) {
+        psim->preport->bad_blocks++;
+    }
+    pnode->arrivals[height] = psim->now;
+    push_block(psim, pmsg->to);
+
+    struct SimJoin * pjoin = pnode->pjoin;
+    if (pjoin != NULL && pnode->chain.len == psim->pconfig->n_blocks) {
+        pjoin->presult->catch_up_us = psim->now - pjoin->done_us;
+    }
+}
+
+/**
+ * Start a joiner's sync by asking its first peer for the headers of its chain
+ * @param psim simulation
+ * @param node joining node
+ */
+static void join_node(struct Sim * psim, uint32_t node) {
+    const struct SimConfig * pconfig = psim->pconfig;
+    struct SimNode * pnode = &psim->nodes[node];
+    struct SimJoin * pjoin = calloc(1, sizeof(struct SimJoin));
+    if (pjoin == NULL) {
+        fprintf(stderr, "Netsim: failed to allocate memory for sync\n");
+        psim->failed = 1;
+        return;
+    }
+    pnode->pjoin = pjoin;
+    pjoin->presult = &psim->preport->syncs[node - pconfig->n_nodes];
+    pjoin->start_us = psim->now;
+    pick_nodes(psim, pconfig->n_nodes, pconfig->sync_peers, pjoin->peers, &pjoin->n_peers);
+    for (uint32_t p = 0; p < pjoin->n_peers; p++) {
+        for (uint32_t c = 0; c < pconfig->conns_per_peer; c++) {
+            pjoin->conns[pjoin->n_conns++].peer = pjoin->peers[p];
+        }
+    }
+
+    struct SimMsg * pmsg = new_msg(psim, SIM_HEADERS_REQ, node, pjoin->peers[0], sizeof(uint8_t));
+    if (pmsg == NULL) {
+        return;
+    }
+    pmsg->data[0] = ENDPOINT_HEADERS;
+    send_msg(psim, pmsg);
+}
+
+/**
+ * Answer a headers request with the compact headers of the whole chain
+ * @param psim simulation
+ * @param pmsg request received
+ */
+static void serve_headers(struct Sim * psim, struct SimMsg * pmsg) {
+    struct BlockChain * pchain = &psim->nodes[pmsg->to].chain;
+    const size_t header_sz = 3 * sizeof(uint32_t) + sizeof(uint64_t);
+    struct SimMsg * presp = new_msg(psim, SIM_HEADERS, pmsg->to, pmsg->from,
+            sizeof(uint32_t) + (size_t)pchain->len * header_sz);
+    if (presp == NULL) {
+        return;
+    }
+    uint32_t network_u32 = htonl(pchain->len);
+    memcpy(presp->data, &network_u32, sizeof(uint32_t));
+    uint8_t * out = presp->data + sizeof(uint32_t);
+    for (struct Link * plink = pchain->head; plink != NULL; plink = plink->next) {
+        uint64_t network_u64 = htobe64(plink->block.timestamp);
+        network_u32 = htonl(plink->block.prev_hash);
+        memcpy(out, &network_u32, sizeof(uint32_t));
+        network_u32 = htonl(plink->block.hash);
+        memcpy(out + sizeof(uint32_t), &network_u32, sizeof(uint32_t));
+        network_u32 = htonl(plink->block.payload_len);
+        memcpy(out + 2 * sizeof(uint32_t), &network_u32, sizeof(uint32_t));
+        memcpy(out + 3 * sizeof(uint32_t), &network_u64, sizeof(uint64_t));
+        out += header_sz;
+    }
+    send_msg(psim, presp);
+}
+
+/**
+ * Decode the headers of the chain being synced, check they link and set every sync
+ * connection fetching ranges
+ * @param psim simulation
+ * @param pmsg headers received
+ */
+static void receive_headers(struct Sim * psim, struct SimMsg * pmsg) {
+    struct SimJoin * pjoin = psim->nodes[pmsg->to].pjoin;
+    const size_t header_sz = 3 * sizeof(uint32_t) + sizeof(uint64_t);
+    uint32_t network_u32;
+    uint64_t network_u64;
+
+    pjoin->presult->bytes += pmsg->len;
+    memcpy(&network_u32, pmsg->data, sizeof(uint32_t));
+    pjoin->n_blocks = ntohl(network_u32);
+    pjoin->n_ranges = (pjoin->n_blocks + SYNC_RANGE_BLOCKS - 1) / SYNC_RANGE_BLOCKS;
+    pjoin->headers = malloc(((size_t)pjoin->n_blocks + 1) * sizeof(struct BlockHeader));
+    pjoin->payloads = calloc((size_t)pjoin->n_blocks + 1, sizeof(char *));
+    pjoin->retry = malloc(((size_t)pjoin->n_ranges + 1) * sizeof(uint32_t));
+    pjoin->attempts = calloc((size_t)pjoin->n_ranges + 1, sizeof(uint8_t));
+    if (pjoin->headers == NULL || pjoin->payloads == NULL || pjoin->retry == NULL
+            || pjoin->attempts == NULL) {
+        fprintf(stderr, "Netsim: failed to allocate memory for %u headers\n", pjoin->n_blocks);
+        psim->failed = 1;
+        return;
+    }
+
+    const uint8_t * in = pmsg->data + sizeof(uint32_t);
+    uint32_t prev_hash = 0;
+    for (uint32_t i = 0; i < pjoin->n_blocks; i++, in += header_sz) {
+        struct BlockHeader * pheader = &pjoin->headers[i];
+        memcpy(&network_u32, in, sizeof(uint32_t));
+        pheader->prev_hash = ntohl(network_u32);
+        memcpy(&network_u32, in + sizeof(uint32_t), sizeof(uint32_t));
+        pheader->hash = ntohl(network_u32);
+        memcpy(&network_u32, in + 2 * sizeof(uint32_t), sizeof(uint32_t));
+        pheader->payload_len = ntohl(network_u32);
+        memcpy(&network_u64, in + 3 * sizeof(uint32_t), sizeof(uint64_t));
+        pheader->timestamp = be64toh(network_u64);
+        if (pheader->prev_hash != prev_hash) {
+            psim->preport->bad_blocks++;
+            return;
+        }
+        prev_hash = pheader->hash;
+    }
+
+    if (pjoin->n_ranges == 0) {
+        assemble_chain(psim, pmsg->to);
+        return;
+    }
+    for (uint32_t c = 0; c < pjoin->n_conns; c++) {
+        request_range(psim, pmsg->to, c);
+    }
+}
+
+/**
+ * Ask a sync connection's peer for the next range waiting to be fetched, ranges to
+ * retry first. The connection goes idle if none are waiting
+ * @param psim simulation
+ * @param node joining node
+ * @param conn connection to ask on
+ */
+static void request_range(struct Sim * psim, uint32_t node, uint32_t conn) {
+    struct SimJoin * pjoin = psim->nodes[node].pjoin;
+    struct SimConn * pconn = &pjoin->conns[conn];
+
+    if (pjoin->retry_len > 0) {
+        pconn->range = pjoin->retry[--pjoin->retry_len];
+    } else if (pjoin->next_range < pjoin->n_ranges) {
+        pconn->range = pjoin->next_range++;
+    } else {
+        pconn->busy = 0;
+        return;
+    }
+    pconn->busy = 1;
+    pjoin->attempts[pconn->range]++;
+
+    uint32_t start = pconn->range * SYNC_RANGE_BLOCKS;
+    uint32_t count = pjoin->n_blocks - start < SYNC_RANGE_BLOCKS ? pjoin->n_blocks - start
+        : SYNC_RANGE_BLOCKS;
+    struct SimMsg * pmsg = new_msg(psim, SIM_PAYLOADS_REQ, node, pconn->peer,
+            sizeof(uint8_t) + 2 * sizeof(uint32_t));
+    if (pmsg == NULL) {
+        return;
+    }
+    uint32_t network_start = htonl(start), network_count = htonl(count);
+    pmsg->data[0] = ENDPOINT_PAYLOADS;
+    memcpy(pmsg->data + 1, &network_start, sizeof(uint32_t));
+    memcpy(pmsg->data + 1 + sizeof(uint32_t), &network_count, sizeof(uint32_t));
+    pmsg->conn = conn;
+    send_msg(psim, pmsg);
+}
+
+/**
+ * Answer a payload range request with as much of the range as the chain holds
+ * @param psim simulation
+ * @param pmsg request received
+ */
+static void serve_payloads(struct Sim * psim, struct SimMsg * pmsg) {
+    struct BlockChain * pchain = &psim->nodes[pmsg->to].chain;
+    uint32_t network_u32;
+
+    memcpy(&network_u32, pmsg->data + 1, sizeof(uint32_t));
+    uint32_t start = ntohl(network_u32);
+    memcpy(&network_u32, pmsg->data + 1 + sizeof(uint32_t), sizeof(uint32_t));
+    uint32_t count = ntohl(network_u32);
+    if (start >= pchain->len) {
+        count = 0;
+    } else if (count > pchain->len - start) {
+        count = pchain->len - start;
+    }
+
+    size_t len = sizeof(uint32_t);
+    for (uint32_t i = 0; i < count; i++) {
+        len += sizeof(uint32_t) + get_link(pchain, start + i)->block.payload_len;
+    }
+    struct SimMsg * presp = new_msg(psim, SIM_PAYLOADS, pmsg->to, pmsg->from, len);
+    if (presp == NULL) {
+        return;
+    }
+    presp->conn = pmsg->conn;
+    network_u32 = htonl(count);
+    memcpy(presp->data, &network_u32, sizeof(uint32_t));
+    uint8_t * out = presp->data + sizeof(uint32_t);
+    for (uint32_t i = 0; i < count; i++) {
+        const struct Block * pblock = &get_link(pchain, start + i)->block;
+        network_u32 = htonl(pblock->payload_len);
+        memcpy(out, &network_u32, sizeof(uint32_t));
+        memcpy(out + sizeof(uint32_t), pblock->payload, pblock->payload_len);
+        out += sizeof(uint32_t) + pblock->payload_len;
+    }
+    send_msg(psim, presp);
+}
+
+/**
+ * Take a payload range. A range the peer could not serve in full or whose payloads do
+ * not match their headers is fetched again. Otherwise the connection asks for the next
+ * range and the chain is assembled once every range is in
+ * @param psim simulation
+ * @param pmsg range received
+ */
+static void receive_payloads(struct Sim * psim, struct SimMsg * pmsg) {
+    struct SimJoin * pjoin = psim->nodes[pmsg->to].pjoin;
+    struct SimConn * pconn = &pjoin->conns[pmsg->conn];
+    uint32_t start = pconn->range * SYNC_RANGE_BLOCKS;
+    uint32_t count = pjoin->n_blocks - start < SYNC_RANGE_BLOCKS ? pjoin->n_blocks - start
+        : SYNC_RANGE_BLOCKS;
+    uint32_t network_u32;
+
+    pjoin->presult->bytes += pmsg->len;
+    memcpy(&network_u32, pmsg->data, sizeof(uint32_t));
+    if (ntohl(network_u32) != count) {
+        retry_range(psim, pmsg->to, pmsg->conn);
+        return;
+    }
+
+    const uint8_t * in = pmsg->data + sizeof(uint32_t);
+    for (uint32_t i = 0; i < count; i++) {
+        const struct BlockHeader * pheader = &pjoin->headers[start + i];
+        memcpy(&network_u32, in, sizeof(uint32_t));
+        uint32_t len = ntohl(network_u32);
+        in += sizeof(uint32_t);
+        if (len != pheader->payload_len || seal_hash(hash_payload((const char *)in, len),
+                    pheader->timestamp) != pheader->hash) {
+            psim->preport->bad_blocks++;
+            retry_range(psim, pmsg->to, pmsg->conn);
+            return;
+        }
+        in += len;
+    }
+
+    //checked in full so payloads are only copied out once the range is known good
+    in = pmsg->data + sizeof(uint32_t);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t len = pjoin->headers[start + i].payload_len;
+        char * payload = malloc((size_t)len + 1);
+        if (payload == NULL) {
+            fprintf(stderr, "Netsim: failed to allocate memory for payload\n");
+            psim->failed = 1;
+            return;
+        }
+        memcpy(payload, in + sizeof(uint32_t), len);
+        payload[len] = '\0';
+        pjoin->payloads[start + i] = payload;
+        in += sizeof(uint32_t) + len;
+    }
+    if (++pjoin->completed == pjoin->n_ranges) {
+        assemble_chain(psim, pmsg->to);
+        return;
+    }
+    request_range(psim, pmsg->to, pmsg->conn);
+}
+
+/**
+ * Queue a connection's range to be fetched again after a short wait, giving the peers
+ * time to catch up. The sync fails once a range has been asked for too often
+ * @param psim simulation
+ * @param node joining node
+ * @param conn connection whose range failed
+ */
+static void retry_range(struct Sim * psim, uint32_t node, uint32_t conn) {
+    struct SimJoin * pjoin = psim->nodes[node].pjoin;
+    struct SimConn * pconn = &pjoin->conns[conn];
+
+    pjoin->presult->retries++;
+    pconn->busy = 0;
+    if (pjoin->attempts[pconn->range] >= SIM_RANGE_ATTEMPTS) {
+        pjoin->presult->failed = 1;
+        return;
+    }
+    pjoin->retry[pjoin->retry_len++] = pconn->range;
+    uint64_t wait_us = 2 * psim->pconfig->latency_us;
+    if (wait_us < SIM_RETRY_FLOOR_US) {
+        wait_us = SIM_RETRY_FLOOR_US;
+    }
+    push_event(psim, (struct SimEvent){.time = psim->now + wait_us, .type = SIM_WAKE, .node = node,
+            .arg = conn});
+}
+
+/**
+ * Build a joiner's chain from its fetched payloads in height order then subscribe it
+ * for the blocks produced since its headers were fetched
+ * @param psim simulation
+ * @param node joining node
+ */
+static void assemble_chain(struct Sim * psim, uint32_t node) {
+    const struct SimConfig * pconfig = psim->pconfig;
+    struct SimNode * pnode = &psim->nodes[node];
+    struct SimJoin * pjoin = pnode->pjoin;
+
+    for (uint32_t i = 0; i < pjoin->n_blocks; i++) {
+        const struct BlockHeader * pheader = &pjoin->headers[i];
+        if (append_block(&pnode->chain, pjoin->payloads[i], pheader->payload_len, pheader->hash,
+                    pheader->timestamp) != 0) {
+            psim->failed = 1;
+            return;
+        }
+        pnode->chain.tail->block.prev_hash = pheader->prev_hash;
+        pjoin->payloads[i] = NULL;
+        pnode->arrivals[i] = psim->now;
+    }
+    pjoin->assembled = 1;
+    pjoin->done_us = psim->now;
+    pjoin->presult->blocks = pjoin->n_blocks;
+    pjoin->presult->time_us = psim->now - pjoin->start_us;
+    if (pnode->chain.len == pconfig->n_blocks) {
+        pjoin->presult->catch_up_us = 0;
+    }
+
+    uint32_t ups[NETSIM_MAX_DEGREE], n_ups;
+    pick_nodes(psim, pconfig->n_nodes, pconfig->degree, ups, &n_ups);
+    for (uint32_t u = 0; u < n_ups; u++) {
+        subscribe_node(psim, node, ups[u], pnode->chain.len);
+    }
+}
+
+/**
+ * Act on a message arriving at its destination, as the node's endpoints would
+ * @param psim simulation
+ * @param pmsg message delivered. Freed by the caller
+ */
+static void deliver_msg(struct Sim * psim, struct SimMsg * pmsg) {
+    struct SimNode * pnode = &psim->nodes[pmsg->to];
+    switch (pmsg->type) {
+        case SIM_SUBSCRIBE: {
+            if (pnode->n_subs == pnode->subs_cap) {
+                uint32_t cap = pnode->subs_cap == 0 ? 4 : pnode->subs_cap * 2;
+                struct SimSub * subs = realloc(pnode->subs, cap * sizeof(struct SimSub));
+                if (subs == NULL) {
+                    fprintf(stderr, "Netsim: failed to allocate memory for subscribers\n");
+                    psim->failed = 1;
+                    return;
+                }
+                pnode->subs = subs;
+                pnode->subs_cap = cap;
+            }
+            uint32_t network_start;
+            memcpy(&network_start, pmsg->data + 1, sizeof(uint32_t));
+            struct SimSub * psub = &pnode->subs[pnode->n_subs++];
+            psub->node = pmsg->from;
+            psub->next_height = ntohl(network_start);
+
+            struct SimMsg * presp = new_msg(psim, SIM_SUBSCRIBED, pmsg->to, pmsg->from, sizeof(uint32_t));
+            if (presp == NULL) {
+                return;
+            }
+            memcpy(presp->data, &network_start, sizeof(uint32_t));
+            send_msg(psim, presp);
+            push_backlog(psim, pmsg->to, psub);
+            break;
+        }
+        case SIM_SUBSCRIBED:
+            break;
+        case SIM_FRAME:
+            receive_frame(psim, pmsg);
+            break;
+        case SIM_HEADERS_REQ:
+            serve_headers(psim, pmsg);
+            break;
+        case SIM_HEADERS:
+            receive_headers(psim, pmsg);
+            break;
+        case SIM_PAYLOADS_REQ:
+            serve_payloads(psim, pmsg);
+            break;
+        case SIM_PAYLOADS:
+            receive_payloads(psim, pmsg);
+            break;
+    }
+}
+
+static int compare_u64(const void * a, const void * b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Nearest rank percentile of sorted values
+ * @param sorted values in ascending order
+ * @param len number of values. 0 gives 0
+ * @param pct percentile from 0 to 100
+ * @return value at percentile
+ */
+static uint64_t percentile(const uint64_t * sorted, size_t len, unsigned pct) {
+    if (len == 0) {
+        return 0;
+    }
+    size_t rank = (len * pct + 99) / 100;
+    return sorted[rank == 0 ? 0 : rank - 1];
+}
+
+/**
+ * Fill report with the delays until each node other than the producer appended each
+ * block and until every such node had it. Joiners are left out, as they were not
+ * present when blocks were produced
+ * @param psim finished simulation
+ */
+static void measure_propagation(struct Sim * psim) {
+    const struct SimConfig * pconfig = psim->pconfig;
+    struct SimReport * preport = psim->preport;
+    uint32_t receivers = pconfig->n_nodes - 1;
+    if (receivers == 0 || pconfig->n_blocks == 0) {
+        return;
+    }
+
+    uint64_t * delays = malloc((size_t)receivers * pconfig->n_blocks * sizeof(uint64_t));
+    uint64_t * all = malloc((size_t)pconfig->n_blocks * sizeof(uint64_t));
+    if (delays == NULL || all == NULL) {
+        fprintf(stderr, "Netsim: failed to allocate memory for measurements\n");
+        free(delays);
+        free(all);
+        return;
+    }
+    size_t n_delays = 0, n_all = 0;
+    for (uint32_t h = 0; h < pconfig->n_blocks; h++) {
+        uint64_t slowest = 0;
+        int complete = 1;
+        for (uint32_t i = 1; i < pconfig->n_nodes; i++) {
+            uint64_t arrival = psim->nodes[i].arrivals[h];
+            if (arrival == UINT64_MAX) {
+                preport->missing++;
+                complete = 0;
+                continue;
+            }
+            uint64_t delay = arrival - psim->produced[h];
+            delays[n_delays++] = delay;
+            if (delay > slowest) {
+                slowest = delay;
+            }
+        }
+        if (complete) {
+            all[n_all++] = slowest;
+        }
+    }
+    qsort(delays, n_delays, sizeof(uint64_t), compare_u64);
+    qsort(all, n_all, sizeof(uint64_t), compare_u64);
+    preport->prop_p50_us = percentile(delays, n_delays, 50);
+    preport->prop_p90_us = percentile(delays, n_delays, 90);
+    preport->prop_p99_us = percentile(delays, n_delays, 99);
+    preport->prop_max_us = n_delays > 0 ? delays[n_delays - 1] : 0;
+    preport->all_p50_us = percentile(all, n_all, 50);
+    preport->all_p99_us = percentile(all, n_all, 99);
+    preport->all_max_us = n_all > 0 ? all[n_all - 1] : 0;
+    free(delays);
+    free(all);
+}
+
+/**
+ * Free every node and anything left in flight
+ * @param psim simulation
+ */
+static void free_sim(struct Sim * psim) {
+    for (size_t i = 0; i < psim->heap_len; i++) {
+        free(psim->heap[i].pmsg);
+    }
+    free(psim->heap);
+    if (psim->nodes != NULL) {
+        for (uint32_t i = 0; i < psim->n_total; i++) {
+            struct SimNode * pnode = &psim->nodes[i];
+            struct SimJoin * pjoin = pnode->pjoin;
+            if (pjoin != NULL) {
+                if (pjoin->payloads != NULL) {
+                    for (uint32_t h = 0; h < pjoin->n_blocks; h++) {
+                        free(pjoin->payloads[h]);
+                    }
+                }
+                free(pjoin->payloads);
+                free(pjoin->headers);
+                free(pjoin->retry);
+                free(pjoin->attempts);
+                free(pjoin);
+            }
+            deinitialise_chain(&pnode->chain);
+            free(pnode->arrivals);
+            free(pnode->subs);
+        }
+    }
+    free(psim->nodes);
+    free(psim->last_arrival);
+    free(psim->produced);
+}
@@ -0,0 +1,785 @@
+/**
+ * Live many node network simulation in one process. Every node holds a real chain behind
+ * a real endpoint context and serves requests with serve_request, publishes blocks
+ * with its subscription hub and syncs with sync_chain, reached through
+ * connect_to_node and get_client over the in-memory transport. The transport
+ * shapes every connection with latency, jitter, per-node upload bandwidth and
+ * segment loss. Node 0 produces blocks which are pushed down a random subscription
+ * mesh, and joiners sync the finished chain headers-first from several peers before
+ * subscribing for the blocks they missed. The mesh, payloads and every link's
+ * jitter and loss are drawn from the seed, but nodes run on their own threads and
+ * are timed by the real clock, so runs are NOT reproducible: reports vary between
+ * runs of one configuration and with the load on the machine. netsim.c is the
+ * deterministic model of the same network
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "netsim.h"
+#include "memnet.h"
+#include "endpoints.h"
+#include "requests.h"
+#include "chain_sync.h"
+
+#define SIM_POLL_MS 50 //Max wait of a node's server between checks for the end of the simulation
+#define SIM_POLLFDS 16 //Initial size of a node's poll set
+#define SIM_SUBSCRIBE_S 10 //Max wait for the mesh to subscribe before blocks are produced
+#define SIM_PEER_LEN 32 //Room for a sim<from>:<to> peer address
+
+struct SimNode;
+struct Sim;
+
+//Subscription of a node to one of its upstreams, received on its own thread
+struct SimUpstream {
+    struct SimNode * pnode;
+    uint32_t up; //node subscribed to
+    uint32_t start; //height subscribed from
+    uint32_t prev_hash; //hash of block before start
+    int fd; //subscribed socket. -1 until connected. Guarded by the node's append lock
+    pthread_t thread;
+};
+
+struct SimNode {
+    struct Sim * psim;
+    uint32_t id;
+    struct BlockChain chain;
+    pthread_rwlock_t chain_lock;
+    struct EndpointContext ctx;
+    struct SubHub hub; //publishes to subscribers. Started on serving nodes only
+    struct ServerData server; //listener and clients. pollfds NULL on joiners
+    pthread_t server_thread;
+    pthread_mutex_t append_lock; //serialises appends from several upstreams
+    uint64_t * arrivals; //time each height was appended at
+    struct SimUpstream ups[NETSIM_MAX_DEGREE];
+    uint32_t n_ups;
+    uint32_t n_running; //upstream threads started
+    uint32_t sync_peers[NETSIM_MAX_DEGREE]; //nodes a joiner syncs from
+    uint32_t n_sync_peers;
+    struct SimSync * psync; //NULL unless node is a joiner
+    uint64_t synced_us; //time a joiner's chain was assembled
+    pthread_t join_thread;
+    int joining; //set once the join thread is started
+};
+
+struct Sim {
+    const struct SimConfig * pconfig;
+    struct SimReport * preport;
+    uint64_t rng; //splitmix64 state
+    struct MemNet net;
+    struct SimNode * nodes; //n_nodes nodes followed by joiners
+    uint32_t n_total;
+    uint64_t start_us; //time the first block was produced at
+    uint64_t * produced; //time each height was produced at, from start_us
+    volatile int running; //cleared to stop every node
+    pthread_mutex_t lock; //guards the fields below
+    pthread_cond_t cond; //signalled as nodes subscribe, append and finish syncing
+    uint32_t subscribed; //upstream subscriptions confirmed
+    uint32_t caught_up; //nodes holding every block
+    uint32_t syncing; //joiners yet to finish syncing
+    uint64_t last_append_us; //time of the latest append by any node
+};
+
+//Internal functions
+static uint64_t next_random(struct Sim * psim);
+static void pick_nodes(struct Sim * psim, uint32_t below, uint32_t want, uint32_t * out, uint32_t * pn);
+static int start_node(struct Sim * psim, uint32_t id, int serve);
+static void * serve_node(void * arg);
+static int follow_upstreams(struct SimNode * pnode, uint32_t start);
+static void * follow_upstream(void * arg);
+static void append_received(struct SimNode * pnode, struct BlockChain * pblocks, uint32_t height,
+        uint32_t wire_len);
+static void note_append(struct Sim * psim, struct SimNode * pnode);
+static int produce_blocks(struct Sim * psim);
+static void * join_node(void * arg);
+static void wait_for_nodes(struct Sim * psim);
+static void stop_nodes(struct Sim * psim);
+static int compare_u64(const void * a, const void * b);
+static uint64_t percentile(const uint64_t * sorted, size_t len, unsigned pct);
+static void measure_propagation(struct Sim * psim);
+static void free_sim(struct Sim * psim);
+
+/**
+ * Run a network of nodes producing, propagating and syncing a chain on the real clock.
+ * Measurements are not reproducible
+ * @param pconfig network and workload to simulate
+ * @param preport filled with measurements of the run
+ * @return 0 on success, -1 on invalid configuration or failure
+ */
+int run_live_simulation(const struct SimConfig * pconfig, struct SimReport * preport) {
+    struct Sim sim;
+
+    if (pconfig->n_nodes == 0 || pconfig->n_nodes > NETSIM_MAX_LIVE_NODES
+            || pconfig->n_joiners > NETSIM_MAX_JOINERS) {
+        fprintf(stderr, "Netsim: need 1 to %d nodes and at most %d joiners\n", NETSIM_MAX_LIVE_NODES,
+                NETSIM_MAX_JOINERS);
+        return -1;
+    }
+    if (pconfig->degree == 0 || pconfig->degree > NETSIM_MAX_DEGREE) {
+        fprintf(stderr, "Netsim: degree must be 1 to %d\n", NETSIM_MAX_DEGREE);
+        return -1;
+    }
+    if (pconfig->n_joiners > 0 && (pconfig->sync_peers == 0 || pconfig->sync_peers > NETSIM_MAX_DEGREE
+            || pconfig->conns_per_peer == 0
+            || pconfig->sync_peers * pconfig->conns_per_peer > SYNC_MAX_WORKERS)) {
+        fprintf(stderr, "Netsim: joiners need 1 to %d sync peers and at most %d connections\n",
+                NETSIM_MAX_DEGREE, SYNC_MAX_WORKERS);
+        return -1;
+    }
+    if (pconfig->payload_size == 0 || pconfig->payload_size > MAX_PAYLOAD || pconfig->loss < 0
+            || pconfig->loss >= 1) {
+        fprintf(stderr, "Netsim: payload size must be 1 to %d and loss below 1\n", MAX_PAYLOAD);
+        return -1;
+    }
+
+    memset(preport, 0, sizeof(*preport));
+    memset(&sim, 0, sizeof(sim));
+    sim.pconfig = pconfig;
+    sim.preport = preport;
+    sim.rng = pconfig->seed;
+    sim.n_total = pconfig->n_nodes + pconfig->n_joiners;
+    sim.running = 1;
+    pthread_mutex_init(&sim.lock, NULL);
+    pthread_cond_init(&sim.cond, NULL);
+    sim.nodes = calloc(sim.n_total, sizeof(struct SimNode));
+    sim.produced = calloc((size_t)pconfig->n_blocks + 1, sizeof(uint64_t));
+    if (sim.nodes == NULL || sim.produced == NULL) {
+        fprintf(stderr, "Netsim: failed to allocate memory for %u nodes\n", sim.n_total);
+        free_sim(&sim);
+        return -1;
+    }
+
+    struct MemLinks links = {
+        .latency_us = pconfig->latency_us,
+        .jitter_us = pconfig->jitter_us,
+        .bandwidth = pconfig->bandwidth,
+        .loss = pconfig->loss,
+        .seed = pconfig->seed
+    };
+    if (initialise_memnet(&sim.net, sim.n_total, &links) != 0) {
+        free_sim(&sim);
+        return -1;
+    }
+    set_transport(&sim.net.transport);
+
+    int ret = 0;
+    for (uint32_t i = 0; i < sim.n_total && ret == 0; i++) {
+        ret = start_node(&sim, i, i < pconfig->n_nodes);
+    }
+
+    //each node subscribes to upstreams drawn from the nodes before it so blocks flow away from
+    //node 0 and the mesh has no cycles. Joiners draw their peers up front so the run depends
+    //only on the seed
+    uint32_t n_subscriptions = 0;
+    for (uint32_t i = 1; i < sim.n_total && ret == 0; i++) {
+        struct SimNode * pnode = &sim.nodes[i];
+        uint32_t ups[NETSIM_MAX_DEGREE];
+        pick_nodes(&sim, i < pconfig->n_nodes ? i : pconfig->n_nodes, pconfig->degree, ups, &pnode->n_ups);
+        for (uint32_t u = 0; u < pnode->n_ups; u++) {
+            pnode->ups[u].up = ups[u];
+        }
+        if (i < pconfig->n_nodes) {
+            n_subscriptions += pnode->n_ups;
+            ret = follow_upstreams(pnode, 0);
+            continue;
+        }
+        pick_nodes(&sim, pconfig->n_nodes, pconfig->sync_peers, pnode->sync_peers, &pnode->n_sync_peers);
+    }
+
+    if (ret == 0) {
+        //blocks are only timed once the mesh is in place
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += SIM_SUBSCRIBE_S;
+        pthread_mutex_lock(&sim.lock);
+        while (sim.subscribed < n_subscriptions &&
+                pthread_cond_timedwait(&sim.cond, &sim.lock, &deadline) != ETIMEDOUT);
+        pthread_mutex_unlock(&sim.lock);
+        if (sim.subscribed < n_subscriptions) {
+            fprintf(stderr, "Netsim: only %u of %u subscriptions were made\n", sim.subscribed, n_subscriptions);
+        }
+        ret = produce_blocks(&sim);
+    }
+    if (ret == 0) {
+        wait_for_nodes(&sim);
+    }
+
+    stop_nodes(&sim);
+    set_transport(NULL);
+    if (ret != 0) {
+        free_sim(&sim);
+        return -1;
+    }
+    preport->end_us = sim.last_append_us > sim.start_us ? sim.last_append_us - sim.start_us : 0;
+    preport->connections = sim.net.connections;
+    preport->bytes = sim.net.bytes;
+    preport->retransmitted = sim.net.retransmitted;
+    measure_propagation(&sim);
+    preport->n_syncs = pconfig->n_joiners;
+    for (uint32_t i = pconfig->n_nodes; i < sim.n_total; i++) {
+        if (sim.nodes[i].chain.len != pconfig->n_blocks) {
+            sim.nodes[i].psync->failed = 1;
+        }
+    }
+    free_sim(&sim);
+    return 0;
+}
+
+/**
+ * Draw the next number from the simulation's splitmix64 generator. Main thread only
+ * @param psim simulation
+ * @return 64 random bits
+ */
+static uint64_t next_random(struct Sim * psim) {
+    uint64_t z = (psim->rng += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * Draw distinct nodes uniformly from those below a bound
+ * @param psim simulation
+ * @param below nodes are drawn from 0 to below - 1
+ * @param want number of nodes wanted. Fewer are drawn if below is smaller
+ * @param out filled with drawn nodes
+ * @param pn set to number of nodes drawn
+ */
+static void pick_nodes(struct Sim * psim, uint32_t below, uint32_t want, uint32_t * out, uint32_t * pn) {
+    uint32_t n = want < below ? want : below;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t candidate;
+        int taken;
+        do {
+            candidate = (uint32_t)(next_random(psim) % below);
+            taken = 0;
+            for (uint32_t j = 0; j < i; j++) {
+                taken |= out[j] == candidate;
+            }
+        } while (taken);
+        out[i] = candidate;
+    }
+    *pn = n;
+}
+
+/**
+ * Bring up a node with an empty chain. Serving nodes listen on the network and publish
+ * to subscribers as a node process would. Joiners only sync and subscribe
+ * @param psim simulation
+ * @param id node to start
+ * @param serve set to serve requests and subscriptions
+ * @return 0 on success, -1 on failure
+ */
+static int start_node(struct Sim * psim, uint32_t id, int serve) {
+    struct SimNode * pnode = &psim->nodes[id];
+    pthread_rwlockattr_t lock_attr;
+
+    pnode->psim = psim;
+    pnode->id = id;
+    pnode->chain = initialise_chain();
+    pthread_rwlockattr_init(&lock_attr);
+    pthread_rwlockattr_setkind_np(&lock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&pnode->chain_lock, &lock_attr);
+    pthread_rwlockattr_destroy(&lock_attr);
+    pthread_mutex_init(&pnode->append_lock, NULL);
+    pnode->ctx.pblock_chain = &pnode->chain;
+    pnode->ctx.plock = &pnode->chain_lock;
+    pnode->ctx.read_only = id != 0;
+    pnode->server.listenerfd = pnode->server.unix_listenerfd = -1;
+    if (!serve) {
+        pnode->psync = &psim->preport->syncs[id - psim->pconfig->n_nodes];
+    }
+
+    pnode->arrivals = malloc(((size_t)psim->pconfig->n_blocks + 1) * sizeof(uint64_t));
+    if (pnode->arrivals == NULL) {
+        fprintf(stderr, "Netsim: failed to allocate memory for arrivals\n");
+        return -1;
+    }
+    for (uint32_t h = 0; h < psim->pconfig->n_blocks; h++) {
+        pnode->arrivals[h] = UINT64_MAX;
+    }
+    if (!serve) {
+        return 0;
+    }
+
+    if (start_subscriptions(&pnode->hub, &pnode->ctx) != 0) {
+        return -1;
+    }
+    pnode->ctx.psubs = &pnode->hub;
+    pnode->server.pollfds = malloc(SIM_POLLFDS * sizeof(struct pollfd));
+    if (pnode->server.pollfds == NULL) {
+        fprintf(stderr, "Netsim: failed to allocate memory for poll set\n");
+        return -1;
+    }
+    pnode->server.fd_size = SIM_POLLFDS;
+    pnode->server.listenerfd = memnet_listen(&psim->net, id);
+    if (pnode->server.listenerfd == -1 || add_fd_to_server(&pnode->server, pnode->server.listenerfd) != 0) {
+        return -1;
+    }
+    if (pthread_create(&pnode->server_thread, NULL, serve_node, pnode) != 0) {
+        fprintf(stderr, "Netsim: failed to start node %u\n", id);
+        pnode->server.fd_count = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Server thread of a node. Accepts connections and serves their requests as the node's
+ * poll backend does until the simulation ends
+ * @param arg SimNode
+ * @return NULL
+ */
+static void * serve_node(void * arg) {
+    struct SimNode * pnode = arg;
+    struct ServerData * pserver_data = &pnode->server;
+
+    while (pnode->psim->running) {
+        if (poll(pserver_data->pollfds, pserver_data->fd_count, SIM_POLL_MS) == -1 && errno != EINTR) {
+            perror("Netsim: poll");
+            break;
+        }
+        for (int i = 0; i < pserver_data->fd_count; i++) {
+            if (!(pserver_data->pollfds[i].revents & POLLIN)) {
+                continue;
+            }
+            if (is_listener(pserver_data, pserver_data->pollfds[i].fd)) {
+                int new_fd = get_client(pserver_data->pollfds[i].fd);
+                if (new_fd != -1 && add_fd_to_server(pserver_data, new_fd) != 0) {
+                    close(new_fd);
+                }
+                continue;
+            }
+            int ret = serve_request(pserver_data->pollfds[i].fd, &pnode->ctx);
+            if (ret == 1) {
+                //socket now belongs to the subscription hub
+                remove_fd_from_server(pserver_data, i);
+            } else if (ret != 0) {
+                delete_fd_from_server(pserver_data, i);
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Subscribe a node to each of its upstreams, each received on its own thread
+ * @param pnode node whose ups are set
+ * @param start height to subscribe from. The chain must hold every block below it
+ * @return 0 on success, -1 on failure
+ */
+static int follow_upstreams(struct SimNode * pnode, uint32_t start) {
+    uint32_t prev_hash = pnode->chain.tail != NULL ? pnode->chain.tail->block.hash : 0;
+
+    for (uint32_t u = 0; u < pnode->n_ups; u++) {
+        struct SimUpstream * pup = &pnode->ups[u];
+        pup->pnode = pnode;
+        pup->start = start;
+        pup->prev_hash = prev_hash;
+        pup->fd = -1;
+        if (pthread_create(&pup->thread, NULL, follow_upstream, pup) != 0) {
+            fprintf(stderr, "Netsim: failed to subscribe node %u to node %u\n", pnode->id, pup->up);
+            return -1;
+        }
+        pthread_mutex_lock(&pnode->append_lock);
+        pnode->n_running++;
+        pthread_mutex_unlock(&pnode->append_lock);
+    }
+    return 0;
+}
+
+/**
+ * Upstream thread. Subscribes to the upstream with request_subscribe_endpoint and appends
+ * every block it pushes that the node does not hold yet
+ * @param arg SimUpstream
+ * @return NULL
+ */
+static void * follow_upstream(void * arg) {
+    struct SimUpstream * pup = arg;
+    struct SimNode * pnode = pup->pnode;
+    struct Sim * psim = pnode->psim;
+    char peer[SIM_PEER_LEN];
+
+    snprintf(peer, sizeof(peer), MEMNET_HOST "%u:%u", pnode->id, pup->up);
+    int sockfd = connect_to_peer(peer);
+    if (sockfd == -1) {
+        return NULL;
+    }
+    //held so stop_nodes either sees the socket to shut down or the node sees it stopping
+    pthread_mutex_lock(&pnode->append_lock);
+    if (!psim->running) {
+        pthread_mutex_unlock(&pnode->append_lock);
+        close(sockfd);
+        return NULL;
+    }
+    pup->fd = sockfd;
+    pthread_mutex_unlock(&pnode->append_lock);
+
+    if (request_subscribe_endpoint(sockfd, pup->start) != 0) {
+        return NULL;
+    }
+    pthread_mutex_lock(&psim->lock);
+    psim->subscribed++;
+    pthread_cond_broadcast(&psim->cond);
+    pthread_mutex_unlock(&psim->lock);
+
+    uint32_t prev_hash = pup->prev_hash;
+    for (uint32_t height = pup->start; height < psim->pconfig->n_blocks; height++) {
+        struct BlockChain blocks = initialise_chain();
+        if (receive_subscribed_blocks(sockfd, height, 1, &prev_hash, &blocks) != 0) {
+            if (psim->running) {
+                fprintf(stderr, "Netsim: node %u lost upstream %u at height %u\n", pnode->id, pup->up, height);
+            }
+            deinitialise_chain(&blocks);
+            break;
+        }
+        prev_hash = blocks.tail->block.hash;
+        append_received(pnode, &blocks, height, BLOCK_WIRE_HEADER_SZ + blocks.tail->block.payload_len);
+        deinitialise_chain(&blocks);
+    }
+    return NULL;
+}
+
+/**
+ * Append a block pushed by an upstream with replicate_blocks, unless another upstream
+ * already delivered it. Blocks already held are counted as duplicates and checked to be
+ * the block the node holds at that height
+ * @param pnode receiving node
+ * @param pblocks verified block. Its payload is moved onto the chain when appended
+ * @param height height of block
+ * @param wire_len bytes the block took on the wire
+ * @return void
+ */
+static void append_received(struct SimNode * pnode, struct BlockChain * pblocks, uint32_t height,
+        uint32_t wire_len) {
+    struct Sim * psim = pnode->psim;
+    int duplicate = 0, bad = 0;
+
+    //only appenders change the chain and they hold the append lock, so it is read without
+    //the chain lock
+    pthread_mutex_lock(&pnode->append_lock);
+    if (height < pnode->chain.len) {
+        duplicate = 1;
+        bad = get_link(&pnode->chain, height)->block.hash != pblocks->tail->block.hash;
+    } else if (height == pnode->chain.len && replicate_blocks(&pnode->ctx, pblocks, height) == DISPATCH_OK) {
+        pnode->arrivals[height] = memnet_now_us() - psim->start_us;
+        note_append(psim, pnode);
+    } else {
+        bad = 1;
+    }
+    pthread_mutex_unlock(&pnode->append_lock);
+
+    if (duplicate || bad) {
+        pthread_mutex_lock(&psim->lock);
+        psim->preport->duplicate_bytes += duplicate ? wire_len : 0;
+        psim->preport->bad_blocks += bad;
+        pthread_mutex_unlock(&psim->lock);
+    }
+}
+
+/**
+ * Record that a node appended blocks, noting when it first holds every block
+ * @param psim simulation
+ * @param pnode node that appended
+ * @return void
+ */
+static void note_append(struct Sim * psim, struct SimNode * pnode) {
+    uint64_t now = memnet_now_us();
+
+    pthread_mutex_lock(&psim->lock);
+    psim->last_append_us = now;
+    if (pnode->chain.len == psim->pconfig->n_blocks) {
+        psim->caught_up++;
+        if (pnode->psync != NULL) {
+            pnode->psync->catch_up_us = now - pnode->synced_us;
+        }
+    }
+    pthread_cond_broadcast(&psim->cond);
+    pthread_mutex_unlock(&psim->lock);
+}
+
+/**
+ * Produce every block on node 0 at the configured interval through its ingest path and
+ * commit each so it is published to subscribers, then start the joiners
+ * @param psim simulation
+ * @return 0 on success, -1 on failure
+ */
+static int produce_blocks(struct Sim * psim) {
+    const struct SimConfig * pconfig = psim->pconfig;
+    struct SimNode * pnode = &psim->nodes[0];
+
+    psim->start_us = memnet_now_us();
+    psim->last_append_us = psim->start_us;
+    for (uint32_t height = 0; height < pconfig->n_blocks; height++) {
+        uint64_t due_us = psim->start_us + height * pconfig->interval_us;
+        struct timespec due = {(time_t)(due_us / 1000000), (long)(due_us % 1000000) * 1000};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR);
+
+        //printable payload tagged with its height so no two are alike
+        char * payload = malloc((size_t)pconfig->payload_size + 1);
+        if (payload == NULL) {
+            fprintf(stderr, "Netsim: failed to allocate memory for payload\n");
+            return -1;
+        }
+        int tag = snprintf(payload, (size_t)pconfig->payload_size + 1, "%u:", height);
+        for (uint32_t i = tag < 0 ? 0 : (uint32_t)tag; i < pconfig->payload_size; i++) {
+            payload[i] = 'a' + (char)(next_random(psim) % 26);
+        }
+        payload[pconfig->payload_size] = '\0';
+
+        psim->produced[height] = memnet_now_us() - psim->start_us;
+        if (ingest_payload(&pnode->ctx, payload, pconfig->payload_size,
+                    hash_payload(payload, pconfig->payload_size), NULL, NULL) != DISPATCH_OK ||
+                commit_chain(&pnode->ctx) != 0) {
+            return -1;
+        }
+        pnode->arrivals[height] = psim->produced[height];
+        note_append(psim, pnode);
+    }
+
+    pthread_mutex_lock(&psim->lock);
+    psim->syncing = pconfig->n_joiners;
+    pthread_mutex_unlock(&psim->lock);
+    for (uint32_t i = pconfig->n_nodes; i < psim->n_total; i++) {
+        struct SimNode * pnode = &psim->nodes[i];
+        if (pthread_create(&pnode->join_thread, NULL, join_node, pnode) != 0) {
+            fprintf(stderr, "Netsim: failed to start joiner %u\n", i);
+            pthread_mutex_lock(&psim->lock);
+            psim->syncing--;
+            pthread_mutex_unlock(&psim->lock);
+            continue;
+        }
+        pnode->joining = 1;
+    }
+    return 0;
+}
+
+/**
+ * Joiner thread. Syncs the chain from the joiner's peers with sync_chain then subscribes
+ * for the blocks produced since its headers were fetched
+ * @param arg SimNode
+ * @return NULL
+ */
+static void * join_node(void * arg) {
+    struct SimNode * pnode = arg;
+    struct Sim * psim = pnode->psim;
+    char names[NETSIM_MAX_DEGREE][SIM_PEER_LEN];
+    char * peers[NETSIM_MAX_DEGREE];
+    struct SyncStats stats;
+
+    for (uint32_t p = 0; p < pnode->n_sync_peers; p++) {
+        snprintf(names[p], sizeof(names[p]), MEMNET_HOST "%u:%u", pnode->id, pnode->sync_peers[p]);
+        peers[p] = names[p];
+    }
+    memset(&stats, 0, sizeof(stats));
+    uint64_t start_us = memnet_now_us();
+    int ret = sync_chain(&pnode->chain, peers, pnode->n_sync_peers, psim->pconfig->conns_per_peer, &stats);
+    uint64_t now = memnet_now_us();
+
+    pnode->synced_us = now;
+    pnode->psync->time_us = now - start_us;
+    pnode->psync->blocks = stats.blocks;
+    pnode->psync->bytes = stats.payload_bytes;
+    pnode->psync->retries = stats.retries;
+    for (uint32_t h = 0; h < pnode->chain.len; h++) {
+        pnode->arrivals[h] = now - psim->start_us;
+    }
+    if (ret == 0 && pnode->chain.len == psim->pconfig->n_blocks) {
+        note_append(psim, pnode);
+    } else if (ret == 0) {
+        follow_upstreams(pnode, pnode->chain.len);
+    }
+
+    pthread_mutex_lock(&psim->lock);
+    psim->syncing--;
+    pthread_cond_broadcast(&psim->cond);
+    pthread_mutex_unlock(&psim->lock);
+    return NULL;
+}
+
+/**
+ * Wait until every node holds every block, or until no node has appended for
+ * NETSIM_STALL_S with every sync finished
+ * @param psim simulation
+ * @return void
+ */
+static void wait_for_nodes(struct Sim * psim) {
+    pthread_mutex_lock(&psim->lock);
+    while (psim->caught_up < psim->n_total) {
+        if (psim->syncing == 0 && memnet_now_us() - psim->last_append_us > NETSIM_STALL_S * 1000000ULL) {
+            break;
+        }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        pthread_cond_timedwait(&psim->cond, &psim->lock, &deadline);
+    }
+    pthread_mutex_unlock(&psim->lock);
+}
+
+/**
+ * Stop every node. Joiners finish syncing, subscriptions are shut down to wake their threads,
+ * then servers and hubs are stopped and the network closed
+ * @param psim simulation
+ * @return void
+ */
+static void stop_nodes(struct Sim * psim) {
+    if (psim->nodes == NULL) {
+        return;
+    }
+    for (uint32_t i = psim->pconfig->n_nodes; i < psim->n_total; i++) {
+        if (psim->nodes[i].joining) {
+            pthread_join(psim->nodes[i].join_thread, NULL);
+            psim->nodes[i].joining = 0;
+        }
+    }
+    pthread_mutex_lock(&psim->lock);
+    psim->running = 0;
+    pthread_mutex_unlock(&psim->lock);
+
+    for (uint32_t i = 0; i < psim->n_total; i++) {
+        struct SimNode * pnode = &psim->nodes[i];
+        if (pnode->psim == NULL) {
+            continue;
+        }
+        pthread_mutex_lock(&pnode->append_lock);
+        for (uint32_t u = 0; u < pnode->n_running; u++) {
+            if (pnode->ups[u].fd != -1) {
+                shutdown(pnode->ups[u].fd, SHUT_RDWR);
+            }
+        }
+        pthread_mutex_unlock(&pnode->append_lock);
+    }
+    for (uint32_t i = 0; i < psim->n_total; i++) {
+        struct SimNode * pnode = &psim->nodes[i];
+        for (uint32_t u = 0; u < pnode->n_running; u++) {
+            pthread_join(pnode->ups[u].thread, NULL);
+            if (pnode->ups[u].fd != -1) {
+                close(pnode->ups[u].fd);
+            }
+        }
+        pnode->n_running = 0;
+    }
+    for (uint32_t i = 0; i < psim->n_total; i++) {
+        struct SimNode * pnode = &psim->nodes[i];
+        if (pnode->server.fd_count > 0) {
+            pthread_join(pnode->server_thread, NULL);
+            //the listener belongs to the network
+            remove_fd_from_server(&pnode->server, 0);
+        }
+        if (pnode->server.pollfds != NULL) {
+            deinitialise_server(&pnode->server);
+        }
+        if (pnode->ctx.psubs != NULL) {
+            stop_subscriptions(&pnode->hub);
+            pnode->ctx.psubs = NULL;
+        }
+    }
+    if (psim->net.listeners != NULL) {
+        deinitialise_memnet(&psim->net);
+    }
+}
+
+static int compare_u64(const void * a, const void * b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Nearest rank percentile of sorted values
+ * @param sorted values in ascending order
+ * @param len number of values. 0 gives 0
+ * @param pct percentile from 0 to 100
+ * @return value at percentile
+ */
+static uint64_t percentile(const uint64_t * sorted, size_t len, unsigned pct) {
+    if (len == 0) {
+        return 0;
+    }
+    size_t rank = (len * pct + 99) / 100;
+    return sorted[rank == 0 ? 0 : rank - 1];
+}
+
+/**
+ * Fill report with the delays until each node other than the producer appended each
+ * block and until every such node had it. Joiners are left out, as they were not
+ * present when blocks were produced
+ * @param psim finished simulation
+ */
+static void measure_propagation(struct Sim * psim) {
+    const struct SimConfig * pconfig = psim->pconfig;
+    struct SimReport * preport = psim->preport;
+    uint32_t receivers = pconfig->n_nodes - 1;
+    if (receivers == 0 || pconfig->n_blocks == 0) {
+        return;
+    }
+
+    uint64_t * delays = malloc((size_t)receivers * pconfig->n_blocks * sizeof(uint64_t));
+    uint64_t * all = malloc((size_t)pconfig->n_blocks * sizeof(uint64_t));
+    if (delays == NULL || all == NULL) {
+        fprintf(stderr, "Netsim: failed to allocate memory for measurements\n");
+        free(delays);
+        free(all);
+        return;
+    }
+    size_t n_delays = 0, n_all = 0;
+    for (uint32_t h = 0; h < pconfig->n_blocks; h++) {
+        uint64_t slowest = 0;
+        int complete = 1;
+        for (uint32_t i = 1; i < pconfig->n_nodes; i++) {
+            uint64_t arrival = psim->nodes[i].arrivals[h];
+            if (arrival == UINT64_MAX) {
+                preport->missing++;
+                complete = 0;
+                continue;
+            }
+            uint64_t delay = arrival - psim->produced[h];
+            delays[n_delays++] = delay;
+            if (delay > slowest) {
+                slowest = delay;
+            }
+        }
+        if (complete) {
+            all[n_all++] = slowest;
+        }
+    }
+    qsort(delays, n_delays, sizeof(uint64_t), compare_u64);
+    qsort(all, n_all, sizeof(uint64_t), compare_u64);
+    preport->prop_p50_us = percentile(delays, n_delays, 50);
+    preport->prop_p90_us = percentile(delays, n_delays, 90);
+    preport->prop_p99_us = percentile(delays, n_delays, 99);
+    preport->prop_max_us = n_delays > 0 ? delays[n_delays - 1] : 0;
+    preport->all_p50_us = percentile(all, n_all, 50);
+    preport->all_p99_us = percentile(all, n_all, 99);
+    preport->all_max_us = n_all > 0 ? all[n_all - 1] : 0;
+    free(delays);
+    free(all);
+}
+
+/**
+ * Free every node once stopped
+ * @param psim simulation
+ */
+static void free_sim(struct Sim * psim) {
+    if (psim->nodes != NULL) {
+        for (uint32_t i = 0; i < psim->n_total; i++) {
+            struct SimNode * pnode = &psim->nodes[i];
+            if (pnode->psim == NULL) {
+                continue;
+            }
+            deinitialise_chain(&pnode->chain);
+            pthread_rwlock_destroy(&pnode->chain_lock);
+            pthread_mutex_destroy(&pnode->append_lock);
+            free(pnode->arrivals);
+        }
+    }
+    free(psim->nodes);
+    free(psim->produced);
+    pthread_mutex_destroy(&psim->lock);
+    pthread_cond_destroy(&psim->cond);
+}
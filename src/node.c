@@ -3,14 +3,180 @@
  * and communicates with other nodes and clients via sockets
  * Written by Josh Cherubino (josh.cherubino@gmail.com)
  */
+#define _GNU_SOURCE //pthread_setaffinity_np
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <getopt.h>
 
 #include "endpoints.h"
+#include "requests.h"
 #include "block.h"
 #include "server.h"
+#include "uring.h"
+#include "shm_ring.h"
+#include "snapshot.h"
+#include "archive.h"
+#include "chain_sync.h"
+#include "follower.h"
+#include "journal.h"
+#include "codec.h"
+#include "trace.h"
+
+#define POLL_TIMEOUT_MS 1 //timeout of each poll call in the poll backend
+#define URING_TIMEOUT_MS 100 //max wait for completions in the io_uring backend
+#define URING_RECV_SZ 65536 //bytes each io_uring backend client receives ahead of the requests served
+#define URING_DRAIN_WAITS 20 //waits for cancelled requests to complete when the io_uring backend stops
+#define PRUNE_RETRY_S 60 //seconds pruning waits before it is retried after cold storage failed
+#define MAX_REACTORS 256 //upper bound on event loop threads
+#define MAX_SYNC_PEERS 16 //upper bound on peers a node bootstraps from
+#define SYNC_CONNS_PER_PEER 2 //payload fetch connections opened to each bootstrap peer
+
+#define NODE_USAGE "usage: node [-u] [-l unix_path] [-s shm_name] [-p prune_depth] " \
+    "[-c cold_path] [-S snapshot_path] [-J journal_path] [-Z dict_store [-z pack_depth]] " \
+    "[-D dedup_window] [-I] [-V verify_threads] [-T spans] [-b archive] " \
+    "[-r reactors] " \
+    "[-L conn_rate[:addr_rate[:max_streams]]] [-y peer[,peer...]] [-F|--follow host:port] " \
+    "servname\n"
+
+struct NodeData;
+
+//Event loop with its own listener and connection set. Reactor 0 runs on the main thread
+//and additionally owns the unix listener, shared memory ring and chain maintenance
+struct Reactor {
+    struct NodeData * pnode; //node state shared by all reactors
+    struct ServerData server_data; //sockets this reactor listens and talks on
+    struct EndpointContext ctx; //node's context with this reactor's own ack queue
+    struct AckQueue acks; //add block responses held until the end of the loop iteration
+    struct TxQueue txs; //signed transactions held for the end of the loop iteration
+    int id; //index of reactor. Also the CPU it is pinned to modulo online CPUs
+    pthread_t thread; //thread running the reactor. Unused for reactor 0
+};
+
+//All state serviced by the node loop
+struct NodeData {
+    struct Reactor * reactors; //event loops of the node
+    int n_reactors; //number of reactors. Greater than 1 enables SO_REUSEPORT listeners
+    int use_uring; //prefer io_uring backend
+    pthread_rwlock_t chain_lock; //shared through ctx.plock with reactors, follower and publisher
+    struct BlockChain block_chain; //the node's chain
+    struct DedupFilter dedup; //duplicate payload filter. Used if ctx.pdedup is set
+    struct SearchIndex search; //payload search index. Used if ctx.psearch is set
+    struct RangeTree tree; //hash tree over height ranges. Always maintained
+    struct TimeIndex time_index; //sparse index from time to height. Always maintained
+    struct Admission admission; //request rate limits. Used if ctx.padmission is set
+    struct SubHub subs; //clients new blocks are pushed to. Always running
+    struct Journal journal; //write ahead journal of appended blocks. Used if ctx.pjournal is set
+    struct Verifier verifier; //checks signatures of transactions. Used if ctx.pverifier is set
+    struct EndpointContext ctx; //state handed to endpoints
+    struct ShmRing shm_ring; //optional same-host ingest ring. hdr is NULL if unused
+    long prune_depth; //payloads deeper than this are pruned. -1 disables pruning
+    time_t prune_retry; //time pruning is retried after cold storage failed. 0 while it succeeds
+    struct PayloadCodec codec; //packs payloads at rest. Used if pack_depth is not -1
+    long pack_depth; //payloads deeper than this are packed. -1 stores payloads raw
+    uint32_t train_len; //chain length at last attempt to train the codec
+    const char * snapshot_path; //file periodic snapshots are written to. NULL if unused
+    time_t last_snapshot; //time of last snapshot
+    const char * follow_peer; //primary this node is a read replica of. NULL if not following
+    struct Follower follower; //tails follow_peer. Used if follow_peer is set
+};
+
+//Stage of the request an io_uring backend client is in
+enum uring_stage {
+    URING_STAGE_ID, //serving requests from received bytes, receiving more once they run out
+    URING_STAGE_PAYLOAD, //receiving an add block payload larger than what was buffered
+    URING_STAGE_DISCARD, //dropping the rest of a refused add block payload
+    URING_STAGE_STREAM, //sending a chain response
+    URING_STAGE_FLUSH //waiting for responses to be sent before serving an endpoint on the socket
+};
+
+//Responses queued for a client of the io_uring backend
+struct UringOut {
+    uint8_t * data;
+    size_t len;
+    size_t cap;
+};
+
+//Client of the io_uring backend. Bytes are received ahead into a buffer and every request
+//found there is served before receiving again. Add block and chain requests are received and
+//answered entirely through the ring, other endpoints are served on the socket, starting from
+//the buffered bytes, once the client's queued responses are sent. Requests in flight point at
+//the client, so it is only closed and freed once each of them has completed
+struct UringConn {
+    int fd;
+    enum uring_stage stage;
+    uint8_t in[URING_RECV_SZ]; //bytes received ahead
+    uint32_t in_start; //first byte of in not yet served
+    uint32_t in_end; //end of bytes received into in
+    uint8_t endpoint_id; //endpoint of the request being served
+    uint32_t len; //length of add block payload, or of the payload being dropped
+    uint32_t received; //bytes of the payload taken so far
+    uint32_t hash; //hash of the payload taken so far
+    char * payload; //add block payload being received
+    size_t payload_cap; //bytes payload can hold. Grown as bytes arrive
+    struct UringOut queued; //responses waiting for the send in flight
+    struct UringOut sending; //responses being sent
+    const uint8_t * out; //bytes the send in flight is from. Responses or a chain batch
+    size_t out_len;
+    size_t out_sent; //bytes of out already sent
+    struct ChainStream * pstream; //chain response being sent. NULL if none
+    struct TraceSpan span;
+    int recv_armed; //receive in flight
+    int send_armed; //send in flight
+    int closing; //dropped. Closed once no request is in flight
+    int detached; //socket was handed off by an endpoint. Forgotten rather than closed
+    struct UringConn * next_released; //next client in the reactor's release list
+    int released; //on the release list
+};
+
+//io_uring backend of one reactor
+struct UringServer {
+    struct Reactor * preactor;
+    struct UringData uring;
+    struct UringConn ** conns; //clients by fd. NULL where an fd is not a client
+    int n_conns; //length of conns
+    unsigned in_flight; //receives and sends yet to complete
+    struct UringConn * released; //clients to free at the end of the loop iteration
+    struct ResponseSink sink; //takes add block responses released by the reactor's commits
+};
+
+//Internal functions
+static void run_reactor(struct Reactor * preactor);
+static void * reactor_thread(void * arg);
+static int start_reactors(struct NodeData * pnode, const char * servname, const char * unix_path);
+static void stop_reactors(struct NodeData * pnode);
+static void run_poll_loop(struct Reactor * preactor);
+static int run_uring_loop(struct Reactor * preactor);
+static void stop_uring_server(struct UringServer * pserver, int keep_clients);
+static void uring_client_accept(struct UringServer * pserver, int fd);
+static void uring_client_received(struct UringServer * pserver, struct UringConn * pconn, int res);
+static void uring_client_sent(struct UringServer * pserver, struct UringConn * pconn, int res);
+static void uring_client_parse(struct UringServer * pserver, struct UringConn * pconn);
+static int uring_client_add_block(struct UringServer * pserver, struct UringConn * pconn);
+static int uring_client_take_payload(struct UringConn * pconn, const uint8_t * buf, uint32_t len);
+static int uring_client_serve(struct UringServer * pserver, struct UringConn * pconn);
+static void uring_client_next(struct UringServer * pserver, struct UringConn * pconn, int outcome);
+static void uring_client_recv(struct UringServer * pserver, struct UringConn * pconn);
+static void uring_client_flush(struct UringServer * pserver, struct UringConn * pconn);
+static int uring_client_queue(struct UringConn * pconn, const void * buf, size_t len);
+static int uring_client_sink(void * arg, int sockfd, const void * buf, size_t len);
+static void uring_client_drop(struct UringServer * pserver, struct UringConn * pconn);
+static void uring_client_release(struct UringServer * pserver, struct UringConn * pconn);
+static void drop_client(struct Reactor * preactor, int fd);
+static void detach_client(struct Reactor * preactor, int fd);
+static int drain_shm_ring(struct NodeData * pnode);
+static int ingest_ring_payload(void * ctx, char * payload, uint32_t len);
+static void maintain_chain(struct NodeData * pnode, int force_snapshot);
+static int seed_chain(struct NodeData * pnode, const char * archive_path, char * sync_peers,
+        const struct ChainSnapshot * psnapshot);
+static int journal_chain(struct NodeData * pnode);
+static void track_client(struct NodeData * pnode, int fd);
+static void check_trace_dump(void);
 
 //Setup signal handler to gracefully exit
 static volatile sig_atomic_t prog_run_status = 1;
@@ -21,85 +187,1514 @@ void sig_int_handler(int _) {
     prog_run_status = 0;    
 }
 
+//Set by SIGUSR1 to have reactor 0 dump the recorded request spans
+static volatile sig_atomic_t trace_dump_requested = 0;
+
+void sig_usr1_handler(int _) {
+    (void)_;
+    trace_dump_requested = 1;
+}
+
 int main(int argc, char * argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "usage: node servname\n");
+    struct NodeData node;
+    const char * unix_path = NULL;
+    const char * shm_name = NULL;
+    const char * cold_path = NULL;
+    const char * archive_path = NULL;
+    const char * journal_path = NULL;
+    const char * dict_path = NULL;
+    char * sync_peers = NULL;
+    int opt;
+
+    long dedup_window = 0;
+    long verify_threads = -1;
+    long trace_spans = 0;
+    const char * rate_limits = NULL;
+    int use_search = 0;
+
+    node.use_uring = 0;
+    node.n_reactors = 1;
+    node.prune_depth = -1;
+    node.prune_retry = 0;
+    node.pack_depth = -1;
+    node.snapshot_path = NULL;
+    node.last_snapshot = time(NULL);
+    node.follow_peer = NULL;
+
+    static const struct option long_options[] = {
+        {"follow", required_argument, NULL, 'F'},
+        {NULL, 0, NULL, 0}
+    };
+
+    while ((opt = getopt_long(argc, argv, "ul:s:p:c:S:J:Z:z:D:IV:T:b:r:L:y:F:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'u':
+                node.use_uring = 1;
+                break;
+            case 'l':
+                unix_path = optarg;
+                break;
+            case 's':
+                shm_name = optarg;
+                break;
+            case 'p':
+                node.prune_depth = strtol(optarg, NULL, 10);
+                if (node.prune_depth < 0) {
+                    fprintf(stderr, "Node: prune depth must not be negative\n");
+                    return 1;
+                }
+                break;
+            case 'c':
+                cold_path = optarg;
+                break;
+            case 'S':
+                node.snapshot_path = optarg;
+                break;
+            case 'J':
+                journal_path = optarg;
+                break;
+            case 'Z':
+                dict_path = optarg;
+                if (node.pack_depth < 0) {
+                    node.pack_depth = CODEC_DEFAULT_DEPTH;
+                }
+                break;
+            case 'z':
+                node.pack_depth = strtol(optarg, NULL, 10);
+                if (node.pack_depth < 0 || node.pack_depth > UINT32_MAX) {
+                    fprintf(stderr, "Node: invalid pack depth\n");
+                    return 1;
+                }
+                break;
+            case 'D':
+                dedup_window = strtol(optarg, NULL, 10);
+                if (dedup_window <= 0 || dedup_window > UINT32_MAX) {
+                    fprintf(stderr, "Node: invalid dedup window\n");
+                    return 1;
+                }
+                break;
+            case 'I':
+                use_search = 1;
+                break;
+            case 'V':
+                verify_threads = strtol(optarg, NULL, 10);
+                if (verify_threads < 0 || verify_threads > VERIFY_MAX_WORKERS) {
+                    fprintf(stderr, "Node: invalid number of verification threads\n");
+                    return 1;
+                }
+                break;
+            case 'T':
+                trace_spans = strtol(optarg, NULL, 10);
+                if (trace_spans <= 0 || trace_spans > TRACE_MAX_SPANS) {
+                    fprintf(stderr, "Node: spans recorded must be 1 to %d\n", TRACE_MAX_SPANS);
+                    return 1;
+                }
+                break;
+            case 'b':
+                archive_path = optarg;
+                break;
+            case 'r':
+                node.n_reactors = strtol(optarg, NULL, 10);
+                if (node.n_reactors < 1 || node.n_reactors > MAX_REACTORS) {
+                    fprintf(stderr, "Node: invalid number of reactors\n");
+                    return 1;
+                }
+                break;
+            case 'L':
+                rate_limits = optarg;
+                break;
+            case 'y':
+                sync_peers = optarg;
+                break;
+            case 'F':
+                node.follow_peer = optarg;
+                break;
+            default:
+                fprintf(stderr, NODE_USAGE);
+                return 1;
+        }
+    }
+
+    if (optind != argc - 1 || (node.pack_depth >= 0 && dict_path == NULL)) {
+        fprintf(stderr, NODE_USAGE);
+        return 1;
+    }
+    //replicas only take blocks from their primary
+    if (node.follow_peer != NULL && shm_name != NULL) {
+        fprintf(stderr, "Node: a read replica cannot accept payloads over shared memory\n");
         return 1;
     }
-    struct BlockChain block_chain = initialise_chain();
-    char payload_buf[TOTAL_PAYLOAD_LEN]; 
-    if (add_block(&block_chain, "Genesis block choo choo all aboard the cherub chrain") != 0) {
-        exit(1);
+    node.block_chain = initialise_chain();
+    node.ctx.pblock_chain = &node.block_chain;
+    node.ctx.pdedup = NULL;
+    if (dedup_window > 0) {
+        if (initialise_dedup(&node.dedup, (uint32_t)dedup_window) != 0) {
+            return 2;
+        }
+        node.ctx.pdedup = &node.dedup;
+    }
+    node.ctx.psearch = NULL;
+    if (use_search) {
+        if (initialise_search_index(&node.search) != 0) {
+            return 2;
+        }
+        node.ctx.psearch = &node.search;
+    }
+    //cheap enough to keep on every node so any pair can be compared
+    if (initialise_range_tree(&node.tree) != 0) {
+        return 2;
+    }
+    node.ctx.ptree = &node.tree;
+    if (initialise_time_index(&node.time_index) != 0) {
+        return 2;
+    }
+    node.ctx.ptime = &node.time_index;
+    node.ctx.padmission = NULL;
+    if (rate_limits != NULL) {
+        //each address may by default use a few connections worth of budget
+        double conn_rate = 0, addr_rate = -1;
+        unsigned max_streams = ADMISSION_DEFAULT_STREAMS;
+        if (sscanf(rate_limits, "%lf:%lf:%u", &conn_rate, &addr_rate, &max_streams) < 1 ||
+                conn_rate <= 0 || max_streams == 0) {
+            fprintf(stderr, "Node: invalid rate limits\n");
+            return 1;
+        }
+        if (addr_rate <= 0) {
+            addr_rate = 4 * conn_rate;
+        }
+        if (initialise_admission(&node.admission, conn_rate, addr_rate, max_streams) != 0) {
+            return 2;
+        }
+        node.ctx.padmission = &node.admission;
+    }
+    node.ctx.read_only = node.follow_peer != NULL;
+    node.ctx.packs = NULL; //each reactor holds its own
+    node.ctx.psink = NULL; //set by reactors running the io_uring backend
+    node.ctx.ptxs = NULL;
+    node.ctx.pverifier = NULL;
+    if (verify_threads >= 0) {
+        if (start_verifier(&node.verifier, (unsigned)verify_threads) != 0) {
+            return 2;
+        }
+        node.ctx.pverifier = &node.verifier;
+    }
+    //the subscription publisher reads the chain from its own thread so the lock is always needed.
+    //Writers must not starve behind a stream of chain readers
+    pthread_rwlockattr_t lock_attr;
+    pthread_rwlockattr_init(&lock_attr);
+    pthread_rwlockattr_setkind_np(&lock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&node.chain_lock, &lock_attr);
+    pthread_rwlockattr_destroy(&lock_attr);
+    node.ctx.plock = &node.chain_lock;
+    node.ctx.psubs = NULL;
+    if (cold_path != NULL && open_cold_store(&node.block_chain, cold_path) != 0) {
+        return 2;
+    }
+    //the last snapshot checks the chain replayed from the journal, or seeds a node without one
+    struct ChainSnapshot snapshot = {0, 0, NULL, NULL, 0};
+    if (node.snapshot_path != NULL && access(node.snapshot_path, F_OK) == 0 &&
+            load_snapshot(&snapshot, node.snapshot_path) != 0) {
+        deinitialise_chain(&node.block_chain);
+        return 2;
+    }
+    //a journal holding blocks is the node's chain from a previous run
+    node.ctx.pjournal = NULL;
+    if (journal_path != NULL) {
+        if (open_journal(&node.journal, journal_path, &node.block_chain) != 0) {
+            free_snapshot(&snapshot);
+            deinitialise_chain(&node.block_chain);
+            return 2;
+        }
+        node.ctx.pjournal = &node.journal;
+        if (node.block_chain.len > 0 && (archive_path != NULL || sync_peers != NULL)) {
+            fprintf(stderr, "Node: %s already holds a chain, not bootstrapping\n", journal_path);
+            close_journal(&node.journal);
+            free_snapshot(&snapshot);
+            deinitialise_chain(&node.block_chain);
+            return 1;
+        }
+    }
+    if (seed_chain(&node, archive_path, sync_peers, &snapshot) != 0 ||
+            (node.ctx.pjournal != NULL && journal_chain(&node) != 0)) {
+        if (node.ctx.pjournal != NULL) {
+            close_journal(&node.journal);
+        }
+        free_snapshot(&snapshot);
+        deinitialise_chain(&node.block_chain);
+        return 2;
     }
-        
-    for (int i = 0; i < 5; i++) {
-        sprintf(payload_buf, "Block %d", i);
-        if (add_block(&block_chain, payload_buf) != 0) {
+    free_snapshot(&snapshot);
+
+    print_chain(&node.block_chain);
+
+    //dictionaries are trained on the chain so a seeded chain can be packed straight away
+    if (dict_path != NULL) {
+        if (initialise_codec(&node.codec, dict_path, &node.block_chain) != 0) {
+            deinitialise_chain(&node.block_chain);
             return 2;
         }
+        node.train_len = node.block_chain.len;
+        if (node.codec.latest == 0 && train_codec(&node.codec, &node.ctx) == -1) {
+            fprintf(stderr, "Node: failed to train payload dictionary, payloads stay raw\n");
+        }
     }
-        
-    print_chain(&block_chain);
-    struct ServerData server_data = initialise_server(argv[1]);
 
-    //Setup sigint handling
+    node.shm_ring.hdr = NULL;
+    if (shm_name != NULL && create_shm_ring(&node.shm_ring, shm_name) != 0) {
+        deinitialise_chain(&node.block_chain);
+        return 3;
+    }
+
+    //Setup sigint handling before any reactor threads exist so they all inherit it
     struct sigaction act;
+    memset(&act, 0, sizeof(act));
     act.sa_handler = sig_int_handler;
     sigaction(SIGINT, &act, NULL);
+    act.sa_handler = sig_usr1_handler;
+    sigaction(SIGUSR1, &act, NULL);
+
+    if (trace_spans > 0) {
+        if (start_tracing((uint32_t)trace_spans) != 0) {
+            deinitialise_chain(&node.block_chain);
+            return 3;
+        }
+        printf("Node: recording the last %ld request spans. SIGUSR1 dumps them\n", trace_spans);
+    }
+
+    //blocks already on the chain are only sent to subscribers as backlog
+    if (start_subscriptions(&node.subs, &node.ctx) != 0) {
+        deinitialise_chain(&node.block_chain);
+        return 3;
+    }
+    node.ctx.psubs = &node.subs;
+
+    if (node.follow_peer != NULL && start_follower(&node.follower, node.follow_peer, &node.ctx) != 0) {
+        stop_subscriptions(&node.subs);
+        deinitialise_chain(&node.block_chain);
+        return 3;
+    }
+
+    if (start_reactors(&node, argv[optind], unix_path) != 0) {
+        if (node.follow_peer != NULL) {
+            stop_follower(&node.follower);
+        }
+        stop_subscriptions(&node.subs);
+        detach_shm_ring(&node.shm_ring);
+        deinitialise_chain(&node.block_chain);
+        return 3;
+    }
 
     printf("Node: Initialisation complete, entering node loop\n"); 
-    //main processing loop
+    run_reactor(&node.reactors[0]);
+    
+    printf("Node: Shutdown signal received -- stopping node\n"); 
+    stop_reactors(&node);
+    if (node.follow_peer != NULL) {
+        stop_follower(&node.follower);
+        printf("Node: Replicated %llu blocks from %s (%llu reconnects)\n",
+                (unsigned long long)node.follower.blocks, node.follow_peer,
+                (unsigned long long)node.follower.reconnects);
+        if (node.follower.diverged) {
+            printf("Node: Stopped following %s after diverging at height %u\n", node.follow_peer,
+                    node.follower.diverged_height);
+        }
+    }
+    if (node.ctx.pverifier != NULL) {
+        stop_verifier(&node.verifier);
+        printf("Node: Verified %llu transactions in %llu batches, %llu bad signatures\n",
+                (unsigned long long)node.verifier.verified, (unsigned long long)node.verifier.batches,
+                (unsigned long long)node.verifier.rejected);
+    }
+    //nothing appends once reactors and follower are stopped
+    stop_subscriptions(&node.subs);
+    printf("Node: Published %llu frames to subscribers, %llu overflows, %llu dropped\n",
+            (unsigned long long)node.subs.frames, (unsigned long long)node.subs.overflows,
+            (unsigned long long)node.subs.dropped);
+    maintain_chain(&node, 1);
+    stop_tracing();
+    if (node.ctx.pjournal != NULL) {
+        close_journal(&node.journal);
+        printf("Node: Journaled %llu blocks with %llu syncs\n",
+                (unsigned long long)node.journal.appended, (unsigned long long)node.journal.syncs);
+    }
+
+    detach_shm_ring(&node.shm_ring);
+    deinitialise_chain(&node.block_chain);
+    if (dict_path != NULL) {
+        printf("Node: Packed %llu payloads from %llu to %llu bytes\n",
+                (unsigned long long)node.codec.packed, (unsigned long long)node.codec.raw_bytes,
+                (unsigned long long)node.codec.packed_bytes);
+        deinitialise_codec(&node.codec);
+    }
+    pthread_rwlock_destroy(&node.chain_lock);
+    if (node.ctx.pdedup != NULL) {
+        deinitialise_dedup(&node.dedup);
+    }
+    if (node.ctx.psearch != NULL) {
+        deinitialise_search_index(&node.search);
+    }
+    deinitialise_range_tree(&node.tree);
+    deinitialise_time_index(&node.time_index);
+    if (node.ctx.padmission != NULL) {
+        printf("Node: %llu requests rejected by admission control\n",
+                (unsigned long long)node.admission.rejected);
+        deinitialise_admission(&node.admission);
+    }
+
+    return 0;
+}
+
+/**
+ * Create every reactor's listener and start all reactors other than reactor 0, which the
+ * caller runs on the main thread. With a single reactor a plain listener is used
+ * @param pnode node state. reactors is allocated and must be released with stop_reactors
+ * @param servname port number or service name every reactor listens on
+ * @param unix_path path of reactor 0's unix listener. NULL if unused
+ * @return 0 on success, -1 on failure
+ */
+static int start_reactors(struct NodeData * pnode, const char * servname, const char * unix_path) {
+    pnode->reactors = calloc(pnode->n_reactors, sizeof(struct Reactor));
+    if (pnode->reactors == NULL) {
+        fprintf(stderr, "Node: failed to allocate memory for reactors\n");
+        return -1;
+    }
+
+    for (int i = 0; i < pnode->n_reactors; i++) {
+        struct Reactor * preactor = &pnode->reactors[i];
+        preactor->pnode = pnode;
+        preactor->id = i;
+        preactor->ctx = pnode->ctx;
+        preactor->ctx.packs = &preactor->acks;
+        preactor->ctx.ptxs = &preactor->txs;
+        preactor->server_data = pnode->n_reactors > 1 ?
+            initialise_reuseport_server(servname) : initialise_server(servname);
+
+        if (preactor->server_data.pollfds == NULL ||
+                (i == 0 && unix_path != NULL &&
+                 add_unix_listener_to_server(&preactor->server_data, unix_path) != 0) ||
+                (i > 0 && pthread_create(&preactor->thread, NULL, reactor_thread, preactor) != 0)) {
+            fprintf(stderr, "Node: failed to start reactor %d\n", i);
+            if (preactor->server_data.pollfds != NULL) {
+                deinitialise_server(&preactor->server_data);
+            }
+            //unwind reactors already running
+            pnode->n_reactors = i;
+            prog_run_status = 0;
+            stop_reactors(pnode);
+            return -1;
+        }
+    }
+    if (pnode->n_reactors > 1) {
+        printf("Node: started %d reactors\n", pnode->n_reactors);
+    }
+    return 0;
+}
+
+/**
+ * Wait for every reactor thread to exit then close all reactors' sockets.
+ * prog_run_status must already be cleared
+ * @param pnode node state
+ * @return void
+ */
+static void stop_reactors(struct NodeData * pnode) {
+    for (int i = 1; i < pnode->n_reactors; i++) {
+        pthread_join(pnode->reactors[i].thread, NULL);
+    }
+    for (int i = 0; i < pnode->n_reactors; i++) {
+        deinitialise_server(&pnode->reactors[i].server_data);
+        free_ack_queue(&pnode->reactors[i].acks);
+        free_tx_queue(&pnode->reactors[i].txs);
+    }
+    free(pnode->reactors);
+    pnode->reactors = NULL;
+}
+
+/**
+ * Thread entry point of reactors other than reactor 0
+ * @param arg reactor to run
+ * @return NULL
+ */
+static void * reactor_thread(void * arg) {
+    run_reactor(arg);
+    return NULL;
+}
+
+/**
+ * Pin reactor to its CPU when the node is multi-reactor and run its event loop until shutdown
+ * @param preactor reactor to run
+ * @return void
+ */
+static void run_reactor(struct Reactor * preactor) {
+    if (preactor->pnode->n_reactors > 1) {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(preactor->id % (n_cpus > 0 ? n_cpus : 1), &cpus);
+        //pinning is only an optimisation so failure is not fatal
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+            fprintf(stderr, "Node: failed to pin reactor %d\n", preactor->id);
+        }
+    }
+
+    //Prefer io_uring when requested but fall back to poll if the kernel refuses it
+    if (!preactor->pnode->use_uring || run_uring_loop(preactor) != 0) {
+        run_poll_loop(preactor);
+    }
+}
+
+/**
+ * Main processing loop built on the `poll` syscall. Fallback backend used on all platforms
+ * @param preactor reactor to service
+ * @return void
+ */
+static void run_poll_loop(struct Reactor * preactor) {
+    struct NodeData * pnode = preactor->pnode;
+    struct ServerData * pserver_data = &preactor->server_data;
+    int timeout = POLL_TIMEOUT_MS;
+
     while(prog_run_status) {
-        int poll_count = poll(server_data.pollfds, server_data.fd_count, 1);
+        int poll_count = poll(pserver_data->pollfds, pserver_data->fd_count, timeout);
 
-        if (poll_count == -1) {
+        //signals such as the trace dump request interrupt the wait but are not errors
+        if (poll_count == -1 && errno != EINTR) {
             perror("Node: poll");
         }
 
         // Run through the existing connections looking for data to read
-        for(int i = 0; i < server_data.fd_count; i++) {
+        for(int i = 0; i < pserver_data->fd_count; i++) {
 
             // Check if someone's ready to read
-            if (server_data.pollfds[i].revents & POLLIN) { 
+            if (pserver_data->pollfds[i].revents & POLLIN) { 
 
-                if (server_data.pollfds[i].fd == server_data.listenerfd) {
+                if (is_listener(pserver_data, pserver_data->pollfds[i].fd)) {
                     // If listener is ready to read, handle new connection
 
-                    int new_fd = get_client(server_data.listenerfd);
+                    int new_fd = get_client(pserver_data->pollfds[i].fd);
 
                     if (new_fd != -1) {
-                        add_fd_to_server(&server_data, new_fd);
+                        track_client(pnode, new_fd);
+                        add_fd_to_server(pserver_data, new_fd);
                     }
                 } else {
                     // If we have received POLLIN revent from socket that is not the listener,
                     //we must handle receiving the data
-                    uint8_t endpoint_id;
-                    //Read endpoint id to determine appropriate endpoint to run
-                    int sender_fd = server_data.pollfds[i].fd;
-                    size_t nbytes = receive_buf(sender_fd, &endpoint_id, 1);
-
-                    if (nbytes <= 0) {
-                        // Got error or connection closed by client
-                        delete_fd_from_server(&server_data, i);
-
-                    } else {
-                        //Try to dispatch to the requested endpoint
-                        if (endpoint_dispatch(endpoint_id, sender_fd, &block_chain) != DISPATCH_OK) {
-                            //If we do not receive OK response then drop the connection
-                            fprintf(stderr, "Node: Dropping connection: %d\n", sender_fd);
-                            delete_fd_from_server(&server_data, i); 
-                        }
+                    int ret = serve_request(pserver_data->pollfds[i].fd, &preactor->ctx);
+                    if (ret == 1) {
+                        //socket now belongs to whoever the endpoint handed it to
+                        remove_fd_from_server(pserver_data, i);
+                    } else if (ret != 0) {
+                        cancel_acks(&preactor->ctx, pserver_data->pollfds[i].fd);
+                        delete_fd_from_server(pserver_data, i);
                     }
                 } // END handle data from client
             } // END got ready-to-read from poll()
         } // END looping through file descriptors
+
+        //Group commit of every block added while serving this iteration's clients
+        commit_acks(&preactor->ctx);
+
+        //Node wide work is done by reactor 0 only
+        if (preactor->id != 0) {
+            continue;
+        }
+        //Busy poll while ring producers are active, otherwise wait on sockets as usual
+        timeout = drain_shm_ring(pnode) > 0 ? 0 : POLL_TIMEOUT_MS;
+        maintain_chain(pnode, 0);
+        check_trace_dump();
     } // END main node loop
-    
-    printf("Node: Shutdown signal received -- stopping node\n"); 
+}
+
+/**
+ * Main processing loop built on io_uring. A multishot accept is kept armed in the kernel and
+ * every client has its next receive, and any response being sent, in flight on the ring, so
+ * each iteration costs a single io_uring_enter that both submits new requests and harvests a
+ * batch of completions. Add block requests are received and acknowledged and chain responses
+ * sent without any further syscalls
+ * @param preactor reactor to service. Accepted clients are tracked in its server data
+ * so they are closed on deinitialisation
+ * @return 0 on shutdown, -1 if io_uring is unavailable or its accept failed and the caller
+ * should fall back. Clients between requests stay in server data for the poll backend
+ */
+static int run_uring_loop(struct Reactor * preactor) {
+    struct NodeData * pnode = preactor->pnode;
+    struct ServerData * pserver_data = &preactor->server_data;
+    struct UringServer server = {.preactor = preactor, .conns = NULL, .n_conns = 0, .in_flight = 0,
+        .released = NULL};
+    struct io_uring_cqe cqe;
+    //the shm ring has no fd to wait on so poll it at the same rate as the poll backend
+    unsigned timeout = preactor->id == 0 && pnode->shm_ring.hdr != NULL ?
+        POLL_TIMEOUT_MS : URING_TIMEOUT_MS;
+
+    if (initialise_uring(&server.uring, URING_ENTRIES) != 0) {
+        fprintf(stderr, "Node: io_uring unavailable, falling back to poll\n");
+        return -1;
+    }
+
+    if (uring_arm_accept(&server.uring, pserver_data->listenerfd) != 0 ||
+            (pserver_data->unix_listenerfd != -1 &&
+             uring_arm_accept(&server.uring, pserver_data->unix_listenerfd) != 0)) {
+        deinitialise_uring(&server.uring);
+        return -1;
+    }
+    //acks are queued on the ring with the rest of the client's responses
+    server.sink.send = uring_client_sink;
+    server.sink.arg = &server;
+    preactor->ctx.psink = &server.sink;
 
-    deinitialise_server(&server_data);
-    deinitialise_chain(&block_chain);
+    printf("Node: using io_uring backend\n");
+    int ret = 0;
+    while (prog_run_status && ret == 0) {
+        if (uring_submit_and_wait(&server.uring, timeout) != 0) {
+            break;
+        }
+
+        //Harvest every completion available in this batch
+        while (uring_next_completion(&server.uring, &cqe)) {
+            uint64_t tag = uring_event_tag(cqe.user_data);
+
+            switch (uring_event_type(cqe.user_data)) {
+                case URING_EVENT_ACCEPT:
+                    //a kernel refusing multishot accept fails every attempt, so rather than
+                    //re-arm it forever hand the listeners to the poll backend
+                    if (cqe.res < 0) {
+                        fprintf(stderr, "Node: io_uring accept: %s, falling back to poll\n",
+                                strerror(-cqe.res));
+                        ret = -1;
+                        break;
+                    }
+                    if (configure_client(cqe.res) == 0) {
+                        printf("Node: new connection on socket %d\n", cqe.res);
+                        track_client(pnode, cqe.res);
+                        add_fd_to_server(pserver_data, cqe.res);
+                        uring_client_accept(&server, cqe.res);
+                    }
+                    //kernel terminated the multishot request. Re-arm it
+                    if (!(cqe.flags & IORING_CQE_F_MORE) && uring_arm_accept(&server.uring, (int)tag) != 0) {
+                        ret = -1;
+                    }
+                    break;
 
+                case URING_EVENT_RECV:
+                    uring_client_received(&server, (struct UringConn *)(uintptr_t)tag, cqe.res);
+                    break;
+
+                case URING_EVENT_SEND:
+                    uring_client_sent(&server, (struct UringConn *)(uintptr_t)tag, cqe.res);
+                    break;
+
+                case URING_EVENT_CANCEL:
+                    break;
+            }
+        }
+
+        //Group commit of every block added by this batch of completions. Acks are queued on
+        //the ring and go out with the next submission
+        commit_acks(&preactor->ctx);
+
+        //clients are only freed here so none is freed while a completion is still using it
+        while (server.released != NULL) {
+            struct UringConn * pconn = server.released;
+            server.released = pconn->next_released;
+            uring_client_release(&server, pconn);
+        }
+
+        if (preactor->id == 0) {
+            drain_shm_ring(pnode);
+            maintain_chain(pnode, 0);
+            check_trace_dump();
+        }
+    }
+
+    stop_uring_server(&server, ret != 0);
+    return ret;
+}
+
+/**
+ * Cancel every request in flight and wait for them to complete before the ring is closed, as
+ * the kernel may otherwise still write into a client's buffers
+ * @param pserver backend to stop
+ * @param keep_clients set to leave clients that are between requests in server data for the
+ * poll backend. Others are closed
+ * @return void
+ */
+static void stop_uring_server(struct UringServer * pserver, int keep_clients) {
+    struct Reactor * preactor = pserver->preactor;
+    struct io_uring_cqe cqe;
+
+    commit_acks(&preactor->ctx);
+    preactor->ctx.psink = NULL;
+    uring_cancel(&pserver->uring, uring_user_data(URING_EVENT_ACCEPT,
+                (uint32_t)preactor->server_data.listenerfd));
+    if (preactor->server_data.unix_listenerfd != -1) {
+        uring_cancel(&pserver->uring, uring_user_data(URING_EVENT_ACCEPT,
+                    (uint32_t)preactor->server_data.unix_listenerfd));
+    }
+    for (int fd = 0; fd < pserver->n_conns; fd++) {
+        struct UringConn * pconn = pserver->conns[fd];
+        if (pconn == NULL) {
+            continue;
+        }
+        //a client whose responses are not all sent, or with part of a request received,
+        //cannot be handed over in step
+        if (!keep_clients || pconn->stage != URING_STAGE_ID || pconn->send_armed ||
+                pconn->queued.len > 0 || pconn->in_start < pconn->in_end) {
+            pconn->closing = 1;
+        }
+        if (pconn->recv_armed) {
+            uring_cancel(&pserver->uring, uring_user_data(URING_EVENT_RECV, (uintptr_t)pconn));
+        }
+        if (pconn->send_armed) {
+            uring_cancel(&pserver->uring, uring_user_data(URING_EVENT_SEND, (uintptr_t)pconn));
+        }
+    }
+
+    for (int i = 0; i < URING_DRAIN_WAITS && pserver->in_flight > 0; i++) {
+        if (uring_submit_and_wait(&pserver->uring, URING_TIMEOUT_MS) != 0) {
+            break;
+        }
+        while (uring_next_completion(&pserver->uring, &cqe)) {
+            uint64_t tag = uring_event_tag(cqe.user_data);
+            enum uring_event_type type = uring_event_type(cqe.user_data);
+            struct UringConn * pconn = (struct UringConn *)(uintptr_t)tag;
+
+            if (type == URING_EVENT_ACCEPT && cqe.res >= 0) {
+                close(cqe.res);
+            } else if (type == URING_EVENT_RECV || type == URING_EVENT_SEND) {
+                pserver->in_flight--;
+                //a receive that completed before its cancel took part of a request
+                if (cqe.res > 0) {
+                    pconn->closing = 1;
+                }
+                if (type == URING_EVENT_RECV) {
+                    pconn->recv_armed = 0;
+                } else {
+                    pconn->send_armed = 0;
+                }
+            }
+        }
+    }
+
+    for (int fd = 0; fd < pserver->n_conns; fd++) {
+        struct UringConn * pconn = pserver->conns[fd];
+        //memory of a request the kernel never completed is left rather than freed under it
+        if (pconn == NULL || pconn->recv_armed || pconn->send_armed) {
+            continue;
+        }
+        uring_client_release(pserver, pconn);
+    }
+    free(pserver->conns);
+    deinitialise_uring(&pserver->uring);
+}
+
+/**
+ * Start serving a client through the ring
+ * @param pserver backend of the reactor the client was added to
+ * @param fd client socket
+ * @return void
+ */
+static void uring_client_accept(struct UringServer * pserver, int fd) {
+    if (fd >= pserver->n_conns) {
+        int n_conns = pserver->n_conns > 0 ? pserver->n_conns : 64;
+        while (n_conns <= fd) {
+            n_conns *= 2;
+        }
+        struct UringConn ** conns = realloc(pserver->conns, n_conns * sizeof(struct UringConn *));
+        if (conns == NULL) {
+            fprintf(stderr, "Node: failed to grow io_uring client table\n");
+            drop_client(pserver->preactor, fd);
+            return;
+        }
+        memset(conns + pserver->n_conns, 0, (n_conns - pserver->n_conns) * sizeof(struct UringConn *));
+        pserver->conns = conns;
+        pserver->n_conns = n_conns;
+    }
+
+    struct UringConn * pconn = calloc(1, sizeof(struct UringConn));
+    if (pconn == NULL) {
+        fprintf(stderr, "Node: failed to allocate io_uring client\n");
+        drop_client(pserver->preactor, fd);
+        return;
+    }
+    pconn->fd = fd;
+    pconn->stage = URING_STAGE_ID;
+    pserver->conns[fd] = pconn;
+    uring_client_recv(pserver, pconn);
+}
+
+/**
+ * Completion of a client's receive
+ * @param pserver backend the client belongs to
+ * @param pconn client
+ * @param res bytes received, 0 if the client closed or a negative errno
+ * @return void
+ */
+static void uring_client_received(struct UringServer * pserver, struct UringConn * pconn, int res) {
+    pconn->recv_armed = 0;
+    pserver->in_flight--;
+    if (pconn->closing || res <= 0) {
+        //closed by the client or failed
+        uring_client_drop(pserver, pconn);
+        return;
+    }
+
+    switch (pconn->stage) {
+        case URING_STAGE_ID:
+            pconn->in_end += res;
+            uring_client_parse(pserver, pconn);
+            return;
+
+        case URING_STAGE_PAYLOAD:
+            pconn->hash = hash_payload_update(pconn->hash, pconn->payload + pconn->received, res);
+            pconn->received += res;
+            if (pconn->received == pconn->len) {
+                int outcome = uring_client_add_block(pserver, pconn);
+                uring_client_next(pserver, pconn, outcome);
+                uring_client_parse(pserver, pconn);
+                return;
+            }
+            break;
+
+        case URING_STAGE_DISCARD:
+            pconn->received += res;
+            if (pconn->received == pconn->len) {
+                uring_client_next(pserver, pconn, 0);
+                uring_client_parse(pserver, pconn);
+                return;
+            }
+            break;
+
+        default:
+            //nothing is received in the other stages
+            uring_client_drop(pserver, pconn);
+            return;
+    }
+    uring_client_recv(pserver, pconn);
+}
+
+/**
+ * Completion of a client's send. Sends whatever is left, then the next responses
+ * @param pserver backend the client belongs to
+ * @param pconn client
+ * @param res bytes sent or a negative errno
+ * @return void
+ */
+static void uring_client_sent(struct UringServer * pserver, struct UringConn * pconn, int res) {
+    pconn->send_armed = 0;
+    pserver->in_flight--;
+    if (pconn->closing || res < 0) {
+        uring_client_drop(pserver, pconn);
+        return;
+    }
+    pconn->out_sent += res;
+    if (pconn->out_sent == pconn->out_len) {
+        pconn->out = NULL;
+        pconn->sending.len = 0;
+    }
+    uring_client_flush(pserver, pconn);
+}
+
+/**
+ * Serve every request whose bytes have been received, then receive more. Stops early on a
+ * request that has to wait for the client's responses to be sent
+ * @param pserver backend the client belongs to
+ * @param pconn client
+ * @return void
+ */
+static void uring_client_parse(struct UringServer * pserver, struct UringConn * pconn) {
+    struct EndpointContext * pctx = &pserver->preactor->ctx;
+
+    while (pconn->stage == URING_STAGE_ID && !pconn->closing && pconn->in_start < pconn->in_end) {
+        uint32_t avail = pconn->in_end - pconn->in_start;
+        const uint8_t * buf = pconn->in + pconn->in_start;
+        pconn->endpoint_id = buf[0];
+
+        if (pconn->endpoint_id == ENDPOINT_ADD_BLOCK) {
+            uint32_t network_len;
+            if (avail < 1 + sizeof(network_len)) {
+                break;
+            }
+            memcpy(&network_len, buf + 1, sizeof(network_len));
+            pconn->len = ntohl(network_len);
+            pconn->in_start += 1 + sizeof(network_len);
+            avail -= 1 + sizeof(network_len);
+            pconn->received = 0;
+
+            //admitted before the payload is taken, as by the endpoint
+            trace_begin_span(&pconn->span, pconn->fd);
+            enum endpoint_dispatch_retval admitted = admit_add_block(pconn->fd, pctx, pconn->len);
+            if (admitted != DISPATCH_OK) {
+                int outcome = finish_request(ENDPOINT_ADD_BLOCK, pconn->fd, admitted, &pconn->span);
+                if (outcome != 0) {
+                    uring_client_next(pserver, pconn, outcome);
+                    return;
+                }
+                //rejection is queued. The payload is still dropped so the stream stays in step
+                uint32_t dropped = avail < pconn->len ? avail : pconn->len;
+                pconn->in_start += dropped;
+                pconn->received = dropped;
+                if (dropped < pconn->len) {
+                    pconn->stage = URING_STAGE_DISCARD;
+                }
+                continue;
+            }
+            trace_drop_span(&pconn->span);
+
+            pconn->hash = HASH_SEED;
+            pconn->payload_cap = 0;
+            uint32_t taken = avail < pconn->len ? avail : pconn->len;
+            if (uring_client_take_payload(pconn, buf + 1 + sizeof(network_len), taken) != 0) {
+                uring_client_drop(pserver, pconn);
+                return;
+            }
+            pconn->in_start += taken;
+            if (pconn->received < pconn->len) {
+                pconn->stage = URING_STAGE_PAYLOAD;
+                break;
+            }
+            int outcome = uring_client_add_block(pserver, pconn);
+            if (outcome != 0) {
+                uring_client_next(pserver, pconn, outcome);
+                return;
+            }
+            continue;
+        }
+
+        pconn->in_start++;
+        int outcome = uring_client_serve(pserver, pconn);
+        if (outcome != 0) {
+            uring_client_next(pserver, pconn, outcome);
+            return;
+        }
+    }
+
+    if (pconn->closing || (pconn->stage != URING_STAGE_ID && pconn->stage != URING_STAGE_PAYLOAD &&
+                pconn->stage != URING_STAGE_DISCARD)) {
+        return;
+    }
+    //whatever is left is the start of a request. Moved to the front to receive the rest after it
+    memmove(pconn->in, pconn->in + pconn->in_start, pconn->in_end - pconn->in_start);
+    pconn->in_end -= pconn->in_start;
+    pconn->in_start = 0;
+    uring_client_recv(pserver, pconn);
+}
+
+/**
+ * Add the payload a client has finished sending
+ * @param pserver backend the client belongs to
+ * @param pconn client whose payload has been received in full. The payload is taken over
+ * @return 0 to keep the client, -1 to drop it
+ */
+static int uring_client_add_block(struct UringServer * pserver, struct UringConn * pconn) {
+    char * payload = pconn->payload;
+
+    //payloads are always taken with room for the null char
+    payload[pconn->len] = '\0';
+    pconn->payload = NULL;
+    trace_begin_span(&pconn->span, pconn->fd);
+    enum endpoint_dispatch_retval ret = add_received_block(pconn->fd, &pserver->preactor->ctx,
+            payload, pconn->len, pconn->hash);
+    return finish_request(ENDPOINT_ADD_BLOCK, pconn->fd, ret, &pconn->span);
+}
+
+/**
+ * Append bytes of an add block payload, growing its allocation as bytes arrive as
+ * receive_payload does, so a client that claims a large payload and stalls costs little
+ * @param pconn client sending the payload
+ * @param buf bytes of payload. NULL to only make room for len more bytes
+ * @param len number of bytes
+ * @return 0 on success, -1 on failure
+ */
+static int uring_client_take_payload(struct UringConn * pconn, const uint8_t * buf, uint32_t len) {
+    size_t need = (size_t)pconn->received + len + 1;
+
+    if (need > pconn->payload_cap) {
+        //doubled up to the exact size, so growth costs O(len) copying in total
+        size_t grown = pconn->payload_cap > 0 ? pconn->payload_cap : PAYLOAD_CHUNK;
+        while (grown < need) {
+            grown *= 2;
+        }
+        if (grown > (size_t)pconn->len + 1) {
+            grown = (size_t)pconn->len + 1;
+        }
+        char * payload = realloc(pconn->payload, grown);
+        if (payload == NULL) {
+            fprintf(stderr, "Node: failed to allocate memory for payload\n");
+            return -1;
+        }
+        pconn->payload = payload;
+        pconn->payload_cap = grown;
+    }
+    if (buf != NULL) {
+        memcpy(pconn->payload + pconn->received, buf, len);
+        pconn->hash = hash_payload_update(pconn->hash, buf, len);
+        pconn->received += len;
+    }
+    return 0;
+}
+
+/**
+ * Serve a request for any endpoint other than add block, whose id has been taken
+ * @param pserver backend the client belongs to
+ * @param pconn client
+ * @return 0 to carry on, -1 to drop the client, 1 if an endpoint took its socket
+ */
+static int uring_client_serve(struct UringServer * pserver, struct UringConn * pconn) {
+    struct EndpointContext * pctx = &pserver->preactor->ctx;
+
+    //Responses must not overtake add block acks still waiting on the group commit
+    commit_acks(pctx);
+    if (pconn->closing) {
+        return 0;
+    }
+
+    if (pconn->endpoint_id == ENDPOINT_CHAIN) {
+        trace_begin_span(&pconn->span, pconn->fd);
+        enum endpoint_dispatch_retval ret = open_chain_stream(pconn->fd, pctx, &pconn->pstream);
+        if (ret == DISPATCH_RATE_LIMITED) {
+            uint32_t network_marker = htonl(ADMISSION_REJECTED);
+            if (uring_client_queue(pconn, &network_marker, sizeof(network_marker)) != 0) {
+                ret = DISPATCH_SEND_FAIL;
+            }
+        }
+        int outcome = finish_request(ENDPOINT_CHAIN, pconn->fd, ret, &pconn->span);
+        if (ret == DISPATCH_OK) {
+            pconn->stage = URING_STAGE_STREAM;
+        }
+        uring_client_flush(pserver, pconn);
+        return outcome;
+    }
+
+    //served on the socket once every response queued before it has been sent
+    if (pconn->send_armed || pconn->queued.len > 0) {
+        pconn->stage = URING_STAGE_FLUSH;
+        uring_client_flush(pserver, pconn);
+        return 0;
+    }
+    //the endpoint reads the rest of its request from what was received ahead
+    trace_begin_span(&pconn->span, pconn->fd);
+    set_receive_prefix(pconn->fd, pconn->in + pconn->in_start, pconn->in_end - pconn->in_start);
+    int outcome = serve_endpoint(pconn->endpoint_id, pconn->fd, pctx, &pconn->span);
+    pconn->in_start = pconn->in_end - clear_receive_prefix();
+    return outcome;
+}
+
+/**
+ * Move on to a client's next request once one has been served. Requests already received
+ * are served by the caller
+ * @param pserver backend the client belongs to
+ * @param pconn client
+ * @param outcome 0 to keep the client, -1 to drop it, 1 if an endpoint took its socket
+ * @return void
+ */
+static void uring_client_next(struct UringServer * pserver, struct UringConn * pconn, int outcome) {
+    if (outcome == 1) {
+        pconn->detached = 1;
+    }
+    if (outcome != 0) {
+        uring_client_drop(pserver, pconn);
+        return;
+    }
+    pconn->stage = URING_STAGE_ID;
+    pconn->received = 0;
+}
+
+/**
+ * Put the receive for a client's current stage in flight
+ * @param pserver backend the client belongs to
+ * @param pconn client
+ * @return void
+ */
+static void uring_client_recv(struct UringServer * pserver, struct UringConn * pconn) {
+    void * buf;
+    size_t len;
+
+    if (pconn->recv_armed) {
+        return;
+    }
+    switch (pconn->stage) {
+        case URING_STAGE_ID:
+            buf = pconn->in + pconn->in_end;
+            len = sizeof(pconn->in) - pconn->in_end;
+            break;
+        case URING_STAGE_PAYLOAD:
+            len = pconn->len - pconn->received > PAYLOAD_CHUNK ? PAYLOAD_CHUNK : pconn->len - pconn->received;
+            if (uring_client_take_payload(pconn, NULL, len) != 0) {
+                uring_client_drop(pserver, pconn);
+                return;
+            }
+            buf = pconn->payload + pconn->received;
+            break;
+        case URING_STAGE_DISCARD:
+            //nothing else is buffered while a payload is dropped
+            buf = pconn->in;
+            len = pconn->len - pconn->received > sizeof(pconn->in) ?
+                sizeof(pconn->in) : pconn->len - pconn->received;
+            break;
+        default:
+            return;
+    }
+
+    if (uring_arm_recv(&pserver->uring, pconn->fd, buf, len,
+                uring_user_data(URING_EVENT_RECV, (uintptr_t)pconn)) != 0) {
+        uring_client_drop(pserver, pconn);
+        return;
+    }
+    pconn->recv_armed = 1;
+    pserver->in_flight++;
+}
+
+/**
+ * Put a client's next send in flight unless one already is. Queued responses go first, then
+ * the next batch of a chain response. A client waiting to be served on its socket is served
+ * once nothing is left to send
+ * @param pserver backend the client belongs to
+ * @param pconn client
+ * @return void
+ */
+static void uring_client_flush(struct UringServer * pserver, struct UringConn * pconn) {
+    struct EndpointContext * pctx = &pserver->preactor->ctx;
+
+    if (pconn->send_armed || pconn->closing) {
+        return;
+    }
+    if (pconn->out == NULL && pconn->queued.len > 0) {
+        //responses queued from here on wait for this send so the buffers trade places
+        struct UringOut sent = pconn->sending;
+        pconn->sending = pconn->queued;
+        pconn->queued = sent;
+        pconn->out = pconn->sending.data;
+        pconn->out_len = pconn->sending.len;
+        pconn->out_sent = 0;
+    }
+    if (pconn->out == NULL && pconn->stage == URING_STAGE_STREAM) {
+        const uint8_t * batch;
+        size_t len;
+        int more = next_chain_batch(pctx, pconn->pstream, &batch, &len);
+        if (more != 1) {
+            close_chain_stream(pctx, pconn->pstream);
+            pconn->pstream = NULL;
+            uring_client_next(pserver, pconn, more == 0 ? 0 : -1);
+            uring_client_parse(pserver, pconn);
+            return;
+        }
+        pconn->out = batch;
+        pconn->out_len = len;
+        pconn->out_sent = 0;
+    }
+    if (pconn->out == NULL) {
+        if (pconn->stage == URING_STAGE_FLUSH) {
+            pconn->stage = URING_STAGE_ID;
+            int outcome = uring_client_serve(pserver, pconn);
+            if (outcome != 0) {
+                uring_client_next(pserver, pconn, outcome);
+                return;
+            }
+            uring_client_parse(pserver, pconn);
+        }
+        return;
+    }
+
+    if (uring_arm_send(&pserver->uring, pconn->fd, pconn->out + pconn->out_sent,
+                pconn->out_len - pconn->out_sent, uring_user_data(URING_EVENT_SEND, (uintptr_t)pconn)) != 0) {
+        uring_client_drop(pserver, pconn);
+        return;
+    }
+    pconn->send_armed = 1;
+    pserver->in_flight++;
+}
+
+/**
+ * Queue bytes to be sent to a client after those already queued
+ * @param pconn client
+ * @param buf bytes to send
+ * @param len number of bytes
+ * @return 0 on success, -1 on failure
+ */
+static int uring_client_queue(struct UringConn * pconn, const void * buf, size_t len) {
+    struct UringOut * pqueued = &pconn->queued;
+
+    if (pqueued->len + len > pqueued->cap) {
+        size_t cap = pqueued->cap > 0 ? pqueued->cap : 256;
+        while (cap < pqueued->len + len) {
+            cap *= 2;
+        }
+        uint8_t * data = realloc(pqueued->data, cap);
+        if (data == NULL) {
+            fprintf(stderr, "Node: failed to grow responses queued for %d\n", pconn->fd);
+            return -1;
+        }
+        pqueued->data = data;
+        pqueued->cap = cap;
+    }
+    memcpy(pqueued->data + pqueued->len, buf, len);
+    pqueued->len += len;
+    return 0;
+}
+
+/**
+ * Response sink of the io_uring backend. Queues add block responses on the client's ring
+ * @param arg UringServer of the reactor
+ * @param sockfd client to respond to
+ * @param buf responses
+ * @param len length of responses
+ * @return 0 once queued, -1 if the client is gone or the responses could not be queued
+ */
+static int uring_client_sink(void * arg, int sockfd, const void * buf, size_t len) {
+    struct UringServer * pserver = arg;
+    struct UringConn * pconn = sockfd < pserver->n_conns ? pserver->conns[sockfd] : NULL;
+
+    if (pconn == NULL || pconn->closing || uring_client_queue(pconn, buf, len) != 0) {
+        return -1;
+    }
+    uring_client_flush(pserver, pconn);
+    return 0;
+}
+
+/**
+ * Stop serving a client. Requests in flight are cancelled and the socket is only closed once
+ * each has completed, so its fd cannot be handed to a new client while the kernel still
+ * holds requests for the old one. The client is freed at the end of the loop iteration
+ * @param pserver backend the client belongs to
+ * @param pconn client
+ * @return void
+ */
+static void uring_client_drop(struct UringServer * pserver, struct UringConn * pconn) {
+    if (!pconn->closing) {
+        pconn->closing = 1;
+        if (!pconn->detached) {
+            cancel_acks(&pserver->preactor->ctx, pconn->fd);
+        }
+        if (pconn->recv_armed) {
+            uring_cancel(&pserver->uring, uring_user_data(URING_EVENT_RECV, (uintptr_t)pconn));
+        }
+        if (pconn->send_armed) {
+            uring_cancel(&pserver->uring, uring_user_data(URING_EVENT_SEND, (uintptr_t)pconn));
+        }
+    }
+    if (!pconn->recv_armed && !pconn->send_armed && !pconn->released) {
+        pconn->released = 1;
+        pconn->next_released = pserver->released;
+        pserver->released = pconn;
+    }
+}
+
+/**
+ * Free a client with no requests in flight. A dropped client's socket is closed and a
+ * detached one's forgotten. Others are left in server data for the poll backend
+ * @param pserver backend the client belongs to
+ * @param pconn client. Freed
+ * @return void
+ */
+static void uring_client_release(struct UringServer * pserver, struct UringConn * pconn) {
+    if (pconn->pstream != NULL) {
+        close_chain_stream(&pserver->preactor->ctx, pconn->pstream);
+    }
+    if (pconn->detached) {
+        detach_client(pserver->preactor, pconn->fd);
+    } else if (pconn->closing) {
+        drop_client(pserver->preactor, pconn->fd);
+    }
+    pserver->conns[pconn->fd] = NULL;
+    free(pconn->payload);
+    free(pconn->queued.data);
+    free(pconn->sending.data);
+    free(pconn);
+}
+
+/**
+ * Append any payloads clients have written into the shared memory ring
+ * @param pnode node state
+ * @return number of blocks appended. 0 if the ring is unused or empty
+ */
+static int drain_shm_ring(struct NodeData * pnode) {
+    if (pnode->shm_ring.hdr == NULL) {
+        return 0;
+    }
+    int consumed = shm_ring_drain(&pnode->shm_ring, ingest_ring_payload, &pnode->ctx);
+    if (consumed > 0) {
+        //ring producers get no acks but the drained batch is still committed as one
+        if (commit_chain(&pnode->ctx) != 0) {
+            fprintf(stderr, "Node: failed to commit payloads from shared memory ring\n");
+        }
+    }
+    return consumed > 0 ? consumed : 0;
+}
+
+/**
+ * Shared memory ring consumer. Feeds each payload through the same ingest path as
+ * the add block endpoint, verifying transactions one at a time when signatures are required
+ * @param ctx endpoint context of the node
+ * @param payload malloc'd null terminated payload. Taken over by ingest_payload
+ * @param len length of payload
+ * @return 0 to keep draining, -1 on failure
+ */
+static int ingest_ring_payload(void * ctx, char * payload, uint32_t len) {
+    struct EndpointContext * pctx = ctx;
+    struct VerifyJob job;
+
+    //ring producers get no response so refused transactions are only dropped
+    if (pctx->pverifier != NULL) {
+        int valid = parse_transaction(payload, len, &job.tx) == 0;
+        if (valid) {
+            verify_batch(pctx->pverifier, &job, 1);
+            valid = job.valid;
+        }
+        if (!valid) {
+            fprintf(stderr, "Node: dropping unverified transaction from shared memory ring\n");
+            free(payload);
+            return 0;
+        }
+    }
+    enum endpoint_dispatch_retval ret = ingest_payload(ctx, payload, len, hash_payload(payload, len),
+            NULL, NULL);
+    //Rejected duplicates are dropped. Only failures to append stop the drain
+    return (ret == DISPATCH_OK || ret == DISPATCH_DUPLICATE) ? 0 : -1;
+}
+
+/**
+ * Dump the recorded request spans if SIGUSR1 asked for them since the last check
+ * @return void
+ */
+static void check_trace_dump(void) {
+    if (!trace_dump_requested) {
+        return;
+    }
+    trace_dump_requested = 0;
+    if (trace_capacity() == 0) {
+        fprintf(stderr, "Node: no request spans recorded. Start the node with -T to record them\n");
+        return;
+    }
+    dump_trace(stderr);
+}
+
+/**
+ * Bound resident memory of the chain. Packs and prunes payloads beyond the configured
+ * depths and writes a snapshot every SNAPSHOT_INTERVAL_S seconds
+ * @param pnode node state
+ * @param force_snapshot write snapshot regardless of when the last one was taken
+ * @return void
+ */
+static void maintain_chain(struct NodeData * pnode, int force_snapshot) {
+    if (pnode->pack_depth >= 0) {
+        //a young chain's dictionary saw little of it, so a new version is trained each time
+        //the chain doubles until one has been trained on a full sample
+        const struct PayloadCodec * pcodec = &pnode->codec;
+        if (pcodec->latest == 0 || pcodec->dicts[pcodec->latest].sampled < CODEC_SAMPLE_BYTES) {
+            lock_chain_shared(&pnode->ctx);
+            uint32_t len = pnode->block_chain.len;
+            unlock_chain(&pnode->ctx);
+            uint64_t due = pcodec->latest == 0 ? (uint64_t)pnode->train_len + CODEC_MIN_SAMPLES :
+                2 * (uint64_t)pnode->train_len;
+            if (len >= due) {
+                pnode->train_len = len;
+                train_codec(&pnode->codec, &pnode->ctx);
+            }
+        }
+        //packed before pruning so cold storage receives packed payloads
+        compress_chain(&pnode->codec, &pnode->ctx, (uint32_t)pnode->pack_depth);
+    }
+    if (pnode->prune_depth >= 0 && time(NULL) >= pnode->prune_retry) {
+        //checked under the shared lock so readers are only stalled when there is work to do
+        lock_chain_shared(&pnode->ctx);
+        int due = pnode->block_chain.len - pnode->block_chain.pruned_len > (uint32_t)pnode->prune_depth;
+        unlock_chain(&pnode->ctx);
+        if (due) {
+            lock_chain_exclusive(&pnode->ctx);
+            int pruned = prune_chain(&pnode->block_chain, (uint32_t)pnode->prune_depth);
+            int err = errno;
+            unlock_chain(&pnode->ctx);
+            //a failing cold store would otherwise stall readers behind the exclusive lock every
+            //iteration, so retries back off and the failure is only reported when it starts
+            if (pruned == -1) {
+                if (pnode->prune_retry == 0) {
+                    fprintf(stderr, "Node: failed to prune payloads to cold storage: %s. Retrying every %d s\n",
+                            strerror(err), PRUNE_RETRY_S);
+                }
+                pnode->prune_retry = time(NULL) + PRUNE_RETRY_S;
+            } else if (pnode->prune_retry != 0) {
+                printf("Node: pruning to cold storage resumed\n");
+                pnode->prune_retry = 0;
+            }
+        }
+    }
+
+    if (pnode->snapshot_path == NULL) {
+        return;
+    }
+
+    time_t now = time(NULL);
+    if (!force_snapshot && now - pnode->last_snapshot < SNAPSHOT_INTERVAL_S) {
+        return;
+    }
+    pnode->last_snapshot = now;
+
+    struct ChainSnapshot snapshot;
+    lock_chain_shared(&pnode->ctx);
+    int ret = take_snapshot(&pnode->block_chain, &snapshot);
+    unlock_chain(&pnode->ctx);
+    if (ret != 0) {
+        return;
+    }
+    //the snapshot points into cold storage, so payloads pruned before it must be durable first.
+    //Pruning only happens on this thread so the fd is synced without the lock
+    if (pnode->block_chain.cold_fd != -1 && fdatasync(pnode->block_chain.cold_fd) != 0) {
+        perror("Node: fdatasync cold storage");
+        free_snapshot(&snapshot);
+        return;
+    }
+    if (write_snapshot(&snapshot, pnode->snapshot_path) == 0) {
+        printf("Node: snapshot of height %u written to %s\n", snapshot.height, pnode->snapshot_path);
+    }
+    free_snapshot(&snapshot);
+}
+
+/**
+ * Give a newly accepted client fresh rate limiting budgets when admission control is enabled
+ * @param pnode node state
+ * @param fd accepted client socket
+ * @return void
+ */
+static void track_client(struct NodeData * pnode, int fd) {
+    if (pnode->ctx.padmission != NULL) {
+        admission_track_client(pnode->ctx.padmission, fd);
+    }
+}
+
+/**
+ * Close a client tracked by a reactor's server using its fd, discarding any responses
+ * still held for it
+ * @param preactor reactor the client was added to
+ * @param fd client socket
+ * @return void
+ */
+static void drop_client(struct Reactor * preactor, int fd) {
+    struct ServerData * pserver_data = &preactor->server_data;
+
+    cancel_acks(&preactor->ctx, fd);
+    for (int i = 0; i < pserver_data->fd_count; i++) {
+        if (pserver_data->pollfds[i].fd == fd) {
+            delete_fd_from_server(pserver_data, i);
+            return;
+        }
+    }
+}
+
+/**
+ * Forget a client tracked by a reactor's server using its fd without closing it, after
+ * an endpoint handed the socket over to be serviced elsewhere
+ * @param preactor reactor the client was added to
+ * @param fd client socket
+ * @return void
+ */
+static void detach_client(struct Reactor * preactor, int fd) {
+    struct ServerData * pserver_data = &preactor->server_data;
+
+    for (int i = 0; i < pserver_data->fd_count; i++) {
+        if (pserver_data->pollfds[i].fd == fd) {
+            remove_fd_from_server(pserver_data, i);
+            return;
+        }
+    }
+}
+
+/**
+ * Populate the node's empty chain, either by bulk loading an archive, syncing from peers or
+ * with the default genesis blocks. Read replicas without either start empty and take every
+ * block from their primary. A chain recovered from the journal is kept as is. Bootstrapped
+ * blocks are fed to the dedup filter, search index, range tree and time index
+ * @param pnode node whose chain to populate
+ * @param archive_path archive to bootstrap from. NULL if unused
+ * @param sync_peers comma separated peers to sync from. NULL if unused
+ * @return 0 on success, -1 on failure
+ */
+static int seed_chain(struct NodeData * pnode, const char * archive_path, char * sync_peers,
+        const struct ChainSnapshot * psnapshot) {
+    char payload_buf[32];
+
+    if (pnode->block_chain.len > 0) {
+        printf("Node: Resuming from %u journaled blocks\n", pnode->block_chain.len);
+        uint32_t diverged = check_snapshot(&pnode->block_chain, psnapshot);
+        if (diverged != 0) {
+            fprintf(stderr, "Node: journal and snapshot %s disagree at height %u\n",
+                    pnode->snapshot_path, diverged - 1);
+            return -1;
+        }
+        //snapshots may include blocks the journal had not yet made durable
+        if (pnode->block_chain.len < psnapshot->height) {
+            printf("Node: journal ends %u blocks before snapshot %s\n",
+                    psnapshot->height - pnode->block_chain.len, pnode->snapshot_path);
+        }
+    } else if (archive_path == NULL && sync_peers == NULL && psnapshot->height > 0) {
+        if (restore_snapshot(&pnode->block_chain, psnapshot) != 0) {
+            return -1;
+        }
+        printf("Node: Restored %u headers from snapshot %s\n", psnapshot->height, pnode->snapshot_path);
+    } else if (sync_peers != NULL) {
+        char * peers[MAX_SYNC_PEERS];
+        unsigned n_peers = 0;
+        struct SyncStats stats;
+        for (char * peer = strtok(sync_peers, ","); peer != NULL && n_peers < MAX_SYNC_PEERS;
+                peer = strtok(NULL, ",")) {
+            peers[n_peers++] = peer;
+        }
+        if (sync_chain(&pnode->block_chain, peers, n_peers, SYNC_CONNS_PER_PEER, &stats) != 0) {
+            return -1;
+        }
+        printf("Node: Synced %u blocks from %u peers\n", stats.blocks, n_peers);
+    } else if (archive_path == NULL && pnode->follow_peer != NULL) {
+        printf("Node: Starting empty as a read replica of %s\n", pnode->follow_peer);
+    } else if (archive_path == NULL) {
+        if (add_block(&pnode->block_chain, "Genesis block choo choo all aboard the cherub chrain") != 0) {
+            return -1;
+        }
+        for (int i = 0; i < 5; i++) {
+            sprintf(payload_buf, "Block %d", i);
+            if (add_block(&pnode->block_chain, payload_buf) != 0) {
+                return -1;
+            }
+        }
+    } else {
+        struct ArchiveStats stats;
+        if (load_archive(&pnode->block_chain, archive_path, 0, &stats) != 0) {
+            return -1;
+        }
+        printf("Node: Bootstrapped %u blocks from %s\n", stats.blocks, archive_path);
+    }
+
+    if (pnode->ctx.pdedup != NULL) {
+        for (const struct Link * link = pnode->block_chain.head; link != NULL; link = link->next) {
+            if (link->block.payload != NULL) {
+                dedup_insert(pnode->ctx.pdedup,
+                        hash_payload64(link->block.payload, link->block.payload_len));
+            }
+        }
+    }
+    if (pnode->ctx.psearch != NULL && search_index_update(pnode->ctx.psearch, &pnode->block_chain) != 0) {
+        return -1;
+    }
+    if (range_tree_update(pnode->ctx.ptree, &pnode->block_chain) != 0 ||
+            time_index_update(pnode->ctx.ptime, &pnode->block_chain) != 0) {
+        return -1;
+    }
     return 0;
 }
 
+/**
+ * Record a freshly bootstrapped chain in a new journal so later runs recover it without
+ * bootstrapping again. A chain recovered from the journal is already in it
+ * @param pnode node whose chain to record. ctx.pjournal must be set
+ * @return 0 on success, -1 on failure
+ */
+static int journal_chain(struct NodeData * pnode) {
+    struct Journal * pjournal = pnode->ctx.pjournal;
+
+    if (pjournal->appended > 0) {
+        return 0;
+    }
+    for (const struct Link * link = pnode->block_chain.head; link != NULL; link = link->next) {
+        if (journal_append(pjournal, &pnode->block_chain, &link->block) != 0) {
+            return -1;
+        }
+    }
+    return journal_sync(pjournal);
+}
@@ -0,0 +1,232 @@
+/**
+ * Incrementally maintained binary hash tree over block height ranges. Appending a block
+ * recomputes only the nodes on the path from its leaf to the root, so keeping the tree
+ * current costs O(log n) per block. Lets two nodes compare their chains by exchanging
+ * a handful of subtree hashes rather than whole chains.
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "range_tree.h"
+
+#define LEVEL_INITIAL_CAP 64 //initial number of nodes allocated per level
+#define MIX_K1 0xff51afd7ed558ccdULL
+#define MIX_K2 0xc4ceb9fe1a85ec53ULL
+#define LEAF_SEED 0x9e3779b97f4a7c15ULL
+
+//Internal functions
+static uint64_t mix64(uint64_t x);
+static uint64_t hash_leaf(const struct Block * pblock);
+static uint64_t hash_node(uint64_t left, uint64_t right);
+static int set_node(struct RangeTree * ptree, uint32_t level, uint32_t index, uint64_t hash);
+static int add_leaf(struct RangeTree * ptree, uint64_t leaf);
+static uint64_t prefix_node(const struct RangeTree * ptree, uint32_t level, uint32_t index, uint32_t len);
+
+/**
+ * Create empty tree. Levels are allocated as the chain grows
+ * @param ptree tree to initialise
+ * @return 0 on success, -1 on failure
+ */
+int initialise_range_tree(struct RangeTree * ptree) {
+    memset(ptree, 0, sizeof(*ptree));
+    return 0;
+}
+
+/**
+ * Free memory held by tree
+ * @param ptree tree to deinitialise
+ * @return void
+ */
+void deinitialise_range_tree(struct RangeTree * ptree) {
+    for (uint32_t i = 0; i < RANGE_TREE_MAX_LEVELS; i++) {
+        free(ptree->levels[i]);
+    }
+    memset(ptree, 0, sizeof(*ptree));
+}
+
+/**
+ * Add every block appended to the chain since the last update. Cheap to call after
+ * each append as only the new leaves and their ancestors are visited
+ * @param ptree tree to update
+ * @param pblock_chain chain the tree is built over
+ * @return 0 on success, -1 on failure
+ */
+int range_tree_update(struct RangeTree * ptree, const struct BlockChain * pblock_chain) {
+    while (ptree->len < pblock_chain->len) {
+        if (add_leaf(ptree, hash_leaf(&get_link(pblock_chain, ptree->len)->block)) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Number of nodes in a level of the tree as it stood after its first len blocks
+ * @param ptree tree to query
+ * @param len number of blocks from genesis. Clamped to the blocks added
+ * @param level level of tree. 0 is the leaf level
+ * @return number of nodes, 0 if the level is above the root
+ */
+uint32_t range_tree_level_len(const struct RangeTree * ptree, uint32_t len, uint32_t level) {
+    if (len > ptree->len) {
+        len = ptree->len;
+    }
+    //the root is the first level holding a single node
+    if (len == 0 || level >= RANGE_TREE_MAX_LEVELS ||
+            (level > 0 && ((uint64_t)len - 1) >> (level - 1) == 0)) {
+        return 0;
+    }
+    return (uint32_t)(((uint64_t)len - 1) >> level) + 1;
+}
+
+/**
+ * Copy out a run of node hashes from one level of the tree as it stood after its first len
+ * blocks, so blocks added since are left out of every hash. Nodes ending at or before len
+ * are copied, the one len ends inside is rebuilt along its path to the leaves
+ * @param ptree tree to read
+ * @param len number of blocks from genesis. Clamped to the blocks added
+ * @param level level of nodes. 0 is the leaf level
+ * @param start index of first node within its level
+ * @param count max number of nodes to copy
+ * @param hashes array of at least count entries to fill
+ * @return number of nodes copied, which is less than count where the level ends
+ */
+uint32_t range_tree_nodes(const struct RangeTree * ptree, uint32_t len, uint32_t level, uint32_t start,
+        uint32_t count, uint64_t * hashes) {
+    uint32_t level_len = range_tree_level_len(ptree, len, level);
+
+    if (len > ptree->len) {
+        len = ptree->len;
+    }
+    if (start >= level_len) {
+        return 0;
+    }
+    if (count > level_len - start) {
+        count = level_len - start;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t index = start + i;
+        hashes[i] = ((uint64_t)index + 1) << level <= len ? ptree->levels[level][index] :
+            prefix_node(ptree, level, index, len);
+    }
+    return count;
+}
+
+/**
+ * Hash a node would have had if the chain ended after len blocks
+ * @param ptree tree to read
+ * @param level level of node
+ * @param index index of node within its level. Must start before len
+ * @param len number of blocks from genesis. At most the blocks added
+ * @return node hash
+ */
+static uint64_t prefix_node(const struct RangeTree * ptree, uint32_t level, uint32_t index, uint32_t len) {
+    if (level == 0 || ((uint64_t)index + 1) << level <= len) {
+        return ptree->levels[level][index];
+    }
+    //copy of the left child when the prefix ends before the right one starts
+    uint64_t right_start = (2 * (uint64_t)index + 1) << (level - 1);
+    if (right_start >= len) {
+        return prefix_node(ptree, level - 1, 2 * index, len);
+    }
+    return hash_node(ptree->levels[level - 1][2 * index], prefix_node(ptree, level - 1, 2 * index + 1, len));
+}
+
+/**
+ * Append a leaf and recompute each of its ancestors
+ * @param ptree tree to append to
+ * @param leaf hash of new block
+ * @return 0 on success, -1 on failure
+ */
+static int add_leaf(struct RangeTree * ptree, uint64_t leaf) {
+    uint32_t height = ptree->len;
+
+    if (set_node(ptree, 0, height, leaf) != 0) {
+        return -1;
+    }
+    ptree->len++;
+
+    //walk up until the level below holds a single node, which is the root
+    uint32_t level = 0;
+    uint32_t level_len = height + 1;
+    while (level_len > 1) {
+        uint32_t parent = (height >> level) >> 1;
+        uint64_t hash = ptree->levels[level][2 * parent];
+        if (2 * parent + 1 < level_len) {
+            hash = hash_node(hash, ptree->levels[level][2 * parent + 1]);
+        }
+        level++;
+        if (set_node(ptree, level, parent, hash) != 0) {
+            return -1;
+        }
+        level_len = (level_len + 1) / 2;
+    }
+    ptree->n_levels = level + 1;
+    return 0;
+}
+
+/**
+ * Store a node hash, growing its level if needed
+ * @param ptree tree to store into
+ * @param level level of node
+ * @param index index of node within its level
+ * @param hash hash of node
+ * @return 0 on success, -1 on failure
+ */
+static int set_node(struct RangeTree * ptree, uint32_t level, uint32_t index, uint64_t hash) {
+    if (index >= ptree->caps[level]) {
+        uint64_t cap = ptree->caps[level] > 0 ? ptree->caps[level] : LEVEL_INITIAL_CAP;
+        while (cap <= index) {
+            cap *= 2;
+        }
+        if (cap > UINT32_MAX) {
+            cap = UINT32_MAX;
+        }
+        uint64_t * nodes = realloc(ptree->levels[level], cap * sizeof(uint64_t));
+        if (nodes == NULL) {
+            fprintf(stderr, "RangeTree: failed to allocate memory for level %u\n", level);
+            return -1;
+        }
+        ptree->levels[level] = nodes;
+        ptree->caps[level] = (uint32_t)cap;
+    }
+    ptree->levels[level][index] = hash;
+    return 0;
+}
+
+/**
+ * Hash of a single block. Covers its linkage as well as its payload hash and length
+ * so headers of pruned blocks hash the same as the full block
+ * @param pblock block to hash
+ * @return leaf hash
+ */
+static uint64_t hash_leaf(const struct Block * pblock) {
+    uint64_t hashes = ((uint64_t)pblock->prev_hash << 32) | pblock->hash;
+    return mix64(hashes ^ mix64(pblock->payload_len + LEAF_SEED));
+}
+
+/**
+ * Hash of an interior node. Order of children matters
+ * @param left hash of left child
+ * @param right hash of right child
+ * @return node hash
+ */
+static uint64_t hash_node(uint64_t left, uint64_t right) {
+    return mix64(left * MIX_K1 + mix64(right ^ MIX_K2));
+}
+
+/**
+ * 64 bit finaliser. Every input bit affects every output bit
+ * @param x value to mix
+ * @return mixed value
+ */
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= MIX_K1;
+    x ^= x >> 33;
+    x *= MIX_K2;
+    x ^= x >> 33;
+    return x;
+}
@@ -6,10 +6,17 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include <endian.h>
 #include "requests.h"
+#include "admission.h"
+
+#define HEADERS_ALLOC_STEP 65536 //headers the receive buffer first holds and grows by at least
 
 //Internal functions
 static inline int send_endpoint_request(int sockfd, const enum endpoint_id);
+static int receive_blocks(int sockfd, uint32_t start, uint32_t n_blocks, const uint32_t * pprev_hash,
+        struct BlockChain * pblocks);
 
 /**
  * Request chain endpoint. Read the received data into a block chain struct
@@ -20,7 +27,7 @@ static inline int send_endpoint_request(int sockfd, const enum endpoint_id);
 int request_chain_endpoint(int sockfd, struct BlockChain * pblock_chain) {
     uint32_t network_len, host_len;
 
-    if (send_endpoint_request(sockfd, ENDPOINT_CHAIN) == 1) {
+    if (send_endpoint_request(sockfd, ENDPOINT_CHAIN) == -1) {
         return -1;
     }
 
@@ -33,6 +40,10 @@ int request_chain_endpoint(int sockfd, struct BlockChain * pblock_chain) {
     }
 
     host_len = ntohl(network_len);
+    if (host_len == ADMISSION_REJECTED) {
+        fprintf(stderr, "Requests: node is rate limiting this client, try again later\n");
+        return -1;
+    }
 
     //Receive all blocks
     for (int i = 0; i < host_len; i++) {
@@ -46,25 +57,28 @@ int request_chain_endpoint(int sockfd, struct BlockChain * pblock_chain) {
 
 
 /**
- * Request add block endpoint. Add block 
+ * Request add block endpoint. Add block and wait for the node to acknowledge it
  * @param sockfd socket to transmit on
- * @param null terminated string containing payload to transmit
- * @return 0 on success and -1 on failure
+ * @param payload payload to transmit. Sent straight from this buffer however large
+ * @param payload_len length of payload. At most MAX_PAYLOAD
+ * @param pheight set to height the block was appended at. May be NULL
+ * @param phash set to hash of the appended block. May be NULL
+ * @return 0 once the node has durably appended the block and -1 on failure
  */
-int request_add_block_endpoint(int sockfd, const char * payload) {
-    //request endpoint
-    if (send_endpoint_request(sockfd, ENDPOINT_ADD_BLOCK) == 1) {
-        return -1;
-    }
-    
-    size_t payload_len = strlen(payload);
+int request_add_block_endpoint(int sockfd, const char * payload, size_t payload_len,
+        uint32_t * pheight, uint32_t * phash) {
     if (payload_len > MAX_PAYLOAD) {
-        fprintf(stderr, "Requests: Specified payload size %lu larger than max allowed payload%d\n",
+        fprintf(stderr, "Requests: Specified payload size %lu larger than max allowed payload %d\n",
                 payload_len, MAX_PAYLOAD);
         return -1;
     }
+
+    //request endpoint
+    if (send_endpoint_request(sockfd, ENDPOINT_ADD_BLOCK) == -1) {
+        return -1;
+    }
     
-    uint16_t network_payload_len = htons((uint16_t)payload_len);
+    uint32_t network_payload_len = htonl((uint32_t)payload_len);
 
     if (send_buf(sockfd, &network_payload_len, sizeof(network_payload_len)) == -1) {
         return -1;
@@ -74,6 +88,557 @@ int request_add_block_endpoint(int sockfd, const char * payload) {
         return -1;
     }
 
+    //Height and hash of the new block, or a marker in place of the height
+    uint32_t network_ack[2];
+    if (receive_buf(sockfd, network_ack, sizeof(network_ack)) <= 0) {
+        return -1;
+    }
+    uint32_t height = ntohl(network_ack[0]);
+    if (height == ADMISSION_REJECTED) {
+        fprintf(stderr, "Requests: node is rate limiting this client, try again later\n");
+        return -1;
+    }
+    if (height == ADD_BLOCK_DUPLICATE) {
+        fprintf(stderr, "Requests: node rejected payload as a duplicate\n");
+        return -1;
+    }
+    if (height == ADD_BLOCK_FAILED) {
+        fprintf(stderr, "Requests: node failed to commit block\n");
+        return -1;
+    }
+    if (height == ADD_BLOCK_UNVERIFIED) {
+        fprintf(stderr, "Requests: node refused transaction signature\n");
+        return -1;
+    }
+    if (height == ADD_BLOCK_READ_ONLY) {
+        fprintf(stderr, "Requests: node is a read replica and refuses writes\n");
+        return -1;
+    }
+    if (pheight != NULL) {
+        *pheight = height;
+    }
+    if (phash != NULL) {
+        *phash = ntohl(network_ack[1]);
+    }
+    return 0;
+}
+
+/**
+ * Request search endpoint. Matching blocks are appended to a chain in ascending height order
+ * @param sockfd socket to request the endpoint on
+ * @param mode type of match to search for
+ * @param query null terminated string to search for
+ * @param presults Initialised chain to append matching blocks to
+ * @param heights array of at least SEARCH_MAX_RESULTS entries filled with height of each match
+ * @param ptruncated set if more blocks matched than the node returned
+ * @return number of matches on success and -1 on failure
+ */
+int request_search_endpoint(int sockfd, enum search_mode mode, const char * query,
+        struct BlockChain * presults, uint32_t * heights, int * ptruncated) {
+    uint32_t network_u32;
+
+    size_t query_len = strlen(query);
+    if (query_len > SEARCH_MAX_QUERY) {
+        fprintf(stderr, "Requests: Specified query size %lu larger than max allowed query %d\n",
+                query_len, SEARCH_MAX_QUERY);
+        return -1;
+    }
+
+    if (send_endpoint_request(sockfd, ENDPOINT_SEARCH) == -1) {
+        return -1;
+    }
+
+    uint8_t network_mode = (uint8_t)mode;
+    uint16_t network_query_len = htons((uint16_t)query_len);
+    if (send_buf(sockfd, &network_mode, sizeof(network_mode)) == -1 ||
+            send_buf(sockfd, &network_query_len, sizeof(network_query_len)) == -1 ||
+            send_buf(sockfd, query, query_len) == -1) {
+        return -1;
+    }
+
+    //Read number of matches
+    if (receive_buf(sockfd, &network_u32, sizeof(network_u32)) <= 0) {
+        return -1;
+    }
+    uint32_t n_results = ntohl(network_u32);
+    if (n_results == ADMISSION_REJECTED) {
+        fprintf(stderr, "Requests: node is rate limiting this client, try again later\n");
+        return -1;
+    }
+    *ptruncated = (n_results & SEARCH_TRUNCATED_FLAG) != 0;
+    n_results &= ~SEARCH_TRUNCATED_FLAG;
+    if (n_results > SEARCH_MAX_RESULTS) {
+        fprintf(stderr, "Requests: node returned too many search results: %u\n", n_results);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < n_results; i++) {
+        if (receive_buf(sockfd, &network_u32, sizeof(network_u32)) <= 0) {
+            return -1;
+        }
+        heights[i] = ntohl(network_u32);
+        if (unpack_block(sockfd, presults) == -1) {
+            return -1;
+        }
+    }
+    return n_results;
+}
+
+/**
+ * Request headers endpoint. Receives the compact header of every block of the node's chain
+ * @param sockfd socket to request the endpoint on
+ * @param pheaders set to malloc'd array of headers in height order. Caller frees
+ * @param plen set to number of headers received
+ * @return 0 on success and -1 on failure
+ */
+int request_headers_endpoint(int sockfd, struct BlockHeader ** pheaders, uint32_t * plen) {
+    uint8_t header[3 * sizeof(uint32_t) + sizeof(uint64_t)];
+    uint32_t network_u32;
+    uint64_t network_u64;
+
+    if (send_endpoint_request(sockfd, ENDPOINT_HEADERS) == -1) {
+        return -1;
+    }
+    if (receive_buf(sockfd, &network_u32, sizeof(network_u32)) <= 0) {
+        return -1;
+    }
+    uint32_t len = ntohl(network_u32);
+    if (len == ADMISSION_REJECTED) {
+        fprintf(stderr, "Requests: node is rate limiting this client, try again later\n");
+        return -1;
+    }
+    if (len > MAX_CHAIN) {
+        fprintf(stderr, "Requests: node sent %u headers, more than any chain holds\n", len);
+        return -1;
+    }
+
+    //count is the node's word alone so memory grows with the headers that actually arrive
+    struct BlockHeader * headers = NULL;
+    uint32_t cap = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        if (i == cap) {
+            uint64_t next = 2 * (uint64_t)cap + HEADERS_ALLOC_STEP;
+            cap = next < len ? (uint32_t)next : len;
+            struct BlockHeader * grown = realloc(headers, (size_t)cap * sizeof(struct BlockHeader));
+            if (grown == NULL) {
+                fprintf(stderr, "Requests: failed to allocate memory for %u headers\n", cap);
+                free(headers);
+                return -1;
+            }
+            headers = grown;
+        }
+        if (receive_buf(sockfd, header, sizeof(header)) <= 0) {
+            free(headers);
+            return -1;
+        }
+        memcpy(&network_u32, header, sizeof(uint32_t));
+        headers[i].prev_hash = ntohl(network_u32);
+        memcpy(&network_u32, header + sizeof(uint32_t), sizeof(uint32_t));
+        headers[i].hash = ntohl(network_u32);
+        memcpy(&network_u32, header + 2 * sizeof(uint32_t), sizeof(uint32_t));
+        headers[i].payload_len = ntohl(network_u32);
+        memcpy(&network_u64, header + 3 * sizeof(uint32_t), sizeof(uint64_t));
+        headers[i].timestamp = be64toh(network_u64);
+    }
+    //callers free the array even for an empty chain
+    if (headers == NULL && (headers = malloc(sizeof(struct BlockHeader))) == NULL) {
+        fprintf(stderr, "Requests: failed to allocate memory for headers\n");
+        return -1;
+    }
+    *pheaders = headers;
+    *plen = len;
+    return 0;
+}
+
+/**
+ * Request payloads endpoint. Each payload is received straight into its destination buffer.
+ * Payloads must match the length in their header but their hash is left to the caller to check
+ * @param sockfd socket to request the endpoint on
+ * @param start height of first payload
+ * @param count number of payloads. At most MAX_PAYLOAD_RANGE
+ * @param headers headers of the count blocks being fetched
+ * @param payloads count buffers of at least payload_len + 1 bytes. Filled with null terminated
+ * payloads. Entries are set to NULL for payloads the node has pruned
+ * @return 0 on success and -1 on failure
+ */
+int request_payloads_endpoint(int sockfd, uint32_t start, uint32_t count,
+        const struct BlockHeader * headers, char ** payloads) {
+    uint32_t network_u32;
+
+    //Request goes out in a single send so pipelined range requests are not held back by Nagle
+    uint8_t request[sizeof(uint8_t) + 2 * sizeof(uint32_t)];
+    uint32_t network_start = htonl(start), network_count = htonl(count);
+    request[0] = ENDPOINT_PAYLOADS;
+    memcpy(request + 1, &network_start, sizeof(uint32_t));
+    memcpy(request + 1 + sizeof(uint32_t), &network_count, sizeof(uint32_t));
+    if (send_buf(sockfd, request, sizeof(request)) == -1) {
+        return -1;
+    }
+
+    if (receive_buf(sockfd, &network_u32, sizeof(network_u32)) <= 0) {
+        return -1;
+    }
+    uint32_t n_payloads = ntohl(network_u32);
+    if (n_payloads == ADMISSION_REJECTED) {
+        fprintf(stderr, "Requests: node is rate limiting this client, try again later\n");
+        return -1;
+    }
+    //node's chain is shorter than the range requested
+    if (n_payloads != count) {
+        fprintf(stderr, "Requests: node returned %u of %u payloads\n", n_payloads, count);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (receive_buf(sockfd, &network_u32, sizeof(network_u32)) <= 0) {
+            return -1;
+        }
+        uint32_t payload_len = ntohl(network_u32);
+        if (payload_len & PAYLOAD_PRUNED_FLAG) {
+            payloads[i] = NULL;
+            continue;
+        }
+        if (payload_len != headers[i].payload_len) {
+            fprintf(stderr, "Requests: payload at height %u does not match its header\n", start + i);
+            return -1;
+        }
+        if (receive_buf(sockfd, payloads[i], payload_len) <= 0 && payload_len > 0) {
+            return -1;
+        }
+        payloads[i][payload_len] = '\0';
+    }
+    return 0;
+}
+
+/**
+ * Request blocks endpoint. Receives every block from a height onwards, verifying each links to
+ * the one before it and that its payload matches its hash. Payloads are received straight into
+ * the blocks appended to pblocks
+ * @param sockfd socket to request the endpoint on
+ * @param start height of first block
+ * @param count max number of blocks. At most MAX_PAYLOAD_RANGE
+ * @param pprev_hash hash the first block must link to, which is that of block start - 1 or 0 if
+ * start is 0. NULL if unknown, in which case the first block's linkage is taken as is
+ * @param pblocks initialised chain received blocks are appended to
+ * @return number of blocks received, which is less than count once the node's tip is reached,
+ * or -1 on failure
+ */
+int request_blocks_endpoint(int sockfd, uint32_t start, uint32_t count, const uint32_t * pprev_hash,
+        struct BlockChain * pblocks) {
+    uint32_t network_u32;
+
+    //Request goes out in a single send so it is not held back by Nagle
+    uint8_t request[sizeof(uint8_t) + 2 * sizeof(uint32_t)];
+    uint32_t network_start = htonl(start), network_count = htonl(count);
+    request[0] = ENDPOINT_BLOCKS;
+    memcpy(request + 1, &network_start, sizeof(uint32_t));
+    memcpy(request + 1 + sizeof(uint32_t), &network_count, sizeof(uint32_t));
+    if (send_buf(sockfd, request, sizeof(request)) == -1) {
+        return -1;
+    }
+
+    if (receive_buf(sockfd, &network_u32, sizeof(network_u32)) <= 0) {
+        return -1;
+    }
+    uint32_t n_blocks = ntohl(network_u32);
+    if (n_blocks == ADMISSION_REJECTED) {
+        fprintf(stderr, "Requests: node is rate limiting this client, try again later\n");
+        return -1;
+    }
+    if (n_blocks > count) {
+        fprintf(stderr, "Requests: node returned %u blocks when %u were requested\n", n_blocks, count);
+        return -1;
+    }
+
+    if (receive_blocks(sockfd, start, n_blocks, pprev_hash, pblocks) != 0) {
+        return -1;
+    }
+    return n_blocks;
+}
+
+/**
+ * Request tree endpoint. Receives a run of subtree hashes from one level of the node's
+ * range hash tree. Node i of level k covers heights [i << k, (i + 1) << k)
+ * @param sockfd socket to request the endpoint on
+ * @param level level of tree. 0 is the leaf level
+ * @param start index of first node within its level
+ * @param count max number of nodes. At most RANGE_TREE_MAX_NODES
+ * @param hashes array of at least count entries filled with node hashes
+ * @param pchain_len set to length of the node's chain the hashes were taken from
+ * @return number of hashes received, which is less than count where the level ends,
+ * or -1 on failure
+ */
+int request_tree_endpoint(int sockfd, uint32_t level, uint32_t start, uint32_t count,
+        uint64_t * hashes, uint32_t * pchain_len) {
+    uint8_t request[2 * sizeof(uint8_t) + 2 * sizeof(uint32_t)];
+    uint32_t network_u32;
+
+    if (level >= RANGE_TREE_MAX_LEVELS || count > RANGE_TREE_MAX_NODES) {
+        fprintf(stderr, "Requests: invalid tree request for %u nodes of level %u\n", count, level);
+        return -1;
+    }
+
+    //Request goes out in a single send so it is not held back by Nagle
+    uint32_t network_start = htonl(start), network_count = htonl(count);
+    request[0] = ENDPOINT_TREE;
+    request[1] = (uint8_t)level;
+    memcpy(request + 2, &network_start, sizeof(uint32_t));
+    memcpy(request + 2 + sizeof(uint32_t), &network_count, sizeof(uint32_t));
+    if (send_buf(sockfd, request, sizeof(request)) == -1) {
+        return -1;
+    }
+
+    if (receive_buf(sockfd, &network_u32, sizeof(network_u32)) <= 0) {
+        return -1;
+    }
+    uint32_t n_hashes = ntohl(network_u32);
+    if (n_hashes == ADMISSION_REJECTED) {
+        fprintf(stderr, "Requests: node is rate limiting this client, try again later\n");
+        return -1;
+    }
+    if (n_hashes > count) {
+        fprintf(stderr, "Requests: node returned %u hashes when %u were requested\n", n_hashes, count);
+        return -1;
+    }
+    if (receive_buf(sockfd, &network_u32, sizeof(network_u32)) <= 0) {
+        return -1;
+    }
+    *pchain_len = ntohl(network_u32);
+
+    //hashes are received in place then converted to host byte-order
+    if (n_hashes > 0 && receive_buf(sockfd, hashes, (size_t)n_hashes * sizeof(uint64_t)) <= 0) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < n_hashes; i++) {
+        hashes[i] = be64toh(hashes[i]);
+    }
+    return n_hashes;
+}
+
+/**
+ * Request window endpoint. Receives the blocks a node appended within a time window, verified
+ * as for request_blocks_endpoint. Windows holding more than count blocks are paged through by
+ * passing the height after the last block received as min_height
+ * @param sockfd socket to request the endpoint on
+ * @param since start of window in milliseconds since the Unix epoch, inclusive
+ * @param until end of window in milliseconds since the Unix epoch, exclusive
+ * @param min_height lowest height to return
+ * @param count max number of blocks. At most MAX_PAYLOAD_RANGE
+ * @param pblocks initialised chain received blocks are appended to. Either empty or holding
+ * the earlier pages of the same window, which the new blocks must link on to
+ * @param pstart set to height of first block received
+ * @return number of blocks received, which is less than count once the window is exhausted,
+ * or -1 on failure
+ */
+int request_window_endpoint(int sockfd, uint64_t since, uint64_t until, uint32_t min_height,
+        uint32_t count, struct BlockChain * pblocks, uint32_t * pstart) {
+    uint8_t request[sizeof(uint8_t) + 2 * sizeof(uint64_t) + 2 * sizeof(uint32_t)];
+    uint32_t network_u32;
+
+    //Request goes out in a single send so it is not held back by Nagle
+    uint64_t network_since = htobe64(since), network_until = htobe64(until);
+    uint32_t network_min_height = htonl(min_height), network_count = htonl(count);
+    request[0] = ENDPOINT_WINDOW;
+    memcpy(request + 1, &network_since, sizeof(uint64_t));
+    memcpy(request + 1 + sizeof(uint64_t), &network_until, sizeof(uint64_t));
+    memcpy(request + 1 + 2 * sizeof(uint64_t), &network_min_height, sizeof(uint32_t));
+    memcpy(request + 1 + 2 * sizeof(uint64_t) + sizeof(uint32_t), &network_count, sizeof(uint32_t));
+    if (send_buf(sockfd, request, sizeof(request)) == -1) {
+        return -1;
+    }
+
+    if (receive_buf(sockfd, &network_u32, sizeof(network_u32)) <= 0) {
+        return -1;
+    }
+    uint32_t n_blocks = ntohl(network_u32);
+    if (n_blocks == ADMISSION_REJECTED) {
+        fprintf(stderr, "Requests: node is rate limiting this client, try again later\n");
+        return -1;
+    }
+    if (n_blocks > count) {
+        fprintf(stderr, "Requests: node returned %u blocks when %u were requested\n", n_blocks, count);
+        return -1;
+    }
+    if (receive_buf(sockfd, &network_u32, sizeof(network_u32)) <= 0) {
+        return -1;
+    }
+    *pstart = ntohl(network_u32);
+
+    //a later page links on to the last block of the page before it
+    uint32_t tip_hash = pblocks->tail != NULL ? pblocks->tail->block.hash : 0;
+    uint32_t first = pblocks->len;
+    if (receive_blocks(sockfd, *pstart, n_blocks, pblocks->tail != NULL ? &tip_hash : NULL,
+                pblocks) != 0) {
+        return -1;
+    }
+
+    for (uint32_t i = first; i < pblocks->len; i++) {
+        uint64_t timestamp = get_link(pblocks, i)->block.timestamp;
+        if (timestamp < since || timestamp >= until) {
+            fprintf(stderr, "Requests: node returned block outside of requested window\n");
+            return -1;
+        }
+    }
+    return n_blocks;
+}
+
+/**
+ * Request subscribe endpoint. On success the socket carries nothing but the subscribed blocks
+ * from then on, which are read with receive_subscribed_blocks
+ * @param sockfd socket to request the endpoint on
+ * @param start height of first block to be sent. May be past the node's tip
+ * @return 0 once subscribed, -1 on failure
+ */
+int request_subscribe_endpoint(int sockfd, uint32_t start) {
+    uint8_t request[sizeof(uint8_t) + sizeof(uint32_t)];
+    uint32_t network_u32 = htonl(start);
+
+    //Request goes out in a single send so it is not held back by Nagle
+    request[0] = ENDPOINT_SUBSCRIBE;
+    memcpy(request + 1, &network_u32, sizeof(uint32_t));
+    if (send_buf(sockfd, request, sizeof(request)) == -1) {
+        return -1;
+    }
+
+    //node echoes the start height to confirm
+    if (receive_buf(sockfd, &network_u32, sizeof(network_u32)) <= 0) {
+        return -1;
+    }
+    uint32_t confirmed = ntohl(network_u32);
+    if (confirmed == ADMISSION_REJECTED) {
+        fprintf(stderr, "Requests: node refused subscription, try again later\n");
+        return -1;
+    }
+    if (confirmed != start) {
+        fprintf(stderr, "Requests: node subscribed from height %u when %u was requested\n",
+                confirmed, start);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Wait for the next blocks pushed on a subscribed socket, verified as for
+ * request_blocks_endpoint
+ * @param sockfd subscribed socket
+ * @param height height of first block. Only used in error messages
+ * @param count number of blocks to wait for
+ * @param pprev_hash hash the first block must link to. NULL to take its linkage as is
+ * @param pblocks initialised chain received blocks are appended to
+ * @return 0 on success, -1 on failure or once the node closes the subscription
+ */
+int receive_subscribed_blocks(int sockfd, uint32_t height, uint32_t count, const uint32_t * pprev_hash,
+        struct BlockChain * pblocks) {
+    return receive_blocks(sockfd, height, count, pprev_hash, pblocks);
+}
+
+/**
+ * Request trace endpoint. Receives the request spans the node has recorded
+ * @param sockfd socket to request the endpoint on
+ * @param pspans set to malloc'd array of spans, oldest first. Caller frees
+ * @param plen set to number of spans received. 0 if the node is not recording
+ * @return 0 on success and -1 on failure
+ */
+int request_trace_endpoint(int sockfd, struct TraceSpan ** pspans, uint32_t * plen) {
+    uint8_t packed[TRACE_SPAN_WIRE_SZ];
+    uint32_t network_u32;
+
+    if (send_endpoint_request(sockfd, ENDPOINT_TRACE) == -1) {
+        return -1;
+    }
+    if (receive_buf(sockfd, &network_u32, sizeof(network_u32)) <= 0) {
+        return -1;
+    }
+    uint32_t len = ntohl(network_u32);
+    if (len == ADMISSION_REJECTED) {
+        fprintf(stderr, "Requests: node is rate limiting this client, try again later\n");
+        return -1;
+    }
+    if (len > TRACE_MAX_SPANS) {
+        fprintf(stderr, "Requests: node sent %u spans, more than any node keeps\n", len);
+        return -1;
+    }
+
+    struct TraceSpan * spans = malloc((size_t)len * sizeof(struct TraceSpan) + 1);
+    if (spans == NULL) {
+        fprintf(stderr, "Requests: failed to allocate memory for %u spans\n", len);
+        return -1;
+    }
+    for (uint32_t i = 0; i < len; i++) {
+        if (receive_buf(sockfd, packed, sizeof(packed)) <= 0) {
+            free(spans);
+            return -1;
+        }
+        unpack_trace_span(packed, &spans[i]);
+    }
+    *pspans = spans;
+    *plen = len;
+    return 0;
+}
+
+/**
+ * Receive a run of consecutive blocks, verifying each links to the one before it, follows it
+ * in time and that its payload and timestamp match its hash. Payloads are received straight
+ * into the blocks appended to pblocks
+ * @param sockfd socket blocks arrive on
+ * @param start height of first block. Only used in error messages
+ * @param n_blocks number of blocks to receive
+ * @param pprev_hash hash the first block must link to. NULL to take its linkage as is
+ * @param pblocks initialised chain received blocks are appended to
+ * @return 0 on success and -1 on failure
+ */
+static int receive_blocks(int sockfd, uint32_t start, uint32_t n_blocks, const uint32_t * pprev_hash,
+        struct BlockChain * pblocks) {
+    uint8_t header[BLOCK_WIRE_HEADER_SZ];
+    uint32_t prev_hash = pprev_hash != NULL ? *pprev_hash : 0;
+    uint32_t first_prev_hash = 0;
+
+    for (uint32_t i = 0; i < n_blocks; i++) {
+        struct Block block;
+        if (receive_buf(sockfd, header, sizeof(header)) <= 0) {
+            return -1;
+        }
+        int pruned = unpack_block_header(header, &block);
+        if (i == 0 && pprev_hash == NULL) {
+            prev_hash = first_prev_hash = block.prev_hash;
+        }
+        if (block.prev_hash != prev_hash) {
+            fprintf(stderr, "Requests: block at height %u does not link to its predecessor\n", start + i);
+            return -1;
+        }
+        prev_hash = block.hash;
+
+        //node no longer holds the payload. Keep the header so the chain stays linked
+        if (pruned) {
+            if (append_header(pblocks, &block) != 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        if (block.payload_len > MAX_PAYLOAD) {
+            fprintf(stderr, "Requests: block at height %u has oversized payload\n", start + i);
+            return -1;
+        }
+        uint32_t hash;
+        char * payload = receive_payload(sockfd, block.payload_len, &hash);
+        if (payload == NULL) {
+            return -1;
+        }
+        if (seal_hash(hash, block.timestamp) != block.hash) {
+            fprintf(stderr, "Requests: payload at height %u does not match its hash\n", start + i);
+            free(payload);
+            return -1;
+        }
+        if (append_block(pblocks, payload, block.payload_len, block.hash, block.timestamp) != 0) {
+            free(payload);
+            return -1;
+        }
+    }
+    //a run starting part way up the chain keeps its real linkage rather than looking like genesis
+    if (n_blocks > 0 && pprev_hash == NULL) {
+        get_link(pblocks, pblocks->len - n_blocks)->block.prev_hash = first_prev_hash;
+    }
     return 0;
 }
 
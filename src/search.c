@@ -0,0 +1,61 @@
+/**
+ * Simple program to search the payloads of a running node's chain
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "block.h"
+#include "server.h"
+#include "requests.h"
+
+//Request search endpoint on node at specified IP
+int main(int argc, char * argv[]) {
+    enum search_mode mode;
+
+    if (argc != 5) {
+        fprintf(stderr, "usage: search hostname servname exact|prefix|substring query\n");
+        return 1;
+    }
+
+    if (strcmp(argv[3], "exact") == 0) {
+        mode = SEARCH_EXACT;
+    } else if (strcmp(argv[3], "prefix") == 0) {
+        mode = SEARCH_PREFIX;
+    } else if (strcmp(argv[3], "substring") == 0) {
+        mode = SEARCH_SUBSTRING;
+    } else {
+        fprintf(stderr, "usage: search hostname servname exact|prefix|substring query\n");
+        return 1;
+    }
+
+    //connect to node with given hostname
+    int node_fd = connect_to_node(argv[1], argv[2]);
+
+    if (node_fd == -1) {
+        return 2;
+    }
+
+    struct BlockChain results = initialise_chain();
+    uint32_t heights[SEARCH_MAX_RESULTS];
+    int truncated;
+
+    int n_results = request_search_endpoint(node_fd, mode, argv[4], &results, heights, &truncated);
+    close(node_fd);
+
+    //failed
+    if (n_results == -1) {
+        deinitialise_chain(&results);
+        return 3;
+    }
+
+    printf("Search: %d matches%s\n", n_results,
+            truncated ? ", more blocks matched than a search returns" : "");
+    for (int i = 0; i < n_results; i++) {
+        printf("------\nHeight: %u\n", heights[i]);
+        print_block(get_link(&results, i)->block);
+    }
+
+    deinitialise_chain(&results);
+    return 0;
+}
@@ -0,0 +1,333 @@
+/**
+ * Incrementally maintained trigram index over block payloads. Each payload is
+ * indexed as <START>payload<END> so exact and prefix queries become anchored
+ * substring queries. Candidates are found by intersecting posting lists and
+ * then verified against the payload itself.
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#define _GNU_SOURCE //memmem
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "search_index.h"
+
+#define GRAM_LEN 3
+#define ANCHOR_START 0x02 //byte placed before every payload
+#define ANCHOR_END 0x03 //byte placed after every payload
+#define INDEX_INITIAL_CAP 4096 //initial number of slots in trigram table
+#define POSTING_INITIAL_CAP 4 //initial number of heights per posting list
+
+//Internal functions
+static uint8_t anchored_byte(const char * payload, size_t len, size_t i);
+static uint32_t gram_slot(const struct SearchIndex * pindex, uint32_t gram);
+static struct PostingList * find_posting(const struct SearchIndex * pindex, uint32_t gram);
+static int add_posting(struct SearchIndex * pindex, uint32_t gram, uint32_t height);
+static int grow_table(struct SearchIndex * pindex);
+static int index_block(struct SearchIndex * pindex, uint32_t height, const char * payload, size_t len);
+static int contains_height(const struct PostingList * plist, uint32_t height);
+static int verify_match(const struct BlockChain * pblock_chain, uint32_t height,
+        enum search_mode mode, const char * query, size_t query_len);
+
+/**
+ * Create empty index
+ * @param pindex index to initialise
+ * @return 0 on success, -1 on failure
+ */
+int initialise_search_index(struct SearchIndex * pindex) {
+    pindex->table = calloc(INDEX_INITIAL_CAP, sizeof(struct PostingList));
+    if (pindex->table == NULL) {
+        fprintf(stderr, "Search: failed to allocate memory for index\n");
+        return -1;
+    }
+    pindex->table_cap = INDEX_INITIAL_CAP;
+    pindex->n_grams = 0;
+    pindex->indexed = 0;
+    return 0;
+}
+
+/**
+ * Free memory held by index
+ * @param pindex index to deinitialise
+ * @return void
+ */
+void deinitialise_search_index(struct SearchIndex * pindex) {
+    for (uint32_t i = 0; i < pindex->table_cap; i++) {
+        free(pindex->table[i].heights);
+    }
+    free(pindex->table);
+    pindex->table = NULL;
+    pindex->table_cap = pindex->n_grams = pindex->indexed = 0;
+}
+
+/**
+ * Index every block appended to the chain since the last update. Cheap to call after
+ * each append as only new blocks are visited
+ * @param pindex index to update
+ * @param pblock_chain chain being indexed
+ * @return 0 on success, -1 on failure
+ */
+int search_index_update(struct SearchIndex * pindex, const struct BlockChain * pblock_chain) {
+    struct PayloadBuf scratch = {NULL, 0};
+
+    while (pindex->indexed < pblock_chain->len) {
+        const struct Block * pblock = &get_link(pblock_chain, pindex->indexed)->block;
+        const char * payload = view_payload(pblock_chain, pblock, &scratch);
+
+        //payloads dropped by pruning can no longer be indexed
+        if (payload != NULL && index_block(pindex, pindex->indexed, payload, pblock->payload_len) != 0) {
+            free_payload_buf(&scratch);
+            return -1;
+        }
+        pindex->indexed++;
+    }
+    free_payload_buf(&scratch);
+    return 0;
+}
+
+/**
+ * Find heights of blocks matching a query.
+ * @param pindex up to date index of chain
+ * @param pblock_chain chain the index was built over. Used to verify candidates
+ * @param mode type of match
+ * @param query bytes to search for
+ * @param query_len length of query
+ * @param results array of at least max_results heights to fill in ascending order
+ * @param max_results maximum number of matches to return
+ * @return number of matches found
+ */
+int search_index_query(const struct SearchIndex * pindex, const struct BlockChain * pblock_chain,
+        enum search_mode mode, const char * query, size_t query_len,
+        uint32_t * results, uint32_t max_results) {
+    uint8_t anchored[SEARCH_MAX_QUERY + 2];
+    size_t anchored_len = 0;
+    uint32_t found = 0;
+
+    if (query_len > SEARCH_MAX_QUERY) {
+        return 0;
+    }
+
+    //Build the anchored form of the query so all modes become a substring search
+    if (mode != SEARCH_SUBSTRING) {
+        anchored[anchored_len++] = ANCHOR_START;
+    }
+    memcpy(anchored + anchored_len, query, query_len);
+    anchored_len += query_len;
+    if (mode == SEARCH_EXACT) {
+        anchored[anchored_len++] = ANCHOR_END;
+    }
+
+    //Too short to form a trigram. Verify every indexed block
+    if (anchored_len < GRAM_LEN) {
+        for (uint32_t height = 0; height < pindex->indexed && found < max_results; height++) {
+            if (verify_match(pblock_chain, height, mode, query, query_len)) {
+                results[found++] = height;
+            }
+        }
+        return found;
+    }
+
+    //Drive the intersection from the rarest trigram
+    const struct PostingList * lists[SEARCH_MAX_QUERY];
+    size_t n_lists = anchored_len - GRAM_LEN + 1;
+    const struct PostingList * rarest = NULL;
+
+    for (size_t i = 0; i < n_lists; i++) {
+        uint32_t gram = anchored[i] << 16 | anchored[i + 1] << 8 | anchored[i + 2];
+        lists[i] = find_posting(pindex, gram);
+        //any absent trigram means no block can match
+        if (lists[i] == NULL) {
+            return 0;
+        }
+        if (rarest == NULL || lists[i]->len < rarest->len) {
+            rarest = lists[i];
+        }
+    }
+
+    for (uint32_t i = 0; i < rarest->len && found < max_results; i++) {
+        uint32_t height = rarest->heights[i];
+        size_t j;
+        for (j = 0; j < n_lists; j++) {
+            if (lists[j] != rarest && !contains_height(lists[j], height)) {
+                break;
+            }
+        }
+        if (j == n_lists && verify_match(pblock_chain, height, mode, query, query_len)) {
+            results[found++] = height;
+        }
+    }
+    return found;
+}
+
+/**
+ * Byte i of <START>payload<END>
+ */
+static uint8_t anchored_byte(const char * payload, size_t len, size_t i) {
+    if (i == 0) {
+        return ANCHOR_START;
+    }
+    if (i == len + 1) {
+        return ANCHOR_END;
+    }
+    return (uint8_t)payload[i - 1];
+}
+
+/**
+ * Home slot of gram in table
+ */
+static uint32_t gram_slot(const struct SearchIndex * pindex, uint32_t gram) {
+    return (gram * 0x9e3779b1u) & (pindex->table_cap - 1);
+}
+
+/**
+ * Look up posting list of a trigram
+ * @return posting list or NULL if no block contains gram
+ */
+static struct PostingList * find_posting(const struct SearchIndex * pindex, uint32_t gram) {
+    for (uint32_t slot = gram_slot(pindex, gram); pindex->table[slot].heights != NULL;
+            slot = (slot + 1) & (pindex->table_cap - 1)) {
+        if (pindex->table[slot].gram == gram) {
+            return &pindex->table[slot];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Record that block at height contains gram. Heights must be added in ascending order
+ * @return 0 on success, -1 on failure
+ */
+static int add_posting(struct SearchIndex * pindex, uint32_t gram, uint32_t height) {
+    struct PostingList * plist = find_posting(pindex, gram);
+
+    if (plist == NULL) {
+        //keep load factor at or below 50%
+        if ((pindex->n_grams + 1) * 2 > pindex->table_cap && grow_table(pindex) != 0) {
+            return -1;
+        }
+        uint32_t slot = gram_slot(pindex, gram);
+        while (pindex->table[slot].heights != NULL) {
+            slot = (slot + 1) & (pindex->table_cap - 1);
+        }
+        plist = &pindex->table[slot];
+        plist->heights = malloc(POSTING_INITIAL_CAP * sizeof(uint32_t));
+        if (plist->heights == NULL) {
+            fprintf(stderr, "Search: failed to allocate memory for posting list\n");
+            return -1;
+        }
+        plist->gram = gram;
+        plist->len = 0;
+        plist->cap = POSTING_INITIAL_CAP;
+        pindex->n_grams++;
+    }
+
+    //gram repeated within the same payload
+    if (plist->len > 0 && plist->heights[plist->len - 1] == height) {
+        return 0;
+    }
+
+    if (plist->len == plist->cap) {
+        uint32_t * heights = realloc(plist->heights, plist->cap * 2 * sizeof(uint32_t));
+        if (heights == NULL) {
+            fprintf(stderr, "Search: failed to allocate memory for posting list\n");
+            return -1;
+        }
+        plist->heights = heights;
+        plist->cap *= 2;
+    }
+    plist->heights[plist->len++] = height;
+    return 0;
+}
+
+/**
+ * Double size of trigram table and rehash every posting list into it
+ * @return 0 on success, -1 on failure
+ */
+static int grow_table(struct SearchIndex * pindex) {
+    struct PostingList * old_table = pindex->table;
+    uint32_t old_cap = pindex->table_cap;
+
+    pindex->table = calloc(old_cap * 2, sizeof(struct PostingList));
+    if (pindex->table == NULL) {
+        fprintf(stderr, "Search: failed to allocate memory for index\n");
+        pindex->table = old_table;
+        return -1;
+    }
+    pindex->table_cap = old_cap * 2;
+
+    for (uint32_t i = 0; i < old_cap; i++) {
+        if (old_table[i].heights == NULL) {
+            continue;
+        }
+        uint32_t slot = gram_slot(pindex, old_table[i].gram);
+        while (pindex->table[slot].heights != NULL) {
+            slot = (slot + 1) & (pindex->table_cap - 1);
+        }
+        pindex->table[slot] = old_table[i];
+    }
+    free(old_table);
+    return 0;
+}
+
+/**
+ * Add every trigram of an anchored payload to the index
+ * @return 0 on success, -1 on failure
+ */
+static int index_block(struct SearchIndex * pindex, uint32_t height, const char * payload, size_t len) {
+    //anchored payload is len + 2 bytes long
+    for (size_t i = 0; i + GRAM_LEN <= len + 2; i++) {
+        uint32_t gram = anchored_byte(payload, len, i) << 16 |
+            anchored_byte(payload, len, i + 1) << 8 | anchored_byte(payload, len, i + 2);
+        if (add_posting(pindex, gram, height) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Binary search posting list for height
+ */
+static int contains_height(const struct PostingList * plist, uint32_t height) {
+    uint32_t lo = 0, hi = plist->len;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (plist->heights[mid] < height) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < plist->len && plist->heights[lo] == height;
+}
+
+/**
+ * Check candidate block's payload actually matches the query. Trigram intersection
+ * only proves every trigram occurs somewhere in the payload
+ * @return 1 on match, 0 otherwise
+ */
+static int verify_match(const struct BlockChain * pblock_chain, uint32_t height,
+        enum search_mode mode, const char * query, size_t query_len) {
+    struct PayloadBuf scratch = {NULL, 0};
+    const struct Block * pblock = &get_link(pblock_chain, height)->block;
+    const char * payload = view_payload(pblock_chain, pblock, &scratch);
+    int match = 0;
+
+    if (payload == NULL) {
+        return 0;
+    }
+
+    switch (mode) {
+        case SEARCH_EXACT:
+            match = pblock->payload_len == query_len && memcmp(payload, query, query_len) == 0;
+            break;
+        case SEARCH_PREFIX:
+            match = pblock->payload_len >= query_len && memcmp(payload, query, query_len) == 0;
+            break;
+        case SEARCH_SUBSTRING:
+            match = memmem(payload, pblock->payload_len, query, query_len) != NULL;
+            break;
+    }
+    free_payload_buf(&scratch);
+    return match;
+}
@@ -9,11 +9,14 @@
 #include <string.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <sys/time.h>
+#include <sys/un.h>
 #include "server.h"
+#include "trace.h"
 
 #define MAX_CONN_NUMBER 255 //number of sockfds connections we communicate with
 #define SEND_TIMEOUT_S 1 //number of seconds until timeout on sends
@@ -21,16 +24,60 @@
 
 #define TOTAL_CONNS MAX_CONN_NUMBER + 1 //number of sockfds in polling data (+1 for listener fd)
 
+#define UNIX_PREFIX "unix:" //node address prefix selecting an AF_UNIX socket path
+
+//Transport installed in place of sockets. NULL to use sockets
+static const struct Transport * transport = NULL;
+
+//Bytes of the request being served that the thread's event loop already received from
+//prefix_fd. receive_buf takes them before reading the socket
+static __thread const uint8_t * prefix_data = NULL;
+static __thread size_t prefix_len = 0;
+static __thread int prefix_fd = -1;
+
 //Internal functions
-static int get_listener(const char * servname);
+static struct ServerData create_server(const char * servname, int reuseport);
+static int get_listener(const char * servname, int reuseport);
+static int get_unix_listener(const char * path);
+static int connect_to_unix_node(const char * path);
 static void *get_in_addr(struct sockaddr *sa);
 
+/**
+ * Carry every later connect_to_node and get_client over a transport instead of sockets.
+ * Set before any connection is made as it is not synchronised
+ * @param ptransport transport to use, which must outlive its use. NULL to go back to sockets
+ * @return void
+ */
+void set_transport(const struct Transport * ptransport) {
+    transport = ptransport;
+}
+
 /**
  * Create server data struct. Populate fields as required to begin communicating
  * @param servname port number or service name 
  * @return populated server data struct. pollfds field will be NULL on failure
  */
 struct ServerData initialise_server(const char * servname) {
+    return create_server(servname, 0);
+}
+
+/**
+ * Create server data struct whose listener shares its port with other listeners in the
+ * process via SO_REUSEPORT. The kernel balances incoming connections across them
+ * @param servname port number or service name
+ * @return populated server data struct. pollfds field will be NULL on failure
+ */
+struct ServerData initialise_reuseport_server(const char * servname) {
+    return create_server(servname, 1);
+}
+
+/**
+ * Create server data struct with a single listener
+ * @param servname port number or service name
+ * @param reuseport set SO_REUSEPORT on the listener
+ * @return populated server data struct. pollfds field will be NULL on failure
+ */
+static struct ServerData create_server(const char * servname, int reuseport) {
     struct ServerData server_data;
 
     server_data.pollfds = malloc(sizeof(struct pollfd));
@@ -41,9 +88,11 @@ struct ServerData initialise_server(const char * servname) {
     }
 
     server_data.fd_size = 1;
+    server_data.unix_listenerfd = -1;
+    server_data.unix_path[0] = '\0';
     
     // Set up and get a listening socket
-    server_data.listenerfd = get_listener(servname);
+    server_data.listenerfd = get_listener(servname, reuseport);
 
     if (server_data.listenerfd == -1) {
         fprintf(stderr, "Server: error getting listening socket\n");
@@ -74,9 +123,52 @@ void deinitialise_server(struct ServerData * pserver_data) {
 
     free(pserver_data->pollfds);
 
+    //remove socket file so the path can be re-bound on next start
+    if (pserver_data->unix_listenerfd != -1) {
+        unlink(pserver_data->unix_path);
+    }
+
     pserver_data->pollfds = NULL;
     pserver_data->fd_count = 0;
     pserver_data->listenerfd = -1;
+    pserver_data->unix_listenerfd = -1;
+}
+
+/**
+ * Additionally listen on an AF_UNIX socket so same-host clients can skip the TCP stack.
+ * @param pserver_data initialised server data struct to add listener to
+ * @param path filesystem path to bind the socket to. Any stale socket file is replaced
+ * @return 0 on success or -1 on failure
+ */
+int add_unix_listener_to_server(struct ServerData* pserver_data, const char * path) {
+    if (strlen(path) >= sizeof(pserver_data->unix_path)) {
+        fprintf(stderr, "Server: unix socket path too long: %s\n", path);
+        return -1;
+    }
+
+    int listenfd = get_unix_listener(path);
+    if (listenfd == -1) {
+        return -1;
+    }
+
+    if (add_fd_to_server(pserver_data, listenfd) != 0) {
+        close(listenfd);
+        unlink(path);
+        return -1;
+    }
+    pserver_data->unix_listenerfd = listenfd;
+    strcpy(pserver_data->unix_path, path);
+    return 0;
+}
+
+/**
+ * Check if given fd is one of the server's listening sockets
+ * @param pserver_data server data struct
+ * @param fd fd to check
+ * @return 1 if fd is a listener, 0 otherwise
+ */
+int is_listener(const struct ServerData* pserver_data, int fd) {
+    return fd == pserver_data->listenerfd || fd == pserver_data->unix_listenerfd;
 }
 
 /**
@@ -90,7 +182,7 @@ int add_fd_to_server(struct ServerData* pserver_data, int new_fd) {
         //double allocated space
         pserver_data->fd_size *= 2;
         pserver_data->pollfds = realloc(pserver_data->pollfds, 
-                sizeof(struct pollfd)*pserver_data->fd_count);
+                sizeof(struct pollfd)*pserver_data->fd_size);
         
         //realloc error
         if (pserver_data->pollfds == NULL) {
@@ -101,13 +193,15 @@ int add_fd_to_server(struct ServerData* pserver_data, int new_fd) {
     
     pserver_data->pollfds[pserver_data->fd_count].fd = new_fd;
     pserver_data->pollfds[pserver_data->fd_count].events = POLLIN; //ready to read
+    //slot may hold a dropped client's events from the poll pass currently being handled
+    pserver_data->pollfds[pserver_data->fd_count].revents = 0;
     pserver_data->fd_count++; 
 
     return 0;
 }
 
 /**
- * Remove socket from list using index in pollfds array.
+ * Close socket and remove it from list using index in pollfds array.
  * @param pserver_data server data struct to remove sock from
  * @return void
  */
@@ -118,12 +212,27 @@ void delete_fd_from_server(struct ServerData* pserver_data, int fd_index) {
         return;
     }
     close(pserver_data->pollfds[fd_index].fd); //close sockfd
+    remove_fd_from_server(pserver_data, fd_index);
+}
+
+/**
+ * Remove socket from list using index in pollfds array without closing it. Used when
+ * the socket has been handed over to something else to service
+ * @param pserver_data server data struct to remove sock from
+ * @return void
+ */
+void remove_fd_from_server(struct ServerData* pserver_data, int fd_index) {
+    //Invalid index
+    if (fd_index >= pserver_data->fd_count) {
+        fprintf(stderr, "Server: invalid index requested to remove");
+        return;
+    }
     //Copy end over sockfd to delete with last entry while also updating count
     pserver_data->pollfds[fd_index] = pserver_data->pollfds[--pserver_data->fd_count];
 }
 
 /**
- * Get client sockfd to commmunicate on
+ * Get client sockfd to commmunicate on. Taken from the installed transport if there is one
  * @param listenfd open listening socket to communicate on
  * @return returns connected socket or -1 on failure
  */
@@ -131,6 +240,14 @@ int get_client(const int listenfd) {
     struct sockaddr_storage their_addr; // connector's address information
     socklen_t sin_size = sizeof(their_addr);
 
+    if (transport != NULL) {
+        int new_fd = transport->accept(transport->arg, listenfd);
+        if (new_fd == -1 || configure_client(new_fd) == -1) {
+            return -1;
+        }
+        return new_fd;
+    }
+
     int new_fd = accept(listenfd, (struct sockaddr *)&their_addr, &sin_size);
 
     if (new_fd == -1) {
@@ -139,6 +256,32 @@ int get_client(const int listenfd) {
         return -1;
     }
         
+    if (configure_client(new_fd) == -1) {
+        return -1;
+    }
+    //report client information
+    
+    if (their_addr.ss_family == AF_UNIX) {
+        printf("Server: new local connection on socket %d\n", new_fd);
+        return new_fd;
+    }
+
+    char remote_ip[INET6_ADDRSTRLEN];
+
+    printf("Server: new connection from %s on socket %d\n",
+            inet_ntop(their_addr.ss_family,
+                get_in_addr((struct sockaddr*)&their_addr), remote_ip, INET6_ADDRSTRLEN),
+                            new_fd);
+    return new_fd;
+}
+
+/**
+ * Configure a freshly accepted client socket. Sets send and receive timeouts and disables
+ * Nagle as responses are already coalesced before sending. Closes the socket on failure
+ * @param new_fd accepted socket to configure
+ * @return 0 on success or -1 on failure
+ */
+int configure_client(int new_fd) {
     //Set send and receive timeouts
     struct timeval tv;
     tv.tv_sec = SEND_TIMEOUT_S;
@@ -155,26 +298,28 @@ int get_client(const int listenfd) {
         close(new_fd);
         return -1; 
     }
-    //report client information
-    
-    char remote_ip[INET6_ADDRSTRLEN];
-
-    printf("Server: new connection from %s on socket %d\n",
-            inet_ntop(their_addr.ss_family,
-                get_in_addr((struct sockaddr*)&their_addr), remote_ip, INET6_ADDRSTRLEN),
-                            new_fd);
-    return new_fd;
+    //fails harmlessly on AF_UNIX sockets
+    int yes = 1;
+    setsockopt(new_fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    return 0;
 }
 
 /**
- * Connect to node
- * @param node_address IP of node to connect to
- * @param servname port number or service name 
+ * Connect to node, over the installed transport if there is one
+ * @param node_address IP of node to connect to, or unix:<path> for a node's AF_UNIX socket
+ * @param servname port number or service name. Ignored for AF_UNIX sockets
  * @return sockfd of connected node or -1 on failure
  */
 int connect_to_node(const char *node_address, const char *servname) {
     struct addrinfo hints, *node_info, *p;
     int ret, sockfd;
+
+    if (transport != NULL) {
+        return transport->connect(transport->arg, node_address, servname);
+    }
+    if (strncmp(node_address, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0) {
+        return connect_to_unix_node(node_address + strlen(UNIX_PREFIX));
+    }
     
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = AF_UNSPEC; //IPV4 or IPV6
@@ -199,6 +344,10 @@ int connect_to_node(const char *node_address, const char *servname) {
 			continue;
 		}
 
+        //requests are small and latency bound so send them immediately
+        int yes = 1;
+        setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
 		break;
 	}
 
@@ -219,6 +368,34 @@ int connect_to_node(const char *node_address, const char *servname) {
     return sockfd;
 }
 
+/**
+ * Connect to node given as a single peer string
+ * @param peer host:port, [ipv6]:port or unix:<path>
+ * @return sockfd of connected node or -1 on failure
+ */
+int connect_to_peer(const char *peer) {
+    char host[256];
+
+    if (strncmp(peer, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0) {
+        return connect_to_node(peer, "");
+    }
+
+    const char * sep = strrchr(peer, ':');
+    size_t host_len = sep != NULL ? (size_t)(sep - peer) : 0;
+    //strip brackets from ipv6 literals
+    if (host_len >= 2 && peer[0] == '[' && peer[host_len - 1] == ']') {
+        peer++;
+        host_len -= 2;
+    }
+    if (sep == NULL || host_len == 0 || host_len >= sizeof(host) || sep[1] == '\0') {
+        fprintf(stderr, "Server: invalid peer %s, expected host:port\n", peer);
+        return -1;
+    }
+    memcpy(host, peer, host_len);
+    host[host_len] = '\0';
+    return connect_to_node(host, sep + 1);
+}
+
 /**
  * Get IP address from given sockaddr struct. Ip version agnostic
  * @param populated sockaddr struct
@@ -237,9 +414,10 @@ static void *get_in_addr(struct sockaddr *sa)
 /**
  * Get sock fd to listen for new connections
  * @param servname port number or service name 
+ * @param reuseport allow other sockets to bind the same port with SO_REUSEPORT
  * @return connected listener sockfd or -1 on error
  */
-static int get_listener(const char * servname) {
+static int get_listener(const char * servname, int reuseport) {
     int sockfd;
     struct addrinfo hints, *servinfo, *p;
     int yes=1;
@@ -266,6 +444,16 @@ static int get_listener(const char * servname) {
         if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes,
                 sizeof(int)) == -1) {
             perror("Server: setsockopt");
+            close(sockfd);
+            freeaddrinfo(servinfo);
+            return -1;
+        }
+
+        if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes,
+                sizeof(int)) == -1) {
+            perror("Server: setsockopt");
+            close(sockfd);
+            freeaddrinfo(servinfo);
             return -1;
         }
 
@@ -297,6 +485,73 @@ static int get_listener(const char * servname) {
     return sockfd;
 }
 
+/**
+ * Get AF_UNIX sock fd to listen for new same-host connections
+ * @param path filesystem path to bind to
+ * @return listener sockfd or -1 on error
+ */
+static int get_unix_listener(const char * path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd == -1) {
+        perror("Server: socket");
+        return -1;
+    }
+
+    //stale socket file from a previous run would make bind fail
+    unlink(path);
+
+    if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("Server: bind");
+        close(sockfd);
+        return -1;
+    }
+
+    if (listen(sockfd, MAX_CONN_NUMBER) == -1) {
+        perror("Server: listen");
+        close(sockfd);
+        unlink(path);
+        return -1;
+    }
+    return sockfd;
+}
+
+/**
+ * Connect to node listening on an AF_UNIX socket
+ * @param path filesystem path of node's socket
+ * @return sockfd of connected node or -1 on failure
+ */
+static int connect_to_unix_node(const char * path) {
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Server: unix socket path too long: %s\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd == -1) {
+        perror("Server: socket");
+        return -1;
+    }
+
+    if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("Server: connect");
+        close(sockfd);
+        return -1;
+    }
+
+    printf("Server: connected to node on unix socket %s\n", path);
+    return sockfd;
+}
+
 /**
  * Send buffer to given socket. Will continue to `send` until appropriate amount of 
  * bytes transmitted or error occurs.
@@ -308,8 +563,15 @@ static int get_listener(const char * servname) {
 int send_buf(int sockfd, const void * buf, size_t len) {
     size_t sent = 0;
     int n; 
+    uint64_t begin = trace_stage_begin();
+    TRACE_PROBE2(send_buf, sockfd, len);
     while (sent < len) {
-        n = send(sockfd, buf+sent, len-sent, 0); 
+        //a peer that went away is reported as EPIPE rather than killing the process
+        n = send(sockfd, buf+sent, len-sent, MSG_NOSIGNAL); 
+        //sockets with timeouts are not restarted after signals. Just retry
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
         if (n == -1) {
             perror("Server: send");
             return -1;
@@ -317,10 +579,38 @@ int send_buf(int sockfd, const void * buf, size_t len) {
         sent += n;
     }
 
+    trace_stage_end(TRACE_SEND, begin, sent);
     return sent;
 }
 
 
+/**
+ * Have the calling thread's receive_buf calls on a socket take bytes the caller already
+ * received from it before reading the socket, for event loops that receive ahead of the
+ * endpoint being served
+ * @param sockfd socket the bytes were received from
+ * @param buf bytes received. Must stay valid until clear_receive_prefix
+ * @param len number of bytes
+ * @return void
+ */
+void set_receive_prefix(int sockfd, const void * buf, size_t len) {
+    prefix_fd = sockfd;
+    prefix_data = buf;
+    prefix_len = len;
+}
+
+/**
+ * Stop taking bytes set with set_receive_prefix
+ * @return number of bytes that were not taken
+ */
+size_t clear_receive_prefix(void) {
+    size_t left = prefix_len;
+    prefix_fd = -1;
+    prefix_data = NULL;
+    prefix_len = 0;
+    return left;
+}
+
 /**
  * Receive buffer from a specified socket.
  * @param sockfd socket to receive from
@@ -331,8 +621,20 @@ int send_buf(int sockfd, const void * buf, size_t len) {
 int receive_buf(int sockfd, void * buf, size_t len) {
     size_t recvd = 0;
     ssize_t n; 
+    uint64_t begin = trace_stage_begin();
+    TRACE_PROBE2(receive_buf, sockfd, len);
+    if (sockfd == prefix_fd && prefix_len > 0) {
+        recvd = len < prefix_len ? len : prefix_len;
+        memcpy(buf, prefix_data, recvd);
+        prefix_data += recvd;
+        prefix_len -= recvd;
+    }
     while (recvd < len) {
         n = recv(sockfd, buf+recvd, len-recvd, 0); 
+        //sockets with timeouts are not restarted after signals. Just retry
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
         //error or socket closed
         if (n == -1) {
             perror("Server: recv");
@@ -345,6 +647,7 @@ int receive_buf(int sockfd, void * buf, size_t len) {
         recvd += n;
     }
 
+    trace_stage_end(TRACE_RECV, begin, recvd);
     //return number of bytes recvd
     return recvd;
 }
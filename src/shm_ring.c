@@ -0,0 +1,266 @@
+/**
+ * Shared memory ring transport for clients on the same host as the node.
+ * Clients write length-prefixed payloads into a ring mapped into both processes
+ * and the node drains them in batches into its ingest path, bypassing the kernel
+ * networking stack entirely.
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shm_ring.h"
+
+#define SHM_RING_MAGIC 0x43485242 //"CHRB"
+
+//Internal functions
+static int map_shm_ring(struct ShmRing * pring, const char * name, int oflag);
+static void ring_write(struct ShmRing * pring, uint64_t pos, const void * src, size_t len);
+static void ring_read(const struct ShmRing * pring, uint64_t pos, void * dst, size_t len);
+static int lock_producers(struct ShmRingHeader * hdr);
+
+/**
+ * Create a new ring for clients to attach to. Replaces any existing object with the same name
+ * @param pring ring struct to populate
+ * @param name name of the shared memory object
+ * @return 0 on success, -1 on failure
+ */
+int create_shm_ring(struct ShmRing * pring, const char * name) {
+    if (map_shm_ring(pring, name, O_RDWR | O_CREAT | O_TRUNC) != 0) {
+        return -1;
+    }
+    pring->owner = 1;
+    pring->hdr->size = SHM_RING_DATA_SIZE;
+    pring->hdr->head = pring->hdr->tail = 0;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int ret = pthread_mutex_init(&pring->hdr->producer_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (ret != 0) {
+        fprintf(stderr, "Shm ring: failed to initialise producer lock: %s\n", strerror(ret));
+        detach_shm_ring(pring);
+        return -1;
+    }
+    //publish ring as ready last
+    __atomic_store_n(&pring->hdr->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * Attach to a ring previously created by a node
+ * @param pring ring struct to populate
+ * @param name name of the shared memory object
+ * @return 0 on success, -1 on failure
+ */
+int attach_shm_ring(struct ShmRing * pring, const char * name) {
+    if (map_shm_ring(pring, name, O_RDWR) != 0) {
+        return -1;
+    }
+    if (__atomic_load_n(&pring->hdr->magic, __ATOMIC_ACQUIRE) != SHM_RING_MAGIC ||
+            pring->hdr->size != SHM_RING_DATA_SIZE) {
+        fprintf(stderr, "Shm ring: %s is not a valid ring\n", pring->name);
+        detach_shm_ring(pring);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Unmap ring. The creating node also unlinks the shared memory object
+ * @param pring ring to detach from
+ * @return void
+ */
+void detach_shm_ring(struct ShmRing * pring) {
+    if (pring->hdr != NULL) {
+        munmap(pring->hdr, pring->map_sz);
+    }
+    if (pring->owner) {
+        shm_unlink(pring->name);
+    }
+    pring->hdr = NULL;
+    pring->data = NULL;
+    pring->owner = 0;
+}
+
+/**
+ * Write a single payload record into the ring. Safe to call from several client processes
+ * @param pring attached ring
+ * @param payload bytes to write
+ * @param len number of bytes in payload. At most SHM_RING_MAX_RECORD
+ * @return 0 on success, -1 if the payload is too large or the ring is full
+ */
+int shm_ring_push(struct ShmRing * pring, const char * payload, uint32_t len) {
+    struct ShmRingHeader * hdr = pring->hdr;
+    size_t record_len = sizeof(uint32_t) + len;
+
+    if (len > SHM_RING_MAX_RECORD) {
+        fprintf(stderr, "Shm ring: Specified payload size %u larger than max ring record %d\n",
+                len, SHM_RING_MAX_RECORD);
+        return -1;
+    }
+
+    if (lock_producers(hdr) != 0) {
+        return -1;
+    }
+
+    uint64_t tail = hdr->tail;
+    uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+
+    if (hdr->size - (tail - head) < record_len) {
+        pthread_mutex_unlock(&hdr->producer_lock);
+        fprintf(stderr, "Shm ring: ring full\n");
+        return -1;
+    }
+
+    ring_write(pring, tail, &len, sizeof(uint32_t));
+    ring_write(pring, tail + sizeof(uint32_t), payload, len);
+
+    //make record visible to the node
+    __atomic_store_n(&hdr->tail, tail + record_len, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&hdr->producer_lock);
+    return 0;
+}
+
+/**
+ * Hand a batch of pending records to a consumer. Must only be called by the node
+ * @param pring ring created by the node
+ * @param consumer function handed each null terminated payload in its own allocation
+ * @param ctx context passed through to consumer
+ * @return number of records consumed or -1 on failure
+ */
+int shm_ring_drain(struct ShmRing * pring, shm_ring_consumer_f consumer, void * ctx) {
+    struct ShmRingHeader * hdr = pring->hdr;
+    uint64_t head = hdr->head;
+    uint64_t tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+    int consumed = 0;
+    int ret = 0;
+
+    while (head != tail && consumed < SHM_RING_DRAIN_BATCH) {
+        uint32_t len;
+        ring_read(pring, head, &len, sizeof(uint32_t));
+
+        //Producers validate length so this is only reachable if the ring was scribbled on
+        if (len > SHM_RING_MAX_RECORD || len > tail - head - sizeof(uint32_t)) {
+            fprintf(stderr, "Shm ring: corrupt record of length %u. Discarding ring contents\n", len);
+            head = tail;
+            ret = -1;
+            break;
+        }
+        //copy straight out of the ring into the allocation the block will keep
+        char * payload = malloc((size_t)len + 1);
+        if (payload == NULL) {
+            fprintf(stderr, "Shm ring: failed to allocate memory for payload\n");
+            ret = -1;
+            break;
+        }
+        ring_read(pring, head + sizeof(uint32_t), payload, len);
+        payload[len] = '\0';
+        head += sizeof(uint32_t) + len;
+
+        if (consumer(ctx, payload, len) != 0) {
+            ret = -1;
+            break;
+        }
+        consumed++;
+    }
+
+    //release consumed space back to producers
+    __atomic_store_n(&hdr->head, head, __ATOMIC_RELEASE);
+    return ret == 0 ? consumed : -1;
+}
+
+/**
+ * Take the lock serialising producers. A producer that died holding it cannot have left
+ * a partial record visible, as tail is only advanced once a record is complete, so the
+ * lock is simply marked consistent again and taken over
+ * @param hdr header of attached ring
+ * @return 0 with the lock held, -1 on failure
+ */
+static int lock_producers(struct ShmRingHeader * hdr) {
+    int ret = pthread_mutex_lock(&hdr->producer_lock);
+    if (ret == EOWNERDEAD) {
+        fprintf(stderr, "Shm ring: previous producer died holding the ring, recovering\n");
+        ret = pthread_mutex_consistent(&hdr->producer_lock);
+    }
+    if (ret != 0) {
+        fprintf(stderr, "Shm ring: failed to lock ring: %s\n", strerror(ret));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Open and map the shared memory object backing a ring
+ * @param pring ring struct to populate
+ * @param name name of shared memory object. Leading '/' is added if missing
+ * @param oflag flags to pass to shm_open
+ * @return 0 on success, -1 on failure
+ */
+static int map_shm_ring(struct ShmRing * pring, const char * name, int oflag) {
+    memset(pring, 0, sizeof(*pring));
+    if (strlen(name) + 2 > sizeof(pring->name)) {
+        fprintf(stderr, "Shm ring: name too long: %s\n", name);
+        return -1;
+    }
+    snprintf(pring->name, sizeof(pring->name), "%s%s", name[0] == '/' ? "" : "/", name);
+
+    int fd = shm_open(pring->name, oflag, 0600);
+    if (fd == -1) {
+        perror("Shm ring: shm_open");
+        return -1;
+    }
+
+    pring->map_sz = sizeof(struct ShmRingHeader) + SHM_RING_DATA_SIZE;
+    if ((oflag & O_CREAT) && ftruncate(fd, pring->map_sz) == -1) {
+        perror("Shm ring: ftruncate");
+        close(fd);
+        shm_unlink(pring->name);
+        return -1;
+    }
+
+    void * map = mmap(NULL, pring->map_sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    //mapping keeps the object alive
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Shm ring: mmap");
+        if (oflag & O_CREAT) {
+            shm_unlink(pring->name);
+        }
+        return -1;
+    }
+
+    pring->hdr = map;
+    pring->data = (uint8_t *)map + sizeof(struct ShmRingHeader);
+    return 0;
+}
+
+/**
+ * Copy bytes into ring at a logical position, wrapping at the end of the data region
+ */
+static void ring_write(struct ShmRing * pring, uint64_t pos, const void * src, size_t len) {
+    size_t offset = pos & (SHM_RING_DATA_SIZE - 1);
+    size_t first = SHM_RING_DATA_SIZE - offset;
+    first = (len < first) ? len : first;
+
+    memcpy(pring->data + offset, src, first);
+    memcpy(pring->data, (const uint8_t *)src + first, len - first);
+}
+
+/**
+ * Copy bytes out of ring at a logical position, wrapping at the end of the data region
+ */
+static void ring_read(const struct ShmRing * pring, uint64_t pos, void * dst, size_t len) {
+    size_t offset = pos & (SHM_RING_DATA_SIZE - 1);
+    size_t first = SHM_RING_DATA_SIZE - offset;
+    first = (len < first) ? len : first;
+
+    memcpy(dst, pring->data + offset, first);
+    memcpy((uint8_t *)dst + first, pring->data, len - first);
+}
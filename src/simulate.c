@@ -0,0 +1,147 @@
+/**
+ * Simple program to benchmark block propagation and chain sync on a simulated network.
+ * Runs every node in one process on simulated time so large networks and slow links
+ * can be measured in seconds, and equal options always print equal reports. With -R
+ * the node's own endpoints, sync and subscriptions run instead over an in-memory
+ * transport shaped like the links, timed by the real clock, so reports of -R runs
+ * are not reproducible
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "netsim.h"
+
+#define SIMULATE_USAGE "usage: simulate [-n nodes] [-d degree] [-b blocks] [-i interval_ms] " \
+    "[-s payload_size] [-l latency_ms[:jitter_ms]] [-w bandwidth_mbit] [-x loss] " \
+    "[-j joiners] [-k sync_peers] [-c conns_per_peer] [-S seed] [-R]\n"
+
+//Run a simulation configured by options and print its report
+int main(int argc, char * argv[]) {
+    struct SimConfig config = {
+        .n_nodes = 64,
+        .degree = 4,
+        .n_blocks = 0, //defaults depend on whether the run is live
+        .interval_us = 0,
+        .payload_size = 1024,
+        .latency_us = 20000,
+        .jitter_us = 0,
+        .bandwidth = 100000000 / 8,
+        .loss = 0,
+        .n_joiners = 0,
+        .sync_peers = 4,
+        .conns_per_peer = 2,
+        .seed = 1
+    };
+    char * end;
+    int live = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:d:b:i:s:l:w:x:j:k:c:S:R")) != -1) {
+        switch (opt) {
+            case 'n':
+                config.n_nodes = strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                config.degree = strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                config.n_blocks = strtoul(optarg, NULL, 10);
+                break;
+            case 'i':
+                config.interval_us = (uint64_t)(strtod(optarg, NULL) * 1000);
+                break;
+            case 's':
+                config.payload_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'l':
+                config.latency_us = (uint64_t)(strtod(optarg, &end) * 1000);
+                config.jitter_us = *end == ':' ? (uint64_t)(strtod(end + 1, NULL) * 1000) : 0;
+                break;
+            case 'w':
+                config.bandwidth = (uint64_t)(strtod(optarg, NULL) * 1000000 / 8);
+                break;
+            case 'x':
+                config.loss = strtod(optarg, NULL);
+                break;
+            case 'j':
+                config.n_joiners = strtoul(optarg, NULL, 10);
+                break;
+            case 'k':
+                config.sync_peers = strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                config.conns_per_peer = strtoul(optarg, NULL, 10);
+                break;
+            case 'S':
+                config.seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'R':
+                live = 1;
+                break;
+            default:
+                fprintf(stderr, SIMULATE_USAGE);
+                return 1;
+        }
+    }
+    if (argc != optind) {
+        fprintf(stderr, SIMULATE_USAGE);
+        return 1;
+    }
+
+    //live runs take as long as the workload they simulate, so their default one is shorter
+    if (config.n_blocks == 0) {
+        config.n_blocks = live ? 200 : 1000;
+    }
+    if (config.interval_us == 0) {
+        config.interval_us = live ? 20000 : 100000;
+    }
+
+    struct SimReport * preport = malloc(sizeof(struct SimReport));
+    if (preport == NULL) {
+        fprintf(stderr, "Simulate: failed to allocate memory for report\n");
+        return 2;
+    }
+    if ((live ? run_live_simulation(&config, preport) : run_simulation(&config, preport)) != 0) {
+        free(preport);
+        return 3;
+    }
+
+    printf("Simulate: %u nodes of degree %u, %u blocks of %u bytes every %.3f ms, seed %llu\n",
+            config.n_nodes, config.degree, config.n_blocks, config.payload_size,
+            config.interval_us / 1e3, (unsigned long long)config.seed);
+    if (live) {
+        printf("Simulate: live run on the real clock, not reproducible\n");
+        printf("Simulate: %.3f s until last append, %llu connections\n", preport->end_us / 1e6,
+                (unsigned long long)preport->connections);
+    } else {
+        printf("Simulate: %.3f s simulated, %llu events, %llu messages\n", preport->end_us / 1e6,
+                (unsigned long long)preport->events, (unsigned long long)preport->messages);
+    }
+    printf("Simulate: %.3f MB sent, %.3f MB retransmitted, %.3f MB of duplicate blocks\n",
+            preport->bytes / 1e6, preport->retransmitted / 1e6, preport->duplicate_bytes / 1e6);
+    printf("Simulate: propagation p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+            preport->prop_p50_us / 1e3, preport->prop_p90_us / 1e3, preport->prop_p99_us / 1e3,
+            preport->prop_max_us / 1e3);
+    printf("Simulate: held by every node p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+            preport->all_p50_us / 1e3, preport->all_p99_us / 1e3, preport->all_max_us / 1e3);
+    for (uint32_t i = 0; i < preport->n_syncs; i++) {
+        const struct SimSync * psync = &preport->syncs[i];
+        if (psync->failed) {
+            printf("Simulate: joiner %u failed to sync after %u retries\n", i, psync->retries);
+            continue;
+        }
+        printf("Simulate: joiner %u synced %u blocks in %.3f ms (%.3f MB, %u retries), caught up in %.3f ms\n",
+                i, psync->blocks, psync->time_us / 1e3, psync->bytes / 1e6, psync->retries,
+                psync->catch_up_us / 1e3);
+    }
+
+    int broken = preport->bad_blocks > 0 || preport->missing > 0;
+    if (broken) {
+        fprintf(stderr, "Simulate: %u blocks failed verification and %u were never delivered\n",
+                preport->bad_blocks, preport->missing);
+    }
+    free(preport);
+    return broken ? 4 : 0;
+}
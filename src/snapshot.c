@@ -0,0 +1,374 @@
+/**
+ * Chain snapshots and payload pruning. Lets a long running node bound its
+ * resident memory by moving old payloads to cold storage (or dropping them)
+ * while keeping every header resident so chain linkage can still be verified.
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <endian.h>
+
+#include "snapshot.h"
+#include "server.h"
+
+#define SNAPSHOT_MAGIC 0x43485334 //"CHS4". Adds cold storage locations to "CHS3"
+#define SNAPSHOT_MAGIC_V3 0x43485333 //"CHS3". 32 bit payload lengths and block timestamps
+#define SNAPSHOT_HEADER_SZ (3 * sizeof(uint32_t) + 2 * sizeof(uint64_t)) //hash, length, timestamp,
+                                                                          //cold offset and packed length per block
+#define SNAPSHOT_HEADER_SZ_V3 (2 * sizeof(uint32_t) + sizeof(uint64_t)) //hash, length, timestamp per block
+#define SNAPSHOT_PREAMBLE_SZ (3 * sizeof(uint32_t) + sizeof(uint64_t)) //magic, height, tip hash, cold end
+#define SNAPSHOT_PREAMBLE_SZ_V3 (3 * sizeof(uint32_t))
+
+/**
+ * Capture height, tip hash, the header of every block in the chain and where each payload
+ * pruned to cold storage was written
+ * @param pblock_chain chain to snapshot
+ * @param psnapshot snapshot to populate. Free with free_snapshot
+ * @return 0 on success, -1 on failure
+ */
+int take_snapshot(const struct BlockChain * pblock_chain, struct ChainSnapshot * psnapshot) {
+    psnapshot->height = pblock_chain->len;
+    psnapshot->tip_hash = pblock_chain->tail != NULL ? pblock_chain->tail->block.hash : 0;
+    psnapshot->cold_end = (uint64_t)pblock_chain->cold_end;
+    psnapshot->headers = malloc(sizeof(struct BlockHeader) * (pblock_chain->len + 1));
+    psnapshot->cold = malloc(sizeof(struct ColdPayload) * (pblock_chain->len + 1));
+
+    if (psnapshot->headers == NULL || psnapshot->cold == NULL) {
+        fprintf(stderr, "Snapshot: failed to allocate memory for headers\n");
+        free_snapshot(psnapshot);
+        return -1;
+    }
+
+    uint32_t i = 0;
+    for (const struct Link* link = pblock_chain->head; link != NULL; link = link->next, i++) {
+        psnapshot->headers[i].prev_hash = link->block.prev_hash;
+        psnapshot->headers[i].hash = link->block.hash;
+        psnapshot->headers[i].payload_len = link->block.payload_len;
+        psnapshot->headers[i].timestamp = link->block.timestamp;
+        //only payloads no longer held in memory are found through cold storage
+        int in_cold = link->block.payload == NULL && link->block.packed == NULL;
+        psnapshot->cold[i].offset = in_cold ? link->block.cold_offset : -1;
+        psnapshot->cold[i].packed_len = in_cold ? link->block.packed_len : 0;
+    }
+    return 0;
+}
+
+/**
+ * Write snapshot to disk. Written to a temporary file then renamed into place so a
+ * crash never leaves a partial snapshot behind. prev_hash is implied by the previous
+ * header so only hash, payload length, timestamp and cold storage location are stored per
+ * block. Cold storage must already be durable up to the snapshot's cold end
+ * @param psnapshot snapshot to write
+ * @param path destination file
+ * @return 0 on success, -1 on failure
+ */
+int write_snapshot(const struct ChainSnapshot * psnapshot, const char * path) {
+    size_t len = SNAPSHOT_PREAMBLE_SZ + (size_t)psnapshot->height * SNAPSHOT_HEADER_SZ;
+    uint8_t * buf = malloc(len);
+    char tmp_path[4096];
+
+    if (buf == NULL) {
+        fprintf(stderr, "Snapshot: failed to allocate memory for buffer\n");
+        return -1;
+    }
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    //pack in network byte order so snapshots are portable between hosts
+    uint8_t * cur = buf;
+    uint32_t net_u32 = htonl(SNAPSHOT_MAGIC);
+    memcpy(cur, &net_u32, sizeof(uint32_t)); cur += sizeof(uint32_t);
+    net_u32 = htonl(psnapshot->height);
+    memcpy(cur, &net_u32, sizeof(uint32_t)); cur += sizeof(uint32_t);
+    net_u32 = htonl(psnapshot->tip_hash);
+    memcpy(cur, &net_u32, sizeof(uint32_t)); cur += sizeof(uint32_t);
+    uint64_t net_u64 = htobe64(psnapshot->cold_end);
+    memcpy(cur, &net_u64, sizeof(uint64_t)); cur += sizeof(uint64_t);
+
+    for (uint32_t i = 0; i < psnapshot->height; i++) {
+        net_u32 = htonl(psnapshot->headers[i].hash);
+        memcpy(cur, &net_u32, sizeof(uint32_t)); cur += sizeof(uint32_t);
+        net_u32 = htonl(psnapshot->headers[i].payload_len);
+        memcpy(cur, &net_u32, sizeof(uint32_t)); cur += sizeof(uint32_t);
+        net_u64 = htobe64(psnapshot->headers[i].timestamp);
+        memcpy(cur, &net_u64, sizeof(uint64_t)); cur += sizeof(uint64_t);
+        net_u64 = htobe64((uint64_t)psnapshot->cold[i].offset);
+        memcpy(cur, &net_u64, sizeof(uint64_t)); cur += sizeof(uint64_t);
+        net_u32 = htonl(psnapshot->cold[i].packed_len);
+        memcpy(cur, &net_u32, sizeof(uint32_t)); cur += sizeof(uint32_t);
+    }
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("Snapshot: open");
+        free(buf);
+        return -1;
+    }
+
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(fd, buf + written, len - written);
+        if (n == -1) {
+            perror("Snapshot: write");
+            close(fd);
+            free(buf);
+            unlink(tmp_path);
+            return -1;
+        }
+        written += n;
+    }
+    free(buf);
+
+    if (fsync(fd) == -1 || close(fd) == -1) {
+        perror("Snapshot: fsync");
+        unlink(tmp_path);
+        return -1;
+    }
+
+    if (rename(tmp_path, path) == -1) {
+        perror("Snapshot: rename");
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Read snapshot written by write_snapshot. Rebuilds each header's prev_hash from the header
+ * before it and checks the last hash against the stored tip hash. Snapshots written before
+ * cold storage locations were recorded load with every payload outside cold storage
+ * @param psnapshot snapshot to populate. Free with free_snapshot
+ * @param path snapshot file
+ * @return 0 on success, -1 if the file can't be read or is not a valid snapshot
+ */
+int load_snapshot(struct ChainSnapshot * psnapshot, const char * path) {
+    FILE * fp = fopen(path, "rb");
+    uint32_t net_u32[3];
+    uint64_t net_u64;
+
+    psnapshot->headers = NULL;
+    psnapshot->cold = NULL;
+    psnapshot->height = 0;
+    psnapshot->cold_end = 0;
+    if (fp == NULL) {
+        perror("Snapshot: open");
+        return -1;
+    }
+
+    if (fread(net_u32, sizeof(uint32_t), 3, fp) != 3 ||
+            (ntohl(net_u32[0]) != SNAPSHOT_MAGIC && ntohl(net_u32[0]) != SNAPSHOT_MAGIC_V3)) {
+        fprintf(stderr, "Snapshot: %s is not a snapshot\n", path);
+        fclose(fp);
+        return -1;
+    }
+    int has_cold = ntohl(net_u32[0]) == SNAPSHOT_MAGIC;
+    uint32_t height = ntohl(net_u32[1]);
+    uint32_t tip_hash = ntohl(net_u32[2]);
+    off_t preamble_sz = has_cold ? SNAPSHOT_PREAMBLE_SZ : SNAPSHOT_PREAMBLE_SZ_V3;
+    off_t header_sz = has_cold ? SNAPSHOT_HEADER_SZ : SNAPSHOT_HEADER_SZ_V3;
+    uint64_t cold_end = 0;
+
+    //every header is stored so the file size must match the height exactly
+    if (fseeko(fp, 0, SEEK_END) == -1 || ftello(fp) != preamble_sz + (off_t)height * header_sz ||
+            fseeko(fp, 3 * sizeof(uint32_t), SEEK_SET) == -1 ||
+            (has_cold && fread(&net_u64, sizeof(net_u64), 1, fp) != 1)) {
+        fprintf(stderr, "Snapshot: %s is truncated or has trailing data\n", path);
+        fclose(fp);
+        return -1;
+    }
+    if (has_cold) {
+        cold_end = be64toh(net_u64);
+    }
+
+    psnapshot->headers = malloc(sizeof(struct BlockHeader) * ((size_t)height + 1));
+    psnapshot->cold = malloc(sizeof(struct ColdPayload) * ((size_t)height + 1));
+    if (psnapshot->headers == NULL || psnapshot->cold == NULL) {
+        fprintf(stderr, "Snapshot: failed to allocate memory for headers\n");
+        fclose(fp);
+        free_snapshot(psnapshot);
+        return -1;
+    }
+
+    uint32_t prev_hash = 0; //genesis block has no previous hash
+    for (uint32_t i = 0; i < height; i++) {
+        uint8_t rec[SNAPSHOT_HEADER_SZ];
+        if (fread(rec, header_sz, 1, fp) != 1) {
+            fprintf(stderr, "Snapshot: failed to read header %u from %s\n", i, path);
+            fclose(fp);
+            free_snapshot(psnapshot);
+            return -1;
+        }
+        memcpy(&net_u32[0], rec, sizeof(uint32_t));
+        memcpy(&net_u32[1], rec + sizeof(uint32_t), sizeof(uint32_t));
+        memcpy(&net_u64, rec + 2 * sizeof(uint32_t), sizeof(uint64_t));
+
+        psnapshot->headers[i].prev_hash = prev_hash;
+        psnapshot->headers[i].hash = ntohl(net_u32[0]);
+        psnapshot->headers[i].payload_len = ntohl(net_u32[1]);
+        psnapshot->headers[i].timestamp = be64toh(net_u64);
+        prev_hash = psnapshot->headers[i].hash;
+
+        psnapshot->cold[i].offset = -1;
+        psnapshot->cold[i].packed_len = 0;
+        if (has_cold) {
+            memcpy(&net_u64, rec + 2 * sizeof(uint32_t) + sizeof(uint64_t), sizeof(uint64_t));
+            memcpy(&net_u32[2], rec + 2 * sizeof(uint32_t) + 2 * sizeof(uint64_t), sizeof(uint32_t));
+            psnapshot->cold[i].offset = (int64_t)be64toh(net_u64);
+            psnapshot->cold[i].packed_len = ntohl(net_u32[2]);
+        }
+    }
+    fclose(fp);
+
+    if (prev_hash != tip_hash) {
+        fprintf(stderr, "Snapshot: last header in %s does not match tip hash\n", path);
+        free_snapshot(psnapshot);
+        return -1;
+    }
+    psnapshot->height = height;
+    psnapshot->tip_hash = tip_hash;
+    psnapshot->cold_end = cold_end;
+    return 0;
+}
+
+/**
+ * Rebuild an empty chain from a snapshot. Every block is appended header only, so the whole
+ * chain starts pruned and new blocks link on to the snapshot's tip. Payloads the snapshot
+ * found in cold storage are read back from the chain's cold storage if it still holds them
+ * @param pblock_chain empty chain to restore into. Cold storage, if any, is already open
+ * @param psnapshot snapshot to restore
+ * @return 0 on success, -1 on failure
+ */
+int restore_snapshot(struct BlockChain * pblock_chain, const struct ChainSnapshot * psnapshot) {
+    if (pblock_chain->len != 0) {
+        fprintf(stderr, "Snapshot: refusing to restore onto a chain of %u blocks\n", pblock_chain->len);
+        return -1;
+    }
+
+    //cold storage cut short since the snapshot loses the payloads past its end
+    if (pblock_chain->cold_fd != -1 && (uint64_t)pblock_chain->cold_end < psnapshot->cold_end) {
+        fprintf(stderr, "Snapshot: cold storage holds %lld of %llu bytes, later payloads are lost\n",
+                (long long)pblock_chain->cold_end, (unsigned long long)psnapshot->cold_end);
+    }
+
+    for (uint32_t i = 0; i < psnapshot->height; i++) {
+        struct Block header;
+        memset(&header, 0, sizeof(header));
+        header.hash = psnapshot->headers[i].hash;
+        header.payload_len = psnapshot->headers[i].payload_len;
+        header.timestamp = psnapshot->headers[i].timestamp;
+        if (append_header(pblock_chain, &header) != 0) {
+            fprintf(stderr, "Snapshot: failed to restore header %u\n", i);
+            return -1;
+        }
+
+        const struct ColdPayload * pcold = &psnapshot->cold[i];
+        uint32_t stored_len = pcold->packed_len > 0 ? pcold->packed_len : header.payload_len;
+        if (pblock_chain->cold_fd != -1 && pcold->offset >= 0 &&
+                (uint64_t)pcold->offset + stored_len <= (uint64_t)pblock_chain->cold_end) {
+            struct Block * pblock = &pblock_chain->tail->block;
+            pblock->cold_offset = pcold->offset;
+            pblock->packed_len = pcold->packed_len;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Check that a chain and a snapshot agree on every block they both hold. Either may be
+ * the longer of the two
+ * @param pblock_chain chain to check
+ * @param psnapshot snapshot to compare against
+ * @return 0 if they agree, otherwise the height of the first block that differs plus one
+ */
+uint32_t check_snapshot(const struct BlockChain * pblock_chain, const struct ChainSnapshot * psnapshot) {
+    uint32_t i = 0;
+    for (const struct Link* link = pblock_chain->head; link != NULL && i < psnapshot->height;
+            link = link->next, i++) {
+        if (link->block.hash != psnapshot->headers[i].hash) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Free memory held by snapshot
+ * @param psnapshot snapshot to free
+ * @return void
+ */
+void free_snapshot(struct ChainSnapshot * psnapshot) {
+    free(psnapshot->headers);
+    free(psnapshot->cold);
+    psnapshot->headers = NULL;
+    psnapshot->cold = NULL;
+    psnapshot->height = 0;
+}
+
+/**
+ * Open cold storage that pruned payloads are moved to. Without cold storage pruned payloads
+ * are dropped. Payloads pruned by earlier runs are kept so a chain restored from a snapshot
+ * can read them back. The chain takes ownership and closes it in deinitialise_chain
+ * @param pblock_chain chain to attach storage to
+ * @param path file to append pruned payloads to. Created if missing
+ * @return 0 on success, -1 on failure
+ */
+int open_cold_store(struct BlockChain * pblock_chain, const char * path) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        perror("Snapshot: open cold storage");
+        return -1;
+    }
+    //appended to after what earlier runs wrote, which snapshots may still point into
+    off_t end = lseek(fd, 0, SEEK_END);
+    if (end == -1) {
+        perror("Snapshot: seek cold storage");
+        close(fd);
+        return -1;
+    }
+    pblock_chain->cold_fd = fd;
+    pblock_chain->cold_end = end;
+    return 0;
+}
+
+/**
+ * Release payloads of all blocks more than depth blocks behind the tip. Payloads are
+ * appended to cold storage if the chain has one, otherwise they are dropped. Packed
+ * payloads are stored as they are and only unpacked when read back. Headers always
+ * stay resident. Failures are left to the caller to report, as it may retry
+ * @param pblock_chain chain to prune
+ * @param depth number of most recent blocks whose payloads stay in memory
+ * @return number of payloads pruned or -1 on failure with errno set. Payloads pruned
+ * before the failure stay pruned
+ */
+int prune_chain(struct BlockChain * pblock_chain, uint32_t depth) {
+    int pruned = 0;
+
+    while (pblock_chain->len - pblock_chain->pruned_len > depth) {
+        struct Link * link = pblock_chain->resident_head;
+        struct Block * pblock = &link->block;
+
+        if (pblock_chain->cold_fd != -1 && (pblock->payload != NULL || pblock->packed != NULL)) {
+            const void * stored = pblock->payload != NULL ? (const void *)pblock->payload : pblock->packed;
+            uint32_t stored_len = pblock->payload != NULL ? pblock->payload_len : pblock->packed_len;
+            ssize_t n = pwrite(pblock_chain->cold_fd, stored, stored_len, pblock_chain->cold_end);
+            if (n != stored_len) {
+                //a short write to a regular file means the disk is full
+                if (n >= 0) {
+                    errno = ENOSPC;
+                }
+                return -1;
+            }
+            pblock->cold_offset = pblock_chain->cold_end;
+            pblock_chain->cold_end += n;
+        }
+
+        release_payload(pblock_chain, pblock);
+        pblock_chain->resident_head = link->next;
+        pblock_chain->pruned_len++;
+        pruned++;
+    }
+    return pruned;
+}
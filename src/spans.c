@@ -0,0 +1,62 @@
+/**
+ * Simple program to fetch the request spans a running node has recorded and break its
+ * latency down per endpoint and stage
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "server.h"
+#include "requests.h"
+#include "trace.h"
+
+#define SPANS_USAGE "usage: spans [-v] host:port|unix:path\n"
+
+//Request the node's recorded spans and summarise them
+int main(int argc, char * argv[]) {
+    int verbose = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "v")) != -1) {
+        switch (opt) {
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                fprintf(stderr, SPANS_USAGE);
+                return 1;
+        }
+    }
+    if (argc - optind != 1) {
+        fprintf(stderr, SPANS_USAGE);
+        return 1;
+    }
+
+    int node_fd = connect_to_peer(argv[optind]);
+    if (node_fd == -1) {
+        return 2;
+    }
+
+    struct TraceSpan * spans;
+    uint32_t n_spans;
+    int ret = request_trace_endpoint(node_fd, &spans, &n_spans);
+    close(node_fd);
+    if (ret != 0) {
+        return 3;
+    }
+
+    if (n_spans == 0) {
+        printf("Spans: node recorded no spans. Is it running with -T?\n");
+    } else {
+        if (verbose) {
+            for (uint32_t i = 0; i < n_spans; i++) {
+                print_trace_span(stdout, &spans[i]);
+            }
+        }
+        printf("Spans: %u spans over %.3f s\n", n_spans,
+                (spans[n_spans - 1].start_ns - spans[0].start_ns) / 1e9);
+        print_trace_summary(stdout, spans, n_spans);
+    }
+    free(spans);
+    return 0;
+}
@@ -0,0 +1,115 @@
+/**
+ * Simple program to follow a running node's chain as it grows. Subscribes from a
+ * height and prints every block the node pushes, backlog first, until interrupted
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "block.h"
+#include "server.h"
+#include "requests.h"
+
+#define SUBSCRIBE_USAGE "usage: subscribe [-q] [-n count] host:port|unix:path [start_height]\n"
+
+//Stop receiving on sigint. Receives retry when interrupted so the socket is shut down to end them
+static volatile sig_atomic_t prog_run_status = 1;
+static int node_fd = -1;
+
+void sig_int_handler(int _) {
+    (void)_;
+    prog_run_status = 0;
+    if (node_fd != -1) {
+        shutdown(node_fd, SHUT_RDWR);
+    }
+}
+
+//Subscribe to a node and print each block pushed to it
+int main(int argc, char * argv[]) {
+    struct timespec start, end;
+    unsigned long count = 0; //0 to follow until interrupted
+    uint32_t height = 0;
+    int quiet = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "qn:")) != -1) {
+        switch (opt) {
+            case 'q':
+                quiet = 1;
+                break;
+            case 'n':
+                count = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, SUBSCRIBE_USAGE);
+                return 1;
+        }
+    }
+    if (argc - optind < 1 || argc - optind > 2) {
+        fprintf(stderr, SUBSCRIBE_USAGE);
+        return 1;
+    }
+    if (argc - optind > 1) {
+        height = strtoul(argv[optind + 1], NULL, 10);
+    }
+
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = sig_int_handler;
+    sigaction(SIGINT, &act, NULL);
+
+    node_fd = connect_to_peer(argv[optind]);
+    if (node_fd == -1) {
+        return 2;
+    }
+    if (request_subscribe_endpoint(node_fd, height) != 0) {
+        close(node_fd);
+        return 3;
+    }
+    printf("Subscribe: subscribed from height %u\n", height);
+
+    //each block is received into its own chain so memory stays flat however long this runs.
+    //Only the tip hash is carried over to check the next block links on
+    uint32_t first = height, tip_hash = 0;
+    unsigned long received = 0;
+    int failed = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (prog_run_status && (count == 0 || received < count)) {
+        struct BlockChain blocks = initialise_chain();
+        if (receive_subscribed_blocks(node_fd, height, 1, received > 0 ? &tip_hash : NULL,
+                    &blocks) != 0) {
+            failed = prog_run_status;
+            deinitialise_chain(&blocks);
+            break;
+        }
+        const struct Block * pblock = &blocks.tail->block;
+        if (!quiet) {
+            printf("------\nHeight: %u\n", height);
+            print_block(*pblock);
+        }
+        tip_hash = pblock->hash;
+        height++;
+        received++;
+        deinitialise_chain(&blocks);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    int fd = node_fd;
+    node_fd = -1;
+    close(fd);
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (received > 0) {
+        printf("Subscribe: %lu blocks at heights %u to %u in %.3f s\n", received, first,
+                height - 1, elapsed);
+    } else {
+        printf("Subscribe: no blocks in %.3f s\n", elapsed);
+    }
+    if (failed) {
+        fprintf(stderr, "Subscribe: subscription ended by node\n");
+        return 3;
+    }
+    return 0;
+}
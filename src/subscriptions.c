@@ -0,0 +1,505 @@
+/**
+ * Block subscriptions. Subscribed clients are handed over from the reactors to a
+ * publisher thread that pushes them every block from their starting height: first
+ * the backlog read from the chain, then each new block as it is appended. A new
+ * block is serialised once into a frame shared by every subscriber keeping up, so
+ * publishing costs one copy of the block plus a pointer per subscriber.
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "subscriptions.h"
+#include "endpoints.h"
+#include "server.h"
+
+#define SUB_MAX_IOV 64 //frames written per sendmsg
+
+//Internal functions
+static void * publish_thread(void * arg);
+static void wake_publisher(struct SubHub * phub);
+static struct SubFrame * build_frame(const struct BlockChain * pblock_chain, const struct Block * pblock,
+        struct PayloadBuf * pcold);
+static void release_frame(struct SubFrame * pframe);
+static int queue_frame(struct Subscriber * psub, struct SubFrame * pframe);
+static void catch_up(struct SubHub * phub);
+static int flush_subscriber(struct Subscriber * psub);
+static void drop_subscriber(struct Subscriber * psub);
+static void compact_subscribers(struct SubHub * phub);
+
+/**
+ * Create hub and start its publisher thread. Blocks already on the chain are not published
+ * @param phub hub to initialise
+ * @param pctx state of the node. plock must be set as the chain is read from the publisher thread
+ * @return 0 on success, -1 on failure
+ */
+int start_subscriptions(struct SubHub * phub, struct EndpointContext * pctx) {
+    memset(phub, 0, sizeof(*phub));
+    if (pctx->plock == NULL) {
+        fprintf(stderr, "Subscriptions: invalid configuration\n");
+        return -1;
+    }
+    phub->pctx = pctx;
+    phub->published = pctx->pblock_chain->len;
+    phub->subs = calloc(SUB_MAX_SUBSCRIBERS, sizeof(struct Subscriber));
+    if (phub->subs == NULL) {
+        fprintf(stderr, "Subscriptions: failed to allocate memory for subscribers\n");
+        return -1;
+    }
+    phub->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (phub->wake_fd == -1) {
+        perror("Subscriptions: eventfd");
+        free(phub->subs);
+        return -1;
+    }
+    pthread_mutex_init(&phub->lock, NULL);
+
+    phub->running = 1;
+    if (pthread_create(&phub->thread, NULL, publish_thread, phub) != 0) {
+        fprintf(stderr, "Subscriptions: failed to start publisher thread\n");
+        pthread_mutex_destroy(&phub->lock);
+        close(phub->wake_fd);
+        free(phub->subs);
+        phub->running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Stop the publisher thread and close every subscriber
+ * @param phub hub to stop
+ * @return void
+ */
+void stop_subscriptions(struct SubHub * phub) {
+    phub->running = 0;
+    wake_publisher(phub);
+    pthread_join(phub->thread, NULL);
+
+    for (uint32_t i = 0; i < phub->n_subs; i++) {
+        drop_subscriber(&phub->subs[i]);
+    }
+    free(phub->subs);
+    phub->subs = NULL;
+    phub->n_subs = 0;
+    free_payload_buf(&phub->cold);
+    close(phub->wake_fd);
+    pthread_mutex_destroy(&phub->lock);
+}
+
+/**
+ * Hand a client over to the hub. The height it subscribed from is echoed first to confirm
+ * the subscription, after which only blocks are sent on the socket
+ * @param phub hub to subscribe to
+ * @param sockfd client socket. Owned by the hub on success
+ * @param start height of first block to send. May be past the current tip
+ * @return 0 on success, -1 if the hub is full in which case the caller keeps the socket
+ */
+int subscribe_client(struct SubHub * phub, int sockfd, uint32_t start) {
+    uint32_t network_start = htonl(start);
+
+    //a slot is held while the confirmation is sent so a full hub is refused before it goes out
+    pthread_mutex_lock(&phub->lock);
+    if (phub->n_subs + phub->reserved == SUB_MAX_SUBSCRIBERS) {
+        pthread_mutex_unlock(&phub->lock);
+        fprintf(stderr, "Subscriptions: too many subscribers, refusing %d\n", sockfd);
+        return -1;
+    }
+    phub->reserved++;
+    pthread_mutex_unlock(&phub->lock);
+
+    //sent before the subscriber is visible to the publisher so it always leads the stream, and
+    //without the hub's lock so a slow client never holds up publishing
+    struct SubFrame ** queue = malloc(SUB_QUEUE_FRAMES * sizeof(struct SubFrame *));
+    int ret = -1;
+    if (queue == NULL) {
+        fprintf(stderr, "Subscriptions: failed to allocate memory for subscriber queue\n");
+    } else {
+        ret = send_buf(sockfd, &network_start, sizeof(network_start)) == -1 ? -1 : 0;
+    }
+
+    pthread_mutex_lock(&phub->lock);
+    phub->reserved--;
+    if (ret == 0) {
+        struct Subscriber * psub = &phub->subs[phub->n_subs];
+        memset(psub, 0, sizeof(*psub));
+        psub->queue = queue;
+        psub->fd = sockfd;
+        psub->next_height = start;
+        psub->last_progress = time(NULL);
+        phub->n_subs++;
+    }
+    pthread_mutex_unlock(&phub->lock);
+    if (ret != 0) {
+        free(queue);
+        return -1;
+    }
+
+    //backlog is read from the chain by the publisher
+    wake_publisher(phub);
+    printf("Subscriptions: %d subscribed from height %u\n", sockfd, start);
+    return 0;
+}
+
+/**
+ * Queue every block committed since the last call for the subscribers keeping up. Must be
+ * called with the chain lock held, once the blocks are durable
+ * @param phub hub to publish to
+ * @param pblock_chain chain of the node
+ * @param len committed length of the chain. Blocks past it are left for a later call
+ * @return void
+ */
+void publish_blocks(struct SubHub * phub, const struct BlockChain * pblock_chain, uint32_t len) {
+    int wake = 0;
+
+    pthread_mutex_lock(&phub->lock);
+    for (uint32_t height = phub->published; height < len; height++) {
+        struct SubFrame * pframe = NULL;
+        for (uint32_t i = 0; i < phub->n_subs; i++) {
+            struct Subscriber * psub = &phub->subs[i];
+            if (psub->fd == -1 || !psub->live || psub->next_height != height) {
+                //subscribers catching up or waiting on a later height are fed by the publisher
+                wake |= psub->fd != -1 && !psub->live && psub->next_height <= height;
+                continue;
+            }
+            //serialised once for all subscribers
+            if (pframe == NULL) {
+                pframe = build_frame(pblock_chain, &get_link(pblock_chain, height)->block, &phub->cold);
+                if (pframe == NULL) {
+                    //left behind at this height. Catching up retries the block from the chain
+                    psub->live = 0;
+                    wake = 1;
+                    continue;
+                }
+                phub->frames++;
+            }
+            if (queue_frame(psub, pframe) == 0) {
+                psub->next_height++;
+            } else {
+                psub->live = 0;
+                phub->overflows++;
+            }
+            wake = 1;
+        }
+        //no subscriber was keeping up. Stragglers catch up from the chain
+        if (pframe != NULL && pframe->refs == 0) {
+            free(pframe);
+        }
+    }
+    //reactors commit concurrently so an earlier commit may publish after a later one
+    if (len > phub->published) {
+        phub->published = len;
+    }
+    //one wakeup covers every publish until the publisher next runs
+    wake = wake && !phub->wake_pending;
+    if (wake) {
+        phub->wake_pending = 1;
+    }
+    pthread_mutex_unlock(&phub->lock);
+
+    if (wake) {
+        wake_publisher(phub);
+    }
+}
+
+/**
+ * Publisher thread. Waits for subscribers to become writable or for new frames, reads the
+ * backlog of subscribers catching up from the chain and writes out queued frames
+ * @param arg SubHub
+ * @return NULL
+ */
+static void * publish_thread(void * arg) {
+    struct SubHub * phub = arg;
+    struct pollfd * pfds = malloc((SUB_MAX_SUBSCRIBERS + 1) * sizeof(struct pollfd));
+    int timeout = SUB_POLL_MS;
+
+    if (pfds == NULL) {
+        fprintf(stderr, "Subscriptions: failed to allocate memory for poll set\n");
+        return NULL;
+    }
+
+    while (phub->running) {
+        //subscribers only ever leave on this thread so indexes stay valid until compacted
+        pthread_mutex_lock(&phub->lock);
+        uint32_t n_subs = phub->n_subs;
+        pfds[0].fd = phub->wake_fd;
+        pfds[0].events = POLLIN;
+        for (uint32_t i = 0; i < n_subs; i++) {
+            pfds[i + 1].fd = phub->subs[i].fd;
+            pfds[i + 1].events = POLLIN | (phub->subs[i].count > 0 ? POLLOUT : 0);
+        }
+        pthread_mutex_unlock(&phub->lock);
+
+        if (poll(pfds, n_subs + 1, timeout) == -1 && errno != EINTR) {
+            perror("Subscriptions: poll");
+        }
+        uint64_t wakeups;
+        if (pfds[0].revents & POLLIN && read(phub->wake_fd, &wakeups, sizeof(wakeups)) == -1) {
+            perror("Subscriptions: read eventfd");
+        }
+
+        //subscriptions are one way. Input means the client closed or broke protocol
+        pthread_mutex_lock(&phub->lock);
+        phub->wake_pending = 0;
+        for (uint32_t i = 0; i < n_subs; i++) {
+            if (pfds[i + 1].revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL)) {
+                printf("Subscriptions: %d unsubscribed at height %u\n", phub->subs[i].fd,
+                        phub->subs[i].next_height);
+                drop_subscriber(&phub->subs[i]);
+            }
+        }
+        compact_subscribers(phub);
+        pthread_mutex_unlock(&phub->lock);
+
+        catch_up(phub);
+
+        time_t now = time(NULL);
+        timeout = SUB_POLL_MS;
+        pthread_mutex_lock(&phub->lock);
+        for (uint32_t i = 0; i < phub->n_subs; i++) {
+            struct Subscriber * psub = &phub->subs[i];
+            if (flush_subscriber(psub) != 0) {
+                drop_subscriber(psub);
+                phub->dropped++;
+            } else if (psub->count == 0) {
+                psub->last_progress = now;
+            } else if (now - psub->last_progress > SUB_STALL_S) {
+                fprintf(stderr, "Subscriptions: %d stalled at height %u, dropping\n", psub->fd,
+                        psub->next_height - psub->count);
+                drop_subscriber(psub);
+                phub->dropped++;
+            }
+            //a drained queue waits on nothing, so keep going while backlog remains to be read
+            if (psub->fd != -1 && !psub->live && psub->count < SUB_QUEUE_FRAMES &&
+                    psub->next_height < phub->published) {
+                timeout = 0;
+            }
+        }
+        compact_subscribers(phub);
+        pthread_mutex_unlock(&phub->lock);
+    }
+
+    free(pfds);
+    return NULL;
+}
+
+/**
+ * Queue backlog from the chain for every subscriber not taking live frames while it has
+ * room. A subscriber that reaches the last published block goes live, which is decided under
+ * the hub's lock so no block published in between is missed
+ * @param phub hub whose subscribers to feed
+ * @return void
+ */
+static void catch_up(struct SubHub * phub) {
+    const struct BlockChain * pblock_chain = phub->pctx->pblock_chain;
+    int catching_up = 0;
+
+    //most wakeups only have live frames to write. Leave the chain lock to appenders then
+    pthread_mutex_lock(&phub->lock);
+    for (uint32_t i = 0; i < phub->n_subs && !catching_up; i++) {
+        catching_up = !phub->subs[i].live;
+    }
+    pthread_mutex_unlock(&phub->lock);
+    if (!catching_up) {
+        return;
+    }
+
+    lock_chain_shared(phub->pctx);
+    pthread_mutex_lock(&phub->lock);
+    for (uint32_t i = 0; i < phub->n_subs; i++) {
+        struct Subscriber * psub = &phub->subs[i];
+        if (psub->live || psub->fd == -1) {
+            continue;
+        }
+        //blocks not yet committed are only sent once published
+        for (unsigned n = 0; n < SUB_CATCHUP_BLOCKS && psub->next_height < phub->published; n++) {
+            struct SubFrame * pframe = build_frame(pblock_chain,
+                    &get_link(pblock_chain, psub->next_height)->block, &phub->cold);
+            //a block that cannot be sent would hold the subscriber at this height for good
+            if (pframe == NULL) {
+                fprintf(stderr, "Subscriptions: %d cannot be sent block %u, dropping\n", psub->fd,
+                        psub->next_height);
+                drop_subscriber(psub);
+                phub->dropped++;
+                break;
+            }
+            if (queue_frame(psub, pframe) != 0) {
+                free(pframe);
+                break;
+            }
+            psub->next_height++;
+        }
+        if (psub->next_height == phub->published) {
+            psub->live = 1;
+        }
+    }
+    pthread_mutex_unlock(&phub->lock);
+    unlock_chain(phub->pctx);
+}
+
+/**
+ * Write as many queued frames as the subscriber's socket accepts without blocking
+ * @param psub subscriber to write to
+ * @return 0 on success including a full socket, -1 if the subscriber failed
+ */
+static int flush_subscriber(struct Subscriber * psub) {
+    while (psub->count > 0) {
+        struct iovec iov[SUB_MAX_IOV];
+        struct msghdr msg;
+        int n_iov = 0;
+
+        for (uint32_t i = 0; i < psub->count && n_iov < SUB_MAX_IOV; i++) {
+            struct SubFrame * pframe = psub->queue[(psub->head + i) % SUB_QUEUE_FRAMES];
+            size_t skip = i == 0 ? psub->sent : 0;
+            iov[n_iov].iov_base = pframe->data + skip;
+            iov[n_iov].iov_len = pframe->len - skip;
+            n_iov++;
+        }
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n_iov;
+
+        ssize_t n = sendmsg(psub->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n == -1) {
+            perror("Subscriptions: sendmsg");
+            return -1;
+        }
+
+        //release fully sent frames
+        psub->last_progress = time(NULL);
+        while (n > 0) {
+            struct SubFrame * pframe = psub->queue[psub->head];
+            size_t left = pframe->len - psub->sent;
+            if ((size_t)n < left) {
+                psub->sent += n;
+                break;
+            }
+            n -= left;
+            psub->sent = 0;
+            psub->queued_bytes -= pframe->len;
+            psub->head = (psub->head + 1) % SUB_QUEUE_FRAMES;
+            psub->count--;
+            release_frame(pframe);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Add a frame to a subscriber's queue unless it is full
+ * @param psub subscriber to queue for
+ * @param pframe frame to queue. Referenced by the subscriber on success
+ * @return 0 on success, -1 if the queue is full
+ */
+static int queue_frame(struct Subscriber * psub, struct SubFrame * pframe) {
+    if (psub->count == SUB_QUEUE_FRAMES ||
+            (psub->count > 0 && psub->queued_bytes + pframe->len > SUB_QUEUE_BYTES)) {
+        return -1;
+    }
+    psub->queue[(psub->head + psub->count) % SUB_QUEUE_FRAMES] = pframe;
+    psub->count++;
+    psub->queued_bytes += pframe->len;
+    pframe->refs++;
+    return 0;
+}
+
+/**
+ * Serialise a block in the same format as every other endpoint sends blocks. Payloads in
+ * cold storage are read back so subscribers get the full block
+ * @param pblock_chain chain block belongs to
+ * @param pblock block to serialise
+ * @param pcold scratch for payloads read from cold storage
+ * @return frame with no references or NULL on failure
+ */
+static struct SubFrame * build_frame(const struct BlockChain * pblock_chain, const struct Block * pblock,
+        struct PayloadBuf * pcold) {
+    struct Block block = *pblock;
+
+    if (block.payload == NULL) {
+        block.payload = (char *)view_payload(pblock_chain, &block, pcold);
+    }
+    size_t payload_len = block.payload != NULL ? block.payload_len : 0;
+    struct SubFrame * pframe = malloc(sizeof(struct SubFrame) + BLOCK_WIRE_HEADER_SZ + payload_len);
+    if (pframe == NULL) {
+        fprintf(stderr, "Subscriptions: failed to allocate memory for frame\n");
+        return NULL;
+    }
+    pframe->refs = 0;
+    pframe->len = BLOCK_WIRE_HEADER_SZ + payload_len;
+    pack_block_header(&block, pframe->data);
+    if (payload_len > 0) {
+        memcpy(pframe->data + BLOCK_WIRE_HEADER_SZ, block.payload, payload_len);
+    }
+    return pframe;
+}
+
+/**
+ * Drop a subscriber's reference to a frame, freeing it once unreferenced
+ * @param pframe frame to release
+ * @return void
+ */
+static void release_frame(struct SubFrame * pframe) {
+    if (--pframe->refs == 0) {
+        free(pframe);
+    }
+}
+
+/**
+ * Close a subscriber and release its queued frames. Its slot is reclaimed by
+ * compact_subscribers. Caller holds the hub's lock
+ * @param psub subscriber to drop
+ * @return void
+ */
+static void drop_subscriber(struct Subscriber * psub) {
+    if (psub->fd == -1) {
+        return;
+    }
+    while (psub->count > 0) {
+        release_frame(psub->queue[psub->head]);
+        psub->head = (psub->head + 1) % SUB_QUEUE_FRAMES;
+        psub->count--;
+    }
+    free(psub->queue);
+    psub->queue = NULL;
+    close(psub->fd);
+    psub->fd = -1;
+}
+
+/**
+ * Reclaim slots of dropped subscribers. Caller holds the hub's lock
+ * @param phub hub to compact
+ * @return void
+ */
+static void compact_subscribers(struct SubHub * phub) {
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < phub->n_subs; i++) {
+        if (phub->subs[i].fd != -1) {
+            phub->subs[kept++] = phub->subs[i];
+        }
+    }
+    phub->n_subs = kept;
+}
+
+/**
+ * Wake the publisher thread from its poll
+ * @param phub hub whose publisher to wake
+ * @return void
+ */
+static void wake_publisher(struct SubHub * phub) {
+    uint64_t one = 1;
+    if (write(phub->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        perror("Subscriptions: write eventfd");
+    }
+}
@@ -0,0 +1,70 @@
+/**
+ * Simple program to sync a chain headers-first from one or more
+ * running nodes and report how quickly it was fetched
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "block.h"
+#include "server.h"
+#include "chain_sync.h"
+#include "archive.h"
+
+#define SYNC_USAGE "usage: sync [-c conns_per_peer] [-o archive] host:port|unix:path ...\n"
+
+//Sync chain from every peer given and print a summary
+int main(int argc, char * argv[]) {
+    struct SyncStats stats;
+    struct timespec start, end;
+    const char * archive_path = NULL;
+    unsigned conns_per_peer = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:o:")) != -1) {
+        switch (opt) {
+            case 'c':
+                conns_per_peer = strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                archive_path = optarg;
+                break;
+            default:
+                fprintf(stderr, SYNC_USAGE);
+                return 1;
+        }
+    }
+    if (optind == argc || conns_per_peer == 0) {
+        fprintf(stderr, SYNC_USAGE);
+        return 1;
+    }
+
+    struct BlockChain block_chain = initialise_chain();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int ret = sync_chain(&block_chain, argv + optind, argc - optind, conns_per_peer, &stats);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    //failed
+    if (ret == -1) {
+        deinitialise_chain(&block_chain);
+        return 3;
+    }
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("Sync: %u blocks (%u without payload) from %d peers over %u connections\n",
+            stats.blocks, stats.pruned, argc - optind, stats.workers);
+    printf("Sync: tip hash %u, %u ranges retried\n",
+            block_chain.tail != NULL ? block_chain.tail->block.hash : 0, stats.retries);
+    printf("Sync: %.3f ms, %.1f MB/s of payload\n", elapsed * 1e3,
+            elapsed > 0 ? stats.payload_bytes / elapsed / 1e6 : 0.0);
+
+    if (archive_path != NULL && write_archive(&block_chain, archive_path) != 0) {
+        deinitialise_chain(&block_chain);
+        return 4;
+    }
+
+    deinitialise_chain(&block_chain);
+    return 0;
+}
@@ -0,0 +1,98 @@
+/**
+ * Sparse time index over block heights. Keeps one timestamp per stride of
+ * blocks so locating the start of a time window is a binary search over a
+ * small array followed by a short scan of links.
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "time_index.h"
+
+#define TIME_INDEX_INITIAL_CAP 256 //initial number of index entries
+
+/**
+ * Create empty index
+ * @param pindex index to initialise
+ * @return 0 on success, -1 on failure
+ */
+int initialise_time_index(struct TimeIndex * pindex) {
+    pindex->stamps = malloc(TIME_INDEX_INITIAL_CAP * sizeof(uint64_t));
+    if (pindex->stamps == NULL) {
+        fprintf(stderr, "TimeIndex: failed to allocate memory for index\n");
+        return -1;
+    }
+    pindex->cap = TIME_INDEX_INITIAL_CAP;
+    pindex->len = 0;
+    pindex->indexed = 0;
+    return 0;
+}
+
+/**
+ * Free memory held by index
+ * @param pindex index to deinitialise
+ * @return void
+ */
+void deinitialise_time_index(struct TimeIndex * pindex) {
+    free(pindex->stamps);
+    pindex->stamps = NULL;
+    pindex->cap = pindex->len = pindex->indexed = 0;
+}
+
+/**
+ * Index every block appended to the chain since the last update. Only one block per
+ * stride is visited so it is cheap to call after each append
+ * @param pindex index to update
+ * @param pblock_chain chain being indexed
+ * @return 0 on success, -1 on failure
+ */
+int time_index_update(struct TimeIndex * pindex, const struct BlockChain * pblock_chain) {
+    while ((uint64_t)pindex->len * TIME_INDEX_STRIDE < pblock_chain->len) {
+        if (pindex->len == pindex->cap) {
+            uint64_t * stamps = realloc(pindex->stamps, (size_t)pindex->cap * 2 * sizeof(uint64_t));
+            if (stamps == NULL) {
+                fprintf(stderr, "TimeIndex: failed to allocate memory for index\n");
+                return -1;
+            }
+            pindex->stamps = stamps;
+            pindex->cap *= 2;
+        }
+        uint32_t height = pindex->len * TIME_INDEX_STRIDE;
+        pindex->stamps[pindex->len++] = get_link(pblock_chain, height)->block.timestamp;
+    }
+    pindex->indexed = pblock_chain->len;
+    return 0;
+}
+
+/**
+ * Find the first block at or after a time
+ * @param pindex up to date index of chain
+ * @param pblock_chain chain the index was built over
+ * @param timestamp milliseconds since the Unix epoch
+ * @return height of first block whose timestamp is at least timestamp, or the indexed
+ * length if every block is older
+ */
+uint32_t time_index_find(const struct TimeIndex * pindex, const struct BlockChain * pblock_chain,
+        uint64_t timestamp) {
+    //first entry at or after timestamp. The answer lies in the stride before it
+    uint32_t lo = 0, hi = pindex->len;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (pindex->stamps[mid] < timestamp) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return 0;
+    }
+
+    uint32_t height = (lo - 1) * TIME_INDEX_STRIDE + 1;
+    uint32_t end = lo < pindex->len ? lo * TIME_INDEX_STRIDE : pindex->indexed;
+    while (height < end && get_link(pblock_chain, height)->block.timestamp < timestamp) {
+        height++;
+    }
+    return height;
+}
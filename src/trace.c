@@ -0,0 +1,318 @@
+/**
+ * Per-request span recorder. While running, each request a node serves is timed
+ * from pickup until its endpoint returns, broken down into the receive, send, pack
+ * and hash stages the hot paths report, and written to a fixed size ring of the
+ * most recent spans. Writers never block: each claims a slot with an atomic
+ * increment and publishes it with a sequence number readers check
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <endian.h>
+
+#include "trace.h"
+
+#define TRACE_MAX_ENDPOINTS 256 //endpoint ids a summary is broken down by
+
+//Slot of the ring. seq is 0 while empty or being written, otherwise 1 + index of its span
+struct TraceSlot {
+    uint64_t seq;
+    struct TraceSpan span;
+};
+
+//Ring of the most recent spans. slots is NULL while the recorder is stopped
+struct TraceRing {
+    struct TraceSlot * slots;
+    uint32_t mask; //number of slots less one. Slots are a power of 2
+    uint64_t head; //index of next span written
+};
+
+__thread struct TraceSpan * trace_current = NULL;
+static struct TraceRing trace_ring = {NULL, 0, 0};
+
+//Internal functions
+static uint64_t now_ns(void);
+static int compare_spans(const void * a, const void * b);
+
+/**
+ * Start recording spans of requests served from now on
+ * @param n_spans spans kept. Rounded up to a power of 2, at most TRACE_MAX_SPANS
+ * @return 0 on success, -1 on failure
+ */
+int start_tracing(uint32_t n_spans) {
+    uint32_t cap = 1;
+
+    if (n_spans == 0 || n_spans > TRACE_MAX_SPANS) {
+        fprintf(stderr, "Trace: spans kept must be 1 to %d\n", TRACE_MAX_SPANS);
+        return -1;
+    }
+    while (cap < n_spans) {
+        cap <<= 1;
+    }
+    struct TraceSlot * slots = calloc(cap, sizeof(struct TraceSlot));
+    if (slots == NULL) {
+        fprintf(stderr, "Trace: failed to allocate memory for %u spans\n", cap);
+        return -1;
+    }
+    trace_ring.mask = cap - 1;
+    trace_ring.head = 0;
+    __atomic_store_n(&trace_ring.slots, slots, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * Stop recording and free the ring. No request may be being served
+ * @return void
+ */
+void stop_tracing(void) {
+    struct TraceSlot * slots = trace_ring.slots;
+    __atomic_store_n(&trace_ring.slots, NULL, __ATOMIC_RELEASE);
+    free(slots);
+}
+
+/**
+ * Start a span for a request about to be served by the calling thread. Nothing is
+ * recorded while the recorder is stopped
+ * @param pspan span to fill, typically on the caller's stack
+ * @param sockfd client being served
+ * @return void
+ */
+void trace_begin_span(struct TraceSpan * pspan, int sockfd) {
+    if (__atomic_load_n(&trace_ring.slots, __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+    memset(pspan, 0, sizeof(*pspan));
+    pspan->sockfd = sockfd;
+    pspan->start_ns = now_ns();
+    trace_current = pspan;
+}
+
+/**
+ * Finish the calling thread's span and write it to the ring
+ * @param pspan span passed to trace_begin_span
+ * @param endpoint endpoint the request was for
+ * @param result result the endpoint returned
+ * @return void
+ */
+void trace_end_span(struct TraceSpan * pspan, uint8_t endpoint, int result) {
+    struct TraceSlot * slots = __atomic_load_n(&trace_ring.slots, __ATOMIC_ACQUIRE);
+    if (trace_current != pspan) {
+        return;
+    }
+    trace_current = NULL;
+    if (slots == NULL) {
+        return;
+    }
+    pspan->total_ns = now_ns() - pspan->start_ns;
+    pspan->endpoint = endpoint;
+    pspan->result = (int8_t)result;
+
+    uint64_t index = __atomic_fetch_add(&trace_ring.head, 1, __ATOMIC_RELAXED);
+    struct TraceSlot * pslot = &slots[index & trace_ring.mask];
+    __atomic_store_n(&pslot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    pslot->span = *pspan;
+    __atomic_store_n(&pslot->seq, index + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Abandon the calling thread's span without recording it, as for a client that
+ * closed rather than sending a request
+ * @param pspan span passed to trace_begin_span
+ * @return void
+ */
+void trace_drop_span(struct TraceSpan * pspan) {
+    if (trace_current == pspan) {
+        trace_current = NULL;
+    }
+}
+
+/**
+ * Number of spans the ring keeps
+ * @return spans kept, 0 while the recorder is stopped
+ */
+uint32_t trace_capacity(void) {
+    if (__atomic_load_n(&trace_ring.slots, __ATOMIC_ACQUIRE) == NULL) {
+        return 0;
+    }
+    return trace_ring.mask + 1;
+}
+
+/**
+ * Copy the most recent spans out of the ring, oldest first. Slots being written as
+ * they are read are skipped
+ * @param spans filled with spans
+ * @param max room in spans
+ * @return number of spans copied. 0 while the recorder is stopped
+ */
+uint32_t trace_snapshot(struct TraceSpan * spans, uint32_t max) {
+    struct TraceSlot * slots = __atomic_load_n(&trace_ring.slots, __ATOMIC_ACQUIRE);
+    if (slots == NULL) {
+        return 0;
+    }
+    uint64_t head = __atomic_load_n(&trace_ring.head, __ATOMIC_ACQUIRE);
+    uint64_t n_slots = (uint64_t)trace_ring.mask + 1;
+    uint64_t first = head > n_slots ? head - n_slots : 0;
+    if (head - first > max) {
+        first = head - max;
+    }
+
+    uint32_t n_spans = 0;
+    for (uint64_t index = first; index < head; index++) {
+        struct TraceSlot * pslot = &slots[index & trace_ring.mask];
+        uint64_t seq = __atomic_load_n(&pslot->seq, __ATOMIC_ACQUIRE);
+        spans[n_spans] = pslot->span;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (seq == index + 1 && __atomic_load_n(&pslot->seq, __ATOMIC_RELAXED) == seq) {
+            n_spans++;
+        }
+    }
+    return n_spans;
+}
+
+/**
+ * Write every span in the ring and a summary of them
+ * @param out stream to write to
+ * @return void
+ */
+void dump_trace(FILE * out) {
+    uint32_t cap = trace_capacity();
+    struct TraceSpan * spans = malloc(((size_t)cap + 1) * sizeof(struct TraceSpan));
+    if (spans == NULL) {
+        fprintf(stderr, "Trace: failed to allocate memory for dump\n");
+        return;
+    }
+    uint32_t n_spans = trace_snapshot(spans, cap);
+    fprintf(out, "Trace: %u spans\n", n_spans);
+    for (uint32_t i = 0; i < n_spans; i++) {
+        print_trace_span(out, &spans[i]);
+    }
+    print_trace_summary(out, spans, n_spans);
+    fflush(out);
+    free(spans);
+}
+
+/**
+ * Summarise spans per endpoint: latency percentiles and, for the slowest 1% of requests,
+ * the share of their time spent in each stage so tail latency can be put down to one
+ * @param out stream to write to
+ * @param spans spans to summarise
+ * @param n_spans number of spans
+ * @return void
+ */
+void print_trace_summary(FILE * out, const struct TraceSpan * spans, uint32_t n_spans) {
+    static const char * STAGE_NAMES[TRACE_N_STAGES] = {"recv", "send", "pack", "hash"};
+    const struct TraceSpan ** sorted = malloc(((size_t)n_spans + 1) * sizeof(struct TraceSpan *));
+    if (sorted == NULL) {
+        fprintf(stderr, "Trace: failed to allocate memory for summary\n");
+        return;
+    }
+
+    for (unsigned endpoint = 0; endpoint < TRACE_MAX_ENDPOINTS; endpoint++) {
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < n_spans; i++) {
+            if (spans[i].endpoint == endpoint) {
+                sorted[n++] = &spans[i];
+            }
+        }
+        if (n == 0) {
+            continue;
+        }
+        qsort(sorted, n, sizeof(*sorted), compare_spans);
+        uint32_t p99 = (n * 99 + 99) / 100 - 1;
+        fprintf(out, "Trace: endpoint %u: %u requests, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+                endpoint, n, sorted[(n + 1) / 2 - 1]->total_ns / 1e3, sorted[p99]->total_ns / 1e3,
+                sorted[n - 1]->total_ns / 1e3);
+
+        //requests at or beyond p99 make up the tail
+        uint64_t total = 0, stages[TRACE_N_STAGES] = {0};
+        for (uint32_t i = p99; i < n; i++) {
+            total += sorted[i]->total_ns;
+            for (int s = 0; s < TRACE_N_STAGES; s++) {
+                stages[s] += sorted[i]->stage_ns[s];
+            }
+        }
+        uint64_t staged = 0;
+        fprintf(out, "Trace:   tail of %u:", n - p99);
+        for (int s = 0; s < TRACE_N_STAGES; s++) {
+            staged += stages[s];
+            fprintf(out, " %s %.1f%%", STAGE_NAMES[s], total > 0 ? 100.0 * stages[s] / total : 0);
+        }
+        fprintf(out, " endpoint %.1f%%\n", total > 0 && total > staged ? 100.0 * (total - staged) / total : 0);
+    }
+    free(sorted);
+}
+
+/**
+ * Write one span on a line
+ * @param out stream to write to
+ * @param pspan span to write
+ * @return void
+ */
+void print_trace_span(FILE * out, const struct TraceSpan * pspan) {
+    fprintf(out, "Trace: at %.6f s fd %d endpoint %u result %d total %.1f us recv %.1f send %.1f "
+            "pack %.1f hash %.1f us, %llu bytes in, %llu out\n", pspan->start_ns / 1e9,
+            pspan->sockfd, pspan->endpoint, pspan->result, pspan->total_ns / 1e3,
+            pspan->stage_ns[TRACE_RECV] / 1e3, pspan->stage_ns[TRACE_SEND] / 1e3,
+            pspan->stage_ns[TRACE_PACK] / 1e3, pspan->stage_ns[TRACE_HASH] / 1e3,
+            (unsigned long long)pspan->bytes_in, (unsigned long long)pspan->bytes_out);
+}
+
+/**
+ * Pack a span in network order for the trace endpoint
+ * @param pspan span to pack
+ * @param buf buffer of at least TRACE_SPAN_WIRE_SZ bytes
+ * @return void
+ */
+void pack_trace_span(const struct TraceSpan * pspan, uint8_t * buf) {
+    uint64_t fields[8] = {pspan->start_ns, pspan->total_ns, pspan->stage_ns[0], pspan->stage_ns[1],
+        pspan->stage_ns[2], pspan->stage_ns[3], pspan->bytes_in, pspan->bytes_out};
+    for (int i = 0; i < 8; i++) {
+        uint64_t network_u64 = htobe64(fields[i]);
+        memcpy(buf, &network_u64, sizeof(uint64_t)); buf += sizeof(uint64_t);
+    }
+    uint32_t network_u32 = htonl((uint32_t)pspan->sockfd);
+    memcpy(buf, &network_u32, sizeof(uint32_t)); buf += sizeof(uint32_t);
+    buf[0] = pspan->endpoint;
+    buf[1] = (uint8_t)pspan->result;
+    buf[2] = buf[3] = 0;
+}
+
+/**
+ * Unpack a span packed by pack_trace_span
+ * @param buf TRACE_SPAN_WIRE_SZ bytes
+ * @param pspan set to span
+ * @return void
+ */
+void unpack_trace_span(const uint8_t * buf, struct TraceSpan * pspan) {
+    uint64_t fields[8];
+    for (int i = 0; i < 8; i++) {
+        uint64_t network_u64;
+        memcpy(&network_u64, buf, sizeof(uint64_t)); buf += sizeof(uint64_t);
+        fields[i] = be64toh(network_u64);
+    }
+    pspan->start_ns = fields[0];
+    pspan->total_ns = fields[1];
+    memcpy(pspan->stage_ns, fields + 2, sizeof(pspan->stage_ns));
+    pspan->bytes_in = fields[6];
+    pspan->bytes_out = fields[7];
+    uint32_t network_u32;
+    memcpy(&network_u32, buf, sizeof(uint32_t)); buf += sizeof(uint32_t);
+    pspan->sockfd = (int32_t)ntohl(network_u32);
+    pspan->endpoint = buf[0];
+    pspan->result = (int8_t)buf[1];
+}
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int compare_spans(const void * a, const void * b) {
+    uint64_t x = (*(const struct TraceSpan * const *)a)->total_ns;
+    uint64_t y = (*(const struct TraceSpan * const *)b)->total_ns;
+    return (x > y) - (x < y);
+}
@@ -0,0 +1,354 @@
+/**
+ * Minimal io_uring backend for the node's network I/O. Talks to the kernel
+ * directly through the io_uring syscalls so the node stays free of external
+ * dependencies. Provides multishot accepts and socket receives and sends whose
+ * completions are harvested in batches, so one syscall submits and completes the
+ * I/O of every connection
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+
+#include "uring.h"
+
+//Internal functions
+static struct io_uring_sqe * get_sqe(struct UringData * puring);
+static int probe_ops(int ring_fd);
+static int uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete,
+        unsigned flags, void * arg, size_t arg_sz);
+
+/**
+ * Create an io_uring instance and map its submission and completion rings.
+ * @param puring uring struct to populate
+ * @param entries number of submission queue entries to request
+ * @return 0 on success, -1 on failure (eg. kernel without io_uring support)
+ */
+int initialise_uring(struct UringData * puring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(puring, 0, sizeof(*puring));
+
+    //Avoid interrupting the node's blocking socket calls to run completions
+    params.flags = IORING_SETUP_COOP_TASKRUN;
+    puring->ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (puring->ring_fd == -1 && errno == EINVAL) {
+        //Older kernel without cooperative task running
+        memset(&params, 0, sizeof(params));
+        puring->ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (puring->ring_fd == -1) {
+        perror("Uring: io_uring_setup");
+        return -1;
+    }
+
+    //Need timeout support on io_uring_enter so the node loop can check for shutdown
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        fprintf(stderr, "Uring: kernel lacks IORING_FEAT_EXT_ARG\n");
+        close(puring->ring_fd);
+        puring->ring_fd = -1;
+        return -1;
+    }
+    if (probe_ops(puring->ring_fd) != 0) {
+        close(puring->ring_fd);
+        puring->ring_fd = -1;
+        return -1;
+    }
+
+    puring->sq_ring_sz = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    puring->cq_ring_sz = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    //Newer kernels map both rings with a single mmap
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (puring->cq_ring_sz > puring->sq_ring_sz) {
+            puring->sq_ring_sz = puring->cq_ring_sz;
+        }
+        puring->cq_ring_sz = puring->sq_ring_sz;
+    }
+
+    puring->sq_ring_ptr = mmap(NULL, puring->sq_ring_sz, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, puring->ring_fd, IORING_OFF_SQ_RING);
+    if (puring->sq_ring_ptr == MAP_FAILED) {
+        perror("Uring: mmap sq ring");
+        close(puring->ring_fd);
+        puring->ring_fd = -1;
+        return -1;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        puring->cq_ring_ptr = puring->sq_ring_ptr;
+    } else {
+        puring->cq_ring_ptr = mmap(NULL, puring->cq_ring_sz, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, puring->ring_fd, IORING_OFF_CQ_RING);
+        if (puring->cq_ring_ptr == MAP_FAILED) {
+            perror("Uring: mmap cq ring");
+            munmap(puring->sq_ring_ptr, puring->sq_ring_sz);
+            close(puring->ring_fd);
+            puring->ring_fd = -1;
+            return -1;
+        }
+    }
+
+    puring->sqes_sz = params.sq_entries * sizeof(struct io_uring_sqe);
+    puring->sqes = mmap(NULL, puring->sqes_sz, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, puring->ring_fd, IORING_OFF_SQES);
+    if (puring->sqes == MAP_FAILED) {
+        perror("Uring: mmap sqes");
+        puring->sqes = NULL;
+        deinitialise_uring(puring);
+        return -1;
+    }
+
+    uint8_t * sq = puring->sq_ring_ptr;
+    puring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    puring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    puring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    puring->sq_array = (unsigned *)(sq + params.sq_off.array);
+
+    uint8_t * cq = puring->cq_ring_ptr;
+    puring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    puring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    puring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    puring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return 0;
+}
+
+/**
+ * Unmap rings and close the io_uring instance. Outstanding requests are cancelled by the kernel
+ * @param puring uring struct to deinit
+ * @return void
+ */
+void deinitialise_uring(struct UringData * puring) {
+    if (puring->sqes != NULL) {
+        munmap(puring->sqes, puring->sqes_sz);
+    }
+    if (puring->cq_ring_ptr != NULL && puring->cq_ring_ptr != puring->sq_ring_ptr) {
+        munmap(puring->cq_ring_ptr, puring->cq_ring_sz);
+    }
+    if (puring->sq_ring_ptr != NULL) {
+        munmap(puring->sq_ring_ptr, puring->sq_ring_sz);
+    }
+    if (puring->ring_fd != -1) {
+        close(puring->ring_fd);
+    }
+    memset(puring, 0, sizeof(*puring));
+    puring->ring_fd = -1;
+}
+
+/**
+ * Queue a multishot accept on a listening socket. Each accepted connection produces
+ * a completion whose result is the new sockfd
+ * @param puring uring to queue request on
+ * @param listenfd listening socket
+ * @return 0 on success, -1 on failure
+ */
+int uring_arm_accept(struct UringData * puring, int listenfd) {
+    struct io_uring_sqe * sqe = get_sqe(puring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = uring_user_data(URING_EVENT_ACCEPT, (uint32_t)listenfd);
+    return 0;
+}
+
+/**
+ * Queue a receive on a connected socket. Completes with the number of bytes received, which
+ * may be fewer than len, 0 once the peer has closed or a negative errno
+ * @param puring uring to queue request on
+ * @param fd socket to receive from
+ * @param buf buffer the kernel fills. Must stay valid until the request completes
+ * @param len most bytes to receive
+ * @param user_data returned with the completion
+ * @return 0 on success, -1 on failure
+ */
+int uring_arm_recv(struct UringData * puring, int fd, void * buf, size_t len, uint64_t user_data) {
+    struct io_uring_sqe * sqe = get_sqe(puring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+/**
+ * Queue a send on a connected socket. Completes with the number of bytes sent, which may be
+ * fewer than len, or a negative errno
+ * @param puring uring to queue request on
+ * @param fd socket to send on
+ * @param buf bytes to send. Must stay valid and unchanged until the request completes
+ * @param len number of bytes
+ * @param user_data returned with the completion
+ * @return 0 on success, -1 on failure
+ */
+int uring_arm_send(struct UringData * puring, int fd, const void * buf, size_t len, uint64_t user_data) {
+    struct io_uring_sqe * sqe = get_sqe(puring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = (uint32_t)len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+/**
+ * Cancel a pending request. The request still completes, with -ECANCELED unless it finished
+ * first, so anything it refers to must be kept until its completion arrives
+ * @param puring uring to queue request on
+ * @param user_data user_data of the request to cancel
+ * @return 0 on success, -1 on failure
+ */
+int uring_cancel(struct UringData * puring, uint64_t user_data) {
+    struct io_uring_sqe * sqe = get_sqe(puring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = uring_user_data(URING_EVENT_CANCEL, 0);
+    return 0;
+}
+
+/**
+ * Submit all queued requests and wait for at least one completion in a single syscall.
+ * @param puring uring to submit on
+ * @param timeout_ms maximum time to wait for a completion
+ * @return 0 on success (including timeout/interrupt), -1 on failure
+ */
+int uring_submit_and_wait(struct UringData * puring, unsigned timeout_ms) {
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+
+    int ret = uring_enter(puring->ring_fd, puring->pending, 1,
+            IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+
+    if (ret == -1) {
+        //timed out or interrupted by signal are not errors for the caller
+        if (errno == ETIME || errno == EINTR) {
+            return 0;
+        }
+        perror("Uring: io_uring_enter");
+        return -1;
+    }
+    puring->pending -= (unsigned)ret;
+    return 0;
+}
+
+/**
+ * Pop the next available completion from the completion queue.
+ * @param puring uring to read completion from
+ * @param pcqe completion to populate
+ * @return 1 if a completion was popped, 0 if the queue is empty
+ */
+int uring_next_completion(struct UringData * puring, struct io_uring_cqe * pcqe) {
+    unsigned head = *puring->cq_head;
+    unsigned tail = __atomic_load_n(puring->cq_tail, __ATOMIC_ACQUIRE);
+
+    if (head == tail) {
+        return 0;
+    }
+
+    *pcqe = puring->cqes[head & *puring->cq_mask];
+    __atomic_store_n(puring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * Reserve next free submission queue entry. Flushes queued entries to the
+ * kernel if the submission queue is full
+ * @param puring uring to take entry from
+ * @return zeroed sqe or NULL on failure
+ */
+static struct io_uring_sqe * get_sqe(struct UringData * puring) {
+    unsigned tail = *puring->sq_tail;
+    unsigned head = __atomic_load_n(puring->sq_head, __ATOMIC_ACQUIRE);
+
+    //full. Submit what we have to make room
+    if (tail - head > *puring->sq_mask) {
+        int ret = uring_enter(puring->ring_fd, puring->pending, 0, 0, NULL, 0);
+        if (ret == -1) {
+            perror("Uring: io_uring_enter");
+            return NULL;
+        }
+        puring->pending -= (unsigned)ret;
+        head = __atomic_load_n(puring->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head > *puring->sq_mask) {
+            fprintf(stderr, "Uring: submission queue full\n");
+            return NULL;
+        }
+    }
+
+    unsigned index = tail & *puring->sq_mask;
+    struct io_uring_sqe * sqe = &puring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    puring->sq_array[index] = index;
+    __atomic_store_n(puring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    puring->pending++;
+    return sqe;
+}
+
+/**
+ * Check the kernel supports every request the backend relies on. Multishot accept has no
+ * feature flag of its own, so the socket opcode, added in the same release, stands in for it.
+ * A kernel that still refuses a multishot request fails its first completion instead
+ * @param ring_fd io_uring instance to probe
+ * @return 0 if every request is supported, -1 otherwise
+ */
+static int probe_ops(int ring_fd) {
+    static const uint8_t required[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND,
+        IORING_OP_ASYNC_CANCEL, IORING_OP_SOCKET};
+    size_t probe_sz = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe * probe = calloc(1, probe_sz);
+
+    if (probe == NULL) {
+        fprintf(stderr, "Uring: failed to allocate memory for probe\n");
+        return -1;
+    }
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) != 0) {
+        perror("Uring: io_uring_register probe");
+        free(probe);
+        return -1;
+    }
+    for (size_t i = 0; i < sizeof(required); i++) {
+        if (required[i] > probe->last_op || !(probe->ops[required[i]].flags & IO_URING_OP_SUPPORTED)) {
+            fprintf(stderr, "Uring: kernel lacks opcode %d\n", required[i]);
+            free(probe);
+            return -1;
+        }
+    }
+    free(probe);
+    return 0;
+}
+
+/**
+ * Thin wrapper over io_uring_enter syscall
+ * @return number of sqes consumed or -1 on failure with errno set
+ */
+static int uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete,
+        unsigned flags, void * arg, size_t arg_sz) {
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+            flags, arg, arg_sz);
+}
@@ -0,0 +1,397 @@
+/**
+ * Ed25519 signed transactions. Payloads carry their signer's public key and a
+ * signature over the message they wrap. Malformed transactions are turned away by
+ * cheap checks before any signature work, and batches of well formed ones are
+ * verified by a pool of threads together with the threads handing the batches in
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "verify.h"
+
+//Order of the Ed25519 group, little endian. Signatures with S not below it are malleable
+static const uint8_t GROUP_ORDER[32] = {
+    0xed, 0xd3, 0xf5, 0x5c, 0x1a, 0x63, 0x12, 0x58, 0xd6, 0x9c, 0xf7, 0xa2, 0xde, 0xf9, 0xde, 0x14,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10
+};
+
+//Internal functions
+static void * verify_worker(void * arg);
+static int claim_chunk(struct Verifier * pverifier, struct VerifyBatch * pbatch, uint32_t * pstart,
+        uint32_t * pend);
+static void finish_chunk(struct Verifier * pverifier, struct VerifyBatch * pbatch, uint32_t start,
+        uint32_t end);
+static void count_results(struct Verifier * pverifier, const struct VerifyJob * jobs, uint32_t n_jobs);
+static int decode_hex(const char * hex, uint8_t * out, size_t len);
+static void encode_hex(const uint8_t * in, size_t len, char * hex);
+
+/**
+ * Start a pool of verification threads
+ * @param pverifier pool to start
+ * @param n_workers threads to start besides the callers of verify_batch. At most VERIFY_MAX_WORKERS
+ * @return 0 on success, -1 on failure
+ */
+int start_verifier(struct Verifier * pverifier, unsigned n_workers) {
+    if (n_workers > VERIFY_MAX_WORKERS) {
+        fprintf(stderr, "Verify: at most %d verification threads\n", VERIFY_MAX_WORKERS);
+        return -1;
+    }
+    pthread_mutex_init(&pverifier->lock, NULL);
+    pthread_cond_init(&pverifier->work, NULL);
+    pverifier->queue = NULL;
+    pverifier->running = 1;
+    pverifier->verified = pverifier->rejected = pverifier->batches = 0;
+
+    for (pverifier->n_workers = 0; pverifier->n_workers < n_workers; pverifier->n_workers++) {
+        if (pthread_create(&pverifier->threads[pverifier->n_workers], NULL, verify_worker,
+                    pverifier) != 0) {
+            fprintf(stderr, "Verify: failed to start verification thread\n");
+            stop_verifier(pverifier);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Stop a pool's threads and free it. No batch may be in progress
+ * @param pverifier pool to stop
+ * @return void
+ */
+void stop_verifier(struct Verifier * pverifier) {
+    pthread_mutex_lock(&pverifier->lock);
+    pverifier->running = 0;
+    pthread_cond_broadcast(&pverifier->work);
+    pthread_mutex_unlock(&pverifier->lock);
+    for (unsigned i = 0; i < pverifier->n_workers; i++) {
+        pthread_join(pverifier->threads[i], NULL);
+    }
+    pverifier->n_workers = 0;
+    pthread_cond_destroy(&pverifier->work);
+    pthread_mutex_destroy(&pverifier->lock);
+}
+
+/**
+ * Verify the signatures of a batch of parsed transactions, setting each job's valid flag.
+ * Batches too small to be worth waking the pool for are verified on the caller alone.
+ * Safe to call from several threads at once; their batches share the pool
+ * @param pverifier pool to verify with
+ * @param jobs transactions to verify
+ * @param n_jobs number of transactions
+ * @return void
+ */
+void verify_batch(struct Verifier * pverifier, struct VerifyJob * jobs, uint32_t n_jobs) {
+    struct VerifyBatch batch = {jobs, n_jobs, 0, 0, PTHREAD_COND_INITIALIZER, NULL};
+    uint32_t start, end;
+
+    if (n_jobs == 0) {
+        return;
+    }
+    //callers on different threads verify at the same time so each has its own context
+    EVP_MD_CTX * pmd_ctx = EVP_MD_CTX_new();
+    if (pmd_ctx == NULL && pverifier->n_workers == 0) {
+        fprintf(stderr, "Verify: failed to allocate digest context, refusing batch\n");
+        for (uint32_t i = 0; i < n_jobs; i++) {
+            jobs[i].valid = 0;
+        }
+        return;
+    }
+    if (pmd_ctx != NULL && (pverifier->n_workers == 0 || n_jobs <= VERIFY_CHUNK)) {
+        for (uint32_t i = 0; i < n_jobs; i++) {
+            jobs[i].valid = verify_transaction(pmd_ctx, &jobs[i].tx) == 0;
+        }
+        EVP_MD_CTX_free(pmd_ctx);
+        pthread_mutex_lock(&pverifier->lock);
+        count_results(pverifier, jobs, n_jobs);
+        pverifier->batches++;
+        pthread_mutex_unlock(&pverifier->lock);
+        return;
+    }
+
+    pthread_mutex_lock(&pverifier->lock);
+    struct VerifyBatch ** pplast = &pverifier->queue;
+    while (*pplast != NULL) {
+        pplast = &(*pplast)->pnext;
+    }
+    *pplast = &batch;
+    pthread_cond_broadcast(&pverifier->work);
+
+    //the caller only works on its own batch so it is never held up by another's
+    while (pmd_ctx != NULL && claim_chunk(pverifier, &batch, &start, &end) == 0) {
+        pthread_mutex_unlock(&pverifier->lock);
+        for (uint32_t i = start; i < end; i++) {
+            jobs[i].valid = verify_transaction(pmd_ctx, &jobs[i].tx) == 0;
+        }
+        pthread_mutex_lock(&pverifier->lock);
+        finish_chunk(pverifier, &batch, start, end);
+    }
+    while (batch.finished < batch.n_jobs) {
+        pthread_cond_wait(&batch.done, &pverifier->lock);
+    }
+    pverifier->batches++;
+    pthread_mutex_unlock(&pverifier->lock);
+    pthread_cond_destroy(&batch.done);
+    EVP_MD_CTX_free(pmd_ctx);
+}
+
+/**
+ * Parse a payload as a signed transaction. This is the fast reject path: anything
+ * malformed, including a non-canonical signature, is refused without touching the
+ * signature itself
+ * @param payload payload to parse
+ * @param len length of payload
+ * @param ptx set to the transaction. Its message points into payload
+ * @return 0 if payload is a well formed transaction, -1 if not
+ */
+int parse_transaction(const char * payload, uint32_t len, struct SignedTx * ptx) {
+    const char * key_hex = payload + TX_PREFIX_LEN;
+    const char * sig_hex = key_hex + 2 * TX_KEY_SZ + 1;
+
+    if (len < TX_HEADER_LEN || memcmp(payload, TX_PREFIX, TX_PREFIX_LEN) != 0 ||
+            key_hex[2 * TX_KEY_SZ] != ':' || sig_hex[2 * TX_SIG_SZ] != ':') {
+        return -1;
+    }
+    if (decode_hex(key_hex, ptx->public_key, TX_KEY_SZ) != 0 ||
+            decode_hex(sig_hex, ptx->signature, TX_SIG_SZ) != 0) {
+        return -1;
+    }
+
+    //S is the second half of the signature. Compared from its most significant byte
+    const uint8_t * s = ptx->signature + TX_SIG_SZ / 2;
+    int i = TX_SIG_SZ / 2 - 1;
+    while (i >= 0 && s[i] == GROUP_ORDER[i]) {
+        i--;
+    }
+    if (i < 0 || s[i] > GROUP_ORDER[i]) {
+        return -1;
+    }
+
+    ptx->message = payload + TX_HEADER_LEN;
+    ptx->message_len = len - TX_HEADER_LEN;
+    return 0;
+}
+
+/**
+ * Check a transaction's signature over its message
+ * @param pmd_ctx digest context of the calling thread. Reset before returning
+ * @param ptx parsed transaction
+ * @return 0 if the signature holds, -1 if not
+ */
+int verify_transaction(EVP_MD_CTX * pmd_ctx, const struct SignedTx * ptx) {
+    EVP_PKEY * pkey = EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, NULL, ptx->public_key, TX_KEY_SZ);
+    if (pkey == NULL) {
+        return -1;
+    }
+    int ret = EVP_DigestVerifyInit(pmd_ctx, NULL, NULL, NULL, pkey) == 1 &&
+        EVP_DigestVerify(pmd_ctx, ptx->signature, TX_SIG_SZ, (const unsigned char *)ptx->message,
+                ptx->message_len) == 1 ? 0 : -1;
+    EVP_MD_CTX_reset(pmd_ctx);
+    EVP_PKEY_free(pkey);
+    return ret;
+}
+
+/**
+ * Load an Ed25519 private key from its seed
+ * @param seed_hex 2 * TX_KEY_SZ hex digits
+ * @return key, or NULL if seed_hex is invalid. Free with EVP_PKEY_free
+ */
+EVP_PKEY * load_signing_key(const char * seed_hex) {
+    uint8_t seed[TX_KEY_SZ];
+
+    if (strlen(seed_hex) != 2 * TX_KEY_SZ || decode_hex(seed_hex, seed, TX_KEY_SZ) != 0) {
+        fprintf(stderr, "Verify: signing key must be %d hex digits\n", 2 * TX_KEY_SZ);
+        return NULL;
+    }
+    EVP_PKEY * pkey = EVP_PKEY_new_raw_private_key(EVP_PKEY_ED25519, NULL, seed, TX_KEY_SZ);
+    if (pkey == NULL) {
+        fprintf(stderr, "Verify: failed to load signing key\n");
+    }
+    return pkey;
+}
+
+/**
+ * Wrap a message in a transaction signed with a key
+ * @param pkey Ed25519 private key
+ * @param message message to sign
+ * @param message_len length of message
+ * @param plen set to length of the transaction excluding null char
+ * @return malloc'd null terminated transaction, or NULL on failure
+ */
+char * sign_transaction(EVP_PKEY * pkey, const char * message, size_t message_len, size_t * plen) {
+    uint8_t public_key[TX_KEY_SZ], signature[TX_SIG_SZ];
+    size_t key_len = sizeof(public_key), sig_len = sizeof(signature);
+
+    EVP_MD_CTX * pmd_ctx = EVP_MD_CTX_new();
+    if (pmd_ctx == NULL || EVP_PKEY_get_raw_public_key(pkey, public_key, &key_len) != 1 ||
+            EVP_DigestSignInit(pmd_ctx, NULL, NULL, NULL, pkey) != 1 ||
+            EVP_DigestSign(pmd_ctx, signature, &sig_len, (const unsigned char *)message,
+                message_len) != 1) {
+        fprintf(stderr, "Verify: failed to sign transaction\n");
+        EVP_MD_CTX_free(pmd_ctx);
+        return NULL;
+    }
+    EVP_MD_CTX_free(pmd_ctx);
+
+    char * tx = malloc(TX_HEADER_LEN + message_len + 1);
+    if (tx == NULL) {
+        fprintf(stderr, "Verify: failed to allocate memory for transaction\n");
+        return NULL;
+    }
+    char * out = tx;
+    memcpy(out, TX_PREFIX, TX_PREFIX_LEN); out += TX_PREFIX_LEN;
+    encode_hex(public_key, TX_KEY_SZ, out); out += 2 * TX_KEY_SZ;
+    *out++ = ':';
+    encode_hex(signature, TX_SIG_SZ, out); out += 2 * TX_SIG_SZ;
+    *out++ = ':';
+    memcpy(out, message, message_len);
+    out[message_len] = '\0';
+    *plen = TX_HEADER_LEN + message_len;
+    return tx;
+}
+
+/**
+ * Thread entry point of a pool worker. Sleeps until a batch is queued then claims chunks
+ * of the oldest queued batch until the queue is empty
+ * @param arg pool the worker belongs to
+ * @return NULL
+ */
+static void * verify_worker(void * arg) {
+    struct Verifier * pverifier = arg;
+    EVP_MD_CTX * pmd_ctx = EVP_MD_CTX_new();
+    uint32_t start, end;
+
+    if (pmd_ctx == NULL) {
+        fprintf(stderr, "Verify: failed to allocate digest context\n");
+        return NULL;
+    }
+    pthread_mutex_lock(&pverifier->lock);
+    for (;;) {
+        while (pverifier->running && pverifier->queue == NULL) {
+            pthread_cond_wait(&pverifier->work, &pverifier->lock);
+        }
+        if (!pverifier->running) {
+            break;
+        }
+        struct VerifyBatch * pbatch = pverifier->queue;
+        if (claim_chunk(pverifier, pbatch, &start, &end) != 0) {
+            continue;
+        }
+        pthread_mutex_unlock(&pverifier->lock);
+        for (uint32_t i = start; i < end; i++) {
+            pbatch->jobs[i].valid = verify_transaction(pmd_ctx, &pbatch->jobs[i].tx) == 0;
+        }
+        pthread_mutex_lock(&pverifier->lock);
+        finish_chunk(pverifier, pbatch, start, end);
+    }
+    pthread_mutex_unlock(&pverifier->lock);
+    EVP_MD_CTX_free(pmd_ctx);
+    return NULL;
+}
+
+/**
+ * Claim the next chunk of a batch. A batch leaves the queue once its last chunk is claimed.
+ * Caller holds the pool's lock
+ * @param pverifier pool the batch is queued on
+ * @param pbatch batch to claim from
+ * @param pstart set to first job of chunk
+ * @param pend set to one past last job of chunk
+ * @return 0 if a chunk was claimed, -1 if every job has already been claimed
+ */
+static int claim_chunk(struct Verifier * pverifier, struct VerifyBatch * pbatch, uint32_t * pstart,
+        uint32_t * pend) {
+    if (pbatch->next >= pbatch->n_jobs) {
+        return -1;
+    }
+    *pstart = pbatch->next;
+    *pend = pbatch->n_jobs - pbatch->next > VERIFY_CHUNK ? pbatch->next + VERIFY_CHUNK : pbatch->n_jobs;
+    pbatch->next = *pend;
+    if (pbatch->next == pbatch->n_jobs) {
+        struct VerifyBatch ** pp = &pverifier->queue;
+        while (*pp != pbatch) {
+            pp = &(*pp)->pnext;
+        }
+        *pp = pbatch->pnext;
+    }
+    return 0;
+}
+
+/**
+ * Count a verified chunk and wake the batch's caller once the batch is complete. Caller
+ * holds the pool's lock
+ * @param pverifier pool the batch was queued on
+ * @param pbatch batch the chunk belongs to. Not touched again once complete as its caller frees it
+ * @param start first job of chunk
+ * @param end one past last job of chunk
+ * @return void
+ */
+static void finish_chunk(struct Verifier * pverifier, struct VerifyBatch * pbatch, uint32_t start,
+        uint32_t end) {
+    count_results(pverifier, pbatch->jobs + start, end - start);
+    pbatch->finished += end - start;
+    if (pbatch->finished == pbatch->n_jobs) {
+        pthread_cond_signal(&pbatch->done);
+    }
+}
+
+/**
+ * Add verified jobs to the pool's counters. Caller holds the pool's lock
+ * @param pverifier pool to count in
+ * @param jobs verified jobs
+ * @param n_jobs number of jobs
+ * @return void
+ */
+static void count_results(struct Verifier * pverifier, const struct VerifyJob * jobs, uint32_t n_jobs) {
+    for (uint32_t i = 0; i < n_jobs; i++) {
+        if (jobs[i].valid) {
+            pverifier->verified++;
+        } else {
+            pverifier->rejected++;
+        }
+    }
+}
+
+/**
+ * Decode hex digits of either case
+ * @param hex 2 * len hex digits
+ * @param out set to decoded bytes
+ * @param len number of bytes to decode
+ * @return 0 on success, -1 on a character that is not a hex digit
+ */
+static int decode_hex(const char * hex, uint8_t * out, size_t len) {
+    for (size_t i = 0; i < 2 * len; i++) {
+        char c = hex[i];
+        uint8_t nibble;
+        if (c >= '0' && c <= '9') {
+            nibble = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            nibble = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            nibble = c - 'A' + 10;
+        } else {
+            return -1;
+        }
+        if (i % 2 == 0) {
+            out[i / 2] = nibble << 4;
+        } else {
+            out[i / 2] |= nibble;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Encode bytes as lower case hex digits. No null char is written
+ * @param in bytes to encode
+ * @param len number of bytes
+ * @param hex set to 2 * len hex digits
+ * @return void
+ */
+static void encode_hex(const uint8_t * in, size_t len, char * hex) {
+    static const char DIGITS[] = "0123456789abcdef";
+    for (size_t i = 0; i < len; i++) {
+        hex[2 * i] = DIGITS[in[i] >> 4];
+        hex[2 * i + 1] = DIGITS[in[i] & 0xf];
+    }
+}
@@ -0,0 +1,194 @@
+/**
+ * Simple program to benchmark transaction signature verification. Measures the fast
+ * reject path and batch verification on the caller alone and with growing pools,
+ * giving the verification rate per core that bounds a node's ingest rate
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include "verify.h"
+
+#define VERIFY_BENCH_USAGE "usage: verify_bench [-n transactions] [-s message_size] [-t max_threads] " \
+    "[-k keys]\n"
+
+//Internal functions
+static double elapsed_s(const struct timespec * pstart);
+static int run_batches(struct Verifier * pverifier, struct VerifyJob * jobs, uint32_t n_jobs);
+
+//Sign transactions with a few keys then time how fast they are rejected and verified
+int main(int argc, char * argv[]) {
+    uint32_t n_txs = 20000, message_size = 256, n_keys = 16;
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    long max_threads = n_cpus > 1 ? n_cpus - 1 : 0;
+    struct timespec start;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:t:k:")) != -1) {
+        switch (opt) {
+            case 'n':
+                n_txs = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                message_size = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                max_threads = strtol(optarg, NULL, 10);
+                break;
+            case 'k':
+                n_keys = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, VERIFY_BENCH_USAGE);
+                return 1;
+        }
+    }
+    if (argc != optind || n_txs == 0 || n_keys == 0 || max_threads < 0 ||
+            max_threads > VERIFY_MAX_WORKERS) {
+        fprintf(stderr, VERIFY_BENCH_USAGE);
+        return 1;
+    }
+
+    EVP_PKEY ** keys = calloc(n_keys, sizeof(EVP_PKEY *));
+    char ** txs = calloc(n_txs, sizeof(char *));
+    size_t * lens = calloc(n_txs, sizeof(size_t));
+    char * message = malloc((size_t)message_size + 1);
+    struct VerifyJob * jobs = calloc(n_txs, sizeof(struct VerifyJob));
+    if (keys == NULL || txs == NULL || lens == NULL || message == NULL || jobs == NULL) {
+        fprintf(stderr, "Verify bench: failed to allocate memory for %u transactions\n", n_txs);
+        return 2;
+    }
+    for (uint32_t i = 0; i < n_keys; i++) {
+        keys[i] = EVP_PKEY_Q_keygen(NULL, NULL, "ED25519");
+        if (keys[i] == NULL) {
+            fprintf(stderr, "Verify bench: failed to generate key\n");
+            return 2;
+        }
+    }
+
+    srand(1);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint32_t i = 0; i < n_txs; i++) {
+        for (uint32_t j = 0; j < message_size; j++) {
+            message[j] = 'a' + rand() % 26;
+        }
+        txs[i] = sign_transaction(keys[i % n_keys], message, message_size, &lens[i]);
+        if (txs[i] == NULL || parse_transaction(txs[i], lens[i], &jobs[i].tx) != 0) {
+            return 3;
+        }
+    }
+    double sign_s = elapsed_s(&start);
+    printf("Verify bench: signed %u transactions of %u bytes with %u keys at %.0f tx/s\n", n_txs,
+            message_size, n_keys, n_txs / sign_s);
+
+    //malformed transactions are refused by parsing alone. Corrupt a hex digit of each key
+    struct SignedTx tx;
+    uint32_t refused = 0;
+    for (uint32_t i = 0; i < n_txs; i++) {
+        txs[i][TX_PREFIX_LEN] ^= 0x40;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint32_t i = 0; i < n_txs; i++) {
+        refused += parse_transaction(txs[i], lens[i], &tx) != 0;
+    }
+    double reject_s = elapsed_s(&start);
+    for (uint32_t i = 0; i < n_txs; i++) {
+        txs[i][TX_PREFIX_LEN] ^= 0x40;
+    }
+    printf("Verify bench: fast reject of %u malformed transactions at %.0f tx/s\n", refused,
+            n_txs / reject_s);
+
+    //a tampered message must fail verification
+    struct Verifier verifier;
+    if (start_verifier(&verifier, 0) != 0) {
+        return 4;
+    }
+    struct VerifyJob tampered = jobs[0];
+    char * forged = strdup(tampered.tx.message);
+    forged[0] ^= 1;
+    tampered.tx.message = forged;
+    verify_batch(&verifier, &tampered, 1);
+    free(forged);
+    if (tampered.valid) {
+        fprintf(stderr, "Verify bench: tampered transaction verified\n");
+        return 5;
+    }
+    stop_verifier(&verifier);
+
+    //the caller verifies alongside the pool so workers + 1 cores are busy
+    double single_rate = 0;
+    for (long n_workers = 0;;) {
+        if (start_verifier(&verifier, (unsigned)n_workers) != 0) {
+            return 4;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int ret = run_batches(&verifier, jobs, n_txs);
+        double verify_s = elapsed_s(&start);
+        stop_verifier(&verifier);
+        if (ret != 0) {
+            fprintf(stderr, "Verify bench: valid transaction failed verification\n");
+            return 5;
+        }
+        double rate = n_txs / verify_s;
+        if (n_workers == 0) {
+            single_rate = rate;
+        }
+        //threads beyond the online cores only share them
+        long cores = n_workers + 1 < n_cpus ? n_workers + 1 : (n_cpus > 0 ? n_cpus : 1);
+        printf("Verify bench: %2ld workers + caller: %9.0f tx/s, %7.0f tx/s per core, %.2fx single core\n",
+                n_workers, rate, rate / cores, rate / single_rate);
+        //pools double in size up to the largest asked for
+        if (n_workers >= max_threads) {
+            break;
+        }
+        long next = n_workers == 0 ? 1 : 2 * n_workers;
+        n_workers = next < max_threads ? next : max_threads;
+    }
+
+    for (uint32_t i = 0; i < n_txs; i++) {
+        free(txs[i]);
+    }
+    for (uint32_t i = 0; i < n_keys; i++) {
+        EVP_PKEY_free(keys[i]);
+    }
+    free(keys);
+    free(txs);
+    free(lens);
+    free(message);
+    free(jobs);
+    return 0;
+}
+
+/**
+ * Seconds since a monotonic time
+ * @param pstart time to measure from
+ * @return elapsed seconds
+ */
+static double elapsed_s(const struct timespec * pstart) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - pstart->tv_sec) + (now.tv_nsec - pstart->tv_nsec) / 1e9;
+}
+
+/**
+ * Verify jobs in batches of the size a node's reactor hands in
+ * @param pverifier pool to verify with
+ * @param jobs transactions to verify. All are expected to be valid
+ * @param n_jobs number of transactions
+ * @return 0 if every transaction verified, -1 if not
+ */
+static int run_batches(struct Verifier * pverifier, struct VerifyJob * jobs, uint32_t n_jobs) {
+    for (uint32_t start = 0; start < n_jobs; start += VERIFY_MAX_BATCH) {
+        uint32_t n = n_jobs - start < VERIFY_MAX_BATCH ? n_jobs - start : VERIFY_MAX_BATCH;
+        verify_batch(pverifier, jobs + start, n);
+    }
+    for (uint32_t i = 0; i < n_jobs; i++) {
+        if (!jobs[i].valid) {
+            return -1;
+        }
+        jobs[i].valid = 0;
+    }
+    return 0;
+}
@@ -0,0 +1,98 @@
+/**
+ * Simple program to fetch the blocks a running node appended within a time window
+ * Written by Josh Cherubino (josh.cherubino@gmail.com)
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "block.h"
+#include "server.h"
+#include "requests.h"
+
+#define WINDOW_USAGE "usage: window [-q] [-l last_seconds] host:port|unix:path [since_ms [until_ms]]\n"
+
+//Request every block in a time window, a page at a time, and print them
+int main(int argc, char * argv[]) {
+    struct timespec now, start, end;
+    uint64_t since = 0, until = UINT64_MAX;
+    long last_s = -1;
+    int quiet = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "ql:")) != -1) {
+        switch (opt) {
+            case 'q':
+                quiet = 1;
+                break;
+            case 'l':
+                last_s = strtol(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, WINDOW_USAGE);
+                return 1;
+        }
+    }
+    if (argc - optind < 1 || argc - optind > 3 || (last_s >= 0 && argc - optind > 1)) {
+        fprintf(stderr, WINDOW_USAGE);
+        return 1;
+    }
+
+    if (last_s >= 0) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        uint64_t now_ms = (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+        since = now_ms > (uint64_t)last_s * 1000 ? now_ms - (uint64_t)last_s * 1000 : 0;
+    }
+    if (argc - optind > 1) {
+        since = strtoull(argv[optind + 1], NULL, 10);
+    }
+    if (argc - optind > 2) {
+        until = strtoull(argv[optind + 2], NULL, 10);
+    }
+
+    int node_fd = connect_to_peer(argv[optind]);
+    if (node_fd == -1) {
+        return 2;
+    }
+
+    struct BlockChain blocks = initialise_chain();
+    uint32_t first = 0, page_start;
+    int n_blocks;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    //page through the window until a short page shows it is exhausted
+    do {
+        uint32_t min_height = blocks.len > 0 ? first + blocks.len : 0;
+        n_blocks = request_window_endpoint(node_fd, since, until, min_height, MAX_PAYLOAD_RANGE,
+                &blocks, &page_start);
+        if (n_blocks > 0 && blocks.len == (uint32_t)n_blocks) {
+            first = page_start;
+        }
+    } while (n_blocks == MAX_PAYLOAD_RANGE);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    close(node_fd);
+
+    //failed
+    if (n_blocks == -1) {
+        deinitialise_chain(&blocks);
+        return 3;
+    }
+
+    if (!quiet) {
+        for (uint32_t i = 0; i < blocks.len; i++) {
+            printf("------\nHeight: %u\n", first + i);
+            print_block(get_link(&blocks, i)->block);
+        }
+    }
+
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (blocks.len > 0) {
+        printf("Window: %u blocks at heights %u to %u, %.3f ms\n", blocks.len, first,
+                first + blocks.len - 1, elapsed * 1e3);
+    } else {
+        printf("Window: no blocks, %.3f ms\n", elapsed * 1e3);
+    }
+
+    deinitialise_chain(&blocks);
+    return 0;
+}